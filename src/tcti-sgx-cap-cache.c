@@ -0,0 +1,181 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <string.h>
+
+#include "tcti-sgx-cap-cache.h"
+
+/*
+ * GetCapability response layout:
+ *   header | moreData (1) | capability (4) | capability data
+ * and for TPM2_CAP_TPM_PROPERTIES the capability data is:
+ *   count (4) | { property (4) | value (4) } * count
+ */
+#define CAP_CAPABILITY_OFFSET TPM2_HEADER_SIZE
+#define CAP_PROPERTY_OFFSET (TPM2_HEADER_SIZE + 4)
+#define CAP_DATA_OFFSET (TPM2_HEADER_SIZE + 5)
+#define CAP_COUNT_OFFSET CAP_DATA_OFFSET
+#define CAP_PROPERTIES_OFFSET (CAP_COUNT_OFFSET + 4)
+
+typedef struct {
+    int valid;
+    uint8_t command [TCTI_SGX_CAP_COMMAND_SIZE];
+    size_t response_size;
+    uint8_t response [TCTI_SGX_CAP_RESPONSE_MAX];
+} tcti_sgx_cap_entry_t;
+
+static tcti_sgx_cap_entry_t cap_cache [TCTI_SGX_CAP_CACHE_ENTRIES];
+/*
+ * Contexts may be used from different enclave threads. Lookups and
+ * inserts are short so a spinlock built on the compiler atomics does the
+ * job without pulling the SGX thread library into the TCTI.
+ */
+static volatile char cap_cache_lock;
+
+static void
+cap_cache_lock_acquire (void)
+{
+    while (__atomic_test_and_set (&cap_cache_lock, __ATOMIC_ACQUIRE))
+        ;
+}
+static void
+cap_cache_lock_release (void)
+{
+    __atomic_clear (&cap_cache_lock, __ATOMIC_RELEASE);
+}
+/*
+ * Determine whether a command asks for something immutable. Returns 1 for
+ * GetCapability commands without sessions that query algorithms, commands,
+ * ECC curves or properties in the fixed group, 0 otherwise.
+ */
+int
+tcti_sgx_cap_cache_cacheable (uint8_t const *command,
+                              size_t size)
+{
+    TPM2_PT property;
+
+    if (size != TCTI_SGX_CAP_COMMAND_SIZE ||
+        !tpm2_header_valid (command, size) ||
+        tpm2_header_tag (command) != TPM2_ST_NO_SESSIONS ||
+        tpm2_header_code (command) != TPM2_CC_GetCapability)
+        return 0;
+    switch (tpm2_get_uint32 (&command [CAP_CAPABILITY_OFFSET])) {
+    case TPM2_CAP_ALGS:
+    case TPM2_CAP_COMMANDS:
+    case TPM2_CAP_ECC_CURVES:
+        return 1;
+    case TPM2_CAP_TPM_PROPERTIES:
+        property = tpm2_get_uint32 (&command [CAP_PROPERTY_OFFSET]);
+        return property >= TPM2_PT_FIXED && property < TPM2_PT_VAR;
+    default:
+        return 0;
+    }
+}
+/*
+ * A TPM property query that starts in the fixed group can run over into
+ * the variable group if the caller asks for enough properties. Those
+ * responses are not cacheable.
+ */
+static int
+response_fixed (uint8_t const *command,
+                uint8_t const *response,
+                size_t size)
+{
+    uint32_t count, i;
+
+    if (tpm2_get_uint32 (&command [CAP_CAPABILITY_OFFSET]) !=
+        TPM2_CAP_TPM_PROPERTIES)
+        return 1;
+    if (size < CAP_PROPERTIES_OFFSET)
+        return 0;
+    count = tpm2_get_uint32 (&response [CAP_COUNT_OFFSET]);
+    if (count > (size - CAP_PROPERTIES_OFFSET) / 8)
+        return 0;
+    for (i = 0; i < count; ++i) {
+        if (tpm2_get_uint32 (&response [CAP_PROPERTIES_OFFSET + i * 8]) >=
+            TPM2_PT_VAR)
+            return 0;
+    }
+    return 1;
+}
+/*
+ * Find the cached response to 'command'. Returns a pointer to the
+ * response and sets 'response_size', or NULL if there's no cached
+ * response.
+ */
+uint8_t const*
+tcti_sgx_cap_cache_lookup (uint8_t const *command,
+                           size_t size,
+                           size_t *response_size)
+{
+    uint8_t const *response = NULL;
+    size_t i;
+
+    if (!tcti_sgx_cap_cache_cacheable (command, size))
+        return NULL;
+    cap_cache_lock_acquire ();
+    for (i = 0; i < TCTI_SGX_CAP_CACHE_ENTRIES; ++i) {
+        if (cap_cache [i].valid &&
+            memcmp (cap_cache [i].command, command, size) == 0) {
+            response = cap_cache [i].response;
+            *response_size = cap_cache [i].response_size;
+            break;
+        }
+    }
+    cap_cache_lock_release ();
+    return response;
+}
+/*
+ * Add the response to a cacheable command. Only successful responses
+ * that describe fixed properties are kept. Once the cache is full new
+ * responses are dropped: there are only so many distinct queries for
+ * fixed properties.
+ */
+void
+tcti_sgx_cap_cache_insert (uint8_t const *command,
+                           size_t size,
+                           uint8_t const *response,
+                           size_t response_size)
+{
+    size_t i;
+
+    if (!tcti_sgx_cap_cache_cacheable (command, size) ||
+        !tpm2_header_valid (response, response_size) ||
+        tpm2_header_tag (response) != TPM2_ST_NO_SESSIONS ||
+        tpm2_header_code (response) != TPM2_RC_SUCCESS ||
+        response_size < CAP_DATA_OFFSET ||
+        response_size > TCTI_SGX_CAP_RESPONSE_MAX ||
+        tpm2_get_uint32 (&response [CAP_CAPABILITY_OFFSET + 1]) !=
+        tpm2_get_uint32 (&command [CAP_CAPABILITY_OFFSET]) ||
+        !response_fixed (command, response, response_size))
+        return;
+    cap_cache_lock_acquire ();
+    for (i = 0; i < TCTI_SGX_CAP_CACHE_ENTRIES; ++i) {
+        if (cap_cache [i].valid &&
+            memcmp (cap_cache [i].command, command, size) == 0)
+            break;
+        if (!cap_cache [i].valid) {
+            memcpy (cap_cache [i].command, command, size);
+            memcpy (cap_cache [i].response, response, response_size);
+            cap_cache [i].response_size = response_size;
+            cap_cache [i].valid = 1;
+            break;
+        }
+    }
+    cap_cache_lock_release ();
+}
+/*
+ * Drop everything from the cache. Responses previously returned by
+ * tcti_sgx_cap_cache_lookup must not be used after this.
+ */
+void
+tcti_sgx_cap_cache_reset (void)
+{
+    size_t i;
+
+    cap_cache_lock_acquire ();
+    for (i = 0; i < TCTI_SGX_CAP_CACHE_ENTRIES; ++i)
+        cap_cache [i].valid = 0;
+    cap_cache_lock_release ();
+}
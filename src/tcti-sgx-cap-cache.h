@@ -0,0 +1,42 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TCTI_SGX_CAP_CACHE_H
+#define TCTI_SGX_CAP_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <tss2/tss2_tpm2_types.h>
+
+#include "tpm2-header.h"
+
+/*
+ * An enclave wide cache of responses to TPM2_GetCapability commands that
+ * query immutable TPM properties: the fixed group of TPM properties
+ * (TPM2_PT_FIXED up to TPM2_PT_VAR), implemented algorithms, implemented
+ * commands and ECC curves. These can't change while the TPM is running so
+ * the responses are cached for the lifetime of the enclave and shared by
+ * all TCTI contexts. Entries are keyed by the bytes of the command and
+ * never change once they've been added, so a pointer to a cached response
+ * remains valid.
+ *
+ * GetCapability: header | capability (4) | property (4) | propertyCount (4)
+ */
+#define TCTI_SGX_CAP_COMMAND_SIZE (TPM2_HEADER_SIZE + 12)
+#define TCTI_SGX_CAP_RESPONSE_MAX (TPM2_HEADER_SIZE + 5 + TPM2_MAX_CAP_BUFFER)
+#define TCTI_SGX_CAP_CACHE_ENTRIES 16
+
+int tcti_sgx_cap_cache_cacheable (uint8_t const *command,
+                                  size_t size);
+uint8_t const* tcti_sgx_cap_cache_lookup (uint8_t const *command,
+                                          size_t size,
+                                          size_t *response_size);
+void tcti_sgx_cap_cache_insert (uint8_t const *command,
+                                size_t size,
+                                uint8_t const *response,
+                                size_t response_size);
+void tcti_sgx_cap_cache_reset (void);
+
+#endif /* TCTI_SGX_CAP_CACHE_H */
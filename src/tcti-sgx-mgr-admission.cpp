@@ -0,0 +1,127 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include "tcti-sgx-mgr-admission.h"
+
+using namespace std;
+
+TctiSgxAdmission::TctiSgxAdmission ()
+: admitted (0), rejected (0) {}
+
+/*
+ * Set the limits for 'scope', 0 for no limit.
+ * Returns 0 on success, -1 for an unknown scope.
+ */
+int
+TctiSgxAdmission::set_limit (tcti_sgx_scope_t scope,
+                             uint32_t commands,
+                             size_t bytes)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    if (scope != TCTI_SGX_SCOPE_MANAGER && scope != TCTI_SGX_SCOPE_ENCLAVE)
+        return -1;
+    this->limits [scope].commands = commands;
+    this->limits [scope].bytes = bytes;
+    return 0;
+}
+/*
+ * True when any limit is set.
+ */
+bool
+TctiSgxAdmission::enabled ()
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    size_t i;
+
+    for (i = 0; i <= TCTI_SGX_SCOPE_ENCLAVE; ++i)
+        if (this->limits [i].commands != 0 || this->limits [i].bytes != 0)
+            return true;
+    return false;
+}
+bool
+TctiSgxAdmission::fits (Limit const &limit,
+                        Usage const &usage,
+                        size_t size)
+{
+    if (usage.commands == 0)
+        return true;
+    if (limit.commands != 0 && usage.commands >= limit.commands)
+        return false;
+    if (limit.bytes != 0 && usage.bytes + size > limit.bytes)
+        return false;
+    return true;
+}
+/*
+ * Admit a command of 'size' bytes from a session with tag 'tag'. When
+ * it doesn't fit '*depth' is set to the number of commands outstanding in
+ * the scope that's full.
+ * Returns true if the command was admitted.
+ */
+bool
+TctiSgxAdmission::admit (uint64_t tag,
+                         size_t size,
+                         uint32_t *depth)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    map<uint64_t, Usage>::iterator itr = this->enclaves.end ();
+    Usage none;
+
+    if (!fits (this->limits [TCTI_SGX_SCOPE_MANAGER], this->total, size)) {
+        *depth = this->total.commands;
+        ++this->rejected;
+        return false;
+    }
+    if (tag != 0) {
+        itr = this->enclaves.find (tag);
+        if (!fits (this->limits [TCTI_SGX_SCOPE_ENCLAVE],
+                   itr == this->enclaves.end () ? none : itr->second,
+                   size))
+        {
+            *depth = itr->second.commands;
+            ++this->rejected;
+            return false;
+        }
+        if (itr == this->enclaves.end ())
+            itr = this->enclaves.insert (make_pair (tag, none)).first;
+        ++itr->second.commands;
+        itr->second.bytes += size;
+    }
+    ++this->total.commands;
+    this->total.bytes += size;
+    ++this->admitted;
+    return true;
+}
+/*
+ * Give back the place of a command admitted with 'tag' and 'size'.
+ */
+void
+TctiSgxAdmission::release (uint64_t tag,
+                           size_t size)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    map<uint64_t, Usage>::iterator itr;
+
+    --this->total.commands;
+    this->total.bytes -= size;
+    if (tag == 0)
+        return;
+    itr = this->enclaves.find (tag);
+    if (itr == this->enclaves.end ())
+        return;
+    --itr->second.commands;
+    itr->second.bytes -= size;
+    if (itr->second.commands == 0)
+        this->enclaves.erase (itr);
+}
+void
+TctiSgxAdmission::get_stats (tcti_sgx_admission_stats_t *stats)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    stats->admitted = this->admitted;
+    stats->rejected = this->rejected;
+    stats->commands = this->total.commands;
+    stats->bytes = this->total.bytes;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TCTI_SGX_MGR_ADMISSION_H
+#define TCTI_SGX_MGR_ADMISSION_H
+
+#include <map>
+#include <mutex>
+
+#include "tcti-sgx-mgr.h"
+
+/*
+ * Limits on the commands sessions have outstanding with the TPM. A
+ * command is admitted when a session sends it and holds its place until
+ * the session collects the response. Commands that would take the number
+ * of commands or bytes outstanding past a limit are turned away so the
+ * enclave thread sending them can back off instead of queuing behind
+ * everybody else, along with a hint of how deep the queue it would have
+ * joined is.
+ *
+ * There's a limit for the manager as a whole and one that applies to
+ * each enclave separately. Enclaves are told apart by the tag their
+ * sessions set, sessions without a tag are only held to the manager's
+ * limit. A limit of 0 is no limit. A command is always admitted if
+ * nothing else is outstanding in its scope, however big it is.
+ *
+ * Shared by all sessions, access is serialized with the object's own
+ * mutex.
+ */
+class TctiSgxAdmission {
+    struct Usage {
+        uint64_t commands;
+        uint64_t bytes;
+        Usage () : commands (0), bytes (0) {}
+    };
+    struct Limit {
+        uint32_t commands;
+        size_t bytes;
+        Limit () : commands (0), bytes (0) {}
+    };
+    std::mutex mutex;
+    Limit limits [TCTI_SGX_SCOPE_ENCLAVE + 1];
+    Usage total;
+    /* usage of each tagged enclave with anything outstanding */
+    std::map<uint64_t, Usage> enclaves;
+    uint64_t admitted;
+    uint64_t rejected;
+    static bool fits (Limit const &limit, Usage const &usage, size_t size);
+public:
+    TctiSgxAdmission ();
+    int set_limit (tcti_sgx_scope_t scope, uint32_t commands, size_t bytes);
+    bool enabled ();
+    bool admit (uint64_t tag, size_t size, uint32_t *depth);
+    void release (uint64_t tag, size_t size);
+    void get_stats (tcti_sgx_admission_stats_t *stats);
+};
+
+#endif /* TCTI_SGX_MGR_ADMISSION_H */
@@ -0,0 +1,542 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+
+#include <openssl/evp.h>
+
+#include "tcti-sgx-mgr-audit-log.h"
+#include "tpm2-header.h"
+
+using namespace std;
+
+#define AUDIT_MAGIC "tctisgxl"
+#define AUDIT_MAGIC_SIZE 8
+#define AUDIT_VERSION 1
+#define AUDIT_HEADER_SIZE 16
+/*
+ * Record layout:
+ *   recordSize (4) | type (4) | sequence (8) | time (8) | session (8) |
+ *   code (4) | size (4) | digest (32) | chain (32)
+ */
+#define RECORD_TYPE_OFFSET 4
+#define RECORD_SEQ_OFFSET 8
+#define RECORD_TIME_OFFSET 16
+#define RECORD_SESSION_OFFSET 24
+#define RECORD_CODE_OFFSET 32
+#define RECORD_SIZE_OFFSET 36
+#define RECORD_DIGEST_OFFSET 40
+#define RECORD_CHAIN_OFFSET 72
+#define RECORD_SIZE 104
+/* the file starts out this big and doubles when it fills up */
+#define AUDIT_FILE_SIZE_MIN (1024 * 1024)
+/* how often the writer drains rings that haven't asked for it */
+#define AUDIT_WRITER_INTERVAL_MS 10
+
+/*
+ * SHA256 of 'prefix' followed by 'data'. Returns false if OpenSSL
+ * fails us.
+ */
+static bool
+sha256 (uint8_t const *prefix,
+        size_t prefix_size,
+        uint8_t const *data,
+        size_t size,
+        uint8_t *digest)
+{
+    EVP_MD_CTX *ctx;
+    bool ret;
+
+    ctx = EVP_MD_CTX_new ();
+    if (ctx == NULL)
+        return false;
+    ret = EVP_DigestInit_ex (ctx, EVP_sha256 (), NULL) == 1 &&
+        EVP_DigestUpdate (ctx, prefix, prefix_size) == 1 &&
+        EVP_DigestUpdate (ctx, data, size) == 1 &&
+        EVP_DigestFinal_ex (ctx, digest, NULL) == 1;
+    EVP_MD_CTX_free (ctx);
+    return ret;
+}
+
+TctiSgxAuditLog::TctiSgxAuditLog ()
+: writer_exit (false), enable (false), fd (-1), map (NULL), map_size (0),
+  used (0), seq (0), records (0), errors (0), stalls (0), placement (NULL)
+{
+    memset (this->chain, 0, sizeof (this->chain));
+}
+
+TctiSgxAuditLog::~TctiSgxAuditLog ()
+{
+    this->open (NULL);
+}
+/*
+ * Open the log file at 'path', creating it if it doesn't exist or
+ * appending to it if it does. Any log already open is closed first, a
+ * 'path' of NULL just closes it.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+TctiSgxAuditLog::open (char const *path)
+{
+    {
+        lock_guard<std::mutex> guard (this->mutex);
+
+        this->enable = false;
+        this->writer_exit = true;
+    }
+    this->cond.notify_all ();
+    if (this->writer.joinable ())
+        this->writer.join ();
+
+    lock_guard<std::mutex> guard (this->mutex);
+
+    this->close_file ();
+    if (path == NULL)
+        return 0;
+    this->path = path;
+    if (this->map_file () != 0) {
+        cout << __func__ << ": failed to open audit log " << path << ": "
+            << strerror (errno) << endl;
+        this->close_file ();
+        return -1;
+    }
+    this->writer_exit = false;
+    this->enable = true;
+    this->writer = thread (&TctiSgxAuditLog::writer_run, this);
+    return 0;
+}
+/*
+ * Map the log file into memory and find the end of the records already
+ * in it. Caller must hold the mutex.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+TctiSgxAuditLog::map_file ()
+{
+    uint8_t header [AUDIT_HEADER_SIZE];
+    struct stat st;
+    void *buf;
+    size_t size, offset;
+
+    this->fd = ::open (this->path.c_str (), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (this->fd < 0 || fstat (this->fd, &st) != 0)
+        return -1;
+    size = st.st_size;
+    /* don't touch a file that isn't ours */
+    if (size != 0 &&
+        (pread (this->fd, header, sizeof (header), 0) != sizeof (header) ||
+         memcmp (header, AUDIT_MAGIC, AUDIT_MAGIC_SIZE) != 0 ||
+         tpm2_get_uint32 (&header [AUDIT_MAGIC_SIZE]) != AUDIT_VERSION))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    this->map_size = size < AUDIT_FILE_SIZE_MIN ? AUDIT_FILE_SIZE_MIN : size;
+    if (this->map_size > size && ftruncate (this->fd, this->map_size) != 0)
+        return -1;
+    buf = mmap (NULL,
+                this->map_size,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED,
+                this->fd,
+                0);
+    if (buf == MAP_FAILED)
+        return -1;
+    this->map = (uint8_t*)buf;
+    if (size == 0) {
+        memcpy (this->map, AUDIT_MAGIC, AUDIT_MAGIC_SIZE);
+        tpm2_set_uint32 (&this->map [AUDIT_MAGIC_SIZE], AUDIT_VERSION);
+    }
+    if (!sha256 (this->map, AUDIT_HEADER_SIZE, NULL, 0, this->chain))
+        return -1;
+    this->seq = 0;
+    for (offset = AUDIT_HEADER_SIZE;
+         offset + RECORD_SIZE <= size &&
+         tpm2_get_uint32 (&this->map [offset]) == RECORD_SIZE;
+         offset += RECORD_SIZE)
+    {
+        memcpy (this->chain,
+                &this->map [offset + RECORD_CHAIN_OFFSET],
+                AUDIT_DIGEST_SIZE);
+        this->seq = tpm2_get_uint64 (&this->map [offset + RECORD_SEQ_OFFSET]) + 1;
+    }
+    this->used = offset;
+    return 0;
+}
+/*
+ * Double the size of the file. Caller must hold the mutex.
+ */
+int
+TctiSgxAuditLog::grow ()
+{
+    size_t size = this->map_size * 2;
+    void *buf;
+
+    if (ftruncate (this->fd, size) != 0)
+        return -1;
+    buf = mremap (this->map, this->map_size, size, MREMAP_MAYMOVE);
+    if (buf == MAP_FAILED)
+        return -1;
+    this->map = (uint8_t*)buf;
+    this->map_size = size;
+    return 0;
+}
+/*
+ * Write out what's left in the rings, then trim the file to the records
+ * and close it. Sessions drop rings that are closed. Caller must hold the
+ * mutex.
+ */
+void
+TctiSgxAuditLog::close_file ()
+{
+    list<shared_ptr<TctiSgxAuditRing> >::iterator itr;
+
+    this->drain ();
+    for (itr = this->rings.begin (); itr != this->rings.end (); ++itr)
+        (*itr)->closed = true;
+    this->rings.clear ();
+    if (this->map != NULL) {
+        munmap (this->map, this->map_size);
+        this->map = NULL;
+    }
+    if (this->fd >= 0) {
+        if (this->used > 0 &&
+            (ftruncate (this->fd, this->used) != 0 || fsync (this->fd) != 0))
+            cout << __func__ << ": failed to trim audit log: "
+                << strerror (errno) << endl;
+        ::close (this->fd);
+        this->fd = -1;
+    }
+    this->map_size = 0;
+    this->used = 0;
+    this->path.clear ();
+}
+/*
+ * Turn 'entry' into the next record in the file. Caller must hold the
+ * mutex.
+ */
+void
+TctiSgxAuditLog::write_entry (TctiSgxAuditEntry const &entry)
+{
+    uint8_t record [RECORD_SIZE];
+
+    if (this->map == NULL ||
+        (this->used + RECORD_SIZE > this->map_size && this->grow () != 0))
+    {
+        ++this->errors;
+        return;
+    }
+    tpm2_set_uint32 (record, RECORD_SIZE);
+    tpm2_set_uint32 (&record [RECORD_TYPE_OFFSET], entry.type);
+    tpm2_set_uint64 (&record [RECORD_SEQ_OFFSET], this->seq);
+    tpm2_set_uint64 (&record [RECORD_TIME_OFFSET], entry.time_ns);
+    tpm2_set_uint64 (&record [RECORD_SESSION_OFFSET], entry.session);
+    tpm2_set_uint32 (&record [RECORD_CODE_OFFSET], entry.code);
+    tpm2_set_uint32 (&record [RECORD_SIZE_OFFSET], entry.size);
+    if (entry.digested)
+        memcpy (&record [RECORD_DIGEST_OFFSET],
+                entry.digest,
+                AUDIT_DIGEST_SIZE);
+    else if (!sha256 (entry.data,
+                      entry.size,
+                      NULL,
+                      0,
+                      &record [RECORD_DIGEST_OFFSET]))
+    {
+        ++this->errors;
+        return;
+    }
+    if (!sha256 (this->chain,
+                 AUDIT_DIGEST_SIZE,
+                 record,
+                 RECORD_CHAIN_OFFSET,
+                 &record [RECORD_CHAIN_OFFSET]))
+    {
+        ++this->errors;
+        return;
+    }
+    /*
+     * The size goes in last so a record we're killed part way through
+     * writing isn't taken for a record when the log is reopened.
+     */
+    memcpy (&this->map [this->used + 4], &record [4], RECORD_SIZE - 4);
+    memcpy (&this->map [this->used], record, 4);
+    memcpy (this->chain, &record [RECORD_CHAIN_OFFSET], AUDIT_DIGEST_SIZE);
+    this->used += RECORD_SIZE;
+    ++this->seq;
+    ++this->records;
+}
+/*
+ * Move everything queued on the rings into the file and sync it. Rings
+ * whose session has gone away are dropped once they're empty. Caller must
+ * hold the mutex.
+ */
+void
+TctiSgxAuditLog::drain ()
+{
+    list<shared_ptr<TctiSgxAuditRing> >::iterator itr;
+    size_t start = this->used, page;
+    uint64_t head, tail;
+
+    for (itr = this->rings.begin (); itr != this->rings.end ();) {
+        tail = (*itr)->tail.load (memory_order_relaxed);
+        head = (*itr)->head.load (memory_order_acquire);
+        for (; tail != head; ++tail)
+            this->write_entry ((*itr)->slots [tail % AUDIT_RING_SLOTS]);
+        (*itr)->tail.store (tail, memory_order_release);
+        if (itr->use_count () == 1 &&
+            (*itr)->head.load (memory_order_acquire) == tail)
+            itr = this->rings.erase (itr);
+        else
+            ++itr;
+    }
+    if (this->map == NULL || this->used == start)
+        return;
+    page = sysconf (_SC_PAGESIZE);
+    start -= start % page;
+    if (msync (&this->map [start], this->used - start, MS_SYNC) != 0)
+        ++this->errors;
+}
+
+/*
+ * True when a ring has entries waiting. Caller must hold the mutex.
+ */
+bool
+TctiSgxAuditLog::pending ()
+{
+    list<shared_ptr<TctiSgxAuditRing> >::const_iterator itr;
+
+    for (itr = this->rings.begin (); itr != this->rings.end (); ++itr)
+        if ((*itr)->head.load (memory_order_acquire) !=
+            (*itr)->tail.load (memory_order_relaxed))
+            return true;
+    return false;
+}
+/*
+ * Sessions only wake the writer when their ring is filling up and the
+ * writer may be busy syncing when they do, so it goes straight back to
+ * draining while there's anything left rather than waiting to be told.
+ */
+void
+TctiSgxAuditLog::writer_run ()
+{
+    unique_lock<std::mutex> guard (this->mutex);
+    uint64_t pinned = 0;
+
+    while (!this->writer_exit) {
+        if (this->placement != NULL)
+            this->placement->pin_self (&pinned);
+        if (!this->pending ())
+            this->cond.wait_for (guard,
+                                 chrono::milliseconds (AUDIT_WRITER_INTERVAL_MS));
+        this->drain ();
+    }
+}
+
+bool
+TctiSgxAuditLog::enabled () const
+{
+    return this->enable;
+}
+/*
+ * Have the writer thread follow 'placement'.
+ */
+void
+TctiSgxAuditLog::set_placement (TctiSgxPlacement *placement)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    this->placement = placement;
+}
+/*
+ * Get a ring for a session to queue its commands and responses on.
+ * Returns NULL when the log isn't open.
+ */
+shared_ptr<TctiSgxAuditRing>
+TctiSgxAuditLog::attach ()
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    shared_ptr<TctiSgxAuditRing> ring;
+
+    if (!this->enable)
+        return ring;
+    ring = make_shared<TctiSgxAuditRing> ();
+    this->rings.push_back (ring);
+    return ring;
+}
+/*
+ * Queue a command or response on 'ring'. Called by the session that owns
+ * the ring without holding the mutex. This only waits when the writer
+ * has fallen a whole ring behind.
+ */
+void
+TctiSgxAuditLog::append (TctiSgxAuditRing &ring,
+                         uint64_t session,
+                         uint32_t type,
+                         uint32_t code,
+                         uint8_t const *data,
+                         size_t size)
+{
+    uint64_t head = ring.head.load (memory_order_relaxed);
+    struct timespec now;
+
+    if (head - ring.tail.load (memory_order_acquire) >= AUDIT_RING_SLOTS) {
+        ++this->stalls;
+        this->cond.notify_one ();
+        while (head - ring.tail.load (memory_order_acquire) >= AUDIT_RING_SLOTS)
+        {
+            if (ring.closed)
+                return;
+            this_thread::yield ();
+        }
+    }
+    TctiSgxAuditEntry &entry = ring.slots [head % AUDIT_RING_SLOTS];
+    clock_gettime (CLOCK_REALTIME, &now);
+    entry.type = type;
+    entry.code = code;
+    entry.session = session;
+    entry.time_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    entry.size = size;
+    entry.digested = size > sizeof (entry.data);
+    if (entry.digested) {
+        if (!sha256 (data, size, NULL, 0, entry.digest))
+            memset (entry.digest, 0, sizeof (entry.digest));
+    } else {
+        memcpy (entry.data, data, size);
+    }
+    ring.head.store (head + 1, memory_order_release);
+    if (head + 1 - ring.tail.load (memory_order_relaxed) >= AUDIT_RING_SLOTS / 2)
+        this->cond.notify_one ();
+}
+/*
+ * Write out and sync everything queued so far.
+ */
+void
+TctiSgxAuditLog::flush ()
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    this->drain ();
+}
+
+void
+TctiSgxAuditLog::get_stats (tcti_sgx_audit_log_stats_t *stats)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    stats->records = this->records;
+    stats->stalls = this->stalls;
+    stats->errors = this->errors;
+}
+/*
+ * Check the log file at 'path': the header, the sequence numbers and the
+ * chain of digests through every record. The records that check out are
+ * added to 'records' if it isn't NULL, so on failure the last one there
+ * is the last good record.
+ * Returns 0 if the whole log checks out, -1 otherwise.
+ */
+int
+TctiSgxAuditLog::verify (char const *path,
+                         vector<TctiSgxAuditRecord> *records)
+{
+    uint8_t chain [AUDIT_DIGEST_SIZE], digest [AUDIT_DIGEST_SIZE];
+    TctiSgxAuditRecord record;
+    struct stat st;
+    uint8_t const *buf;
+    size_t size, offset;
+    uint64_t seq = 0;
+    void *map;
+    int fd, ret = -1;
+
+    fd = ::open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat (fd, &st) != 0 || (size_t)st.st_size < AUDIT_HEADER_SIZE) {
+        ::close (fd);
+        return -1;
+    }
+    size = st.st_size;
+    map = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close (fd);
+    if (map == MAP_FAILED)
+        return -1;
+    buf = (uint8_t const*)map;
+    if (memcmp (buf, AUDIT_MAGIC, AUDIT_MAGIC_SIZE) != 0 ||
+        tpm2_get_uint32 (&buf [AUDIT_MAGIC_SIZE]) != AUDIT_VERSION ||
+        !sha256 (buf, AUDIT_HEADER_SIZE, NULL, 0, chain))
+        goto out;
+    for (offset = AUDIT_HEADER_SIZE;
+         offset + RECORD_SIZE <= size;
+         offset += RECORD_SIZE, ++seq)
+    {
+        if (tpm2_get_uint32 (&buf [offset]) == 0)
+            break;
+        if (tpm2_get_uint32 (&buf [offset]) != RECORD_SIZE ||
+            tpm2_get_uint64 (&buf [offset + RECORD_SEQ_OFFSET]) != seq ||
+            !sha256 (chain,
+                     AUDIT_DIGEST_SIZE,
+                     &buf [offset],
+                     RECORD_CHAIN_OFFSET,
+                     digest) ||
+            memcmp (digest,
+                    &buf [offset + RECORD_CHAIN_OFFSET],
+                    AUDIT_DIGEST_SIZE) != 0)
+            goto out;
+        memcpy (chain, digest, AUDIT_DIGEST_SIZE);
+        if (records == NULL)
+            continue;
+        record.type = tpm2_get_uint32 (&buf [offset + RECORD_TYPE_OFFSET]);
+        record.code = tpm2_get_uint32 (&buf [offset + RECORD_CODE_OFFSET]);
+        record.seq = seq;
+        record.session =
+            tpm2_get_uint64 (&buf [offset + RECORD_SESSION_OFFSET]);
+        record.time_ns = tpm2_get_uint64 (&buf [offset + RECORD_TIME_OFFSET]);
+        record.size = tpm2_get_uint32 (&buf [offset + RECORD_SIZE_OFFSET]);
+        memcpy (record.digest,
+                &buf [offset + RECORD_DIGEST_OFFSET],
+                AUDIT_DIGEST_SIZE);
+        records->push_back (record);
+    }
+    /* only the zeros left by a crash may follow the last record */
+    for (; offset < size; ++offset)
+        if (buf [offset] != 0)
+            goto out;
+    ret = 0;
+out:
+    munmap (map, size);
+    return ret;
+}
+/*
+ * Hand a command or response to the audit log, if it's open. A new ring
+ * is attached if the log was reopened since the last one.
+ */
+void
+TctiSgxAuditTrail::record (uint32_t type,
+                           uint32_t code,
+                           uint8_t const *data,
+                           size_t size)
+{
+    if (this->log == NULL || !this->log->enabled ()) {
+        this->ring.reset ();
+        return;
+    }
+    if (!this->ring || this->ring->closed)
+        this->ring = this->log->attach ();
+    if (this->ring)
+        this->log->append (*this->ring,
+                           this->session != NULL ? this->session->load () : 0,
+                           type,
+                           code,
+                           data,
+                           size);
+}
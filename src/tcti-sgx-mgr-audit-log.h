@@ -0,0 +1,210 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TCTI_SGX_MGR_AUDIT_LOG_H
+#define TCTI_SGX_MGR_AUDIT_LOG_H
+
+#include <string.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <tss2/tss2_tpm2_types.h>
+#include "tcti-sgx-mgr.h"
+#include "tcti-sgx-mgr-placement.h"
+#include "util.h"
+
+#define AUDIT_DIGEST_SIZE 32
+#define AUDIT_RING_SLOTS 32
+#define AUDIT_DATA_MAX (TPM2_MAX_COMMAND_SIZE > TPM2_MAX_RESPONSE_SIZE ? \
+                        TPM2_MAX_COMMAND_SIZE : TPM2_MAX_RESPONSE_SIZE)
+
+/*
+ * What an audit record describes: a client's command or response, or one
+ * the manager sent or got itself (to manage contexts, fill caches and the
+ * like, on a session's behalf or its own).
+ */
+#define AUDIT_TYPE_COMMAND 1
+#define AUDIT_TYPE_RESPONSE 2
+#define AUDIT_TYPE_MGR_COMMAND 3
+#define AUDIT_TYPE_MGR_RESPONSE 4
+
+#ifdef ENABLE_AUDIT_LOG
+
+/*
+ * A command or response a session has handed to the audit log that the
+ * writer hasn't got to yet. Buffers too big for 'data' are hashed by the
+ * session and only their digest is queued.
+ */
+struct TctiSgxAuditEntry {
+    uint32_t type;
+    uint32_t code;
+    uint64_t session;
+    uint64_t time_ns;
+    size_t size;
+    bool digested;
+    uint8_t digest [AUDIT_DIGEST_SIZE];
+    uint8_t data [AUDIT_DATA_MAX];
+};
+/*
+ * Single producer, single consumer ring of entries. The producer is the
+ * session the ring belongs to (calls into a session are serialized by its
+ * lock), the consumer the audit log's writer thread. 'head' is the number
+ * of entries queued and 'tail' the number written out, so neither side
+ * takes a lock to hand entries over.
+ */
+struct TctiSgxAuditRing {
+    TctiSgxAuditEntry slots [AUDIT_RING_SLOTS];
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    /* the log was closed, this ring will never be drained again */
+    std::atomic<bool> closed;
+    TctiSgxAuditRing () : head (0), tail (0), closed (false) {}
+};
+/* a record from the log as read back by verify */
+struct TctiSgxAuditRecord {
+    uint32_t type;
+    uint32_t code;
+    uint64_t seq;
+    uint64_t session;
+    uint64_t time_ns;
+    uint32_t size;
+    uint8_t digest [AUDIT_DIGEST_SIZE];
+};
+/*
+ * Append only log of every command sessions send and every response they
+ * get back, the manager's own included. Sessions queue what they send
+ * and receive on their own ring and go on their way, a writer thread
+ * drains the rings into a file mapped into memory and syncs it after each
+ * batch. Sessions only wait if their ring fills up.
+ *
+ * Commands and responses can carry secrets so the log doesn't hold them,
+ * only their SHA256 digests: anyone with a transcript of what a client
+ * sent can prove it against the log. Each record also carries a chain
+ * digest over the one before it so records can't be removed, reordered or
+ * changed without breaking the chain from that point on.
+ *
+ * File format, integers are big endian:
+ *   magic (8) | version (4) | reserved (4) |
+ *   { recordSize (4) | type (4) | sequence (8) | time (8) |
+ *     session (8) | code (4) | size (4) | digest (32) | chain (32) } *
+ * 'time' is nanoseconds since the epoch and 'code' is the command code for
+ * commands, the response code (or the TCTI error if there wasn't a
+ * response) for responses. The manager's own commands on its connection
+ * are logged with session 0. The chain of the first record follows the
+ * SHA256 of the file header, each 'chain' is SHA256 (previous chain ||
+ * record up to the chain). The file is grown as needed and trimmed to the
+ * last record when the log is closed. A log left behind by a crash ends in
+ * zeros and is appended to when it's next opened.
+ */
+class TctiSgxAuditLog {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::thread writer;
+    bool writer_exit;
+    std::atomic<bool> enable;
+    std::string path;
+    int fd;
+    uint8_t *map;
+    size_t map_size;
+    /* bytes of the file holding the header and records */
+    size_t used;
+    uint64_t seq;
+    uint8_t chain [AUDIT_DIGEST_SIZE];
+    std::list<std::shared_ptr<TctiSgxAuditRing> > rings;
+    uint64_t records;
+    uint64_t errors;
+    std::atomic<uint64_t> stalls;
+    /* where the writer runs, if anyone cares */
+    TctiSgxPlacement *placement;
+    int map_file ();
+    int grow ();
+    void write_entry (TctiSgxAuditEntry const &entry);
+    void drain ();
+    bool pending ();
+    void writer_run ();
+    void close_file ();
+public:
+    TctiSgxAuditLog ();
+    ~TctiSgxAuditLog ();
+    int open (char const *path);
+    bool enabled () const;
+    void set_placement (TctiSgxPlacement *placement);
+    std::shared_ptr<TctiSgxAuditRing> attach ();
+    void append (TctiSgxAuditRing &ring,
+                 uint64_t session,
+                 uint32_t type,
+                 uint32_t code,
+                 uint8_t const *data,
+                 size_t size);
+    void flush ();
+    void get_stats (tcti_sgx_audit_log_stats_t *stats);
+    static int verify (char const *path,
+                       std::vector<TctiSgxAuditRecord> *records);
+};
+/*
+ * Where one producer, a session or the manager's maintenance, hands what
+ * it sends and receives to the audit log. '*session' is the id of the
+ * session records are logged against, 0 if it's NULL. The ring is
+ * attached when there's something to log and dropped when the log is
+ * closed.
+ */
+class TctiSgxAuditTrail {
+    TctiSgxAuditLog *log;
+    std::atomic<uint64_t> const *session;
+    std::shared_ptr<TctiSgxAuditRing> ring;
+public:
+    TctiSgxAuditTrail (TctiSgxAuditLog *log,
+                       std::atomic<uint64_t> const *session)
+        : log (log), session (session) {}
+    void record (uint32_t type,
+                 uint32_t code,
+                 uint8_t const *data,
+                 size_t size);
+};
+
+#else /* ENABLE_AUDIT_LOG */
+/*
+ * Built without the audit log (it needs OpenSSL): there's no log to open
+ * and nothing is recorded.
+ */
+class TctiSgxAuditLog {
+public:
+    int open (char const *path) { return path == NULL ? 0 : -1; }
+    bool enabled () const { return false; }
+    void set_placement (TctiSgxPlacement *placement) { UNUSED (placement); }
+    void flush () {}
+    void get_stats (tcti_sgx_audit_log_stats_t *stats)
+    {
+        memset (stats, 0, sizeof (*stats));
+    }
+};
+class TctiSgxAuditTrail {
+public:
+    TctiSgxAuditTrail (TctiSgxAuditLog *log,
+                       std::atomic<uint64_t> const *session)
+    {
+        UNUSED (log);
+        UNUSED (session);
+    }
+    void record (uint32_t type,
+                 uint32_t code,
+                 uint8_t const *data,
+                 size_t size)
+    {
+        UNUSED (type);
+        UNUSED (code);
+        UNUSED (data);
+        UNUSED (size);
+    }
+};
+#endif /* ENABLE_AUDIT_LOG */
+
+#endif /* TCTI_SGX_MGR_AUDIT_LOG_H */
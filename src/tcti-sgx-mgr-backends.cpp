@@ -0,0 +1,265 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <iostream>
+
+#include "tcti-sgx-mgr-backends.h"
+
+using namespace std;
+
+/* weight of a new sample in the latency average: 1 / 2^LATENCY_WEIGHT_SHIFT */
+#define LATENCY_WEIGHT_SHIFT 3
+
+TctiSgxBackends::TctiSgxBackends (downstream_tcti_init_cb init_cb,
+                                  void *user_data)
+: policy (TCTI_SGX_BACKEND_LEAST_LOADED)
+{
+    Backend first = { init_cb, user_data, 0, 0, 0, 0, 0, 0, 0 };
+
+    this->backends.push_back (first);
+}
+/*
+ * Add a backend that connects with 'init_cb'.
+ * Returns the index of the new backend, -1 when there's no callback or
+ * there are already BACKENDS_MAX backends.
+ */
+int
+TctiSgxBackends::add (downstream_tcti_init_cb init_cb,
+                      void *user_data)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    Backend backend = { init_cb, user_data, 0, 0, 0, 0, 0, 0, 0 };
+
+    if (init_cb == NULL || this->backends.size () >= BACKENDS_MAX)
+        return -1;
+    this->backends.push_back (backend);
+    return this->backends.size () - 1;
+}
+size_t
+TctiSgxBackends::count ()
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    return this->backends.size ();
+}
+/*
+ * Returns 0 on success, -1 for an unknown policy.
+ */
+int
+TctiSgxBackends::set_policy (tcti_sgx_backend_policy_t policy)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    switch (policy) {
+    case TCTI_SGX_BACKEND_LEAST_LOADED:
+    case TCTI_SGX_BACKEND_TWO_CHOICES:
+    case TCTI_SGX_BACKEND_ENCLAVE:
+        this->policy = policy;
+        return 0;
+    default:
+        return -1;
+    }
+}
+/*
+ * Caller must hold the mutex.
+ */
+uint64_t
+TctiSgxBackends::load (unsigned backend) const
+{
+    return this->backends [backend].sessions +
+        this->backends [backend].outstanding;
+}
+/*
+ * The backend with the least load, the first of those that tie. Caller
+ * must hold the mutex.
+ */
+unsigned
+TctiSgxBackends::least_loaded () const
+{
+    unsigned best = 0, i;
+
+    for (i = 1; i < this->backends.size (); ++i)
+        if (this->load (i) < this->load (best))
+            best = i;
+    return best;
+}
+/*
+ * Pick the backend for a session of the enclave with 'tag', 0 for a
+ * session without one.
+ */
+unsigned
+TctiSgxBackends::place (uint64_t tag)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    map<uint64_t, Enclave>::const_iterator itr;
+    unsigned first, second;
+
+    if (this->backends.size () == 1)
+        return 0;
+    switch (this->policy) {
+    case TCTI_SGX_BACKEND_TWO_CHOICES:
+        first = this->random () % this->backends.size ();
+        second = this->random () % (this->backends.size () - 1);
+        if (second >= first)
+            ++second;
+        return this->load (second) < this->load (first) ? second : first;
+    case TCTI_SGX_BACKEND_ENCLAVE:
+        itr = this->enclaves.find (tag);
+        if (tag != 0 && itr != this->enclaves.end ())
+            return itr->second.backend;
+        return this->least_loaded ();
+    default:
+        return this->least_loaded ();
+    }
+}
+/*
+ * True, with the backend of the enclave with 'tag' in '*backend', when
+ * sessions follow their enclave and the enclave has sessions around.
+ */
+bool
+TctiSgxBackends::enclave_backend (uint64_t tag,
+                                  unsigned *backend)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    map<uint64_t, Enclave>::const_iterator itr;
+
+    if (this->policy != TCTI_SGX_BACKEND_ENCLAVE || tag == 0)
+        return false;
+    itr = this->enclaves.find (tag);
+    if (itr == this->enclaves.end ())
+        return false;
+    *backend = itr->second.backend;
+    return true;
+}
+/*
+ * Create a connection to 'backend'. Returns NULL if the callback fails.
+ */
+TSS2_TCTI_CONTEXT*
+TctiSgxBackends::connect (unsigned backend)
+{
+    downstream_tcti_init_cb init_cb = NULL;
+    void *user_data = NULL;
+    TSS2_TCTI_CONTEXT *tcti_context;
+
+    this->mutex.lock ();
+    if (backend < this->backends.size ()) {
+        init_cb = this->backends [backend].init_cb;
+        user_data = this->backends [backend].user_data;
+    }
+    this->mutex.unlock ();
+    if (init_cb == NULL)
+        return NULL;
+    tcti_context = init_cb (user_data);
+    if (tcti_context == NULL)
+        cout << __func__ << ": init callback for backend " << backend
+             << " failed to create a TCTI" << endl;
+    return tcti_context;
+}
+/*
+ * A session of the enclave with 'tag' is now on 'backend'.
+ */
+void
+TctiSgxBackends::attach (unsigned backend,
+                         uint64_t tag)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    Enclave fresh = { backend, 0 };
+    map<uint64_t, Enclave>::iterator itr;
+
+    if (backend >= this->backends.size ())
+        return;
+    ++this->backends [backend].sessions;
+    if (tag == 0)
+        return;
+    itr = this->enclaves.insert (make_pair (tag, fresh)).first;
+    ++itr->second.sessions;
+}
+void
+TctiSgxBackends::detach (unsigned backend,
+                         uint64_t tag)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    map<uint64_t, Enclave>::iterator itr;
+
+    if (backend >= this->backends.size ())
+        return;
+    --this->backends [backend].sessions;
+    itr = this->enclaves.find (tag);
+    if (tag != 0 && itr != this->enclaves.end () &&
+        --itr->second.sessions == 0)
+        this->enclaves.erase (itr);
+}
+/*
+ * A command was sent to 'backend'.
+ */
+void
+TctiSgxBackends::sent (unsigned backend)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    if (backend >= this->backends.size ())
+        return;
+    ++this->backends [backend].outstanding;
+    ++this->backends [backend].commands;
+}
+/*
+ * A command sent to 'backend' 'elapsed_us' ago is done with: 'answered'
+ * if there's a response, otherwise it's counted as an error.
+ */
+void
+TctiSgxBackends::received (unsigned backend,
+                           uint64_t elapsed_us,
+                           bool answered)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    Backend *entry;
+
+    if (backend >= this->backends.size ())
+        return;
+    entry = &this->backends [backend];
+    if (entry->outstanding > 0)
+        --entry->outstanding;
+    if (!answered) {
+        ++entry->errors;
+        return;
+    }
+    if (entry->samples++ == 0)
+        entry->latency_us = elapsed_us;
+    else
+        entry->latency_us = entry->latency_us -
+            (entry->latency_us >> LATENCY_WEIGHT_SHIFT) +
+            (elapsed_us >> LATENCY_WEIGHT_SHIFT);
+    if (elapsed_us > entry->max_latency_us)
+        entry->max_latency_us = elapsed_us;
+}
+/*
+ * Returns 0 on success, -1 if there's no such backend.
+ */
+int
+TctiSgxBackends::get_stats (unsigned backend,
+                            tcti_sgx_backend_stats_t *stats)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    if (backend >= this->backends.size ())
+        return -1;
+    stats->sessions = this->backends [backend].sessions;
+    stats->outstanding = this->backends [backend].outstanding;
+    stats->commands = this->backends [backend].commands;
+    stats->errors = this->backends [backend].errors;
+    stats->latency_us = this->backends [backend].latency_us;
+    stats->max_latency_us = this->backends [backend].max_latency_us;
+    return 0;
+}
+/*
+ * The scheduler for 'backend', NULL if there can't be such a backend.
+ * The schedulers are never moved so this needs no lock.
+ */
+TctiSgxScheduler*
+TctiSgxBackends::scheduler (unsigned backend)
+{
+    if (backend >= BACKENDS_MAX)
+        return NULL;
+    return &this->schedulers [backend];
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TCTI_SGX_MGR_BACKENDS_H
+#define TCTI_SGX_MGR_BACKENDS_H
+
+#include <map>
+#include <mutex>
+#include <random>
+#include <vector>
+
+#include <tss2/tss2_tcti.h>
+#include "tcti-sgx-mgr.h"
+#include "tcti-sgx-mgr-scheduler.h"
+
+#define BACKENDS_MAX 64
+
+/*
+ * The TPMs the manager connects sessions to. Each backend is a TCTI init
+ * callback, the first is the one the manager was initialized with. A new
+ * session is placed on a backend by the policy and gets its own
+ * connection from the backend's callback.
+ *
+ * A backend's load is the number of sessions on it plus the commands it
+ * has in flight. TCTI_SGX_BACKEND_ENCLAVE keeps the sessions of an
+ * enclave together: the first session with a tag goes to the least
+ * loaded backend and the others with the same tag follow it for as long
+ * as any of them is around.
+ *
+ * Each TPM runs its own commands so each backend has its own scheduler.
+ * There's one for every backend there can be, set up alike, so they're
+ * never moved and one added later is configured like the others.
+ *
+ * Shared by all sessions, access is serialized with the object's own
+ * mutex.
+ */
+class TctiSgxBackends {
+    struct Backend {
+        downstream_tcti_init_cb init_cb;
+        void *user_data;
+        uint64_t sessions;
+        uint64_t outstanding;
+        uint64_t commands;
+        uint64_t errors;
+        uint64_t latency_us;
+        uint64_t samples;
+        uint64_t max_latency_us;
+    };
+    struct Enclave {
+        unsigned backend;
+        uint64_t sessions;
+    };
+    std::mutex mutex;
+    std::vector<Backend> backends;
+    tcti_sgx_backend_policy_t policy;
+    /* the backend of each tagged enclave with sessions around */
+    std::map<uint64_t, Enclave> enclaves;
+    std::minstd_rand random;
+    TctiSgxScheduler schedulers [BACKENDS_MAX];
+    uint64_t load (unsigned backend) const;
+    unsigned least_loaded () const;
+public:
+    TctiSgxBackends (downstream_tcti_init_cb init_cb,
+                     void *user_data);
+    int add (downstream_tcti_init_cb init_cb,
+             void *user_data);
+    size_t count ();
+    int set_policy (tcti_sgx_backend_policy_t policy);
+    unsigned place (uint64_t tag);
+    bool enclave_backend (uint64_t tag,
+                          unsigned *backend);
+    TSS2_TCTI_CONTEXT* connect (unsigned backend);
+    void attach (unsigned backend,
+                 uint64_t tag);
+    void detach (unsigned backend,
+                 uint64_t tag);
+    void sent (unsigned backend);
+    void received (unsigned backend,
+                   uint64_t elapsed_us,
+                   bool answered);
+    int get_stats (unsigned backend,
+                   tcti_sgx_backend_stats_t *stats);
+    TctiSgxScheduler* scheduler (unsigned backend);
+};
+
+#endif /* TCTI_SGX_MGR_BACKENDS_H */
@@ -0,0 +1,161 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "tcti-sgx-mgr-conn-pool.h"
+
+using namespace std;
+
+TctiSgxConnPool::TctiSgxConnPool ()
+: max_idle (0), max_idle_ms (0)
+{
+    memset (&this->stats, 0, sizeof (this->stats));
+}
+TctiSgxConnPool::~TctiSgxConnPool ()
+{
+    this->set_limits (0, 0);
+}
+/*
+ * Finalize and free each of 'closing'.
+ */
+void
+TctiSgxConnPool::close (vector<TSS2_TCTI_CONTEXT*> const &closing)
+{
+    size_t i;
+
+    for (i = 0; i < closing.size (); ++i) {
+        Tss2_Tcti_Finalize (closing [i]);
+        free (closing [i]);
+    }
+}
+/*
+ * Move the connections in excess of 'max_idle' and the ones idle for too
+ * long to 'closing'. Caller must hold the mutex.
+ */
+void
+TctiSgxConnPool::trim (vector<TSS2_TCTI_CONTEXT*> &closing)
+{
+    chrono::steady_clock::time_point oldest = chrono::steady_clock::now () -
+        chrono::milliseconds (this->max_idle_ms);
+    map<unsigned, list<Idle> >::iterator itr;
+
+    for (itr = this->idle.begin (); itr != this->idle.end (); ++itr) {
+        while (!itr->second.empty () &&
+               (itr->second.size () > this->max_idle ||
+                (this->max_idle_ms != 0 && itr->second.back ().since < oldest)))
+        {
+            closing.push_back (itr->second.back ().tcti_context);
+            itr->second.pop_back ();
+            --this->stats.idle;
+            ++this->stats.discarded;
+        }
+    }
+}
+bool
+TctiSgxConnPool::enabled ()
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    return this->max_idle > 0;
+}
+/*
+ * Keep up to 'max_idle' connections for each backend, none for longer
+ * than 'max_idle_ms' (0 for as long as they're not needed). Connections
+ * over the new limits are closed.
+ */
+void
+TctiSgxConnPool::set_limits (size_t max_idle,
+                             uint32_t max_idle_ms)
+{
+    vector<TSS2_TCTI_CONTEXT*> closing;
+
+    this->mutex.lock ();
+    this->max_idle = max_idle;
+    this->max_idle_ms = max_idle_ms;
+    this->trim (closing);
+    this->mutex.unlock ();
+    close (closing);
+}
+/*
+ * Take an idle connection to 'backend'. Returns NULL if there's none.
+ */
+TSS2_TCTI_CONTEXT*
+TctiSgxConnPool::take (unsigned backend)
+{
+    vector<TSS2_TCTI_CONTEXT*> closing;
+    TSS2_TCTI_CONTEXT *tcti_context = NULL;
+    map<unsigned, list<Idle> >::iterator itr;
+
+    this->mutex.lock ();
+    if (this->max_idle > 0) {
+        this->trim (closing);
+        itr = this->idle.find (backend);
+        if (itr != this->idle.end () && !itr->second.empty ()) {
+            tcti_context = itr->second.front ().tcti_context;
+            itr->second.pop_front ();
+            --this->stats.idle;
+            ++this->stats.hits;
+        } else {
+            ++this->stats.misses;
+        }
+    }
+    this->mutex.unlock ();
+    close (closing);
+    return tcti_context;
+}
+/*
+ * Give back a clean connection to 'backend'. It's closed if the backend
+ * already has as many idle connections as it may keep.
+ */
+void
+TctiSgxConnPool::give (unsigned backend,
+                       TSS2_TCTI_CONTEXT *tcti_context)
+{
+    vector<TSS2_TCTI_CONTEXT*> closing;
+    Idle idle = { tcti_context, chrono::steady_clock::now () };
+
+    this->mutex.lock ();
+    this->idle [backend].push_front (idle);
+    ++this->stats.idle;
+    ++this->stats.returned;
+    this->trim (closing);
+    this->mutex.unlock ();
+    close (closing);
+}
+/*
+ * Close a connection that couldn't be cleaned up.
+ */
+void
+TctiSgxConnPool::discard (TSS2_TCTI_CONTEXT *tcti_context)
+{
+    vector<TSS2_TCTI_CONTEXT*> closing (1, tcti_context);
+
+    this->mutex.lock ();
+    ++this->stats.discarded;
+    this->mutex.unlock ();
+    close (closing);
+}
+/*
+ * Close the connections that have been idle for too long.
+ */
+void
+TctiSgxConnPool::expire ()
+{
+    vector<TSS2_TCTI_CONTEXT*> closing;
+
+    this->mutex.lock ();
+    this->trim (closing);
+    this->mutex.unlock ();
+    close (closing);
+}
+
+void
+TctiSgxConnPool::get_stats (tcti_sgx_conn_pool_stats_t *stats)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    *stats = this->stats;
+}
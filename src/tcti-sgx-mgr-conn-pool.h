@@ -0,0 +1,61 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TCTI_SGX_MGR_CONN_POOL_H
+#define TCTI_SGX_MGR_CONN_POOL_H
+
+#include <chrono>
+#include <list>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <tss2/tss2_tcti.h>
+#include "tcti-sgx-mgr.h"
+
+/*
+ * Downstream connections kept open after their session is gone, for the
+ * next session on the same backend. A session that goes away without a
+ * command outstanding cleans up its connection, flushing whatever is
+ * still loaded and going back to locality 0, and gives it to the pool.
+ * New sessions take a pooled connection before asking the backend for a
+ * new one.
+ *
+ * Cleaning up lists what's loaded with GetCapability, so it relies on the
+ * downstream giving each connection its own handles, as a resource
+ * manager does. Migrating or suspending a session doesn't, they only move
+ * what the session's client loaded.
+ *
+ * Each backend keeps at most 'max_idle' connections, the most recently
+ * returned is handed out first and connections idle for more than
+ * 'max_idle_ms' are closed. A 'max_idle' of 0 (the default) disables the
+ * pool. Shared by all sessions, access is serialized with the object's
+ * own mutex. Connections are finalized outside of it.
+ */
+class TctiSgxConnPool {
+    struct Idle {
+        TSS2_TCTI_CONTEXT *tcti_context;
+        std::chrono::steady_clock::time_point since;
+    };
+    std::mutex mutex;
+    size_t max_idle;
+    uint32_t max_idle_ms;
+    /* idle connections of each backend, most recently returned first */
+    std::map<unsigned, std::list<Idle> > idle;
+    tcti_sgx_conn_pool_stats_t stats;
+    void trim (std::vector<TSS2_TCTI_CONTEXT*> &closing);
+    static void close (std::vector<TSS2_TCTI_CONTEXT*> const &closing);
+public:
+    TctiSgxConnPool ();
+    ~TctiSgxConnPool ();
+    bool enabled ();
+    void set_limits (size_t max_idle, uint32_t max_idle_ms);
+    TSS2_TCTI_CONTEXT* take (unsigned backend);
+    void give (unsigned backend, TSS2_TCTI_CONTEXT *tcti_context);
+    void discard (TSS2_TCTI_CONTEXT *tcti_context);
+    void expire ();
+    void get_stats (tcti_sgx_conn_pool_stats_t *stats);
+};
+
+#endif /* TCTI_SGX_MGR_CONN_POOL_H */
@@ -0,0 +1,305 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include "tcti-sgx-mgr-cost-table.h"
+#include "tpm2-header.h"
+
+using namespace std;
+
+/*
+ * Maximum command durations in milliseconds. Short, medium and long are
+ * from the PTP spec, extra long is what Linux allows for key generation.
+ */
+#define DURATION_SHORT_MS 20
+#define DURATION_MEDIUM_MS 750
+#define DURATION_LONG_MS 2000
+#define DURATION_EXTRA_LONG_MS 300000
+/* command codes with an entry of their own */
+#define MAX_ENTRIES 512
+/* weight of a new sample in the moving average: 1 / 2^n */
+#define EXPECTED_WEIGHT_SHIFT 3
+
+/*
+ * The duration class of the commands we know about. Everything else is
+ * assumed to be long.
+ */
+tcti_sgx_duration_t
+TctiSgxCostTable::default_duration (TPM2_CC code)
+{
+    switch (code) {
+    case TPM2_CC_Startup:
+    case TPM2_CC_PCR_Read:
+    case TPM2_CC_ReadPublic:
+    case TPM2_CC_ReadClock:
+    case TPM2_CC_FlushContext:
+    case TPM2_CC_ContextSave:
+    case TPM2_CC_ContextLoad:
+        return TCTI_SGX_DURATION_SHORT;
+    case TPM2_CC_GetCapability:
+    case TPM2_CC_NV_ReadPublic:
+    case TPM2_CC_PCR_Extend:
+    case TPM2_CC_Hash:
+    case TPM2_CC_HashSequenceStart:
+    case TPM2_CC_SequenceUpdate:
+    case TPM2_CC_SequenceComplete:
+    case TPM2_CC_EventSequenceComplete:
+    case TPM2_CC_StartAuthSession:
+        return TCTI_SGX_DURATION_MEDIUM;
+    case TPM2_CC_CreatePrimary:
+    case TPM2_CC_Create:
+    case TPM2_CC_CreateLoaded:
+        return TCTI_SGX_DURATION_EXTRA_LONG;
+    default:
+        return TCTI_SGX_DURATION_LONG;
+    }
+}
+
+uint32_t
+TctiSgxCostTable::default_timeout (tcti_sgx_duration_t duration)
+{
+    switch (duration) {
+    case TCTI_SGX_DURATION_SHORT:
+        return DURATION_SHORT_MS;
+    case TCTI_SGX_DURATION_MEDIUM:
+        return DURATION_MEDIUM_MS;
+    case TCTI_SGX_DURATION_EXTRA_LONG:
+        return DURATION_EXTRA_LONG_MS;
+    default:
+        return DURATION_LONG_MS;
+    }
+}
+TctiSgxCostTable::Entry
+TctiSgxCostTable::defaults (TPM2_CC code)
+{
+    Entry entry;
+
+    entry.duration = TctiSgxCostTable::default_duration (code);
+    entry.timeout_ms = TctiSgxCostTable::default_timeout (entry.duration);
+    entry.expected_us = (uint64_t)entry.timeout_ms * 1000;
+    entry.samples = 0;
+    entry.timeouts = 0;
+    return entry;
+}
+/*
+ * Get the entry for 'code'. When there isn't one it's created from the
+ * defaults if 'create' is set and there's room. Caller must hold the
+ * mutex.
+ */
+TctiSgxCostTable::Entry*
+TctiSgxCostTable::find (TPM2_CC code,
+                        bool create)
+{
+    map<TPM2_CC, Entry>::iterator itr = this->entries.find (code);
+
+    if (itr != this->entries.end ())
+        return &itr->second;
+    if (!create || this->entries.size () >= MAX_ENTRIES)
+        return NULL;
+    itr = this->entries.insert (make_pair (code,
+                                           TctiSgxCostTable::defaults (code))).first;
+    return &itr->second;
+}
+/*
+ * Override the duration class of 'code' and its timeout. A 'timeout_ms'
+ * of 0 uses the default timeout for the class.
+ */
+int
+TctiSgxCostTable::set (TPM2_CC code,
+                       tcti_sgx_duration_t duration,
+                       uint32_t timeout_ms)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    Entry *entry = this->find (code, true);
+
+    if (entry == NULL)
+        return -1;
+    entry->duration = duration;
+    entry->timeout_ms = timeout_ms != 0 ?
+        timeout_ms : TctiSgxCostTable::default_timeout (duration);
+    if (entry->samples == 0)
+        entry->expected_us = (uint64_t)entry->timeout_ms * 1000;
+    return 0;
+}
+
+void
+TctiSgxCostTable::get (TPM2_CC code,
+                       tcti_sgx_command_cost_t *cost)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    Entry *entry = this->find (code, false);
+    Entry defaults;
+
+    if (entry == NULL) {
+        defaults = TctiSgxCostTable::defaults (code);
+        entry = &defaults;
+    }
+    cost->duration = entry->duration;
+    cost->timeout_ms = entry->timeout_ms;
+    cost->expected_us = entry->expected_us;
+    cost->samples = entry->samples;
+    cost->timeouts = entry->timeouts;
+}
+/*
+ * Whether sessions cancel commands that outlast their timeout.
+ */
+void
+TctiSgxCostTable::set_enforced (bool enforce)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    this->enforce = enforce;
+}
+bool
+TctiSgxCostTable::enforced ()
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    return this->enforce;
+}
+/*
+ * How long to wait on the TPM for the response to 'code'.
+ */
+int32_t
+TctiSgxCostTable::timeout (TPM2_CC code)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    Entry *entry = this->find (code, false);
+
+    if (entry == NULL)
+        return TctiSgxCostTable::default_timeout (
+            TctiSgxCostTable::default_duration (code));
+    return entry->timeout_ms;
+}
+
+/*
+ * The variant of a command: the key type in the high 16 bits and, for
+ * RSA, the key size in the low 16 bits of the object TPM2_Create,
+ * TPM2_CreatePrimary or TPM2_CreateLoaded creates. 0 for everything else
+ * and commands we can't make sense of.
+ */
+uint32_t
+TctiSgxCostTable::variant (uint8_t const *command,
+                           size_t size)
+{
+    size_t offset = TPM2_HEADER_SIZE + sizeof (TPM2_HANDLE);
+    uint16_t type, skip;
+
+    if (!tpm2_header_valid (command, size))
+        return 0;
+    switch (tpm2_header_code (command)) {
+    case TPM2_CC_Create:
+    case TPM2_CC_CreatePrimary:
+    case TPM2_CC_CreateLoaded:
+        break;
+    default:
+        return 0;
+    }
+    /* authorization area, inSensitive and the size of inPublic */
+    if (tpm2_header_tag (command) == TPM2_ST_SESSIONS) {
+        if (offset + sizeof (uint32_t) > size)
+            return 0;
+        offset += sizeof (uint32_t) + tpm2_get_uint32 (&command [offset]);
+    }
+    if (offset + sizeof (uint16_t) > size)
+        return 0;
+    offset += sizeof (uint16_t) + tpm2_get_uint16 (&command [offset]);
+    offset += sizeof (uint16_t);
+    /* type, nameAlg, objectAttributes and authPolicy */
+    if (offset + 8 + sizeof (uint16_t) > size)
+        return 0;
+    type = tpm2_get_uint16 (&command [offset]);
+    if (type != TPM2_ALG_RSA)
+        return (uint32_t)type << 16;
+    offset += 8;
+    offset += sizeof (uint16_t) + tpm2_get_uint16 (&command [offset]);
+    /* symmetric: algorithm, then key bits and mode unless it's NULL */
+    if (offset + sizeof (uint16_t) > size)
+        return (uint32_t)type << 16;
+    skip = tpm2_get_uint16 (&command [offset]) == TPM2_ALG_NULL ? 0 : 4;
+    offset += sizeof (uint16_t) + skip;
+    /* scheme: algorithm, then the hash unless it's NULL */
+    if (offset + sizeof (uint16_t) > size)
+        return (uint32_t)type << 16;
+    skip = tpm2_get_uint16 (&command [offset]) == TPM2_ALG_NULL ? 0 : 2;
+    offset += sizeof (uint16_t) + skip;
+    if (offset + sizeof (uint16_t) > size)
+        return (uint32_t)type << 16;
+    return (uint32_t)type << 16 | tpm2_get_uint16 (&command [offset]);
+}
+/*
+ * What a command with 'code' is expected to cost: the duration learned
+ * for 'variant' if there is one, otherwise the one for 'code'.
+ */
+uint64_t
+TctiSgxCostTable::expected_us (TPM2_CC code,
+                               uint32_t variant)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    map<pair<TPM2_CC, uint32_t>, Variant>::const_iterator itr;
+    Entry *entry;
+
+    if (variant != 0) {
+        itr = this->variants.find (make_pair (code, variant));
+        if (itr != this->variants.end ())
+            return itr->second.expected_us;
+    }
+    entry = this->find (code, false);
+    if (entry == NULL)
+        return (uint64_t)TctiSgxCostTable::default_timeout (
+            TctiSgxCostTable::default_duration (code)) * 1000;
+    return entry->expected_us;
+}
+/*
+ * Fold 'elapsed_us' into the moving average 'expected_us' of 'samples'.
+ */
+static void
+average (uint64_t *expected_us,
+         uint64_t *samples,
+         uint64_t elapsed_us)
+{
+    if ((*samples)++ == 0) {
+        *expected_us = elapsed_us;
+        return;
+    }
+    *expected_us = *expected_us - (*expected_us >> EXPECTED_WEIGHT_SHIFT) +
+        (elapsed_us >> EXPECTED_WEIGHT_SHIFT);
+}
+/*
+ * Note that a command with 'code' and 'variant' took 'elapsed_us' to
+ * execute.
+ */
+void
+TctiSgxCostTable::record (TPM2_CC code,
+                          uint64_t elapsed_us,
+                          uint32_t variant)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    Entry *entry = this->find (code, true);
+    map<pair<TPM2_CC, uint32_t>, Variant>::iterator itr;
+    Variant fresh = { 0, 0 };
+
+    if (entry == NULL)
+        return;
+    average (&entry->expected_us, &entry->samples, elapsed_us);
+    if (variant == 0)
+        return;
+    itr = this->variants.find (make_pair (code, variant));
+    if (itr == this->variants.end ()) {
+        if (this->variants.size () >= MAX_ENTRIES)
+            return;
+        itr = this->variants.insert (make_pair (make_pair (code, variant),
+                                                fresh)).first;
+    }
+    average (&itr->second.expected_us, &itr->second.samples, elapsed_us);
+}
+
+void
+TctiSgxCostTable::timed_out (TPM2_CC code)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    Entry *entry = this->find (code, true);
+
+    if (entry != NULL)
+        ++entry->timeouts;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TCTI_SGX_MGR_COST_TABLE_H
+#define TCTI_SGX_MGR_COST_TABLE_H
+
+#include <map>
+#include <mutex>
+
+#include <tss2/tss2_tpm2_types.h>
+#include "tcti-sgx-mgr.h"
+
+/*
+ * What each command is expected to cost, keyed by command code. Every
+ * command has a duration class (short, medium, long or extra long) with a
+ * default timeout: the maximum durations from the TPM PC client platform
+ * TPM profile (PTP) spec and, for the commands that generate keys, the
+ * extra long duration Linux uses. The class and the timeout can be
+ * overridden for each command code.
+ *
+ * The expected duration of a command is learned from the latencies
+ * observed by the sessions: it's a moving average of the time from
+ * sending a command to getting its response. Until a command has been
+ * seen the maximum duration for its class is used. Schedulers use the
+ * expected duration to decide what to admit and in what order. Sessions
+ * only use the timeout to cancel commands when a client blocks waiting
+ * on a response if the table is 'enforced', which it isn't by default.
+ *
+ * Some commands cost wildly different amounts depending on their
+ * parameters: creating an RSA key takes far longer than an ECC key. The
+ * key type (and RSA key size) of the object creating commands is their
+ * variant, expected durations are learned for each variant as well and
+ * used once there's a sample.
+ *
+ * Entries are kept for at most 'MAX_ENTRIES' command codes, commands past
+ * that use the defaults. Shared by all sessions, access is serialized with the table's own
+ * mutex.
+ */
+class TctiSgxCostTable {
+    struct Entry {
+        tcti_sgx_duration_t duration;
+        uint32_t timeout_ms;
+        uint64_t expected_us;
+        uint64_t samples;
+        uint64_t timeouts;
+    };
+    struct Variant {
+        uint64_t expected_us;
+        uint64_t samples;
+    };
+    std::mutex mutex;
+    /* only the commands that have been seen or overridden */
+    std::map<TPM2_CC, Entry> entries;
+    std::map<std::pair<TPM2_CC, uint32_t>, Variant> variants;
+    bool enforce;
+    static Entry defaults (TPM2_CC code);
+    Entry* find (TPM2_CC code, bool create);
+public:
+    TctiSgxCostTable () : enforce (false) {}
+    void set_enforced (bool enforce);
+    bool enforced ();
+    int set (TPM2_CC code,
+             tcti_sgx_duration_t duration,
+             uint32_t timeout_ms);
+    void get (TPM2_CC code,
+              tcti_sgx_command_cost_t *cost);
+    int32_t timeout (TPM2_CC code);
+    uint64_t expected_us (TPM2_CC code, uint32_t variant = 0);
+    void record (TPM2_CC code,
+                 uint64_t elapsed_us,
+                 uint32_t variant = 0);
+    void timed_out (TPM2_CC code);
+    static tcti_sgx_duration_t default_duration (TPM2_CC code);
+    static uint32_t default_timeout (tcti_sgx_duration_t duration);
+    static uint32_t variant (uint8_t const *command, size_t size);
+};
+
+#endif /* TCTI_SGX_MGR_COST_TABLE_H */
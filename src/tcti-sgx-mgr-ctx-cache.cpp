@@ -0,0 +1,390 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <string.h>
+
+#include <tss2/tss2_tpm2_types.h>
+
+#include "tcti-sgx-mgr-ctx-cache.h"
+#include "tcti-sgx-mgr-rsp-cache.h"
+#include "tpm2-header.h"
+
+using namespace std;
+
+/*
+ * Layout of the TPMS_CONTEXT structure that is the sole parameter of the
+ * ContextLoad command and the ContextSave response:
+ *   sequence (8) | savedHandle (4) | hierarchy (4) | contextBlob (2 + n)
+ */
+#define CONTEXT_SAVED_HANDLE_OFFSET 8
+#define CONTEXT_MIN_SIZE 18
+/* savedHandle values for ordinary and stClear transient objects */
+#define CONTEXT_SAVED_OBJECT 0x80000000
+#define CONTEXT_SAVED_STCLEAR 0x80000002
+/* an object loaded this many times is worth preloading */
+#define PRELOAD_USES_MIN 2
+
+static bool
+context_cacheable (uint8_t const *context,
+                   size_t size)
+{
+    uint32_t saved;
+
+    if (size < CONTEXT_MIN_SIZE)
+        return false;
+    saved = tpm2_get_uint32 (&context [CONTEXT_SAVED_HANDLE_OFFSET]);
+    return saved == CONTEXT_SAVED_OBJECT || saved == CONTEXT_SAVED_STCLEAR;
+}
+/*
+ * Build a successful response with 'size' bytes of parameters. Callers
+ * fill in the parameter area.
+ */
+static uint8_t*
+response_init (vector<uint8_t> &response,
+               size_t size)
+{
+    response.resize (TPM2_HEADER_SIZE + size);
+    tpm2_header_set (response.data (),
+                     TPM2_ST_NO_SESSIONS,
+                     response.size (),
+                     TPM2_RC_SUCCESS);
+    return &response [TPM2_HEADER_SIZE];
+}
+
+TctiSgxCtxCache::TctiSgxCtxCache (size_t max_idle)
+: max_idle (max_idle)
+{
+    memset (&this->stats, 0, sizeof (this->stats));
+}
+
+list<TctiSgxCtxCache::Entry>::iterator
+TctiSgxCtxCache::find_handle (TPM2_HANDLE handle)
+{
+    list<Entry>::iterator itr;
+
+    for (itr = this->entries.begin (); itr != this->entries.end (); ++itr) {
+        if (itr->loaded && itr->handle == handle)
+            break;
+    }
+    return itr;
+}
+/*
+ * Find the idle entry for 'blob', one that's 'loaded' or one that has
+ * been flushed.
+ */
+list<TctiSgxCtxCache::Entry>::iterator
+TctiSgxCtxCache::find_blob (uint8_t const *blob,
+                            size_t size,
+                            bool loaded)
+{
+    list<Entry>::iterator itr;
+
+    for (itr = this->entries.begin (); itr != this->entries.end (); ++itr) {
+        if (itr->idle && itr->loaded == loaded && itr->blob.size () == size &&
+            memcmp (itr->blob.data (), blob, size) == 0)
+            break;
+    }
+    return itr;
+}
+/*
+ * Forget the blobs of flushed objects in excess of 'max_idle', the least
+ * used first.
+ */
+void
+TctiSgxCtxCache::trim ()
+{
+    list<Entry>::iterator itr, victim;
+    size_t flushed = 0;
+
+    for (itr = this->entries.begin (); itr != this->entries.end (); ++itr)
+        flushed += itr->loaded ? 0 : 1;
+    for (; flushed > this->max_idle; --flushed) {
+        victim = this->entries.end ();
+        for (itr = this->entries.begin (); itr != this->entries.end ();
+             ++itr) {
+            if (!itr->loaded &&
+                (victim == this->entries.end () || itr->uses <= victim->uses))
+                victim = itr;
+        }
+        this->entries.erase (victim);
+    }
+}
+/*
+ * The TPM may have flushed any of the objects, their blobs won't load
+ * again. Objects the client has loaded are its business, those we're
+ * holding idle are only kept to be flushed.
+ */
+void
+TctiSgxCtxCache::forget ()
+{
+    list<Entry>::iterator itr = this->entries.begin ();
+
+    while (itr != this->entries.end ()) {
+        if (itr->idle && itr->loaded) {
+            itr->blob.clear ();
+            itr->uses = 0;
+            ++itr;
+        } else {
+            itr = this->entries.erase (itr);
+        }
+    }
+}
+/*
+ * Inspect a command before it's sent to the TPM. When the command can be
+ * answered from the cache this function returns true and 'response'
+ * holds the response buffer. Otherwise the command must be sent on to the
+ * TPM and false is returned.
+ */
+bool
+TctiSgxCtxCache::command (uint8_t const *command,
+                          size_t size,
+                          vector<uint8_t> &response)
+{
+    list<Entry>::iterator itr;
+    uint8_t const *params = &command [TPM2_HEADER_SIZE];
+    size_t params_size = size - TPM2_HEADER_SIZE;
+    uint8_t *out;
+
+    if (!this->enabled () || !tpm2_header_valid (command, size) ||
+        tpm2_header_tag (command) != TPM2_ST_NO_SESSIONS)
+        return false;
+
+    switch (tpm2_header_code (command)) {
+    case TPM2_CC_ContextSave:
+        if (params_size != sizeof (TPM2_HANDLE))
+            return false;
+        itr = this->find_handle (tpm2_get_uint32 (params));
+        if (itr == this->entries.end () || itr->idle)
+            return false;
+        ++this->stats.hits;
+        ++itr->uses;
+        out = response_init (response, itr->blob.size ());
+        memcpy (out, itr->blob.data (), itr->blob.size ());
+        return true;
+    case TPM2_CC_FlushContext:
+        if (params_size != sizeof (TPM2_HANDLE))
+            return false;
+        itr = this->find_handle (tpm2_get_uint32 (params));
+        if (itr == this->entries.end () || itr->idle)
+            return false;
+        /* defer the flush, most recently idle goes to the front */
+        itr->idle = true;
+        this->entries.splice (this->entries.begin (), this->entries, itr);
+        response_init (response, 0);
+        return true;
+    case TPM2_CC_ContextLoad:
+        if (!context_cacheable (params, params_size))
+            return false;
+        itr = this->find_blob (params, params_size, true);
+        if (itr == this->entries.end ()) {
+            ++this->stats.misses;
+            return false;
+        }
+        ++this->stats.hits;
+        ++itr->uses;
+        itr->idle = false;
+        this->entries.splice (this->entries.begin (), this->entries, itr);
+        out = response_init (response, sizeof (TPM2_HANDLE));
+        tpm2_set_uint32 (out, itr->handle);
+        return true;
+    default:
+        return false;
+    }
+}
+/*
+ * Learn from a response received from the TPM. 'command' is the command
+ * that produced it.
+ */
+void
+TctiSgxCtxCache::response (uint8_t const *command,
+                           size_t command_size,
+                           uint8_t const *response,
+                           size_t response_size)
+{
+    list<Entry>::iterator itr;
+    Entry entry;
+    uint8_t const *params = &response [TPM2_HEADER_SIZE];
+    size_t params_size = response_size - TPM2_HEADER_SIZE;
+
+    if (!this->enabled () || !tpm2_header_valid (command, command_size) ||
+        !tpm2_header_valid (response, response_size) ||
+        tpm2_header_code (response) != TPM2_RC_SUCCESS)
+        return;
+
+    entry.idle = false;
+    entry.loaded = true;
+    entry.uses = 1;
+    switch (tpm2_header_code (command)) {
+    case TPM2_CC_ContextSave:
+        if (command_size != TPM2_HEADER_SIZE + sizeof (TPM2_HANDLE) ||
+            !context_cacheable (params, params_size))
+            return;
+        entry.handle = tpm2_get_uint32 (&command [TPM2_HEADER_SIZE]);
+        entry.blob.assign (params, params + params_size);
+        break;
+    case TPM2_CC_ContextLoad:
+        if (params_size != sizeof (TPM2_HANDLE) ||
+            !context_cacheable (&command [TPM2_HEADER_SIZE],
+                                command_size - TPM2_HEADER_SIZE))
+            return;
+        entry.handle = tpm2_get_uint32 (params);
+        entry.blob.assign (&command [TPM2_HEADER_SIZE],
+                           command + command_size);
+        /* an object we flushed is back, it keeps its count */
+        itr = this->find_blob (entry.blob.data (), entry.blob.size (), false);
+        if (itr != this->entries.end ()) {
+            entry.uses = itr->uses + 1;
+            this->entries.erase (itr);
+        }
+        break;
+    case TPM2_CC_Startup:
+        /* a TPM reset or restart flushes every transient object */
+        this->entries.clear ();
+        return;
+    default:
+        /* as do, for some hierarchies, the commands the rsp cache knows */
+        if (TctiSgxRspCache::flushes_objects (command, command_size))
+            this->forget ();
+        return;
+    }
+    itr = this->find_handle (entry.handle);
+    if (itr != this->entries.end ())
+        this->entries.erase (itr);
+    this->entries.push_front (entry);
+}
+/*
+ * Select an idle object that must be flushed from the TPM. When 'all' is
+ * false a handle is returned only if we're holding more idle objects than
+ * we're allowed. The object loaded the fewest times is selected, the least
+ * recently used of those, and only its blob is kept, if it still has one.
+ * The caller is responsible for flushing it.
+ */
+bool
+TctiSgxCtxCache::evict (TPM2_HANDLE *handle,
+                        bool all)
+{
+    list<Entry>::iterator itr, victim = this->entries.end ();
+
+    if (!all && this->idle_count () <= this->max_idle)
+        return false;
+    /* most recently used first, the last of the least used wins */
+    for (itr = this->entries.begin (); itr != this->entries.end (); ++itr) {
+        if (itr->idle && itr->loaded &&
+            (victim == this->entries.end () || itr->uses <= victim->uses))
+            victim = itr;
+    }
+    if (victim == this->entries.end ())
+        return false;
+    *handle = victim->handle;
+    if (victim->blob.empty ())
+        this->entries.erase (victim);
+    else
+        victim->loaded = false;
+    ++this->stats.evictions;
+    this->trim ();
+    return true;
+}
+/*
+ * Build the ContextLoad for the flushed object most worth loading again:
+ * the one the client has loaded most often, at least PRELOAD_USES_MIN
+ * times. Nothing is preloaded while that would take the cache over
+ * 'max_idle'. Returns false when there's nothing to do.
+ */
+bool
+TctiSgxCtxCache::preload_command (vector<uint8_t> &command)
+{
+    list<Entry>::iterator itr, best = this->entries.end ();
+
+    if (!this->enabled () || this->idle_count () >= this->max_idle)
+        return false;
+    for (itr = this->entries.begin (); itr != this->entries.end (); ++itr) {
+        if (!itr->loaded && itr->uses >= PRELOAD_USES_MIN &&
+            (best == this->entries.end () || itr->uses > best->uses))
+            best = itr;
+    }
+    if (best == this->entries.end ())
+        return false;
+    command.resize (TPM2_HEADER_SIZE + best->blob.size ());
+    tpm2_header_set (command.data (),
+                     TPM2_ST_NO_SESSIONS,
+                     command.size (),
+                     TPM2_CC_ContextLoad);
+    memcpy (&command [TPM2_HEADER_SIZE], best->blob.data (),
+            best->blob.size ());
+    return true;
+}
+/*
+ * Take the TPM's response to a command from preload_command. The object
+ * is held idle until the client loads it. A blob the TPM won't take
+ * (after a reset, say) is forgotten. Returns false if it wasn't loaded.
+ */
+bool
+TctiSgxCtxCache::preload_response (uint8_t const *command,
+                                   size_t command_size,
+                                   uint8_t const *response,
+                                   size_t response_size)
+{
+    list<Entry>::iterator itr;
+
+    itr = this->find_blob (&command [TPM2_HEADER_SIZE],
+                           command_size - TPM2_HEADER_SIZE,
+                           false);
+    if (itr == this->entries.end ())
+        return false;
+    if (!tpm2_header_valid (response, response_size) ||
+        tpm2_header_code (response) != TPM2_RC_SUCCESS ||
+        response_size != TPM2_HEADER_SIZE + sizeof (TPM2_HANDLE))
+    {
+        if (!tpm2_header_valid (response, response_size) ||
+            tpm2_header_code (response) != TPM2_RC_OBJECT_MEMORY)
+            this->entries.erase (itr);
+        return false;
+    }
+    itr->handle = tpm2_get_uint32 (&response [TPM2_HEADER_SIZE]);
+    itr->loaded = true;
+    ++this->stats.preloads;
+    return true;
+}
+/*
+ * The objects that were 'from' on the session's old connection are 'to'
+ * on its new one.
+ */
+void
+TctiSgxCtxCache::moved (vector<TPM2_HANDLE> const &from,
+                        vector<TPM2_HANDLE> const &to)
+{
+    list<Entry>::iterator itr;
+    size_t i;
+
+    for (itr = this->entries.begin (); itr != this->entries.end (); ++itr) {
+        if (!itr->loaded)
+            continue;
+        for (i = 0; i < from.size () && i < to.size (); ++i) {
+            if (itr->handle == from [i]) {
+                itr->handle = to [i];
+                break;
+            }
+        }
+    }
+}
+
+size_t
+TctiSgxCtxCache::idle_count () const
+{
+    list<Entry>::const_iterator itr;
+    size_t count = 0;
+
+    for (itr = this->entries.begin (); itr != this->entries.end (); ++itr) {
+        if (itr->idle && itr->loaded)
+            ++count;
+    }
+    return count;
+}
+
+void
+TctiSgxCtxCache::get_stats (tcti_sgx_ctx_cache_stats_t *stats) const
+{
+    *stats = this->stats;
+    stats->entries = this->idle_count ();
+}
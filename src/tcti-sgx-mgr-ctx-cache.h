@@ -0,0 +1,78 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TCTI_SGX_MGR_CTX_CACHE_H
+#define TCTI_SGX_MGR_CTX_CACHE_H
+
+#include <list>
+#include <vector>
+
+#include <tss2/tss2_tpm2_types.h>
+#include "tcti-sgx-mgr.h"
+
+/*
+ * A per-session cache of transient object contexts. The TSS swaps objects
+ * out of the TPM with a ContextSave / FlushContext pair and brings them
+ * back with ContextLoad. When the cache is enabled the FlushContext is
+ * deferred: the object stays loaded in the TPM and is remembered along
+ * with the context blob the client holds for it. A later ContextLoad of
+ * the same blob (or a ContextSave of a handle we already hold a blob for)
+ * is then answered without a round trip to the TPM.
+ *
+ * At most 'max_idle' deferred objects are kept loaded. Beyond that the
+ * one the client has loaded the fewest times is flushed for real, the
+ * least recently used of those. Its blob is remembered, as are up to
+ * 'max_idle' others, so an object the client keeps coming back to can be
+ * preloaded while the session is idle and the client's next ContextLoad
+ * is answered from the cache. Only ordinary and stClear objects are
+ * cached: sequence objects change as they're used and saved session
+ * contexts may only be loaded once. Blobs are forgotten when the TPM may
+ * have flushed their objects: on Startup and on the commands the
+ * response cache knows flush objects of a hierarchy.
+ *
+ * This object is not thread safe. The owning TctiSgxSession serializes
+ * access with its own mutex.
+ */
+class TctiSgxCtxCache {
+    struct Entry {
+        TPM2_HANDLE handle;
+        std::vector<uint8_t> blob;
+        bool idle;
+        /* false once flushed, 'handle' means nothing then */
+        bool loaded;
+        uint64_t uses;
+    };
+    size_t max_idle;
+    std::list<Entry> entries;
+    tcti_sgx_ctx_cache_stats_t stats;
+    std::list<Entry>::iterator find_handle (TPM2_HANDLE handle);
+    std::list<Entry>::iterator find_blob (uint8_t const *blob,
+                                          size_t size,
+                                          bool loaded);
+    void trim ();
+    void forget ();
+public:
+    TctiSgxCtxCache (size_t max_idle);
+    bool enabled () const { return this->max_idle > 0; }
+    bool command (uint8_t const *command,
+                  size_t size,
+                  std::vector<uint8_t> &response);
+    void response (uint8_t const *command,
+                   size_t command_size,
+                   uint8_t const *response,
+                   size_t response_size);
+    bool evict (TPM2_HANDLE *handle,
+                bool all);
+    bool preload_command (std::vector<uint8_t> &command);
+    bool preload_response (uint8_t const *command,
+                           size_t command_size,
+                           uint8_t const *response,
+                           size_t response_size);
+    void moved (std::vector<TPM2_HANDLE> const &from,
+                std::vector<TPM2_HANDLE> const &to);
+    size_t idle_count () const;
+    void get_stats (tcti_sgx_ctx_cache_stats_t *stats) const;
+};
+
+#endif /* TCTI_SGX_MGR_CTX_CACHE_H */
@@ -0,0 +1,328 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <string.h>
+
+#include "tcti-sgx-mgr-handle-map.h"
+#include "tpm2-header.h"
+
+using namespace std;
+
+/*
+ * GetCapability layout:
+ *   command: header | capability (4) | property (4) | propertyCount (4)
+ *   response: header | moreData (1) | capability (4) | count (4) |
+ *             item (4) * count
+ * TPMA_CC and handles are both 4 bytes, the TPM sends as many as fit.
+ */
+#define CAP_COMMAND_SIZE (TPM2_HEADER_SIZE + 12)
+#define CAP_MORE_OFFSET TPM2_HEADER_SIZE
+#define CAP_CAPABILITY_OFFSET (TPM2_HEADER_SIZE + 1)
+#define CAP_COUNT_OFFSET (TPM2_HEADER_SIZE + 5)
+#define CAP_ITEMS_OFFSET (CAP_COUNT_OFFSET + 4)
+#define CAP_ITEMS_MAX 256
+
+TctiSgxHandleMap::TctiSgxHandleMap ()
+: code (0), flushed (0), next (TPM2_HR_HANDLE_MASK)
+{}
+
+static void
+cap_command (TPM2_CAP capability,
+             uint32_t property,
+             vector<uint8_t> &command)
+{
+    command.resize (CAP_COMMAND_SIZE);
+    tpm2_header_set (command.data (),
+                     TPM2_ST_NO_SESSIONS,
+                     CAP_COMMAND_SIZE,
+                     TPM2_CC_GetCapability);
+    tpm2_set_uint32 (&command [TPM2_HEADER_SIZE], capability);
+    tpm2_set_uint32 (&command [TPM2_HEADER_SIZE + 4], property);
+    tpm2_set_uint32 (&command [TPM2_HEADER_SIZE + 8], CAP_ITEMS_MAX);
+}
+/*
+ * Check a GetCapability response for 'capability' and return the number
+ * of items in it, -1 if it's not what we asked for.
+ */
+static int
+cap_count (uint8_t const *response,
+           size_t size,
+           TPM2_CAP capability)
+{
+    uint32_t count;
+
+    if (!tpm2_header_valid (response, size) ||
+        tpm2_header_code (response) != TPM2_RC_SUCCESS ||
+        size < CAP_ITEMS_OFFSET ||
+        tpm2_get_uint32 (&response [CAP_CAPABILITY_OFFSET]) != capability)
+        return -1;
+    count = tpm2_get_uint32 (&response [CAP_COUNT_OFFSET]);
+    if (count > CAP_ITEMS_MAX || size != CAP_ITEMS_OFFSET + count * 4)
+        return -1;
+    return count;
+}
+/*
+ * Build the GetCapability command for the attributes of the commands
+ * from 'first' on.
+ */
+void
+TctiSgxHandleMap::commands_command (TPM2_CC first,
+                                    vector<uint8_t> &command)
+{
+    cap_command (TPM2_CAP_COMMANDS, first, command);
+}
+/*
+ * Build the GetCapability command for the handles from 'first' on.
+ */
+void
+TctiSgxHandleMap::handles_command (TPM2_HANDLE first,
+                                   vector<uint8_t> &command)
+{
+    cap_command (TPM2_CAP_HANDLES, first, command);
+}
+/*
+ * Add the command attributes from the response to 'commands_command'.
+ * '*next' is where to pick up when there are more.
+ * Returns 1 if there are more, 0 if not, -1 if the response is bad.
+ */
+int
+TctiSgxHandleMap::add_commands (uint8_t const *response,
+                                size_t size,
+                                TPM2_CC *next)
+{
+    TPMA_CC attrs;
+    int count, i;
+
+    count = cap_count (response, size, TPM2_CAP_COMMANDS);
+    if (count < 0)
+        return -1;
+    for (i = 0; i < count; ++i) {
+        attrs = tpm2_get_uint32 (&response [CAP_ITEMS_OFFSET + i * 4]);
+        *next = attrs & (TPMA_CC_COMMANDINDEX_MASK | TPMA_CC_V);
+        this->commands [*next] = attrs;
+        ++*next;
+    }
+    return response [CAP_MORE_OFFSET] && count > 0 ? 1 : 0;
+}
+/*
+ * Add the handles from the response to 'handles_command' to 'handles'.
+ * '*more' is set if the TPM has more, from the last one in 'handles' on.
+ * Returns 0 on success, -1 if the response is bad.
+ */
+int
+TctiSgxHandleMap::parse_handles (uint8_t const *response,
+                                 size_t size,
+                                 TPM2_HANDLE first,
+                                 vector<TPM2_HANDLE> &handles,
+                                 bool *more)
+{
+    TPM2_HANDLE handle;
+    int count, i;
+
+    count = cap_count (response, size, TPM2_CAP_HANDLES);
+    if (count < 0)
+        return -1;
+    for (i = 0; i < count; ++i) {
+        handle = tpm2_get_uint32 (&response [CAP_ITEMS_OFFSET + i * 4]);
+        if (handle < first)
+            return -1;
+        handles.push_back (handle);
+    }
+    *more = response [CAP_MORE_OFFSET] && count > 0;
+    return 0;
+}
+
+bool
+TctiSgxHandleMap::response_handle (TPM2_CC code) const
+{
+    map<TPM2_CC, TPMA_CC>::const_iterator itr = this->commands.find (code);
+
+    return itr != this->commands.end () && (itr->second & TPMA_CC_RHANDLE);
+}
+/*
+ * The number of handles 'code' takes, -1 if we don't know.
+ */
+int
+TctiSgxHandleMap::command_handles (TPM2_CC code) const
+{
+    map<TPM2_CC, TPMA_CC>::const_iterator itr = this->commands.find (code);
+
+    if (itr == this->commands.end ())
+        return -1;
+    return (itr->second & TPMA_CC_CHANDLES_MASK) >> TPMA_CC_CHANDLES_SHIFT;
+}
+
+TPM2_HANDLE
+TctiSgxHandleMap::tpm (TPM2_HANDLE client) const
+{
+    map<TPM2_HANDLE, TPM2_HANDLE>::const_iterator itr;
+
+    itr = this->to_tpm.find (client);
+    return itr == this->to_tpm.end () ? client : itr->second;
+}
+/*
+ * The handle the client knows the TPM's 'tpm' as. One that the client
+ * already uses for something else is given a handle we make up from the
+ * top of its range down.
+ */
+TPM2_HANDLE
+TctiSgxHandleMap::client (TPM2_HANDLE tpm)
+{
+    map<TPM2_HANDLE, TPM2_HANDLE>::const_iterator itr;
+    TPM2_HANDLE client;
+
+    itr = this->to_client.find (tpm);
+    if (itr != this->to_client.end ())
+        return itr->second;
+    if (this->to_tpm.find (tpm) == this->to_tpm.end ())
+        return tpm;
+    do {
+        client = (tpm & TPM2_HR_RANGE_MASK) |
+            (this->next-- & TPM2_HR_HANDLE_MASK);
+    } while (this->to_tpm.count (client) > 0 ||
+             this->to_client.count (client) > 0);
+    this->add (client, tpm);
+    return client;
+}
+/*
+ * Map 'client' to 'tpm', replacing whatever either was mapped to before.
+ */
+void
+TctiSgxHandleMap::add (TPM2_HANDLE client,
+                       TPM2_HANDLE tpm)
+{
+    map<TPM2_HANDLE, TPM2_HANDLE>::iterator itr;
+
+    this->remove (client);
+    itr = this->to_client.find (tpm);
+    if (itr != this->to_client.end ()) {
+        this->to_tpm.erase (itr->second);
+        this->to_client.erase (itr);
+    }
+    if (client == tpm)
+        return;
+    this->to_tpm [client] = tpm;
+    this->to_client [tpm] = client;
+}
+
+void
+TctiSgxHandleMap::remove (TPM2_HANDLE client)
+{
+    map<TPM2_HANDLE, TPM2_HANDLE>::iterator itr;
+
+    itr = this->to_tpm.find (client);
+    if (itr == this->to_tpm.end ())
+        return;
+    this->to_client.erase (itr->second);
+    this->to_tpm.erase (itr);
+}
+/*
+ * The objects and sessions that were 'from' on the old connection are
+ * 'to' on the new one. That's everything there was, whatever else the
+ * map knew about is gone.
+ */
+void
+TctiSgxHandleMap::moved (vector<TPM2_HANDLE> const &from,
+                         vector<TPM2_HANDLE> const &to)
+{
+    map<TPM2_HANDLE, TPM2_HANDLE> clients;
+    map<TPM2_HANDLE, TPM2_HANDLE>::const_iterator itr;
+    size_t i;
+
+    clients.swap (this->to_client);
+    this->to_tpm.clear ();
+    for (i = 0; i < from.size () && i < to.size (); ++i) {
+        itr = clients.find (from [i]);
+        this->add (itr == clients.end () ? from [i] : itr->second, to [i]);
+    }
+}
+/*
+ * Translate the handles in a command from the client's to the TPM's.
+ * Returns the command to send: 'client_command' itself when there's
+ * nothing to translate, otherwise a translated copy that's good until the next
+ * command.
+ */
+uint8_t const*
+TctiSgxHandleMap::command (uint8_t const *client_command,
+                           size_t size)
+{
+    map<TPM2_CC, TPMA_CC>::const_iterator attrs;
+    size_t count, offset, end;
+    uint8_t *command;
+
+    this->code = 0;
+    this->flushed = 0;
+    if (!tpm2_header_valid (client_command, size))
+        return client_command;
+    this->code = tpm2_header_code (client_command);
+    if (!this->active ())
+        return client_command;
+    attrs = this->commands.find (this->code);
+    if (attrs == this->commands.end ())
+        return client_command;
+    count = (attrs->second & TPMA_CC_CHANDLES_MASK) >>
+        TPMA_CC_CHANDLES_SHIFT;
+    if (size < TPM2_HEADER_SIZE + count * 4)
+        return client_command;
+    this->mapped.assign (client_command, client_command + size);
+    command = this->mapped.data ();
+    for (offset = TPM2_HEADER_SIZE; count > 0; --count, offset += 4)
+        tpm2_set_uint32 (&command [offset],
+                         this->tpm (tpm2_get_uint32 (&command [offset])));
+    /* the one command that takes a handle as a parameter */
+    if (this->code == TPM2_CC_FlushContext && size >= offset + 4) {
+        this->flushed = tpm2_get_uint32 (&command [offset]);
+        tpm2_set_uint32 (&command [offset], this->tpm (this->flushed));
+        return command;
+    }
+    /*
+     * authorization area: authSize (4) followed by
+     *   sessionHandle (4) | nonce (2 + n) | attributes (1) | hmac (2 + n)
+     */
+    if (tpm2_header_tag (command) != TPM2_ST_SESSIONS || size < offset + 4)
+        return command;
+    end = offset + 4 + tpm2_get_uint32 (&command [offset]);
+    if (end > size)
+        return command;
+    for (offset += 4; offset + 4 <= end;) {
+        tpm2_set_uint32 (&command [offset],
+                         this->tpm (tpm2_get_uint32 (&command [offset])));
+        offset += 4;
+        if (offset + 2 > end)
+            break;
+        offset += 2 + tpm2_get_uint16 (&command [offset]) + 1;
+        if (offset + 2 > end)
+            break;
+        offset += 2 + tpm2_get_uint16 (&command [offset]);
+    }
+    return command;
+}
+/*
+ * Translate the handle in the response to the last command from the
+ * TPM's to the client's and forget handles that have been flushed.
+ */
+void
+TctiSgxHandleMap::response (uint8_t *response,
+                            size_t size)
+{
+    if (!tpm2_header_valid (response, size) ||
+        tpm2_header_code (response) != TPM2_RC_SUCCESS)
+        return;
+    /* a TPM reset or restart flushes every transient object */
+    if (this->code == TPM2_CC_Startup) {
+        this->to_tpm.clear ();
+        this->to_client.clear ();
+        return;
+    }
+    if (this->code == TPM2_CC_FlushContext) {
+        this->remove (this->flushed);
+        return;
+    }
+    if (!this->active () || !this->response_handle (this->code) ||
+        size < TPM2_HEADER_SIZE + 4)
+        return;
+    tpm2_set_uint32 (&response [TPM2_HEADER_SIZE],
+                     this->client (
+                         tpm2_get_uint32 (&response [TPM2_HEADER_SIZE])));
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TCTI_SGX_MGR_HANDLE_MAP_H
+#define TCTI_SGX_MGR_HANDLE_MAP_H
+
+#include <map>
+#include <vector>
+
+#include <tss2/tss2_tpm2_types.h>
+#include "tcti-sgx-mgr.h"
+
+/*
+ * Handles of a session that has moved from one downstream connection to
+ * another. Objects loaded again on the new connection get new handles
+ * but the client still holds the old ones, so until they're flushed the
+ * handles in commands are translated from what the client knows to what
+ * the TPM knows and the handle in responses the other way. A handle the
+ * TPM gives out that the client already uses for something else is given
+ * to the client as one we make up.
+ *
+ * Which of a command's bytes are handles comes from the TPM: the TPMA_CC
+ * of each command, fetched with GetCapability before the first move.
+ * Handles in the handle and authorization areas are translated, as is the
+ * handle FlushContext takes as a parameter. Handles the TPM lists in
+ * parameters, like GetCapability for TPM2_CAP_HANDLES, are not.
+ *
+ * Everything before the map is in the TPM's terms, the map is the last
+ * thing a response goes through and the first a command does. Nothing is
+ * translated until the session has moved. This object is not thread
+ * safe, the owning TctiSgxSession serializes access.
+ */
+class TctiSgxHandleMap {
+    /* handle the client knows -> handle on the connection and back */
+    std::map<TPM2_HANDLE, TPM2_HANDLE> to_tpm;
+    std::map<TPM2_HANDLE, TPM2_HANDLE> to_client;
+    /* TPMA_CC of each command by command code */
+    std::map<TPM2_CC, TPMA_CC> commands;
+    /* the last command, translated, and what its response needs */
+    std::vector<uint8_t> mapped;
+    TPM2_CC code;
+    TPM2_HANDLE flushed;
+    /* next handle to try when we have to make one up */
+    TPM2_HANDLE next;
+    TPM2_HANDLE tpm (TPM2_HANDLE client) const;
+    TPM2_HANDLE client (TPM2_HANDLE tpm);
+    void add (TPM2_HANDLE client, TPM2_HANDLE tpm);
+    void remove (TPM2_HANDLE client);
+public:
+    TctiSgxHandleMap ();
+    bool active () const { return !this->to_tpm.empty (); }
+    size_t size () const { return this->to_tpm.size (); }
+    bool has_commands () const { return !this->commands.empty (); }
+    int add_commands (uint8_t const *response,
+                      size_t size,
+                      TPM2_CC *next);
+    bool response_handle (TPM2_CC code) const;
+    int command_handles (TPM2_CC code) const;
+    TPM2_CC last () const { return this->code; }
+    void moved (std::vector<TPM2_HANDLE> const &from,
+                std::vector<TPM2_HANDLE> const &to);
+    uint8_t const* command (uint8_t const *command, size_t size);
+    void response (uint8_t *response, size_t size);
+    static void commands_command (TPM2_CC first,
+                                  std::vector<uint8_t> &command);
+    static void handles_command (TPM2_HANDLE first,
+                                 std::vector<uint8_t> &command);
+    static int parse_handles (uint8_t const *response,
+                              size_t size,
+                              TPM2_HANDLE first,
+                              std::vector<TPM2_HANDLE> &handles,
+                              bool *more);
+};
+
+#endif /* TCTI_SGX_MGR_HANDLE_MAP_H */
@@ -0,0 +1,168 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include "tcti-sgx-mgr-interceptor.h"
+#include "tpm2-header.h"
+
+using namespace std;
+
+/*
+ * The table covers the TPM2 command codes: TPM2_CC_FIRST (0x11f) up.
+ * Vendor specific commands are looked up in 'other'.
+ */
+#define INTERCEPT_CC_FIRST 0x11f
+#define INTERCEPT_CC_COUNT 0x100
+
+bool
+TctiSgxInterceptorChain::empty () const
+{
+    return this->interceptors.empty ();
+}
+/*
+ * Add 'interceptor' to the end of the chain for the 'count' command codes
+ * in 'codes', or for all commands when 'count' is 0.
+ */
+void
+TctiSgxInterceptorChain::add (tcti_sgx_interceptor_t const &interceptor,
+                              TPM2_CC const *codes,
+                              size_t count)
+{
+    map<TPM2_CC, vector<size_t> >::iterator itr;
+    size_t index = this->interceptors.size (), i;
+    TPM2_CC slot;
+
+    this->interceptors.push_back (interceptor);
+    if (this->table.empty ())
+        this->table.resize (INTERCEPT_CC_COUNT);
+    if (count == 0) {
+        for (i = 0; i < this->table.size (); ++i)
+            this->table [i].push_back (index);
+        for (itr = this->other.begin (); itr != this->other.end (); ++itr)
+            itr->second.push_back (index);
+        this->wildcard.push_back (index);
+        return;
+    }
+    for (i = 0; i < count; ++i) {
+        slot = codes [i] - INTERCEPT_CC_FIRST;
+        if (slot < INTERCEPT_CC_COUNT) {
+            this->table [slot].push_back (index);
+            continue;
+        }
+        itr = this->other.find (codes [i]);
+        if (itr == this->other.end ())
+            itr = this->other.insert (make_pair (codes [i],
+                                                 this->wildcard)).first;
+        itr->second.push_back (index);
+    }
+}
+/*
+ * Get the interceptors for 'code', NULL when there are none.
+ */
+vector<size_t> const*
+TctiSgxInterceptorChain::lookup (TPM2_CC code) const
+{
+    map<TPM2_CC, vector<size_t> >::const_iterator itr;
+    TPM2_CC slot = code - INTERCEPT_CC_FIRST;
+
+    if (this->table.empty ())
+        return NULL;
+    if (slot < INTERCEPT_CC_COUNT)
+        return &this->table [slot];
+    itr = this->other.find (code);
+    return itr == this->other.end () ? &this->wildcard : &itr->second;
+}
+/*
+ * Determine whether any interceptor wants to see 'command'.
+ */
+bool
+TctiSgxInterceptorChain::wants (uint8_t const *command,
+                                size_t size) const
+{
+    vector<size_t> const *chain;
+
+    if (this->table.empty () || size < TPM2_HEADER_SIZE)
+        return false;
+    chain = this->lookup (tpm2_header_code (command));
+    return chain != NULL && !chain->empty ();
+}
+/*
+ * Run 'command' through the command hooks. 'command' must have room for
+ * TPM2_MAX_COMMAND_SIZE bytes and 'response' for TPM2_MAX_RESPONSE_SIZE.
+ * Sets '*answered' when an interceptor answered the command, in which
+ * case the response is in 'response'. Returns the number of interceptors
+ * that passed the command on: the ones whose response hooks need to be
+ * called.
+ */
+size_t
+TctiSgxInterceptorChain::command (uint64_t id,
+                                  uint8_t *command,
+                                  size_t *command_size,
+                                  uint8_t *response,
+                                  size_t *response_size,
+                                  bool *answered) const
+{
+    vector<size_t> const *chain;
+    tcti_sgx_intercept_t action;
+    size_t depth;
+
+    *answered = false;
+    if (*command_size < TPM2_HEADER_SIZE)
+        return 0;
+    chain = this->lookup (tpm2_header_code (command));
+    if (chain == NULL)
+        return 0;
+    for (depth = 0; depth < chain->size (); ++depth) {
+        tcti_sgx_interceptor_t const &interceptor =
+            this->interceptors [(*chain) [depth]];
+
+        if (interceptor.command == NULL)
+            continue;
+        *response_size = TPM2_MAX_RESPONSE_SIZE;
+        action = interceptor.command (interceptor.user_data,
+                                      id,
+                                      command,
+                                      command_size,
+                                      response,
+                                      response_size);
+        if (action == TCTI_SGX_INTERCEPT_RESPOND) {
+            *answered = true;
+            break;
+        }
+    }
+    return depth;
+}
+/*
+ * Run 'response' through the response hooks of the first 'depth'
+ * interceptors for 'code', the code of the command as the client sent it,
+ * last one first.
+ */
+void
+TctiSgxInterceptorChain::response (uint64_t id,
+                                   TPM2_CC code,
+                                   size_t depth,
+                                   uint8_t const *command,
+                                   size_t command_size,
+                                   uint8_t *response,
+                                   size_t *response_size,
+                                   size_t capacity) const
+{
+    vector<size_t> const *chain;
+
+    if (depth == 0)
+        return;
+    chain = this->lookup (code);
+    for (; depth > 0; --depth) {
+        tcti_sgx_interceptor_t const &interceptor =
+            this->interceptors [(*chain) [depth - 1]];
+
+        if (interceptor.response != NULL)
+            interceptor.response (interceptor.user_data,
+                                  id,
+                                  command,
+                                  command_size,
+                                  response,
+                                  response_size,
+                                  capacity);
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TCTI_SGX_MGR_INTERCEPTOR_H
+#define TCTI_SGX_MGR_INTERCEPTOR_H
+
+#include <map>
+#include <vector>
+
+#include <tss2/tss2_tpm2_types.h>
+#include "tcti-sgx-mgr.h"
+
+/*
+ * An ordered chain of interceptors that see the commands a session sends
+ * before they go to the TPM and the responses after they come back. Each
+ * interceptor is registered for a set of command codes (or all of them)
+ * and only sees those. The chain keeps a table indexed by command code
+ * with, for each code, the interceptors that want it in registration
+ * order. Dispatching a command is a bounds check and a table lookup, when
+ * no interceptor wants the command there's nothing more to it.
+ *
+ * An interceptor's command hook may rewrite the command in place, answer
+ * it or pass it on to the next interceptor. The response hooks of the
+ * interceptors that passed the command on are called in the reverse order
+ * once the response is available, they may rewrite it in place. The
+ * interceptors called are the ones for the code of the command as the
+ * client sent it, even if one of them rewrites the code.
+ *
+ * The manager keeps the chain in the session config, each session gets
+ * its own copy when it's created. It isn't changed after that so there's
+ * no locking.
+ */
+class TctiSgxInterceptorChain {
+    std::vector<tcti_sgx_interceptor_t> interceptors;
+    /* indexes into 'interceptors' for each command code in the table */
+    std::vector<std::vector<size_t> > table;
+    /* the same for the (vendor) command codes outside of the table */
+    std::map<TPM2_CC, std::vector<size_t> > other;
+    /* the interceptors for all commands */
+    std::vector<size_t> wildcard;
+    std::vector<size_t> const* lookup (TPM2_CC code) const;
+public:
+    bool empty () const;
+    bool wants (uint8_t const *command,
+                size_t size) const;
+    void add (tcti_sgx_interceptor_t const &interceptor,
+              TPM2_CC const *codes,
+              size_t count);
+    size_t command (uint64_t id,
+                    uint8_t *command,
+                    size_t *command_size,
+                    uint8_t *response,
+                    size_t *response_size,
+                    bool *answered) const;
+    void response (uint64_t id,
+                   TPM2_CC code,
+                   size_t depth,
+                   uint8_t const *command,
+                   size_t command_size,
+                   uint8_t *response,
+                   size_t *response_size,
+                   size_t capacity) const;
+};
+
+#endif /* TCTI_SGX_MGR_INTERCEPTOR_H */
@@ -0,0 +1,243 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <string.h>
+
+#include <tss2/tss2_tpm2_types.h>
+
+#include "tcti-sgx-mgr-key-pool.h"
+#include "tpm2-header.h"
+
+using namespace std;
+
+/*
+ * Create command layout with a single password session:
+ *   header | parentHandle (4) | authorizationSize (4) |
+ *   sessionHandle (4) | nonceCaller (2 + 0) | sessionAttributes (1) |
+ *   hmac (2 + n) | parameters
+ * The response ends with the password session response:
+ *   nonceTPM (2 + 0) | sessionAttributes (1) | hmac (2 + 0)
+ */
+#define CREATE_PARENT_OFFSET TPM2_HEADER_SIZE
+#define CREATE_AUTH_SIZE_OFFSET (TPM2_HEADER_SIZE + 4)
+#define CREATE_ATTRS_OFFSET (TPM2_HEADER_SIZE + 14)
+#define CREATE_HMAC_OFFSET (TPM2_HEADER_SIZE + 15)
+#define PW_RESPONSE_SIZE 5
+
+/*
+ * Build the Create command for 'spec'. A client command can only be
+ * answered from the pool if it's identical to this one, apart from the
+ * sessionAttributes.
+ */
+static void
+build_create (TctiSgxKeySpec const &spec,
+              vector<uint8_t> &command)
+{
+    size_t params_offset = CREATE_HMAC_OFFSET + 2 + spec.auth.size ();
+
+    command.assign (params_offset + spec.params.size (), 0);
+    tpm2_header_set (command.data (),
+                     TPM2_ST_SESSIONS,
+                     command.size (),
+                     TPM2_CC_Create);
+    tpm2_set_uint32 (&command [CREATE_PARENT_OFFSET], spec.parent);
+    tpm2_set_uint32 (&command [CREATE_AUTH_SIZE_OFFSET],
+                     params_offset - CREATE_AUTH_SIZE_OFFSET - 4);
+    tpm2_set_uint32 (&command [CREATE_AUTH_SIZE_OFFSET + 4], TPM2_RS_PW);
+    /* nonceCaller is empty and sessionAttributes are 0 */
+    tpm2_set_uint16 (&command [CREATE_HMAC_OFFSET], spec.auth.size ());
+    if (!spec.auth.empty ())
+        memcpy (&command [CREATE_HMAC_OFFSET + 2],
+                spec.auth.data (),
+                spec.auth.size ());
+    memcpy (&command [params_offset], spec.params.data (), spec.params.size ());
+}
+/*
+ * Build the spec for keys created from the marshalled TPM2B_PUBLIC
+ * 'in_public' under the persistent key 'parent'. The keys are created
+ * with an empty inSensitive, outsideInfo and creationPCR. 'parent_auth'
+ * may be NULL if the parent has no password.
+ */
+bool
+TctiSgxKeyPool::make_spec (TPM2_HANDLE parent,
+                           TPM2B_AUTH const *parent_auth,
+                           uint8_t const *in_public,
+                           size_t in_public_size,
+                           size_t depth,
+                           uint32_t max_age_ms,
+                           TctiSgxKeySpec *spec)
+{
+    /* TPM2B_SENSITIVE_CREATE with empty userAuth and data */
+    static uint8_t const in_sensitive [] = { 0x00, 0x04, 0x00, 0x00, 0x00, 0x00 };
+    /* empty outsideInfo and a TPML_PCR_SELECTION with count 0 */
+    static uint8_t const creation [] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+    if (parent >> TPM2_HR_SHIFT != TPM2_HT_PERSISTENT || in_public == NULL ||
+        in_public_size < 2 ||
+        tpm2_get_uint16 (in_public) + 2u != in_public_size)
+        return false;
+    if (parent_auth != NULL && parent_auth->size > sizeof (parent_auth->buffer))
+        return false;
+    spec->parent = parent;
+    spec->auth.clear ();
+    if (parent_auth != NULL)
+        spec->auth.assign (parent_auth->buffer,
+                           parent_auth->buffer + parent_auth->size);
+    spec->params.assign (in_sensitive, in_sensitive + sizeof (in_sensitive));
+    spec->params.insert (spec->params.end (),
+                         in_public,
+                         in_public + in_public_size);
+    spec->params.insert (spec->params.end (),
+                         creation,
+                         creation + sizeof (creation));
+    spec->depth = depth;
+    spec->max_age = chrono::milliseconds (max_age_ms);
+    return true;
+}
+
+TctiSgxKeyPool::TctiSgxKeyPool ()
+{
+    memset (&this->stats, 0, sizeof (this->stats));
+}
+
+bool
+TctiSgxKeyPool::enabled ()
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    return !this->specs.empty ();
+}
+
+void
+TctiSgxKeyPool::add_spec (TctiSgxKeySpec const &spec)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    this->specs.push_back (spec);
+    this->pools.push_back (list<Entry> ());
+}
+/*
+ * Drop the keys for 'spec' that are past their age limit. The oldest key
+ * is at the front. Caller must hold the mutex. Returns the number of keys
+ * left.
+ */
+size_t
+TctiSgxKeyPool::expire (size_t spec)
+{
+    list<Entry> &pool = this->pools [spec];
+    chrono::steady_clock::time_point now = chrono::steady_clock::now ();
+
+    if (this->specs [spec].max_age.count () == 0)
+        return pool.size ();
+    while (!pool.empty () &&
+           now - pool.front ().created >= this->specs [spec].max_age)
+    {
+        pool.pop_front ();
+        ++this->stats.expired;
+    }
+    return pool.size ();
+}
+/*
+ * Answer a Create from the pool. Returns true and populates 'response'
+ * when a pooled key was handed out.
+ */
+bool
+TctiSgxKeyPool::command (uint8_t const *command,
+                         size_t size,
+                         vector<uint8_t> &response)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    vector<uint8_t> expected;
+    uint8_t attrs;
+    size_t i;
+
+    if (this->specs.empty () || !tpm2_header_valid (command, size) ||
+        tpm2_header_tag (command) != TPM2_ST_SESSIONS ||
+        tpm2_header_code (command) != TPM2_CC_Create ||
+        size <= CREATE_ATTRS_OFFSET)
+        return false;
+    /* only continueSession means anything for a password session */
+    attrs = command [CREATE_ATTRS_OFFSET];
+    if ((attrs & ~TPMA_SESSION_CONTINUESESSION) != 0)
+        return false;
+    for (i = 0; i < this->specs.size (); ++i) {
+        if (this->specs [i].parent !=
+            tpm2_get_uint32 (&command [CREATE_PARENT_OFFSET]))
+            continue;
+        build_create (this->specs [i], expected);
+        expected [CREATE_ATTRS_OFFSET] = attrs;
+        if (expected.size () == size &&
+            memcmp (expected.data (), command, size) == 0)
+            break;
+    }
+    if (i == this->specs.size ())
+        return false;
+    if (this->expire (i) == 0) {
+        ++this->stats.misses;
+        return false;
+    }
+    response.swap (this->pools [i].front ().response);
+    this->pools [i].pop_front ();
+    response [response.size () - 3] = attrs;
+    ++this->stats.hits;
+    return true;
+}
+/*
+ * Find a spec whose pool is below its configured depth and build the
+ * Create command that will make a key for it. Returns false when all
+ * pools are full.
+ */
+bool
+TctiSgxKeyPool::refill_command (size_t *spec,
+                                vector<uint8_t> &command)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    size_t i;
+
+    for (i = 0; i < this->specs.size (); ++i) {
+        if (this->expire (i) < this->specs [i].depth)
+            break;
+    }
+    if (i == this->specs.size ())
+        return false;
+    *spec = i;
+    build_create (this->specs [i], command);
+    return true;
+}
+/*
+ * Add the key from a Create response to the pool for 'spec'. Returns false
+ * if the response doesn't carry a key.
+ */
+bool
+TctiSgxKeyPool::refill_response (size_t spec,
+                                 uint8_t const *response,
+                                 size_t size)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    Entry entry;
+
+    if (spec >= this->specs.size () || !tpm2_header_valid (response, size) ||
+        tpm2_header_tag (response) != TPM2_ST_SESSIONS ||
+        tpm2_header_code (response) != TPM2_RC_SUCCESS ||
+        size < TPM2_HEADER_SIZE + 4 + PW_RESPONSE_SIZE)
+        return false;
+    entry.response.assign (response, response + size);
+    entry.created = chrono::steady_clock::now ();
+    this->pools [spec].push_back (entry);
+    ++this->stats.generated;
+    return true;
+}
+
+void
+TctiSgxKeyPool::get_stats (tcti_sgx_key_pool_stats_t *stats)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    uint64_t available = 0;
+    size_t i;
+
+    for (i = 0; i < this->pools.size (); ++i)
+        available += this->expire (i);
+    *stats = this->stats;
+    stats->available = available;
+}
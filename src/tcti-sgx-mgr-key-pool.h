@@ -0,0 +1,71 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TCTI_SGX_MGR_KEY_POOL_H
+#define TCTI_SGX_MGR_KEY_POOL_H
+
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <vector>
+
+#include <tss2/tss2_tpm2_types.h>
+#include "tcti-sgx-mgr.h"
+
+/*
+ * Description of one kind of pre-generated key: the persistent parent it's
+ * created under, the password for that parent and the parameters of the
+ * Create command (inSensitive, inPublic, outsideInfo and creationPCR).
+ * Keys older than 'max_age' are thrown away (0 means no limit).
+ */
+struct TctiSgxKeySpec {
+    TPM2_HANDLE parent;
+    std::vector<uint8_t> auth;
+    std::vector<uint8_t> params;
+    size_t depth;
+    std::chrono::milliseconds max_age;
+};
+/*
+ * A pool of keys created ahead of time with TPM2_Create. A Create from a
+ * client that's byte-for-byte the command we used to make one of the keys
+ * (same parent, same password, same parameters) is answered with a key
+ * from the pool.
+ *
+ * The keys aren't loaded and the parents are persistent, so unlike the
+ * session pool this one isn't tied to a connection and is shared by all
+ * sessions. Access is serialized with the pool's own mutex.
+ */
+class TctiSgxKeyPool {
+    struct Entry {
+        std::vector<uint8_t> response;
+        std::chrono::steady_clock::time_point created;
+    };
+    std::mutex mutex;
+    std::vector<TctiSgxKeySpec> specs;
+    std::vector<std::list<Entry> > pools;
+    tcti_sgx_key_pool_stats_t stats;
+    size_t expire (size_t spec);
+public:
+    TctiSgxKeyPool ();
+    bool enabled ();
+    void add_spec (TctiSgxKeySpec const &spec);
+    bool command (uint8_t const *command,
+                  size_t size,
+                  std::vector<uint8_t> &response);
+    bool refill_command (size_t *spec,
+                         std::vector<uint8_t> &command);
+    bool refill_response (size_t spec,
+                          uint8_t const *response,
+                          size_t size);
+    void get_stats (tcti_sgx_key_pool_stats_t *stats);
+    static bool make_spec (TPM2_HANDLE parent,
+                           TPM2B_AUTH const *parent_auth,
+                           uint8_t const *in_public,
+                           size_t in_public_size,
+                           size_t depth,
+                           uint32_t max_age_ms,
+                           TctiSgxKeySpec *spec);
+};
+
+#endif /* TCTI_SGX_MGR_KEY_POOL_H */
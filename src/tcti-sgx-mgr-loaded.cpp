@@ -0,0 +1,171 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include "tcti-sgx-mgr-loaded.h"
+#include "tcti-sgx-mgr-rsp-cache.h"
+#include "tpm2-header.h"
+
+using namespace std;
+
+TctiSgxLoaded::TctiSgxLoaded ()
+: known (true), code (0), lost_track (false)
+{}
+/*
+ * What we know 'handle' by: itself for an object, the HMAC session handle
+ * with its index for a session.
+ */
+TPM2_HANDLE
+TctiSgxLoaded::key (TPM2_HANDLE handle)
+{
+    if ((handle >> TPM2_HR_SHIFT) == TPM2_HT_POLICY_SESSION)
+        return TPM2_HR_HMAC_SESSION | (handle & TPM2_HR_HANDLE_MASK);
+    return handle;
+}
+
+bool
+TctiSgxLoaded::has_sessions () const
+{
+    set<TPM2_HANDLE>::const_iterator itr;
+
+    itr = this->handles.lower_bound (TPM2_HR_HMAC_SESSION);
+    return itr != this->handles.end () &&
+        (*itr >> TPM2_HR_SHIFT) == TPM2_HT_HMAC_SESSION;
+}
+/*
+ * Note what the command about to go to the TPM unloads should it succeed.
+ * 'handles' is the number of handles the command has, -1 if not known.
+ */
+void
+TctiSgxLoaded::command (uint8_t const *command,
+                        size_t size,
+                        int handles)
+{
+    TPM2_HANDLE handle;
+    size_t offset, end;
+
+    this->code = 0;
+    this->ending.clear ();
+    this->lost_track = false;
+    if (!tpm2_header_valid (command, size))
+        return;
+    this->code = tpm2_header_code (command);
+    /* Startup flushes everything, the others some hierarchy's objects */
+    this->lost_track = this->code != TPM2_CC_Startup &&
+        TctiSgxRspCache::flushes_objects (command, size);
+    switch (this->code) {
+    case TPM2_CC_FlushContext:
+    case TPM2_CC_ContextSave:
+    case TPM2_CC_SequenceComplete:
+        if (size < TPM2_HEADER_SIZE + 4)
+            break;
+        handle = tpm2_get_uint32 (&command [TPM2_HEADER_SIZE]);
+        /* saving a session unloads it, saving an object doesn't */
+        if (this->code != TPM2_CC_ContextSave ||
+            key (handle) >> TPM2_HR_SHIFT == TPM2_HT_HMAC_SESSION)
+            this->ending.push_back (handle);
+        break;
+    case TPM2_CC_EventSequenceComplete:
+        /* pcrHandle then sequenceHandle */
+        if (size >= TPM2_HEADER_SIZE + 8)
+            this->ending.push_back (
+                tpm2_get_uint32 (&command [TPM2_HEADER_SIZE + 4]));
+        break;
+    }
+    if (tpm2_header_tag (command) != TPM2_ST_SESSIONS)
+        return;
+    if (handles < 0) {
+        if (this->has_sessions ())
+            this->lost_track = true;
+        return;
+    }
+    /*
+     * authorization area: authSize (4) followed by
+     *   sessionHandle (4) | nonce (2 + n) | attributes (1) | hmac (2 + n)
+     */
+    offset = TPM2_HEADER_SIZE + handles * 4;
+    if (size < offset + 4)
+        return;
+    end = offset + 4 + tpm2_get_uint32 (&command [offset]);
+    if (end > size)
+        return;
+    for (offset += 4; offset + 4 <= end;) {
+        handle = tpm2_get_uint32 (&command [offset]);
+        offset += 4;
+        if (offset + 2 > end)
+            break;
+        offset += 2 + tpm2_get_uint16 (&command [offset]);
+        if (offset + 1 > end)
+            break;
+        if (!(command [offset] & TPMA_SESSION_CONTINUESESSION))
+            this->ending.push_back (handle);
+        offset += 1;
+        if (offset + 2 > end)
+            break;
+        offset += 2 + tpm2_get_uint16 (&command [offset]);
+    }
+}
+/*
+ * Bring the set up to date with the response to the last command, be it
+ * from the TPM or one of the caches answering for it.
+ */
+void
+TctiSgxLoaded::response (uint8_t const *response,
+                         size_t size)
+{
+    size_t i;
+
+    if (this->code == 0 || !tpm2_header_valid (response, size) ||
+        tpm2_header_code (response) != TPM2_RC_SUCCESS)
+        return;
+    for (i = 0; i < this->ending.size (); ++i)
+        this->handles.erase (key (this->ending [i]));
+    if (this->lost_track)
+        this->known = false;
+    switch (this->code) {
+    case TPM2_CC_Startup:
+        this->handles.clear ();
+        this->known = true;
+        break;
+    case TPM2_CC_CreatePrimary:
+    case TPM2_CC_Load:
+    case TPM2_CC_LoadExternal:
+    case TPM2_CC_CreateLoaded:
+    case TPM2_CC_StartAuthSession:
+    case TPM2_CC_HashSequenceStart:
+    case TPM2_CC_HMAC_Start:
+    case TPM2_CC_ContextLoad:
+        if (size >= TPM2_HEADER_SIZE + 4)
+            this->handles.insert (
+                key (tpm2_get_uint32 (&response [TPM2_HEADER_SIZE])));
+        break;
+    }
+    this->code = 0;
+}
+/*
+ * Keep only the handles in 'handles' that are in the set.
+ */
+void
+TctiSgxLoaded::select (vector<TPM2_HANDLE> &handles) const
+{
+    size_t i, kept = 0;
+
+    for (i = 0; i < handles.size (); ++i)
+        if (this->handles.count (key (handles [i])) > 0)
+            handles [kept++] = handles [i];
+    handles.resize (kept);
+}
+/*
+ * What was 'from' is now 'to'.
+ */
+void
+TctiSgxLoaded::moved (vector<TPM2_HANDLE> const &from,
+                      vector<TPM2_HANDLE> const &to)
+{
+    size_t i;
+
+    for (i = 0; i < from.size (); ++i)
+        this->handles.erase (key (from [i]));
+    for (i = 0; i < to.size (); ++i)
+        this->handles.insert (key (to [i]));
+}
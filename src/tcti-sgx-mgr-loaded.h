@@ -0,0 +1,56 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TCTI_SGX_MGR_LOADED_H
+#define TCTI_SGX_MGR_LOADED_H
+
+#include <set>
+#include <vector>
+
+#include <tss2/tss2_tpm2_types.h>
+
+/*
+ * The transient objects and sessions a session's client has loaded on the
+ * TPM. Without a resource manager downstream every connection sees what
+ * every other one has loaded, so when the manager saves and flushes what
+ * a session has (to suspend or move it) it only takes what's listed here.
+ *
+ * Handles are added from the response to a command that loads something
+ * and dropped when the client flushes them, saves a session, completes a
+ * sequence or uses a session without continueSession. Finding the
+ * sessions a command uses takes the number of handles the command has, a
+ * command with sessions whose handle count isn't known when the client
+ * has a session loaded leaves us not knowing which are still there. So
+ * does a command that flushes the objects of a hierarchy, as the response
+ * cache has them. Startup flushes everything, we know where we are again
+ * after that.
+ *
+ * Handles are in the TPM's terms. A session is known by its index, the
+ * TPM lists a loaded policy session in the HMAC session range. This
+ * object is not thread safe, the owning TctiSgxSession serializes access.
+ */
+class TctiSgxLoaded {
+    std::set<TPM2_HANDLE> handles;
+    bool known;
+    /* the last command and what its success unloads */
+    TPM2_CC code;
+    std::vector<TPM2_HANDLE> ending;
+    bool lost_track;
+    static TPM2_HANDLE key (TPM2_HANDLE handle);
+public:
+    TctiSgxLoaded ();
+    bool exact () const { return this->known; }
+    bool has_sessions () const;
+    void command (uint8_t const *command,
+                  size_t size,
+                  int handles);
+    void cancel () { this->code = 0; }
+    void response (uint8_t const *response,
+                   size_t size);
+    void select (std::vector<TPM2_HANDLE> &handles) const;
+    void moved (std::vector<TPM2_HANDLE> const &from,
+                std::vector<TPM2_HANDLE> const &to);
+};
+
+#endif /* TCTI_SGX_MGR_LOADED_H */
@@ -0,0 +1,215 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "tcti-sgx-mgr-mux.h"
+
+using namespace std;
+
+TctiSgxMux::TctiSgxMux (TctiSgxBackends *backends)
+: backends (backends), width (0), wait_ms (MUX_WAIT_DEFAULT)
+{
+    memset (&this->stats, 0, sizeof (this->stats));
+}
+TctiSgxMux::~TctiSgxMux ()
+{
+    map<unsigned, list<Channel> >::iterator itr;
+    list<Channel>::iterator chan;
+    vector<TSS2_TCTI_CONTEXT*> closing;
+
+    for (itr = this->channels.begin (); itr != this->channels.end (); ++itr) {
+        for (chan = itr->second.begin (); chan != itr->second.end (); ++chan) {
+            if (chan->tcti_context != NULL)
+                closing.push_back (chan->tcti_context);
+        }
+    }
+    close (closing);
+}
+/*
+ * Finalize and free each of 'closing'.
+ */
+void
+TctiSgxMux::close (vector<TSS2_TCTI_CONTEXT*> const &closing)
+{
+    size_t i;
+
+    for (i = 0; i < closing.size (); ++i) {
+        Tss2_Tcti_Finalize (closing [i]);
+        free (closing [i]);
+    }
+}
+/*
+ * The most channels a backend may have: 'width', or one for the sessions
+ * still multiplexed once it's 0. Caller must hold the mutex.
+ */
+size_t
+TctiSgxMux::limit () const
+{
+    return this->width == 0 && this->stats.sessions > 0 ? 1 : this->width;
+}
+/*
+ * Move the channels no one holds in excess of the limit to 'closing'.
+ * Caller must hold the mutex.
+ */
+void
+TctiSgxMux::trim (vector<TSS2_TCTI_CONTEXT*> &closing)
+{
+    map<unsigned, list<Channel> >::iterator itr;
+    list<Channel>::iterator chan;
+
+    for (itr = this->channels.begin (); itr != this->channels.end (); ++itr) {
+        chan = itr->second.begin ();
+        while (itr->second.size () > this->limit () &&
+               chan != itr->second.end ())
+        {
+            if (chan->held) {
+                ++chan;
+                continue;
+            }
+            closing.push_back (chan->tcti_context);
+            chan = itr->second.erase (chan);
+            --this->stats.connections;
+        }
+    }
+}
+/*
+ * Share up to 'width' connections to each backend between the sessions
+ * created from now on. Channels over the new width are closed as they
+ * become free.
+ */
+void
+TctiSgxMux::set_limits (size_t width,
+                        uint32_t wait_ms)
+{
+    vector<TSS2_TCTI_CONTEXT*> closing;
+
+    this->mutex.lock ();
+    this->width = width;
+    this->wait_ms = wait_ms;
+    this->trim (closing);
+    this->mutex.unlock ();
+    close (closing);
+}
+/*
+ * Count a new session in if sessions are being multiplexed. Returns false
+ * if the session should have a connection of its own.
+ */
+bool
+TctiSgxMux::attach ()
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    if (this->width == 0)
+        return false;
+    ++this->stats.sessions;
+    return true;
+}
+void
+TctiSgxMux::detach ()
+{
+    vector<TSS2_TCTI_CONTEXT*> closing;
+
+    this->mutex.lock ();
+    --this->stats.sessions;
+    this->trim (closing);
+    this->mutex.unlock ();
+    close (closing);
+}
+/*
+ * Take a free channel to 'backend', connecting a new one if the backend
+ * has fewer than 'width'. Waits for one to be given back otherwise, until
+ * 'wait_ms' has passed or '*deadline' if that's sooner: TRY_AGAIN.
+ * Returns NO_CONNECTION if the backend can't be connected to.
+ */
+TSS2_RC
+TctiSgxMux::acquire (unsigned backend,
+                     chrono::steady_clock::time_point const *deadline,
+                     TSS2_TCTI_CONTEXT **tcti_context)
+{
+    unique_lock<std::mutex> lock (this->mutex);
+    chrono::steady_clock::time_point limit;
+    list<Channel> &chans = this->channels [backend];
+    list<Channel>::iterator chan;
+    Channel fresh = { NULL, true };
+    bool waited = false;
+
+    limit = chrono::steady_clock::now () + chrono::milliseconds (this->wait_ms);
+    if (deadline != NULL && *deadline < limit)
+        limit = *deadline;
+    for (;;) {
+        for (chan = chans.begin (); chan != chans.end (); ++chan) {
+            if (!chan->held && chan->tcti_context != NULL) {
+                chan->held = true;
+                *tcti_context = chan->tcti_context;
+                ++this->stats.acquired;
+                this->stats.waited += waited ? 1 : 0;
+                return TSS2_RC_SUCCESS;
+            }
+        }
+        if (chans.size () < this->limit ())
+            break;
+        if (this->cond.wait_until (lock, limit) == cv_status::timeout) {
+            ++this->stats.timeouts;
+            return TSS2_TCTI_RC_TRY_AGAIN;
+        }
+        waited = true;
+    }
+    /* hold the place while connecting so no one else takes it */
+    chan = chans.insert (chans.end (), fresh);
+    lock.unlock ();
+    *tcti_context = this->backends->connect (backend);
+    lock.lock ();
+    if (*tcti_context == NULL) {
+        chans.erase (chan);
+        this->cond.notify_all ();
+        return TSS2_TCTI_RC_NO_CONNECTION;
+    }
+    chan->tcti_context = *tcti_context;
+    ++this->stats.connections;
+    ++this->stats.acquired;
+    this->stats.waited += waited ? 1 : 0;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Give back a channel taken with acquire. A channel that isn't 'clean',
+ * with something still loaded or a response outstanding, is closed.
+ */
+void
+TctiSgxMux::release (unsigned backend,
+                     TSS2_TCTI_CONTEXT *tcti_context,
+                     bool clean)
+{
+    vector<TSS2_TCTI_CONTEXT*> closing;
+    list<Channel>::iterator chan;
+
+    this->mutex.lock ();
+    list<Channel> &chans = this->channels [backend];
+    for (chan = chans.begin (); chan != chans.end (); ++chan) {
+        if (chan->tcti_context == tcti_context)
+            break;
+    }
+    if (chan != chans.end ()) {
+        chan->held = false;
+        if (!clean) {
+            closing.push_back (tcti_context);
+            chans.erase (chan);
+            --this->stats.connections;
+            ++this->stats.discarded;
+        }
+        this->trim (closing);
+    }
+    this->cond.notify_all ();
+    this->mutex.unlock ();
+    close (closing);
+}
+
+void
+TctiSgxMux::get_stats (tcti_sgx_mux_stats_t *stats)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    *stats = this->stats;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TCTI_SGX_MGR_MUX_H
+#define TCTI_SGX_MGR_MUX_H
+
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <tss2/tss2_tcti.h>
+#include "tcti-sgx-mgr.h"
+#include "tcti-sgx-mgr-backends.h"
+
+#define MUX_WAIT_DEFAULT 5000
+
+/*
+ * Downstream connections shared by multiplexed sessions. Rather than a
+ * connection of its own, a multiplexed session takes one of up to
+ * 'width' channels to its backend when it sends a command and gives it
+ * back once it has the response. The TPM runs one command at a time so a
+ * handful of channels keeps it as busy as a connection per session would.
+ *
+ * Sessions don't share what they load: a session that leaves something
+ * on its channel (an object, a loaded session or a hash sequence) or
+ * changes its locality keeps the channel until it's back to nothing, so a
+ * channel only ever changes hands clean. With a resource manager
+ * downstream that scopes handles per connection a session sees no one
+ * else's objects, the same as with a connection of its own.
+ *
+ * A session waiting for a channel gives up after 'wait_ms' or at its
+ * command's deadline. Waiters hold their session's lock, as they do for
+ * the scheduler. A 'width' of 0 (the default) gives new sessions their own
+ * connection, sessions already multiplexed then make do with one channel
+ * per backend. Shared by all sessions, access is serialized with the
+ * object's own mutex. Connections are made and finalized outside of it.
+ */
+class TctiSgxMux {
+    struct Channel {
+        /* NULL while it's being connected */
+        TSS2_TCTI_CONTEXT *tcti_context;
+        bool held;
+    };
+    std::mutex mutex;
+    std::condition_variable cond;
+    TctiSgxBackends *backends;
+    size_t width;
+    uint32_t wait_ms;
+    std::map<unsigned, std::list<Channel> > channels;
+    tcti_sgx_mux_stats_t stats;
+    size_t limit () const;
+    void trim (std::vector<TSS2_TCTI_CONTEXT*> &closing);
+    static void close (std::vector<TSS2_TCTI_CONTEXT*> const &closing);
+public:
+    TctiSgxMux (TctiSgxBackends *backends);
+    ~TctiSgxMux ();
+    void set_limits (size_t width, uint32_t wait_ms);
+    bool attach ();
+    void detach ();
+    TSS2_RC acquire (unsigned backend,
+                     std::chrono::steady_clock::time_point const *deadline,
+                     TSS2_TCTI_CONTEXT **tcti_context);
+    void release (unsigned backend,
+                  TSS2_TCTI_CONTEXT *tcti_context,
+                  bool clean);
+    void get_stats (tcti_sgx_mux_stats_t *stats);
+};
+
+#endif /* TCTI_SGX_MGR_MUX_H */
@@ -0,0 +1,280 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+
+#include "tcti-sgx-mgr-placement.h"
+
+using namespace std;
+
+TctiSgxPlacement::TctiSgxPlacement (char const *root)
+: policy (TCTI_SGX_PLACEMENT_NONE), node (0), generation (0)
+{
+    long count;
+    int cpu;
+
+    if (this->load_topology (root) == 0)
+        return;
+    /* no NUMA information, everything is on node 0 */
+    count = sysconf (_SC_NPROCESSORS_CONF);
+    this->node_cpus.assign (1, vector<int> ());
+    this->cpu_node.clear ();
+    for (cpu = 0; cpu < (count > 0 ? count : 1); ++cpu) {
+        this->node_cpus [0].push_back (cpu);
+        this->cpu_node.push_back (0);
+    }
+}
+/*
+ * Parse a sysfs CPU list like "0-3,8,10-11" into 'cpus'.
+ * Returns 0 on success, -1 if 'list' isn't a CPU list.
+ */
+int
+TctiSgxPlacement::parse_cpulist (char const *list,
+                                 vector<int> &cpus)
+{
+    char *end;
+    long first, last;
+
+    cpus.clear ();
+    while (*list != '\0' && *list != '\n') {
+        errno = 0;
+        first = strtol (list, &end, 10);
+        if (end == list || errno != 0 || first < 0)
+            return -1;
+        last = first;
+        list = end;
+        if (*list == '-') {
+            ++list;
+            last = strtol (list, &end, 10);
+            if (end == list || errno != 0 || last < first)
+                return -1;
+            list = end;
+        }
+        for (; first <= last; ++first)
+            cpus.push_back (first);
+        if (*list == ',')
+            ++list;
+        else if (*list != '\0' && *list != '\n')
+            return -1;
+    }
+    return 0;
+}
+/*
+ * Read the CPUs of each node from 'root'/node<N>/cpulist. Nodes may be
+ * numbered with gaps, missing ones have no CPUs.
+ * Returns 0 if at least one node was found, -1 otherwise.
+ */
+int
+TctiSgxPlacement::load_topology (char const *root)
+{
+    char buf [4096];
+    vector<int> cpus;
+    size_t i;
+    FILE *file;
+    int n;
+
+    for (n = 0; n < PLACEMENT_NODES_MAX; ++n) {
+        string path = string (root) + "/node" + to_string (n) + "/cpulist";
+        file = fopen (path.c_str (), "r");
+        if (file == NULL)
+            continue;
+        if (fgets (buf, sizeof (buf), file) == NULL ||
+            parse_cpulist (buf, cpus) != 0)
+        {
+            cout << __func__ << ": can't parse " << path << endl;
+            cpus.clear ();
+        }
+        fclose (file);
+        this->node_cpus.resize (n + 1);
+        this->node_cpus [n] = cpus;
+        for (i = 0; i < cpus.size (); ++i) {
+            if ((size_t)cpus [i] >= this->cpu_node.size ())
+                this->cpu_node.resize (cpus [i] + 1, -1);
+            this->cpu_node [cpus [i]] = n;
+        }
+    }
+    return this->node_cpus.empty () ? -1 : 0;
+}
+size_t
+TctiSgxPlacement::node_count () const
+{
+    return this->node_cpus.size ();
+}
+/*
+ * Returns the node 'cpu' belongs to, 0 if we don't know.
+ */
+int
+TctiSgxPlacement::node_of_cpu (int cpu) const
+{
+    if (cpu < 0 || (size_t)cpu >= this->cpu_node.size () ||
+        this->cpu_node [cpu] < 0)
+        return 0;
+    return this->cpu_node [cpu];
+}
+int
+TctiSgxPlacement::current_node () const
+{
+    return this->node_of_cpu (sched_getcpu ());
+}
+/*
+ * Pick the node with the most sessions for TCTI_SGX_PLACEMENT_ENCLAVE.
+ * Caller must hold the mutex.
+ */
+void
+TctiSgxPlacement::retarget ()
+{
+    unsigned best = this->node, n;
+
+    for (n = 0; n < this->node_cpus.size (); ++n)
+        if (!this->node_cpus [n].empty () &&
+            this->counters [n].sessions > this->counters [best].sessions)
+            best = n;
+    if (best != this->node) {
+        this->node = best;
+        ++this->generation;
+    }
+}
+/*
+ * Set the placement policy. 'node' is only used by
+ * TCTI_SGX_PLACEMENT_NODE and must have CPUs.
+ * Returns 0 on success, -1 on a bad policy or node.
+ */
+int
+TctiSgxPlacement::set (tcti_sgx_placement_t policy,
+                       unsigned node)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    switch (policy) {
+    case TCTI_SGX_PLACEMENT_NONE:
+        break;
+    case TCTI_SGX_PLACEMENT_NODE:
+        if (node >= this->node_cpus.size () || this->node_cpus [node].empty ())
+            return -1;
+        this->node = node;
+        break;
+    case TCTI_SGX_PLACEMENT_ENCLAVE:
+        break;
+    default:
+        return -1;
+    }
+    this->policy = policy;
+    ++this->generation;
+    if (policy == TCTI_SGX_PLACEMENT_ENCLAVE)
+        this->retarget ();
+    return 0;
+}
+/*
+ * True when session state should be placed on its home node.
+ */
+bool
+TctiSgxPlacement::local ()
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    return this->policy != TCTI_SGX_PLACEMENT_NONE;
+}
+/*
+ * The node manager threads are pinned to.
+ */
+unsigned
+TctiSgxPlacement::target ()
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    return this->node;
+}
+/*
+ * Pin the calling thread to the CPUs of the target node, or let it run
+ * anywhere without a policy. '*generation' is the caller's record of the
+ * placement it last applied, nothing is done if that's still current.
+ */
+void
+TctiSgxPlacement::pin_self (uint64_t *generation)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    cpu_set_t set;
+    size_t i;
+    int ret;
+
+    if (*generation == this->generation)
+        return;
+    *generation = this->generation;
+    CPU_ZERO (&set);
+    if (this->policy == TCTI_SGX_PLACEMENT_NONE) {
+        for (i = 0; i < this->cpu_node.size (); ++i)
+            if (this->cpu_node [i] >= 0 && i < CPU_SETSIZE)
+                CPU_SET (i, &set);
+    } else {
+        for (i = 0; i < this->node_cpus [this->node].size (); ++i)
+            if (this->node_cpus [this->node][i] < CPU_SETSIZE)
+                CPU_SET (this->node_cpus [this->node][i], &set);
+    }
+    ret = pthread_setaffinity_np (pthread_self (), sizeof (set), &set);
+    if (ret != 0)
+        cout << __func__ << ": failed to set affinity: " << strerror (ret)
+             << endl;
+}
+/*
+ * Called when a session is created, on the thread creating it.
+ * Returns the session's home node.
+ */
+int
+TctiSgxPlacement::session_created ()
+{
+    int home = this->current_node ();
+
+    ++this->counters [home].sessions;
+    lock_guard<std::mutex> guard (this->mutex);
+    if (this->policy == TCTI_SGX_PLACEMENT_ENCLAVE)
+        this->retarget ();
+    return home;
+}
+void
+TctiSgxPlacement::session_destroyed (int home)
+{
+    if (home < 0 || home >= PLACEMENT_NODES_MAX)
+        return;
+    --this->counters [home].sessions;
+    lock_guard<std::mutex> guard (this->mutex);
+    if (this->policy == TCTI_SGX_PLACEMENT_ENCLAVE)
+        this->retarget ();
+}
+/*
+ * Count an ocall for a session with home node 'home' serviced on the
+ * calling thread.
+ */
+void
+TctiSgxPlacement::served (int home)
+{
+    int current = this->current_node ();
+
+    ++this->counters [current].ocalls;
+    if (home >= 0 && home != current)
+        ++this->counters [current].remote_ocalls;
+}
+/*
+ * Returns 0 on success, -1 if there's no such node.
+ */
+int
+TctiSgxPlacement::get_stats (unsigned node,
+                             tcti_sgx_node_stats_t *stats)
+{
+    if (node >= this->node_cpus.size ())
+        return -1;
+    stats->cpus = this->node_cpus [node].size ();
+    stats->sessions = this->counters [node].sessions;
+    stats->ocalls = this->counters [node].ocalls;
+    stats->remote_ocalls = this->counters [node].remote_ocalls;
+    return 0;
+}
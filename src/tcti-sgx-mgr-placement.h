@@ -0,0 +1,68 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TCTI_SGX_MGR_PLACEMENT_H
+#define TCTI_SGX_MGR_PLACEMENT_H
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "tcti-sgx-mgr.h"
+
+#define PLACEMENT_SYSFS_ROOT "/sys/devices/system/node"
+#define PLACEMENT_NODES_MAX 64
+
+struct TctiSgxNodeCounters {
+    std::atomic<uint64_t> sessions;
+    std::atomic<uint64_t> ocalls;
+    std::atomic<uint64_t> remote_ocalls;
+    TctiSgxNodeCounters () : sessions (0), ocalls (0), remote_ocalls (0) {}
+};
+/*
+ * Where the manager's threads run and where session state lives on hosts
+ * with more than one NUMA node.
+ *
+ * Ocalls are serviced on the enclave's own threads so the manager can't
+ * move those. What it can do is keep its own threads (maintenance and
+ * the audit log writer) on the node the enclave runs on and give each
+ * session a home: the node of the thread that created it. Memory is
+ * placed on the node that first touches it so with a policy set the
+ * session's buffers are touched when it's created, on its home node,
+ * rather than on whichever node first sends a command. Ocalls serviced on
+ * a node other than the session's home are counted as remote.
+ *
+ * The topology comes from sysfs, a host without it is one node. Shared by
+ * all sessions, settings are protected by the object's own mutex and the
+ * counters are atomic.
+ */
+class TctiSgxPlacement {
+    std::mutex mutex;
+    /* CPUs of each node and the node of each CPU */
+    std::vector<std::vector<int> > node_cpus;
+    std::vector<int> cpu_node;
+    tcti_sgx_placement_t policy;
+    /* node threads are pinned to, bumped 'generation' when it changes */
+    unsigned node;
+    uint64_t generation;
+    TctiSgxNodeCounters counters [PLACEMENT_NODES_MAX];
+    int load_topology (char const *root);
+    void retarget ();
+public:
+    TctiSgxPlacement (char const *root = PLACEMENT_SYSFS_ROOT);
+    size_t node_count () const;
+    int node_of_cpu (int cpu) const;
+    int current_node () const;
+    int set (tcti_sgx_placement_t policy, unsigned node);
+    bool local ();
+    unsigned target ();
+    void pin_self (uint64_t *generation);
+    int session_created ();
+    void session_destroyed (int node);
+    void served (int home);
+    int get_stats (unsigned node, tcti_sgx_node_stats_t *stats);
+    static int parse_cpulist (char const *list, std::vector<int> &cpus);
+};
+
+#endif /* TCTI_SGX_MGR_PLACEMENT_H */
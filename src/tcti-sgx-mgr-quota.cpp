@@ -0,0 +1,174 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <string.h>
+
+#include "tcti-sgx-mgr-quota.h"
+
+using namespace std;
+
+TctiSgxBucket::TctiSgxBucket ()
+: enabled (false), commands (0), tpm_ms (0), admitted (0), throttled (0),
+  charged_ms (0)
+{
+    memset (&this->quota, 0, sizeof (this->quota));
+}
+/*
+ * Apply 'quota', or remove the quota if it's NULL. A burst of 0 is one
+ * second's worth. The bucket starts out full, its counters are kept.
+ */
+void
+TctiSgxBucket::configure (tcti_sgx_quota_t const *quota,
+                          chrono::steady_clock::time_point now)
+{
+    if (quota == NULL) {
+        this->enabled = false;
+        return;
+    }
+    this->quota = *quota;
+    if (this->quota.commands_burst == 0)
+        this->quota.commands_burst = this->quota.commands_per_sec;
+    if (this->quota.tpm_ms_burst == 0)
+        this->quota.tpm_ms_burst = this->quota.tpm_ms_per_sec;
+    this->enabled = true;
+    this->commands = this->quota.commands_burst;
+    this->tpm_ms = this->quota.tpm_ms_burst;
+    this->last = now;
+}
+void
+TctiSgxBucket::refill (chrono::steady_clock::time_point now)
+{
+    double elapsed;
+
+    if (now <= this->last)
+        return;
+    elapsed = chrono::duration<double> (now - this->last).count ();
+    this->last = now;
+    this->commands += elapsed * this->quota.commands_per_sec;
+    if (this->commands > this->quota.commands_burst)
+        this->commands = this->quota.commands_burst;
+    this->tpm_ms += elapsed * this->quota.tpm_ms_per_sec;
+    if (this->tpm_ms > this->quota.tpm_ms_burst)
+        this->tpm_ms = this->quota.tpm_ms_burst;
+}
+bool
+TctiSgxBucket::ready () const
+{
+    if (this->quota.commands_per_sec != 0 && this->commands < 1)
+        return false;
+    if (this->quota.tpm_ms_per_sec != 0 && this->tpm_ms <= 0)
+        return false;
+    return true;
+}
+void
+TctiSgxBucket::charge (double cost_ms)
+{
+    if (this->quota.commands_per_sec != 0)
+        this->commands -= 1;
+    if (this->quota.tpm_ms_per_sec != 0)
+        this->tpm_ms -= cost_ms;
+    this->charged_ms += cost_ms;
+    ++this->admitted;
+}
+void
+TctiSgxBucket::get_stats (tcti_sgx_quota_stats_t *stats) const
+{
+    stats->admitted = this->admitted;
+    stats->throttled = this->throttled;
+    stats->tpm_ms = (uint64_t)this->charged_ms;
+}
+/*
+ * Set or, when 'quota' is NULL, remove the quota for the manager or the
+ * enclave with tag 'tag'. Session quotas are set on the session.
+ * Returns 0 on success, -1 for a scope other than the manager or an
+ * enclave, or an enclave tag of 0.
+ */
+int
+TctiSgxQuota::set (tcti_sgx_scope_t scope,
+                   uint64_t tag,
+                   tcti_sgx_quota_t const *quota)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    chrono::steady_clock::time_point now = chrono::steady_clock::now ();
+
+    switch (scope) {
+    case TCTI_SGX_SCOPE_MANAGER:
+        this->manager.configure (quota, now);
+        return 0;
+    case TCTI_SGX_SCOPE_ENCLAVE:
+        if (tag == 0)
+            return -1;
+        if (quota == NULL)
+            this->enclaves.erase (tag);
+        else
+            this->enclaves [tag].configure (quota, now);
+        return 0;
+    default:
+        return -1;
+    }
+}
+/*
+ * Take what a command costing 'cost_ms' of TPM time needs from the
+ * session's bucket, its enclave's and the manager's.
+ * Returns false, taking nothing, if one of them is empty.
+ */
+bool
+TctiSgxQuota::take (uint64_t tag,
+                    double cost_ms,
+                    TctiSgxBucket &session)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    chrono::steady_clock::time_point now = chrono::steady_clock::now ();
+    map<uint64_t, TctiSgxBucket>::iterator itr;
+    TctiSgxBucket *buckets [3];
+    size_t count = 0, i;
+
+    if (session.enabled)
+        buckets [count++] = &session;
+    if (tag != 0) {
+        itr = this->enclaves.find (tag);
+        if (itr != this->enclaves.end ())
+            buckets [count++] = &itr->second;
+    }
+    if (this->manager.enabled)
+        buckets [count++] = &this->manager;
+    for (i = 0; i < count; ++i) {
+        buckets [i]->refill (now);
+        if (!buckets [i]->ready ()) {
+            ++buckets [i]->throttled;
+            return false;
+        }
+    }
+    for (i = 0; i < count; ++i)
+        buckets [i]->charge (cost_ms);
+    return true;
+}
+/*
+ * Returns 0 on success, -1 if there's no quota for the manager or the
+ * enclave with tag 'tag'.
+ */
+int
+TctiSgxQuota::get_stats (tcti_sgx_scope_t scope,
+                         uint64_t tag,
+                         tcti_sgx_quota_stats_t *stats)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    map<uint64_t, TctiSgxBucket>::const_iterator itr;
+
+    switch (scope) {
+    case TCTI_SGX_SCOPE_MANAGER:
+        if (!this->manager.enabled)
+            return -1;
+        this->manager.get_stats (stats);
+        return 0;
+    case TCTI_SGX_SCOPE_ENCLAVE:
+        itr = this->enclaves.find (tag);
+        if (itr == this->enclaves.end ())
+            return -1;
+        itr->second.get_stats (stats);
+        return 0;
+    default:
+        return -1;
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TCTI_SGX_MGR_QUOTA_H
+#define TCTI_SGX_MGR_QUOTA_H
+
+#include <chrono>
+#include <map>
+#include <mutex>
+
+#include "tcti-sgx-mgr.h"
+
+/*
+ * Token bucket for one quota. There's a bucket of commands and a bucket
+ * of TPM milliseconds, each filling at its rate per second up to its
+ * burst. A command needs a whole command token and for the TPM time
+ * bucket not to be empty: its cost is an estimate and may be more than
+ * the burst, so the bucket is allowed to go into debt that has to be paid
+ * off before the next command.
+ */
+struct TctiSgxBucket {
+    tcti_sgx_quota_t quota;
+    bool enabled;
+    double commands;
+    double tpm_ms;
+    std::chrono::steady_clock::time_point last;
+    uint64_t admitted;
+    uint64_t throttled;
+    double charged_ms;
+    TctiSgxBucket ();
+    void configure (tcti_sgx_quota_t const *quota,
+                    std::chrono::steady_clock::time_point now);
+    void refill (std::chrono::steady_clock::time_point now);
+    bool ready () const;
+    void charge (double cost_ms);
+    void get_stats (tcti_sgx_quota_stats_t *stats) const;
+};
+/*
+ * Rate limits on what sessions send to the TPM, so one enclave can't
+ * keep the others from it. Quotas can be set for the manager as a whole,
+ * for each enclave (the sessions sharing a tag) and for single sessions.
+ * A command has to fit in every quota that applies to it and is charged
+ * to all of them. Commands that don't fit are throttled: the session
+ * turns them away with TRY_AGAIN.
+ *
+ * What a command costs in TPM time is the cost table's estimate for it.
+ * Enclaves pick their own tags so enclave quotas only hold enclaves that
+ * play along, a host that doesn't trust its enclaves should give each
+ * session a quota.
+ *
+ * Session buckets live in the sessions. The others are shared by all
+ * sessions and access to them is serialized with the object's own mutex.
+ */
+class TctiSgxQuota {
+    std::mutex mutex;
+    TctiSgxBucket manager;
+    std::map<uint64_t, TctiSgxBucket> enclaves;
+public:
+    int set (tcti_sgx_scope_t scope,
+             uint64_t tag,
+             tcti_sgx_quota_t const *quota);
+    bool take (uint64_t tag,
+               double cost_ms,
+               TctiSgxBucket &session);
+    int get_stats (tcti_sgx_scope_t scope,
+                   uint64_t tag,
+                   tcti_sgx_quota_stats_t *stats);
+};
+
+#endif /* TCTI_SGX_MGR_QUOTA_H */
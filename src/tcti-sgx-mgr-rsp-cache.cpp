@@ -0,0 +1,393 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <string.h>
+
+#include <tss2/tss2_tpm2_types.h>
+
+#include "tcti-sgx-mgr-rsp-cache.h"
+#include "tpm2-header.h"
+
+using namespace std;
+
+/* the kinds of cached response, used as a mask when invalidating */
+#define RSP_PUBLIC 0x1
+#define RSP_NV 0x2
+#define RSP_PCR 0x4
+/* not a kind of response: the TPM flushes transient objects */
+#define RSP_OBJECTS 0x8
+#define RSP_ALL (RSP_PUBLIC | RSP_NV | RSP_PCR | RSP_OBJECTS)
+
+/*
+ * NV_Read command layout with a single password session:
+ *   header | authHandle (4) | nvIndex (4) | authorizationSize (4) |
+ *   sessionHandle (4) | nonceCaller (2 + 0) | sessionAttributes (1) |
+ *   hmac (2 + n) | size (2) | offset (2)
+ */
+#define NV_READ_AUTH_SIZE_OFFSET (TPM2_HEADER_SIZE + 8)
+#define NV_READ_SESSION_OFFSET (TPM2_HEADER_SIZE + 12)
+#define NV_READ_HMAC_OFFSET (NV_READ_SESSION_OFFSET + 7)
+#define NV_READ_PARAMS_SIZE 4
+#define PW_SESSION_MIN_SIZE 9u
+
+static TPM2_HANDLE
+command_handle (uint8_t const *command,
+                size_t size,
+                size_t index)
+{
+    if (size < TPM2_HEADER_SIZE + 4 * (index + 1))
+        return 0;
+    return tpm2_get_uint32 (&command [TPM2_HEADER_SIZE + 4 * index]);
+}
+/*
+ * An NV_Read is only cacheable when it's authorized with nothing but a
+ * password: then the response auth area is the same every time.
+ */
+static bool
+nv_read_cacheable (uint8_t const *command,
+                   size_t size)
+{
+    uint32_t auth_size;
+
+    if (tpm2_header_tag (command) != TPM2_ST_SESSIONS ||
+        size < NV_READ_HMAC_OFFSET + 2 + NV_READ_PARAMS_SIZE)
+        return false;
+    auth_size = tpm2_get_uint32 (&command [NV_READ_AUTH_SIZE_OFFSET]);
+    return tpm2_get_uint32 (&command [NV_READ_SESSION_OFFSET]) == TPM2_RS_PW &&
+        tpm2_get_uint16 (&command [NV_READ_SESSION_OFFSET + 4]) == 0 &&
+        auth_size ==
+            PW_SESSION_MIN_SIZE + tpm2_get_uint16 (&command [NV_READ_HMAC_OFFSET]) &&
+        size == NV_READ_SESSION_OFFSET + auth_size + NV_READ_PARAMS_SIZE;
+}
+/*
+ * Determine whether the response to 'command' may be cached. On success
+ * '*kind' is set to the kind of response and '*handle' to the object or NV
+ * index it describes (0 for PCRs).
+ */
+static bool
+cacheable (uint8_t const *command,
+           size_t size,
+           int *kind,
+           TPM2_HANDLE *handle)
+{
+    if (!tpm2_header_valid (command, size))
+        return false;
+    switch (tpm2_header_code (command)) {
+    case TPM2_CC_ReadPublic:
+        *kind = RSP_PUBLIC;
+        *handle = command_handle (command, size, 0);
+        return tpm2_header_tag (command) == TPM2_ST_NO_SESSIONS &&
+            size == TPM2_HEADER_SIZE + 4 &&
+            *handle >> TPM2_HR_SHIFT == TPM2_HT_PERSISTENT;
+    case TPM2_CC_NV_ReadPublic:
+        *kind = RSP_NV;
+        *handle = command_handle (command, size, 0);
+        return tpm2_header_tag (command) == TPM2_ST_NO_SESSIONS &&
+            size == TPM2_HEADER_SIZE + 4;
+    case TPM2_CC_NV_Read:
+        *kind = RSP_NV;
+        *handle = command_handle (command, size, 1);
+        return nv_read_cacheable (command, size);
+    case TPM2_CC_PCR_Read:
+        *kind = RSP_PCR;
+        *handle = 0;
+        return tpm2_header_tag (command) == TPM2_ST_NO_SESSIONS;
+    default:
+        return false;
+    }
+}
+
+TctiSgxRspCache::TctiSgxRspCache ()
+: max_entries (0), generation (0), pcr_update_counter (0),
+  pcr_update_counter_valid (false)
+{
+    memset (&this->stats, 0, sizeof (this->stats));
+}
+
+bool
+TctiSgxRspCache::enabled ()
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    return this->max_entries > 0;
+}
+
+void
+TctiSgxRspCache::set_size (size_t max_entries)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    this->max_entries = max_entries;
+    while (this->entries.size () > this->max_entries)
+        this->entries.pop_back ();
+}
+/*
+ * Drop the entries of the kinds in the 'kinds' mask. For NV entries a
+ * non-zero 'handle' limits this to the entries for that index. Caller
+ * must hold the mutex.
+ */
+void
+TctiSgxRspCache::invalidate (int kinds,
+                             TPM2_HANDLE handle)
+{
+    list<Entry>::iterator itr = this->entries.begin ();
+
+    while (itr != this->entries.end ()) {
+        if ((itr->kind & kinds) != 0 &&
+            (handle == 0 || itr->kind != RSP_NV || itr->handle == handle))
+        {
+            itr = this->entries.erase (itr);
+            ++this->stats.invalidations;
+        } else {
+            ++itr;
+        }
+    }
+    ++this->generation;
+}
+/*
+ * Note the pcrUpdateCounter from a PCR_Read response. If it has moved
+ * since the last one then some PCR has changed. Caller must hold the
+ * mutex.
+ */
+void
+TctiSgxRspCache::update_counter (uint32_t counter)
+{
+    if (this->pcr_update_counter_valid && counter != this->pcr_update_counter)
+        this->invalidate (RSP_PCR, 0);
+    this->pcr_update_counter = counter;
+    this->pcr_update_counter_valid = true;
+}
+/*
+ * Determine which kinds of cached response 'command' may change. Returns
+ * a mask of the kinds (0 if the command doesn't change anything we cache)
+ * and sets '*handle' to the NV index changed, or 0 when it's all of them.
+ */
+static int
+changed_kinds (uint8_t const *command,
+               size_t size,
+               TPM2_HANDLE *handle)
+{
+    *handle = 0;
+    if (!tpm2_header_valid (command, size))
+        return 0;
+    switch (tpm2_header_code (command)) {
+    case TPM2_CC_PCR_Extend:
+    case TPM2_CC_PCR_Event:
+    case TPM2_CC_PCR_Reset:
+    case TPM2_CC_PCR_Allocate:
+    case TPM2_CC_EventSequenceComplete:
+        return RSP_PCR;
+    case TPM2_CC_EvictControl:
+        return RSP_PUBLIC;
+    case TPM2_CC_ChangeEPS:
+    case TPM2_CC_ChangePPS:
+        return RSP_PUBLIC | RSP_OBJECTS;
+    case TPM2_CC_NV_Write:
+    case TPM2_CC_NV_Increment:
+    case TPM2_CC_NV_Extend:
+    case TPM2_CC_NV_SetBits:
+    case TPM2_CC_NV_WriteLock:
+    case TPM2_CC_NV_ReadLock:
+    case TPM2_CC_NV_UndefineSpace:
+        /* authHandle then nvIndex */
+        *handle = command_handle (command, size, 1);
+        return RSP_NV;
+    case TPM2_CC_NV_ChangeAuth:
+    case TPM2_CC_NV_UndefineSpaceSpecial:
+        *handle = command_handle (command, size, 0);
+        return RSP_NV;
+    case TPM2_CC_NV_GlobalWriteLock:
+    case TPM2_CC_HierarchyChangeAuth:
+        return RSP_NV;
+    case TPM2_CC_HierarchyControl:
+        return RSP_PUBLIC | RSP_NV | RSP_OBJECTS;
+    case TPM2_CC_Startup:
+    case TPM2_CC_Clear:
+        return RSP_ALL;
+    default:
+        return 0;
+    }
+}
+/*
+ * True for the read-only commands whose responses we cache: the response
+ * only depends on the command and on TPM state that changes_state
+ * commands change.
+ */
+bool
+TctiSgxRspCache::read_only (uint8_t const *command,
+                            size_t size)
+{
+    TPM2_HANDLE handle;
+    int kind;
+
+    return cacheable (command, size, &kind, &handle);
+}
+
+bool
+TctiSgxRspCache::changes_state (uint8_t const *command,
+                                size_t size)
+{
+    TPM2_HANDLE handle;
+
+    return changed_kinds (command, size, &handle) != 0;
+}
+/*
+ * True for the commands that may flush transient objects, for the other
+ * caches of TPM state.
+ */
+bool
+TctiSgxRspCache::flushes_objects (uint8_t const *command,
+                                  size_t size)
+{
+    TPM2_HANDLE handle;
+
+    return (changed_kinds (command, size, &handle) & RSP_OBJECTS) != 0;
+}
+/*
+ * Invalidate the entries that 'command' may change. Returns false if the
+ * command doesn't change anything we cache. Caller must hold the mutex.
+ */
+bool
+TctiSgxRspCache::state_change (uint8_t const *command,
+                               size_t size)
+{
+    TPM2_HANDLE handle;
+    int kinds;
+
+    kinds = changed_kinds (command, size, &handle);
+    if (kinds == 0)
+        return false;
+    this->invalidate (kinds, handle);
+    return true;
+}
+/*
+ * Process a command from a client. Commands that change state invalidate
+ * the entries they affect. Returns true and populates 'response' when the
+ * command is answered from the cache. Otherwise '*generation' is set so
+ * that the response can be added to the cache when it comes back,
+ * provided nothing has been invalidated in the meantime.
+ */
+bool
+TctiSgxRspCache::command (uint8_t const *command,
+                          size_t size,
+                          vector<uint8_t> &response,
+                          uint64_t *generation)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    list<Entry>::iterator itr;
+    TPM2_HANDLE handle;
+    int kind;
+
+    *generation = this->generation;
+    if (this->max_entries == 0 || this->state_change (command, size) ||
+        !cacheable (command, size, &kind, &handle))
+        return false;
+    for (itr = this->entries.begin (); itr != this->entries.end (); ++itr) {
+        if (itr->command.size () == size &&
+            memcmp (itr->command.data (), command, size) == 0)
+            break;
+    }
+    if (itr == this->entries.end ()) {
+        ++this->stats.misses;
+        return false;
+    }
+    this->entries.splice (this->entries.begin (), this->entries, itr);
+    response = itr->response;
+    ++this->stats.hits;
+    return true;
+}
+/*
+ * Process the response to a command sent to the TPM. Commands that change
+ * state invalidate the entries they affect again: a read that was
+ * executed before the change but whose response came back after we saw
+ * the command go by would otherwise be cached. Successful responses to
+ * cacheable commands are cached if nothing was invalidated since
+ * 'generation'.
+ */
+void
+TctiSgxRspCache::response (uint8_t const *command,
+                           size_t command_size,
+                           uint8_t const *response,
+                           size_t response_size,
+                           uint64_t generation)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    list<Entry>::iterator itr;
+    Entry entry;
+
+    if (this->max_entries == 0 || this->state_change (command, command_size) ||
+        !cacheable (command, command_size, &entry.kind, &entry.handle) ||
+        !tpm2_header_valid (response, response_size) ||
+        tpm2_header_code (response) != TPM2_RC_SUCCESS ||
+        tpm2_header_tag (response) != tpm2_header_tag (command) ||
+        generation != this->generation)
+        return;
+    if (entry.kind == RSP_PCR) {
+        if (response_size < TPM2_HEADER_SIZE + 4)
+            return;
+        this->update_counter (tpm2_get_uint32 (&response [TPM2_HEADER_SIZE]));
+    }
+    for (itr = this->entries.begin (); itr != this->entries.end (); ++itr) {
+        if (itr->command.size () == command_size &&
+            memcmp (itr->command.data (), command, command_size) == 0)
+        {
+            this->entries.erase (itr);
+            break;
+        }
+    }
+    entry.command.assign (command, command + command_size);
+    entry.response.assign (response, response + response_size);
+    this->entries.push_front (entry);
+    while (this->entries.size () > this->max_entries)
+        this->entries.pop_back ();
+}
+
+bool
+TctiSgxRspCache::has_pcr_entries ()
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    list<Entry>::const_iterator itr;
+
+    for (itr = this->entries.begin (); itr != this->entries.end (); ++itr) {
+        if (itr->kind == RSP_PCR)
+            return true;
+    }
+    return false;
+}
+/*
+ * Build a PCR_Read that selects no PCRs. The response carries nothing but
+ * the pcrUpdateCounter, which makes it a cheap way to check whether any
+ * PCR has changed.
+ */
+void
+TctiSgxRspCache::pcr_update_counter_command (vector<uint8_t> &command)
+{
+    command.assign (TPM2_HEADER_SIZE + 4, 0);
+    tpm2_header_set (command.data (),
+                     TPM2_ST_NO_SESSIONS,
+                     command.size (),
+                     TPM2_CC_PCR_Read);
+}
+
+void
+TctiSgxRspCache::pcr_update_counter_response (uint8_t const *response,
+                                              size_t size)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    if (!tpm2_header_valid (response, size) ||
+        tpm2_header_code (response) != TPM2_RC_SUCCESS ||
+        size < TPM2_HEADER_SIZE + 4)
+        return;
+    this->update_counter (tpm2_get_uint32 (&response [TPM2_HEADER_SIZE]));
+}
+
+void
+TctiSgxRspCache::get_stats (tcti_sgx_rsp_cache_stats_t *stats)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    *stats = this->stats;
+    stats->entries = this->entries.size ();
+}
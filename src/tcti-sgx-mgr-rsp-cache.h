@@ -0,0 +1,84 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TCTI_SGX_MGR_RSP_CACHE_H
+#define TCTI_SGX_MGR_RSP_CACHE_H
+
+#include <list>
+#include <mutex>
+#include <vector>
+
+#include <tss2/tss2_tpm2_types.h>
+#include "tcti-sgx-mgr.h"
+
+/*
+ * A cache of responses to read-only commands, shared by all sessions and
+ * keyed by the bytes of the command. Three kinds of command are cached:
+ * ReadPublic of a persistent object, NV_ReadPublic and NV_Read with a
+ * single password session (the response carries nothing that varies from
+ * one call to the next), and PCR_Read.
+ *
+ * Entries are dropped when a command that may change what they describe
+ * goes by: PCR_Extend and friends for PCR_Read, EvictControl for
+ * ReadPublic, NV_Write and friends for the NV index they name, and
+ * Startup or Clear for everything. This happens both when the command is
+ * sent and when its response comes back so that a read that raced with
+ * the change isn't cached. PCR_Read entries are also dropped when a PCR
+ * read shows the pcrUpdateCounter has moved, which catches PCR changes
+ * made by TPM users other than this manager. Other changes made outside
+ * of the manager aren't seen, so the cache should only be enabled when
+ * the manager is the only user of the NV indices and persistent objects
+ * its clients read.
+ *
+ * At most 'max_entries' responses are kept, the least recently used one
+ * is dropped to make room. Access is serialized with the cache's own
+ * mutex.
+ */
+class TctiSgxRspCache {
+    struct Entry {
+        int kind;
+        TPM2_HANDLE handle;
+        std::vector<uint8_t> command;
+        std::vector<uint8_t> response;
+    };
+    std::mutex mutex;
+    size_t max_entries;
+    std::list<Entry> entries;
+    /* bumped each time entries are invalidated */
+    uint64_t generation;
+    uint32_t pcr_update_counter;
+    bool pcr_update_counter_valid;
+    tcti_sgx_rsp_cache_stats_t stats;
+    void invalidate (int kinds,
+                     TPM2_HANDLE handle);
+    void update_counter (uint32_t counter);
+    bool state_change (uint8_t const *command,
+                       size_t size);
+public:
+    TctiSgxRspCache ();
+    bool enabled ();
+    void set_size (size_t max_entries);
+    bool command (uint8_t const *command,
+                  size_t size,
+                  std::vector<uint8_t> &response,
+                  uint64_t *generation);
+    void response (uint8_t const *command,
+                   size_t command_size,
+                   uint8_t const *response,
+                   size_t response_size,
+                   uint64_t generation);
+    bool has_pcr_entries ();
+    void pcr_update_counter_response (uint8_t const *response,
+                                      size_t size);
+    void get_stats (tcti_sgx_rsp_cache_stats_t *stats);
+    static void pcr_update_counter_command (std::vector<uint8_t> &command);
+    static bool read_only (uint8_t const *command,
+                           size_t size);
+    static bool changes_state (uint8_t const *command,
+                               size_t size);
+    static bool flushes_objects (uint8_t const *command,
+                                 size_t size);
+};
+
+#endif /* TCTI_SGX_MGR_RSP_CACHE_H */
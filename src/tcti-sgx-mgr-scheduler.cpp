@@ -0,0 +1,263 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include "tcti-sgx-mgr-scheduler.h"
+
+using namespace std;
+
+TctiSgxScheduler::TctiSgxScheduler ()
+: enable (false), policy (TCTI_SGX_SCHED_FIFO),
+  aging_ms (SCHEDULER_AGING_DEFAULT),
+  wait_ms (SCHEDULER_WAIT_DEFAULT), seq (0), turn (0), turns (0),
+  holder (TCTI_SGX_PRIORITY_NORMAL) {}
+
+/*
+ * Turn scheduling on or off. Waiters move up a class every 'aging_ms',
+ * 0 turns aging off, and give up after 'wait_ms'.
+ * Returns 0 on success, -1 if 'wait_ms' is 0.
+ */
+int
+TctiSgxScheduler::set (int enable,
+                       uint32_t aging_ms,
+                       uint32_t wait_ms)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    if (wait_ms == 0)
+        return -1;
+    this->enable = enable;
+    this->aging_ms = aging_ms;
+    this->wait_ms = wait_ms;
+    this->cond.notify_all ();
+    return 0;
+}
+/*
+ * Set how the next command is picked within a class.
+ * Returns 0 on success, -1 for an unknown policy.
+ */
+int
+TctiSgxScheduler::set_policy (tcti_sgx_sched_policy_t policy)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    if (policy != TCTI_SGX_SCHED_FIFO && policy != TCTI_SGX_SCHED_SJF &&
+        policy != TCTI_SGX_SCHED_DEADLINE)
+        return -1;
+    this->policy = policy;
+    this->cond.notify_all ();
+    return 0;
+}
+/*
+ * Put commands with code 'code' in class 'priority' whatever the class
+ * of the session sending them.
+ * Returns 0 on success, -1 for an unknown class.
+ */
+int
+TctiSgxScheduler::set_command (TPM2_CC code,
+                               tcti_sgx_priority_t priority)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    if ((unsigned)priority >= TCTI_SGX_PRIORITY_CLASSES)
+        return -1;
+    this->codes [code] = priority;
+    return 0;
+}
+/*
+ * The class of a command with code 'code' sent by a session in class
+ * 'session'.
+ */
+unsigned
+TctiSgxScheduler::priority_of (TPM2_CC code,
+                               unsigned session)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    map<TPM2_CC, unsigned>::const_iterator itr;
+
+    itr = this->codes.find (code);
+    return itr == this->codes.end () ? session : itr->second;
+}
+/*
+ * The class 'waiter' has aged into by 'now'.
+ */
+unsigned
+TctiSgxScheduler::effective (Waiter const &waiter,
+                             chrono::steady_clock::time_point now) const
+{
+    uint64_t steps;
+
+    if (this->aging_ms == 0)
+        return waiter.priority;
+    steps = chrono::duration_cast<chrono::milliseconds> (
+        now - waiter.since).count () / this->aging_ms;
+    return steps >= waiter.priority ? 0 : waiter.priority - steps;
+}
+/*
+ * True when 'a' should go before 'b', two waiters in the same class.
+ * Ties go to whoever came first.
+ */
+bool
+TctiSgxScheduler::before (Waiter const &a,
+                          Waiter const &b,
+                          chrono::steady_clock::time_point now) const
+{
+    uint64_t a_cost = a.cost_us > 0 ? a.cost_us : 1;
+    uint64_t b_cost = b.cost_us > 0 ? b.cost_us : 1;
+    double a_ratio, b_ratio;
+
+    if (this->policy == TCTI_SGX_SCHED_DEADLINE && a.deadline != b.deadline)
+        return a.deadline < b.deadline;
+    if (this->policy == TCTI_SGX_SCHED_SJF) {
+        a_ratio = (chrono::duration_cast<chrono::microseconds> (
+            now - a.since).count () + a_cost) / (double)a_cost;
+        b_ratio = (chrono::duration_cast<chrono::microseconds> (
+            now - b.since).count () + b_cost) / (double)b_cost;
+        if (a_ratio != b_ratio)
+            return a_ratio > b_ratio;
+    }
+    return a.seq < b.seq;
+}
+/*
+ * The waiter that gets the next turn. Caller must hold the mutex.
+ */
+TctiSgxScheduler::Waiter*
+TctiSgxScheduler::next (chrono::steady_clock::time_point now) const
+{
+    list<Waiter*>::const_iterator itr;
+    Waiter *best = NULL;
+    unsigned best_class = TCTI_SGX_PRIORITY_CLASSES, cls;
+
+    for (itr = this->waiters.begin (); itr != this->waiters.end (); ++itr) {
+        cls = this->effective (**itr, now);
+        if (cls < best_class ||
+            (cls == best_class && this->before (**itr, *best, now)))
+        {
+            best = *itr;
+            best_class = cls;
+        }
+    }
+    return best;
+}
+/*
+ * End the turn that has the TPM. Caller must hold the mutex.
+ */
+void
+TctiSgxScheduler::finish (chrono::steady_clock::time_point now)
+{
+    this->turn = 0;
+    this->stats [this->holder].service_us +=
+        chrono::duration_cast<chrono::microseconds> (
+            now - this->granted).count ();
+}
+/*
+ * Wait for the TPM for a command in class 'priority' expected to take
+ * 'cost_us' that must be sent by 'deadline', if it's not NULL. '*turn' is
+ * set when the caller has the TPM and must give it back with 'release',
+ * it's 0 when scheduling is off.
+ * Returns false if the wait limit or the deadline passed before the
+ * command's turn came.
+ */
+bool
+TctiSgxScheduler::acquire (unsigned priority,
+                           uint64_t cost_us,
+                           chrono::steady_clock::time_point const *deadline,
+                           uint64_t *turn)
+{
+    unique_lock<std::mutex> lock (this->mutex);
+    chrono::steady_clock::time_point now = chrono::steady_clock::now ();
+    chrono::steady_clock::time_point limit;
+    uint64_t waited;
+    Waiter self;
+
+    *turn = 0;
+    if (!this->enable)
+        return true;
+    if (priority >= TCTI_SGX_PRIORITY_CLASSES)
+        priority = TCTI_SGX_PRIORITY_CLASSES - 1;
+    if (deadline != NULL && *deadline <= now) {
+        ++this->stats [priority].expired;
+        return false;
+    }
+    self.priority = priority;
+    self.cost_us = cost_us;
+    self.seq = ++this->seq;
+    self.since = now;
+    limit = now + chrono::milliseconds (this->wait_ms);
+    self.deadline = deadline != NULL && *deadline < limit ? *deadline : limit;
+    this->waiters.push_back (&self);
+    while (this->enable && (this->turn != 0 || this->next (now) != &self)) {
+        if (this->cond.wait_until (lock, self.deadline) ==
+            cv_status::timeout)
+        {
+            now = chrono::steady_clock::now ();
+            if (!this->enable ||
+                (this->turn == 0 && this->next (now) == &self))
+                break;
+            this->waiters.remove (&self);
+            if (self.deadline < limit)
+                ++this->stats [priority].expired;
+            else
+                ++this->stats [priority].timeouts;
+            if (this->turn != 0 &&
+                now - this->granted >= chrono::milliseconds (this->wait_ms))
+                this->finish (now);
+            /* we may have been next, let whoever is now have a look */
+            this->cond.notify_all ();
+            return false;
+        }
+        now = chrono::steady_clock::now ();
+    }
+    this->waiters.remove (&self);
+    if (!this->enable) {
+        this->cond.notify_all ();
+        return true;
+    }
+    waited = chrono::duration_cast<chrono::microseconds> (
+        now - self.since).count ();
+    if (this->effective (self, now) < priority)
+        ++this->stats [priority].aged;
+    ++this->stats [priority].commands;
+    this->stats [priority].wait_us += waited;
+    if (waited > this->stats [priority].max_wait_us)
+        this->stats [priority].max_wait_us = waited;
+    this->turn = ++this->turns;
+    this->holder = priority;
+    this->granted = now;
+    *turn = this->turn;
+    return true;
+}
+/*
+ * Give the TPM back and hand it to whoever is next, unless 'turn' has
+ * lapsed.
+ */
+void
+TctiSgxScheduler::release (uint64_t turn)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    if (turn == 0 || turn != this->turn)
+        return;
+    this->finish (chrono::steady_clock::now ());
+    this->cond.notify_all ();
+}
+/*
+ * Returns 0 on success, -1 for an unknown class.
+ */
+int
+TctiSgxScheduler::get_stats (tcti_sgx_priority_t priority,
+                             tcti_sgx_priority_stats_t *stats)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    if ((unsigned)priority >= TCTI_SGX_PRIORITY_CLASSES)
+        return -1;
+    stats->commands = this->stats [priority].commands;
+    stats->aged = this->stats [priority].aged;
+    stats->timeouts = this->stats [priority].timeouts;
+    stats->expired = this->stats [priority].expired;
+    stats->wait_us = this->stats [priority].wait_us;
+    stats->max_wait_us = this->stats [priority].max_wait_us;
+    stats->service_us = this->stats [priority].service_us;
+    return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TCTI_SGX_MGR_SCHEDULER_H
+#define TCTI_SGX_MGR_SCHEDULER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <mutex>
+
+#include <tss2/tss2_tpm2_types.h>
+#include "tcti-sgx-mgr.h"
+
+#define SCHEDULER_AGING_DEFAULT 100
+#define SCHEDULER_WAIT_DEFAULT 5000
+
+/*
+ * Orders the commands sessions send to the TPM by priority class. The TPM
+ * runs one command at a time so a session takes the TPM when it sends a
+ * command downstream and gives it back once it has read the response. Sessions
+ * that want the TPM while it's taken wait their turn: the next turn goes
+ * to the waiter in the best class. Within a class it's first come first
+ * served or, with TCTI_SGX_SCHED_SJF, shortest job first.
+ *
+ * Shortest job first uses what the cost table expects each command to
+ * cost and serves the waiter with the highest response ratio: (time
+ * waited + cost) / cost. A short command that just arrived goes ahead of
+ * a long one that also just arrived, but the ratio of a waiting command
+ * grows the longer it waits, fastest for the short ones, so long commands
+ * get their turn without anyone having to set a bound.
+ *
+ * Commands may come with a deadline. TCTI_SGX_SCHED_DEADLINE serves the
+ * earliest one first and, under any policy, a command whose deadline
+ * passes while it waits is dropped rather than sent to the TPM.
+ *
+ * Each command has a class: the one set for its command code if there is
+ * one, otherwise its session's. To keep low priority work from starving,
+ * a waiter moves up a class for every 'aging_ms' it has waited. A waiter
+ * gives up after 'wait_ms'. Like single flight followers, waiters hold
+ * their session's lock so this also bounds how long they hold up the
+ * manager. A turn held for longer than 'wait_ms' when a waiter gives up
+ * on it is taken to have been abandoned, by a client that never collects
+ * its response, and lapses: the next waiter gets the TPM and the holder
+ * giving it back later changes nothing. Turns are numbered for this.
+ *
+ * Commands the manager answers itself, or that follow another session's
+ * identical command, don't need the TPM and aren't scheduled. Disabled by
+ * default. Shared by all sessions, access is serialized with the object's
+ * own mutex.
+ */
+class TctiSgxScheduler {
+    struct Waiter {
+        unsigned priority;
+        uint64_t cost_us;
+        uint64_t seq;
+        std::chrono::steady_clock::time_point since;
+        std::chrono::steady_clock::time_point deadline;
+    };
+    struct ClassStats {
+        uint64_t commands;
+        uint64_t aged;
+        uint64_t timeouts;
+        uint64_t expired;
+        uint64_t wait_us;
+        uint64_t max_wait_us;
+        uint64_t service_us;
+        ClassStats ()
+            : commands (0), aged (0), timeouts (0), expired (0), wait_us (0),
+              max_wait_us (0), service_us (0) {}
+    };
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool enable;
+    tcti_sgx_sched_policy_t policy;
+    uint32_t aging_ms;
+    uint32_t wait_ms;
+    std::map<TPM2_CC, unsigned> codes;
+    std::list<Waiter*> waiters;
+    uint64_t seq;
+    /* the turn that has the TPM (0 when nobody has), its class and since */
+    uint64_t turn;
+    uint64_t turns;
+    unsigned holder;
+    std::chrono::steady_clock::time_point granted;
+    ClassStats stats [TCTI_SGX_PRIORITY_CLASSES];
+    unsigned effective (Waiter const &waiter,
+                        std::chrono::steady_clock::time_point now) const;
+    bool before (Waiter const &a,
+                 Waiter const &b,
+                 std::chrono::steady_clock::time_point now) const;
+    Waiter* next (std::chrono::steady_clock::time_point now) const;
+    void finish (std::chrono::steady_clock::time_point now);
+public:
+    TctiSgxScheduler ();
+    int set (int enable, uint32_t aging_ms, uint32_t wait_ms);
+    int set_policy (tcti_sgx_sched_policy_t policy);
+    int set_command (TPM2_CC code, tcti_sgx_priority_t priority);
+    unsigned priority_of (TPM2_CC code, unsigned session);
+    bool acquire (unsigned priority,
+                  uint64_t cost_us,
+                  std::chrono::steady_clock::time_point const *deadline,
+                  uint64_t *turn);
+    void release (uint64_t turn);
+    int get_stats (tcti_sgx_priority_t priority,
+                   tcti_sgx_priority_stats_t *stats);
+};
+
+#endif /* TCTI_SGX_MGR_SCHEDULER_H */
@@ -0,0 +1,243 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <string.h>
+
+#include <tss2/tss2_tpm2_types.h>
+
+#include "tcti-sgx-mgr-session-pool.h"
+#include "tpm2-header.h"
+
+using namespace std;
+
+/*
+ * StartAuthSession command layout:
+ *   header | tpmKey (4) | bind (4) | nonceCaller (2 + n) |
+ *   encryptedSalt (2 + n) | sessionType (1) | symmetric (2 [+ 2 [+ 2]]) |
+ *   authHash (2)
+ * and response:
+ *   header | sessionHandle (4) | nonceTPM (2 + n)
+ */
+#define START_TPMKEY_OFFSET TPM2_HEADER_SIZE
+#define START_BIND_OFFSET (TPM2_HEADER_SIZE + 4)
+#define START_NONCE_OFFSET (TPM2_HEADER_SIZE + 8)
+
+static uint16_t
+digest_size (TPM2_ALG_ID hash)
+{
+    switch (hash) {
+    case TPM2_ALG_SHA1:
+        return TPM2_SHA1_DIGEST_SIZE;
+    case TPM2_ALG_SHA256:
+        return TPM2_SHA256_DIGEST_SIZE;
+    case TPM2_ALG_SHA384:
+        return TPM2_SHA384_DIGEST_SIZE;
+    case TPM2_ALG_SHA512:
+        return TPM2_SHA512_DIGEST_SIZE;
+    case TPM2_ALG_SM3_256:
+        return TPM2_SM3_256_DIGEST_SIZE;
+    default:
+        return 0;
+    }
+}
+/*
+ * Build the spec for sessions of 'type' using 'auth_hash' and parameter
+ * encryption algorithm 'symmetric' (NULL for none). The nonce used is the
+ * size of the 'auth_hash' digest, this is what the TSS ESAPI sends.
+ */
+bool
+TctiSgxSessionPool::make_spec (TPM2_SE type,
+                               TPM2_ALG_ID auth_hash,
+                               TPMT_SYM_DEF const *symmetric,
+                               size_t depth,
+                               TctiSgxSessionSpec *spec)
+{
+    TPM2_ALG_ID sym_alg = TPM2_ALG_NULL;
+    uint8_t buf [2];
+
+    if (type != TPM2_SE_HMAC && type != TPM2_SE_POLICY)
+        return false;
+    spec->nonce_size = digest_size (auth_hash);
+    if (spec->nonce_size == 0)
+        return false;
+    spec->depth = depth;
+    spec->tail.clear ();
+    /* encryptedSalt: empty */
+    spec->tail.push_back (0);
+    spec->tail.push_back (0);
+    spec->tail.push_back (type);
+    if (symmetric != NULL)
+        sym_alg = symmetric->algorithm;
+    tpm2_set_uint16 (buf, sym_alg);
+    spec->tail.insert (spec->tail.end (), buf, buf + sizeof (buf));
+    if (sym_alg != TPM2_ALG_NULL) {
+        tpm2_set_uint16 (buf, symmetric->keyBits.sym);
+        spec->tail.insert (spec->tail.end (), buf, buf + sizeof (buf));
+        if (sym_alg != TPM2_ALG_XOR) {
+            tpm2_set_uint16 (buf, symmetric->mode.sym);
+            spec->tail.insert (spec->tail.end (), buf, buf + sizeof (buf));
+        }
+    }
+    tpm2_set_uint16 (buf, auth_hash);
+    spec->tail.insert (spec->tail.end (), buf, buf + sizeof (buf));
+    return true;
+}
+
+TctiSgxSessionPool::TctiSgxSessionPool (vector<TctiSgxSessionSpec> const &specs)
+: specs (specs), pools (specs.size ())
+{
+    memset (&this->stats, 0, sizeof (this->stats));
+}
+/*
+ * Answer a StartAuthSession from the pool. Returns true and populates
+ * 'response' when a pooled session was handed out.
+ */
+bool
+TctiSgxSessionPool::command (uint8_t const *command,
+                             size_t size,
+                             vector<uint8_t> &response)
+{
+    uint16_t nonce_size;
+    size_t tail_offset, i;
+    Entry entry;
+
+    if (!this->enabled () || !tpm2_header_valid (command, size) ||
+        tpm2_header_tag (command) != TPM2_ST_NO_SESSIONS ||
+        tpm2_header_code (command) != TPM2_CC_StartAuthSession ||
+        size < START_NONCE_OFFSET + 2)
+        return false;
+    if (tpm2_get_uint32 (&command [START_TPMKEY_OFFSET]) != TPM2_RH_NULL ||
+        tpm2_get_uint32 (&command [START_BIND_OFFSET]) != TPM2_RH_NULL)
+        return false;
+    nonce_size = tpm2_get_uint16 (&command [START_NONCE_OFFSET]);
+    tail_offset = START_NONCE_OFFSET + 2 + nonce_size;
+    if (tail_offset > size)
+        return false;
+    for (i = 0; i < this->specs.size (); ++i) {
+        TctiSgxSessionSpec const &spec = this->specs [i];
+        if (spec.nonce_size == nonce_size &&
+            spec.tail.size () == size - tail_offset &&
+            memcmp (spec.tail.data (), &command [tail_offset],
+                    spec.tail.size ()) == 0)
+            break;
+    }
+    if (i == this->specs.size ())
+        return false;
+    if (this->pools [i].empty ()) {
+        ++this->stats.misses;
+        return false;
+    }
+    entry = this->pools [i].front ();
+    this->pools [i].pop_front ();
+    ++this->stats.hits;
+
+    response.resize (TPM2_HEADER_SIZE + 4 + 2 + entry.nonce.size ());
+    tpm2_header_set (response.data (),
+                     TPM2_ST_NO_SESSIONS,
+                     response.size (),
+                     TPM2_RC_SUCCESS);
+    tpm2_set_uint32 (&response [TPM2_HEADER_SIZE], entry.handle);
+    tpm2_set_uint16 (&response [TPM2_HEADER_SIZE + 4], entry.nonce.size ());
+    memcpy (&response [TPM2_HEADER_SIZE + 6],
+            entry.nonce.data (),
+            entry.nonce.size ());
+    return true;
+}
+/*
+ * Find a spec whose pool is below its configured depth and build the
+ * StartAuthSession command that will start a session for it. Returns
+ * false when all pools are full.
+ */
+bool
+TctiSgxSessionPool::refill_command (size_t *spec,
+                                    vector<uint8_t> &command) const
+{
+    size_t i, offset;
+
+    for (i = 0; i < this->specs.size (); ++i) {
+        if (this->pools [i].size () < this->specs [i].depth)
+            break;
+    }
+    if (i == this->specs.size ())
+        return false;
+    *spec = i;
+    command.assign (START_NONCE_OFFSET + 2 + this->specs [i].nonce_size +
+                    this->specs [i].tail.size (), 0);
+    tpm2_header_set (command.data (),
+                     TPM2_ST_NO_SESSIONS,
+                     command.size (),
+                     TPM2_CC_StartAuthSession);
+    tpm2_set_uint32 (&command [START_TPMKEY_OFFSET], TPM2_RH_NULL);
+    tpm2_set_uint32 (&command [START_BIND_OFFSET], TPM2_RH_NULL);
+    tpm2_set_uint16 (&command [START_NONCE_OFFSET], this->specs [i].nonce_size);
+    /*
+     * The nonceCaller is left zeroed: with no salt and no bind it's only
+     * an input to the session key KDF which produces an empty key anyway.
+     */
+    offset = START_NONCE_OFFSET + 2 + this->specs [i].nonce_size;
+    memcpy (&command [offset],
+            this->specs [i].tail.data (),
+            this->specs [i].tail.size ());
+    return true;
+}
+/*
+ * Add the session from a StartAuthSession response to the pool for
+ * 'spec'. Returns false if the response doesn't carry a session.
+ */
+bool
+TctiSgxSessionPool::refill_response (size_t spec,
+                                     uint8_t const *response,
+                                     size_t size)
+{
+    uint16_t nonce_size;
+    Entry entry;
+
+    if (spec >= this->specs.size () || !tpm2_header_valid (response, size) ||
+        tpm2_header_code (response) != TPM2_RC_SUCCESS ||
+        size < TPM2_HEADER_SIZE + 6)
+        return false;
+    nonce_size = tpm2_get_uint16 (&response [TPM2_HEADER_SIZE + 4]);
+    if (size != TPM2_HEADER_SIZE + 6u + nonce_size)
+        return false;
+    entry.handle = tpm2_get_uint32 (&response [TPM2_HEADER_SIZE]);
+    entry.nonce.assign (&response [TPM2_HEADER_SIZE + 6], response + size);
+    this->pools [spec].push_back (entry);
+    ++this->stats.started;
+    return true;
+}
+/*
+ * Remove a session from the pool. The caller is responsible for flushing
+ * it from the TPM.
+ */
+bool
+TctiSgxSessionPool::evict (TPM2_HANDLE *handle)
+{
+    size_t i;
+
+    for (i = 0; i < this->pools.size (); ++i) {
+        if (!this->pools [i].empty ()) {
+            *handle = this->pools [i].back ().handle;
+            this->pools [i].pop_back ();
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t
+TctiSgxSessionPool::available () const
+{
+    size_t i, count = 0;
+
+    for (i = 0; i < this->pools.size (); ++i)
+        count += this->pools [i].size ();
+    return count;
+}
+
+void
+TctiSgxSessionPool::get_stats (tcti_sgx_session_pool_stats_t *stats) const
+{
+    *stats = this->stats;
+    stats->available = this->available ();
+}
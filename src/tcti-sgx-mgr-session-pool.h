@@ -0,0 +1,65 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TCTI_SGX_MGR_SESSION_POOL_H
+#define TCTI_SGX_MGR_SESSION_POOL_H
+
+#include <list>
+#include <vector>
+
+#include <tss2/tss2_tpm2_types.h>
+#include "tcti-sgx-mgr.h"
+
+/*
+ * Description of one kind of pre-started session: the tail of the
+ * StartAuthSession parameters (empty encryptedSalt, sessionType,
+ * symmetric and authHash) along with the size of nonceCaller. Unbound,
+ * unsalted sessions that agree on these are indistinguishable to the
+ * client.
+ */
+struct TctiSgxSessionSpec {
+    std::vector<uint8_t> tail;
+    uint16_t nonce_size;
+    size_t depth;
+};
+/*
+ * A per-session pool of pre-started authorization sessions. The manager
+ * fills the pool while the session is idle and a StartAuthSession from
+ * the client that matches one of the configured specs is answered with a
+ * session from the pool.
+ *
+ * Pooled sessions were started on the downstream connection of the
+ * owning TctiSgxSession and so can only be handed to its client. This
+ * object is not thread safe, the owning TctiSgxSession serializes access.
+ */
+class TctiSgxSessionPool {
+    struct Entry {
+        TPM2_HANDLE handle;
+        std::vector<uint8_t> nonce;
+    };
+    std::vector<TctiSgxSessionSpec> specs;
+    std::vector<std::list<Entry> > pools;
+    tcti_sgx_session_pool_stats_t stats;
+public:
+    TctiSgxSessionPool (std::vector<TctiSgxSessionSpec> const &specs);
+    bool enabled () const { return !this->specs.empty (); }
+    bool command (uint8_t const *command,
+                  size_t size,
+                  std::vector<uint8_t> &response);
+    bool refill_command (size_t *spec,
+                         std::vector<uint8_t> &command) const;
+    bool refill_response (size_t spec,
+                          uint8_t const *response,
+                          size_t size);
+    bool evict (TPM2_HANDLE *handle);
+    size_t available () const;
+    void get_stats (tcti_sgx_session_pool_stats_t *stats) const;
+    static bool make_spec (TPM2_SE type,
+                           TPM2_ALG_ID auth_hash,
+                           TPMT_SYM_DEF const *symmetric,
+                           size_t depth,
+                           TctiSgxSessionSpec *spec);
+};
+
+#endif /* TCTI_SGX_MGR_SESSION_POOL_H */
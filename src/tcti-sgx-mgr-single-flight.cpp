@@ -0,0 +1,153 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <string.h>
+
+#include <chrono>
+
+#include "tcti-sgx-mgr-rsp-cache.h"
+#include "tcti-sgx-mgr-single-flight.h"
+
+using namespace std;
+
+/*
+ * How long after the flight took off followers wait on the leader before
+ * giving up and sending the command themselves. The leader only receives
+ * its response when its client asks for it.
+ */
+#define FLIGHT_WAIT_MAX_MS 5000
+
+TctiSgxSingleFlight::TctiSgxSingleFlight ()
+: enable (false)
+{
+    memset (&this->stats, 0, sizeof (this->stats));
+}
+
+bool
+TctiSgxSingleFlight::enabled ()
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    return this->enable;
+}
+
+void
+TctiSgxSingleFlight::set_enabled (bool enable)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    this->enable = enable;
+}
+/*
+ * Process a command a session is about to send. Returns NULL when the
+ * command can't be shared, in which case the session just sends it.
+ * Otherwise returns the flight and sets '*leader' to indicate whether the
+ * caller must send the command (and later complete or fail the flight) or
+ * follow the flight and wait for its response.
+ */
+shared_ptr<TctiSgxFlight>
+TctiSgxSingleFlight::join (uint8_t const *command,
+                           size_t size,
+                           bool *leader)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    list<shared_ptr<TctiSgxFlight> >::const_iterator itr;
+    shared_ptr<TctiSgxFlight> flight;
+
+    if (!this->enable)
+        return flight;
+    if (TctiSgxRspCache::changes_state (command, size)) {
+        this->flights.clear ();
+        return flight;
+    }
+    if (!TctiSgxRspCache::read_only (command, size))
+        return flight;
+    for (itr = this->flights.begin (); itr != this->flights.end (); ++itr) {
+        if ((*itr)->command.size () == size &&
+            memcmp ((*itr)->command.data (), command, size) == 0)
+        {
+            *leader = false;
+            ++this->stats.joined;
+            return *itr;
+        }
+    }
+    flight = make_shared<TctiSgxFlight> ();
+    flight->command.assign (command, command + size);
+    this->flights.push_back (flight);
+    *leader = true;
+    ++this->stats.flights;
+    return flight;
+}
+/*
+ * Mark 'flight' done, wake up its followers and close it to new ones.
+ * Caller must hold the mutex.
+ */
+void
+TctiSgxSingleFlight::finish (shared_ptr<TctiSgxFlight> const &flight)
+{
+    flight->done = true;
+    this->flights.remove (flight);
+    this->cond.notify_all ();
+}
+/*
+ * The leader has the response from the TPM.
+ */
+void
+TctiSgxSingleFlight::complete (shared_ptr<TctiSgxFlight> const &flight,
+                               uint8_t const *response,
+                               size_t size)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    flight->response.assign (response, response + size);
+    this->finish (flight);
+}
+/*
+ * The leader won't be getting a response.
+ */
+void
+TctiSgxSingleFlight::fail (shared_ptr<TctiSgxFlight> const &flight)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    flight->failed = true;
+    this->finish (flight);
+}
+/*
+ * Wait up to 'timeout' ms (TSS2_TCTI_TIMEOUT_BLOCK for as long as it
+ * takes) for the leader of 'flight' to get its response. Returns 1 and
+ * populates 'response' with a copy, 0 if the follower has to send the
+ * command itself or -1 if 'timeout' ran out first, the follower may wait
+ * again.
+ */
+int
+TctiSgxSingleFlight::wait (shared_ptr<TctiSgxFlight> const &flight,
+                           int32_t timeout,
+                           vector<uint8_t> &response)
+{
+    unique_lock<std::mutex> guard (this->mutex);
+    chrono::steady_clock::time_point limit, give_up;
+
+    give_up = flight->started + chrono::milliseconds (FLIGHT_WAIT_MAX_MS);
+    limit = chrono::steady_clock::now () + chrono::milliseconds (timeout);
+    if (timeout < 0 || give_up < limit)
+        limit = give_up;
+    this->cond.wait_until (guard, limit, [&flight] { return flight->done; });
+    if (flight->done && !flight->failed) {
+        response = flight->response;
+        return 1;
+    }
+    if (!flight->done && chrono::steady_clock::now () < give_up)
+        return -1;
+    ++this->stats.fallbacks;
+    return 0;
+}
+
+void
+TctiSgxSingleFlight::get_stats (tcti_sgx_single_flight_stats_t *stats)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    *stats = this->stats;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TCTI_SGX_MGR_SINGLE_FLIGHT_H
+#define TCTI_SGX_MGR_SINGLE_FLIGHT_H
+
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <tss2/tss2_tpm2_types.h>
+#include "tcti-sgx-mgr.h"
+
+/*
+ * A read-only command sent to the TPM by one session (the leader) that
+ * other sessions sending the same command (the followers) are waiting on.
+ */
+struct TctiSgxFlight {
+    std::vector<uint8_t> command;
+    std::vector<uint8_t> response;
+    bool done;
+    bool failed;
+    std::chrono::steady_clock::time_point started;
+    TctiSgxFlight ()
+        : done (false), failed (false),
+          started (std::chrono::steady_clock::now ()) {}
+};
+/*
+ * Deduplication of identical read-only commands that are in flight at the
+ * same time. The first session to send a command leads the flight and
+ * sends it to the TPM. Sessions that send the same bytes before the
+ * response has come back follow the flight: they don't send anything and
+ * get a copy of the leader's response when they call receive. Only the
+ * commands that the response cache considers read-only qualify since for
+ * them the same command gets the same response.
+ *
+ * A command that changes TPM state closes the flights in progress to new
+ * followers: a read sent after the change must not get a response that
+ * may have been produced before it. If the leader doesn't get a response
+ * (an error, a cancel, its session going away) or takes too long, the
+ * followers are told to send the command themselves.
+ *
+ * Shared by all sessions, access is serialized with the object's own
+ * mutex.
+ */
+class TctiSgxSingleFlight {
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool enable;
+    /* flights new followers may join */
+    std::list<std::shared_ptr<TctiSgxFlight> > flights;
+    tcti_sgx_single_flight_stats_t stats;
+    void finish (std::shared_ptr<TctiSgxFlight> const &flight);
+public:
+    TctiSgxSingleFlight ();
+    bool enabled ();
+    void set_enabled (bool enable);
+    std::shared_ptr<TctiSgxFlight> join (uint8_t const *command,
+                                         size_t size,
+                                         bool *leader);
+    void complete (std::shared_ptr<TctiSgxFlight> const &flight,
+                   uint8_t const *response,
+                   size_t size);
+    void fail (std::shared_ptr<TctiSgxFlight> const &flight);
+    int wait (std::shared_ptr<TctiSgxFlight> const &flight,
+              int32_t timeout,
+              std::vector<uint8_t> &response);
+    void get_stats (tcti_sgx_single_flight_stats_t *stats);
+};
+
+#endif /* TCTI_SGX_MGR_SINGLE_FLIGHT_H */
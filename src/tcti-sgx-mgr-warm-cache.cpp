@@ -0,0 +1,514 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include "tcti-sgx-mgr-warm-cache.h"
+#include "tpm2-header.h"
+
+using namespace std;
+
+#define WARM_CACHE_MAGIC "tctisgxw"
+#define WARM_CACHE_MAGIC_SIZE 8
+#define WARM_CACHE_VERSION 1
+/* there are only so many distinct queries for TPM metadata */
+#define WARM_CACHE_ENTRIES_MAX 256
+
+/*
+ * GetCapability layout:
+ *   command: header | capability (4) | property (4) | propertyCount (4)
+ *   response: header | moreData (1) | capability (4) | count (4) |
+ *             { property (4) | value (4) } * count
+ */
+#define CAP_COMMAND_SIZE (TPM2_HEADER_SIZE + 12)
+#define CAP_PROPERTY_OFFSET (TPM2_HEADER_SIZE + 4)
+#define CAP_COUNT_OFFSET (TPM2_HEADER_SIZE + 5)
+#define CAP_PROPERTIES_OFFSET (CAP_COUNT_OFFSET + 4)
+/* manufacturer, vendor strings, TPM type and firmware version */
+#define IDENTITY_PROPERTY_COUNT 8
+
+/*
+ * Determine whether 'command' asks for TPM metadata that we keep: fixed
+ * capabilities and the public area of persistent objects.
+ */
+static bool
+warmable (uint8_t const *command,
+          size_t size)
+{
+    TPM2_PT property;
+
+    if (!tpm2_header_valid (command, size) ||
+        tpm2_header_tag (command) != TPM2_ST_NO_SESSIONS)
+        return false;
+    switch (tpm2_header_code (command)) {
+    case TPM2_CC_GetCapability:
+        if (size != CAP_COMMAND_SIZE)
+            return false;
+        switch (tpm2_get_uint32 (&command [TPM2_HEADER_SIZE])) {
+        case TPM2_CAP_ALGS:
+        case TPM2_CAP_COMMANDS:
+        case TPM2_CAP_ECC_CURVES:
+            return true;
+        case TPM2_CAP_TPM_PROPERTIES:
+            property = tpm2_get_uint32 (&command [CAP_PROPERTY_OFFSET]);
+            return property >= TPM2_PT_FIXED && property < TPM2_PT_VAR;
+        default:
+            return false;
+        }
+    case TPM2_CC_ReadPublic:
+        return size == TPM2_HEADER_SIZE + 4 &&
+            tpm2_get_uint32 (&command [TPM2_HEADER_SIZE]) >> TPM2_HR_SHIFT ==
+            TPM2_HT_PERSISTENT;
+    default:
+        return false;
+    }
+}
+/*
+ * Determine whether 'response' to a warmable 'command' may be kept: it
+ * must be successful and, for a property query that ran over into the
+ * variable properties, only describe fixed ones.
+ */
+static bool
+response_ok (uint8_t const *command,
+             uint8_t const *response,
+             size_t size)
+{
+    uint32_t count, i;
+
+    if (!tpm2_header_valid (response, size) ||
+        tpm2_header_code (response) != TPM2_RC_SUCCESS ||
+        tpm2_header_tag (response) != TPM2_ST_NO_SESSIONS)
+        return false;
+    if (tpm2_header_code (command) != TPM2_CC_GetCapability ||
+        tpm2_get_uint32 (&command [TPM2_HEADER_SIZE]) != TPM2_CAP_TPM_PROPERTIES)
+        return true;
+    if (size < CAP_PROPERTIES_OFFSET)
+        return false;
+    count = tpm2_get_uint32 (&response [CAP_COUNT_OFFSET]);
+    if (count > (size - CAP_PROPERTIES_OFFSET) / 8)
+        return false;
+    for (i = 0; i < count; ++i) {
+        if (tpm2_get_uint32 (&response [CAP_PROPERTIES_OFFSET + i * 8]) >=
+            TPM2_PT_VAR)
+            return false;
+    }
+    return true;
+}
+/*
+ * Commands that may change the public area or existence of persistent
+ * objects.
+ */
+static bool
+changes_public (uint8_t const *command,
+                size_t size)
+{
+    if (!tpm2_header_valid (command, size))
+        return false;
+    switch (tpm2_header_code (command)) {
+    case TPM2_CC_EvictControl:
+    case TPM2_CC_ChangeEPS:
+    case TPM2_CC_ChangePPS:
+    case TPM2_CC_Clear:
+    case TPM2_CC_HierarchyControl:
+        return true;
+    default:
+        return false;
+    }
+}
+/*
+ * Read a size prefixed blob from 'buf' at '*offset'.
+ */
+static bool
+read_blob (uint8_t const *buf,
+           size_t size,
+           size_t *offset,
+           vector<uint8_t> &blob)
+{
+    uint32_t blob_size;
+
+    if (size - *offset < 4)
+        return false;
+    blob_size = tpm2_get_uint32 (&buf [*offset]);
+    *offset += 4;
+    if (size - *offset < blob_size)
+        return false;
+    blob.assign (&buf [*offset], &buf [*offset] + blob_size);
+    *offset += blob_size;
+    return true;
+}
+
+static void
+write_blob (vector<uint8_t> &buf,
+            vector<uint8_t> const &blob)
+{
+    size_t offset = buf.size ();
+
+    buf.resize (offset + 4);
+    tpm2_set_uint32 (&buf [offset], blob.size ());
+    buf.insert (buf.end (), blob.begin (), blob.end ());
+}
+
+TctiSgxWarmCache::TctiSgxWarmCache ()
+: checked (false), dirty (false)
+{
+    memset (&this->stats, 0, sizeof (this->stats));
+}
+
+bool
+TctiSgxWarmCache::enabled ()
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    return !this->path.empty ();
+}
+/*
+ * Parse the content of a cache file. Caller must hold the mutex.
+ */
+bool
+TctiSgxWarmCache::load (uint8_t const *buf,
+                        size_t size)
+{
+    size_t offset = WARM_CACHE_MAGIC_SIZE + 4;
+    uint32_t count;
+    Entry entry;
+
+    if (size < offset ||
+        memcmp (buf, WARM_CACHE_MAGIC, WARM_CACHE_MAGIC_SIZE) != 0 ||
+        tpm2_get_uint32 (&buf [WARM_CACHE_MAGIC_SIZE]) != WARM_CACHE_VERSION ||
+        !read_blob (buf, size, &offset, this->identity) ||
+        size - offset < 4)
+        return false;
+    count = tpm2_get_uint32 (&buf [offset]);
+    offset += 4;
+    if (count > WARM_CACHE_ENTRIES_MAX)
+        return false;
+    entry.verified = false;
+    for (; count > 0; --count) {
+        if (!read_blob (buf, size, &offset, entry.command) ||
+            !read_blob (buf, size, &offset, entry.response) ||
+            !warmable (entry.command.data (), entry.command.size ()) ||
+            !response_ok (entry.command.data (),
+                          entry.response.data (),
+                          entry.response.size ()))
+            return false;
+        this->entries.push_back (entry);
+    }
+    return offset == size;
+}
+/*
+ * Use the file at 'path' to keep the cache across restarts, loading what's
+ * in it. A file that doesn't exist yet, or that we can't make sense of
+ * (another version, corrupted), is replaced once the maintenance thread
+ * has something to put in it. A NULL 'path' disables the cache.
+ * Returns 0 on success, -1 if the file exists but can't be read.
+ */
+int
+TctiSgxWarmCache::set_path (char const *path)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    struct stat st;
+    void *buf;
+    int fd;
+
+    this->path = path == NULL ? "" : path;
+    this->identity.clear ();
+    this->entries.clear ();
+    this->checked = false;
+    this->dirty = false;
+    if (path == NULL)
+        return 0;
+    fd = open (path, O_RDONLY);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    if (fstat (fd, &st) != 0) {
+        close (fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close (fd);
+        return 0;
+    }
+    buf = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (buf == MAP_FAILED)
+        return -1;
+    if (!this->load ((uint8_t const*)buf, st.st_size)) {
+        cout << __func__ << ": ignoring malformed warm cache file " << path
+            << endl;
+        this->identity.clear ();
+        this->entries.clear ();
+    }
+    munmap (buf, st.st_size);
+    return 0;
+}
+/*
+ * Write the cache to its file if it has changed since it was loaded. The
+ * new content goes to a temporary file that replaces the old one so that
+ * a crash part way through doesn't leave a truncated file behind. Nothing
+ * is written until the TPM identity has been checked.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+TctiSgxWarmCache::save ()
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    list<Entry>::const_iterator itr;
+    vector<uint8_t> buf (WARM_CACHE_MAGIC_SIZE + 4);
+    string tmp_path;
+    size_t offset;
+    ssize_t ret;
+    int fd;
+
+    if (this->path.empty () || !this->dirty || !this->checked)
+        return 0;
+    memcpy (buf.data (), WARM_CACHE_MAGIC, WARM_CACHE_MAGIC_SIZE);
+    tpm2_set_uint32 (&buf [WARM_CACHE_MAGIC_SIZE], WARM_CACHE_VERSION);
+    write_blob (buf, this->identity);
+    offset = buf.size ();
+    buf.resize (offset + 4);
+    tpm2_set_uint32 (&buf [offset], this->entries.size ());
+    for (itr = this->entries.begin (); itr != this->entries.end (); ++itr) {
+        write_blob (buf, itr->command);
+        write_blob (buf, itr->response);
+    }
+
+    tmp_path = this->path + ".tmp";
+    fd = open (tmp_path.c_str (), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return -1;
+    for (offset = 0; offset < buf.size (); offset += ret) {
+        ret = TEMP_FAILURE_RETRY (write (fd,
+                                         &buf [offset],
+                                         buf.size () - offset));
+        if (ret < 0) {
+            close (fd);
+            unlink (tmp_path.c_str ());
+            return -1;
+        }
+    }
+    if (fsync (fd) != 0 || close (fd) != 0 ||
+        rename (tmp_path.c_str (), this->path.c_str ()) != 0)
+    {
+        unlink (tmp_path.c_str ());
+        return -1;
+    }
+    this->dirty = false;
+    return 0;
+}
+/*
+ * Add or update the response to 'command' after hearing it from the TPM.
+ * Caller must hold the mutex.
+ */
+void
+TctiSgxWarmCache::add (uint8_t const *command,
+                       size_t command_size,
+                       uint8_t const *response,
+                       size_t response_size)
+{
+    list<Entry>::iterator itr;
+    Entry entry;
+
+    for (itr = this->entries.begin (); itr != this->entries.end (); ++itr) {
+        if (itr->command.size () == command_size &&
+            memcmp (itr->command.data (), command, command_size) == 0)
+            break;
+    }
+    if (itr != this->entries.end ()) {
+        itr->verified = true;
+        if (itr->response.size () == response_size &&
+            memcmp (itr->response.data (), response, response_size) == 0)
+            return;
+        itr->response.assign (response, response + response_size);
+        ++this->stats.stale;
+        this->dirty = true;
+        return;
+    }
+    if (this->entries.size () >= WARM_CACHE_ENTRIES_MAX)
+        return;
+    entry.command.assign (command, command + command_size);
+    entry.response.assign (response, response + response_size);
+    entry.verified = true;
+    this->entries.push_back (entry);
+    this->dirty = true;
+}
+/*
+ * Drop the ReadPublic responses. Caller must hold the mutex.
+ */
+void
+TctiSgxWarmCache::drop_public ()
+{
+    list<Entry>::iterator itr = this->entries.begin ();
+
+    while (itr != this->entries.end ()) {
+        if (tpm2_header_code (itr->command.data ()) == TPM2_CC_ReadPublic) {
+            itr = this->entries.erase (itr);
+            this->dirty = true;
+        } else {
+            ++itr;
+        }
+    }
+}
+/*
+ * Process a command from a client. Returns true and populates 'response'
+ * when the command is answered from the cache.
+ */
+bool
+TctiSgxWarmCache::command (uint8_t const *command,
+                           size_t size,
+                           vector<uint8_t> &response)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    list<Entry>::const_iterator itr;
+
+    if (this->path.empty ())
+        return false;
+    if (changes_public (command, size)) {
+        this->drop_public ();
+        return false;
+    }
+    if (!warmable (command, size))
+        return false;
+    for (itr = this->entries.begin (); itr != this->entries.end (); ++itr) {
+        if (itr->command.size () == size &&
+            memcmp (itr->command.data (), command, size) == 0)
+        {
+            response = itr->response;
+            ++this->stats.hits;
+            return true;
+        }
+    }
+    ++this->stats.misses;
+    return false;
+}
+/*
+ * Process the response to a command sent to the TPM. Responses to the
+ * commands we keep are added to the cache. Responses to commands that
+ * change persistent objects drop the ReadPublic responses again, in case
+ * one was sent while the change was in flight.
+ */
+void
+TctiSgxWarmCache::response (uint8_t const *command,
+                            size_t command_size,
+                            uint8_t const *response,
+                            size_t response_size)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    if (this->path.empty ())
+        return;
+    if (changes_public (command, command_size))
+        this->drop_public ();
+    else if (warmable (command, command_size) &&
+             response_ok (command, response, response_size))
+        this->add (command, command_size, response, response_size);
+}
+/*
+ * Build the command for the maintenance thread to send next to check the
+ * cache: the identity query until the TPM identity has been checked, then
+ * the commands from the file the TPM hasn't answered since. Returns false
+ * when there's nothing left to check.
+ */
+bool
+TctiSgxWarmCache::verify_command (vector<uint8_t> &command)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    list<Entry>::const_iterator itr;
+
+    if (this->path.empty ())
+        return false;
+    if (!this->checked) {
+        TctiSgxWarmCache::identity_command (command);
+        return true;
+    }
+    for (itr = this->entries.begin (); itr != this->entries.end (); ++itr) {
+        if (!itr->verified) {
+            command = itr->command;
+            return true;
+        }
+    }
+    return false;
+}
+/*
+ * Process the response to a command from verify_command. A TPM that
+ * doesn't match the identity from the file makes everything from the file
+ * stale. A command the TPM now fails (a persistent object that's gone) is
+ * dropped from the cache.
+ */
+void
+TctiSgxWarmCache::verify_response (vector<uint8_t> const &command,
+                                   uint8_t const *response,
+                                   size_t size)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+    list<Entry>::iterator itr;
+
+    if (!tpm2_header_valid (response, size))
+        return;
+    if (!this->checked) {
+        if (tpm2_header_code (response) != TPM2_RC_SUCCESS)
+            return;
+        /* without a file, what we have came from this TPM */
+        if (!this->identity.empty () &&
+            (this->identity.size () != size ||
+             memcmp (this->identity.data (), response, size) != 0))
+        {
+            cout << __func__ << ": TPM doesn't match the warm cache file,"
+                " discarding " << this->entries.size () << " entries" << endl;
+            this->stats.stale += this->entries.size ();
+            this->entries.clear ();
+            this->identity.clear ();
+        }
+        if (this->identity.empty ()) {
+            this->identity.assign (response, response + size);
+            this->dirty = true;
+        }
+        this->checked = true;
+        return;
+    }
+    if (response_ok (command.data (), response, size)) {
+        this->add (command.data (), command.size (), response, size);
+        return;
+    }
+    for (itr = this->entries.begin (); itr != this->entries.end (); ++itr) {
+        if (itr->command == command) {
+            this->entries.erase (itr);
+            ++this->stats.stale;
+            this->dirty = true;
+            return;
+        }
+    }
+}
+
+void
+TctiSgxWarmCache::get_stats (tcti_sgx_warm_cache_stats_t *stats)
+{
+    lock_guard<std::mutex> guard (this->mutex);
+
+    *stats = this->stats;
+    stats->entries = this->entries.size ();
+}
+/*
+ * Build the query for the properties that identify the TPM: from
+ * TPM2_PT_MANUFACTURER through TPM2_PT_FIRMWARE_VERSION_2.
+ */
+void
+TctiSgxWarmCache::identity_command (vector<uint8_t> &command)
+{
+    command.assign (CAP_COMMAND_SIZE, 0);
+    tpm2_header_set (command.data (),
+                     TPM2_ST_NO_SESSIONS,
+                     command.size (),
+                     TPM2_CC_GetCapability);
+    tpm2_set_uint32 (&command [TPM2_HEADER_SIZE], TPM2_CAP_TPM_PROPERTIES);
+    tpm2_set_uint32 (&command [CAP_PROPERTY_OFFSET], TPM2_PT_MANUFACTURER);
+    tpm2_set_uint32 (&command [CAP_PROPERTY_OFFSET + 4],
+                     IDENTITY_PROPERTY_COUNT);
+}
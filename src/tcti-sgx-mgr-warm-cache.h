@@ -0,0 +1,82 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TCTI_SGX_MGR_WARM_CACHE_H
+#define TCTI_SGX_MGR_WARM_CACHE_H
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <tss2/tss2_tpm2_types.h>
+#include "tcti-sgx-mgr.h"
+
+/*
+ * A cache of the TPM metadata every client asks for when it starts that
+ * is kept in a file so that it survives restarts of the process: the
+ * GetCapability queries for fixed properties, algorithms, commands and ECC
+ * curves and ReadPublic of persistent objects (the EK, SRK and the like,
+ * which gives their names too). Responses loaded from the file are used
+ * straight away and checked against the TPM in the background by the
+ * maintenance thread. A response the TPM no longer agrees with is
+ * replaced.
+ *
+ * The file is keyed by the identity of the TPM: its manufacturer, vendor
+ * strings and firmware version. When the TPM doesn't match the file (a
+ * different TPM or a firmware update) the whole file is thrown away the
+ * first time the maintenance thread checks. EvictControl and the like
+ * drop the ReadPublic responses.
+ *
+ * File format, integers are big endian:
+ *   magic (8) | version (4) | identitySize (4) | identity |
+ *   entryCount (4) | { commandSize (4) | command |
+ *                      responseSize (4) | response } * entryCount
+ * The file is mapped into memory to load it and replaced with a new one
+ * by the maintenance thread when its content has changed. Access is
+ * serialized with the cache's own mutex.
+ */
+class TctiSgxWarmCache {
+    struct Entry {
+        std::vector<uint8_t> command;
+        std::vector<uint8_t> response;
+        /* the TPM has given us this response since the file was loaded */
+        bool verified;
+    };
+    std::mutex mutex;
+    std::string path;
+    /* identity from the file, checked against the TPM when 'checked' */
+    std::vector<uint8_t> identity;
+    bool checked;
+    bool dirty;
+    std::list<Entry> entries;
+    tcti_sgx_warm_cache_stats_t stats;
+    bool load (uint8_t const *buf,
+               size_t size);
+    void drop_public ();
+    void add (uint8_t const *command,
+              size_t command_size,
+              uint8_t const *response,
+              size_t response_size);
+public:
+    TctiSgxWarmCache ();
+    bool enabled ();
+    int set_path (char const *path);
+    int save ();
+    bool command (uint8_t const *command,
+                  size_t size,
+                  std::vector<uint8_t> &response);
+    void response (uint8_t const *command,
+                   size_t command_size,
+                   uint8_t const *response,
+                   size_t response_size);
+    bool verify_command (std::vector<uint8_t> &command);
+    void verify_response (std::vector<uint8_t> const &command,
+                          uint8_t const *response,
+                          size_t size);
+    void get_stats (tcti_sgx_warm_cache_stats_t *stats);
+    static void identity_command (std::vector<uint8_t> &command);
+};
+
+#endif /* TCTI_SGX_MGR_WARM_CACHE_H */
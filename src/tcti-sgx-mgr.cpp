@@ -14,15 +14,24 @@
 #include "tcti-sgx-mgr_priv.h"
 #include "tcti-sgx-mgr.h"
 #include "tcti-util.h"
+#include "tpm2-header.h"
 #include "util.h"
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <list>
 #include <mutex>
+#include <thread>
+#include <vector>
 
 using namespace std;
 
 #define RAND_SRC "/dev/urandom"
+#define MAINTENANCE_INTERVAL_DEFAULT 100
+#define REFILL_PER_INTERVAL_DEFAULT 1
+#define PARK_TIMEOUT_DEFAULT 60000
+#define RESUME_TOKEN_SIZE 32
 #if defined(__GNUC__)
 #define SO_EXPORT __attribute__ ((visibility ("default")))
 #else
@@ -53,8 +62,38 @@ using namespace std;
  */
 TctiSgxMgr::TctiSgxMgr (downstream_tcti_init_cb init_cb,
                         void *user_data)
-: init_cb (init_cb), user_data (user_data) {}
-TctiSgxMgr::~TctiSgxMgr () {}
+: worker_exit (false), tcti_context (NULL), init_cb (init_cb),
+  user_data (user_data), backends (init_cb, user_data),
+  mux (&this->backends), audit_trail (&this->audit_log, NULL),
+  maintenance_interval (MAINTENANCE_INTERVAL_DEFAULT),
+  refill_per_interval (REFILL_PER_INTERVAL_DEFAULT),
+  park_timeout (PARK_TIMEOUT_DEFAULT), lease_idle_ms (0), lease_expire_ms (0),
+  lazy_connect (false)
+{
+    this->session_config.key_pool = &this->key_pool;
+    this->session_config.rsp_cache = &this->rsp_cache;
+    this->session_config.single_flight = &this->single_flight;
+    this->session_config.warm_cache = &this->warm_cache;
+    this->session_config.cost_table = &this->cost_table;
+    this->session_config.audit_log = &this->audit_log;
+    this->session_config.placement = &this->placement;
+    this->session_config.admission = &this->admission;
+    this->session_config.quota = &this->quota;
+    this->session_config.backends = &this->backends;
+    this->session_config.conn_pool = &this->conn_pool;
+    this->session_config.mux = &this->mux;
+    this->audit_log.set_placement (&this->placement);
+}
+TctiSgxMgr::~TctiSgxMgr ()
+{
+    this->worker_stop ();
+    if (this->warm_cache.save () != 0)
+        cout << __func__ << ": failed to save warm cache" << endl;
+    if (this->tcti_context != NULL) {
+        Tss2_Tcti_Finalize (this->tcti_context);
+        free (this->tcti_context);
+    }
+}
 
 void
 TctiSgxMgr::lock ()
@@ -66,12 +105,15 @@ TctiSgxMgr::unlock ()
 {
     this->sessions_mutex.unlock ();
 }
+/*
+ * Find a session, parked or not, leaving its lease alone. Caller must
+ * hold the manager lock.
+ */
 TctiSgxSession*
-TctiSgxMgr::session_lookup (uint64_t id)
+TctiSgxMgr::session_find (uint64_t id)
 {
     list <TctiSgxSession*>::const_iterator itr;
 
-    cout << __func__ << ": looking up TctiSgxSession with id: " << id << endl;
     for (itr = this->sessions.begin (); itr != this->sessions.end (); ++itr)
     {
         if ((*itr)->id == id) {
@@ -80,31 +122,623 @@ TctiSgxMgr::session_lookup (uint64_t id)
     }
     return NULL;
 }
+/*
+ * Find the session an enclave is using. Parked sessions belong to no
+ * enclave until they're resumed. Finding a session renews its lease.
+ */
+TctiSgxSession*
+TctiSgxMgr::session_lookup (uint64_t id)
+{
+    TctiSgxSession *session;
+
+    cout << __func__ << ": looking up TctiSgxSession with id: " << id << endl;
+    session = this->session_find (id);
+    if (session != NULL && session->parked)
+        return NULL;
+    if (session != NULL)
+        session->last_used = chrono::steady_clock::now ();
+    return session;
+}
+/*
+ * Delete a session that's no longer on the list.
+ */
+void
+TctiSgxMgr::session_free (TctiSgxSession *session)
+{
+    /* wait for the maintenance thread to be done with it */
+    session->lock ();
+    session->unlock ();
+    delete session;
+}
 
+/*
+ * Take the session off the list and delete it. The manager lock is only
+ * held for the first part, the caller mustn't hold it: tearing a session
+ * down talks to the TPM and nobody should wait on the manager for that.
+ */
 void
 TctiSgxMgr::session_remove (uint64_t id)
 {
-    list <TctiSgxSession*>::const_iterator itr;
+    list <TctiSgxSession*>::iterator itr;
+    TctiSgxSession *session = NULL;
 
+    this->lock ();
     for (itr = this->sessions.begin (); itr != this->sessions.end (); ++itr)
     {
         if ((*itr)->id == id) {
-            delete *itr;
+            session = *itr;
             this->sessions.erase (itr);
-            return;
+            break;
+        }
+    }
+    this->unlock ();
+    if (session != NULL)
+        this->session_free (session);
+}
+/*
+ * Find the session with resume token 'token' and take its token away so
+ * it can't be claimed twice. Every token is compared in full so how long
+ * this takes doesn't give away how close a guess was. Caller must hold
+ * the manager lock.
+ */
+TctiSgxSession*
+TctiSgxMgr::session_claim (uint8_t const *token,
+                           size_t size)
+{
+    list <TctiSgxSession*>::const_iterator itr;
+    TctiSgxSession *match = NULL;
+    uint8_t diff;
+    size_t i;
+
+    for (itr = this->sessions.begin (); itr != this->sessions.end (); ++itr)
+    {
+        if ((*itr)->resume_token.size () != size)
+            continue;
+        diff = 0;
+        for (i = 0; i < size; ++i)
+            diff |= (*itr)->resume_token [i] ^ token [i];
+        if (diff == 0)
+            match = *itr;
+    }
+    if (match != NULL) {
+        match->resume_token.clear ();
+        match->last_used = chrono::steady_clock::now ();
+    }
+    return match;
+}
+/*
+ * Take parked sessions nobody came back for off the list and onto
+ * 'expired'. Caller must hold the manager lock and free the sessions
+ * once it has let go of it, as with reap_idle.
+ */
+void
+TctiSgxMgr::reap_parked (list<TctiSgxSession*> &expired)
+{
+    list <TctiSgxSession*>::iterator itr, next;
+    chrono::steady_clock::time_point now = chrono::steady_clock::now ();
+
+    for (itr = this->sessions.begin (); itr != this->sessions.end (); itr = next)
+    {
+        next = itr;
+        ++next;
+        if ((*itr)->parked && (*itr)->parked_until <= now) {
+            cout << __func__ << ": parked session " << (*itr)->id
+                 << " expired" << endl;
+            expired.splice (expired.end (), this->sessions, itr);
+        }
+    }
+}
+/*
+ * Take sessions no enclave has used for 'lease_expire_ms', those of
+ * enclaves that crashed or never finalized them, off the list and onto
+ * 'expired'. A session that's in use is left alone. Parked sessions have
+ * their own timeout. Caller must hold the manager lock and free the
+ * sessions once it has let go of it: tearing a session down talks to the
+ * TPM and nobody should wait on the manager for that.
+ */
+void
+TctiSgxMgr::reap_idle (list<TctiSgxSession*> &expired)
+{
+    list <TctiSgxSession*>::iterator itr, next;
+    chrono::steady_clock::time_point now = chrono::steady_clock::now ();
+
+    if (this->lease_expire_ms == 0)
+        return;
+    for (itr = this->sessions.begin (); itr != this->sessions.end (); itr = next)
+    {
+        next = itr;
+        ++next;
+        if ((*itr)->parked ||
+            (*itr)->last_used + chrono::milliseconds (this->lease_expire_ms) >
+            now || !(*itr)->try_lock ())
+            continue;
+        (*itr)->unlock ();
+        cout << __func__ << ": idle session " << (*itr)->id << " expired"
+             << endl;
+        expired.splice (expired.end (), this->sessions, itr);
+    }
+}
+
+void
+TctiSgxMgr::worker_run ()
+{
+    unique_lock<mutex> guard (this->worker_mutex);
+    uint64_t pinned = 0;
+
+    while (!this->worker_exit) {
+        this->worker_cond.wait_for (guard,
+            chrono::milliseconds (this->maintenance_interval));
+        if (this->worker_exit)
+            break;
+        guard.unlock ();
+        this->placement.pin_self (&pinned);
+        this->maintain ();
+        guard.lock ();
+    }
+}
+/*
+ * Start the maintenance thread if it isn't already running. It's only
+ * started when there's background work configured.
+ */
+void
+TctiSgxMgr::worker_start ()
+{
+    lock_guard<mutex> guard (this->worker_mutex);
+
+    if (this->worker.joinable () || this->maintenance_interval == 0)
+        return;
+    this->worker_exit = false;
+    this->worker = thread (&TctiSgxMgr::worker_run, this);
+}
+void
+TctiSgxMgr::worker_stop ()
+{
+    {
+        lock_guard<mutex> guard (this->worker_mutex);
+        this->worker_exit = true;
+    }
+    this->worker_cond.notify_all ();
+    if (this->worker.joinable ())
+        this->worker.join ();
+}
+/*
+ * Send a command to the TPM over 'tcti_context' and wait for the
+ * response. Every command the manager sends itself goes through here and
+ * is logged on 'trail' along with what came back.
+ */
+static TSS2_RC
+tcti_transact (TSS2_TCTI_CONTEXT *tcti_context,
+               TctiSgxAuditTrail *trail,
+               uint8_t const *command,
+               size_t command_size,
+               uint8_t *response,
+               size_t *response_size)
+{
+    TSS2_RC rc;
+
+    trail->record (AUDIT_TYPE_MGR_COMMAND,
+                   tpm2_header_code (command),
+                   command,
+                   command_size);
+    rc = Tss2_Tcti_Transmit (tcti_context, command_size, command);
+    if (rc == TSS2_RC_SUCCESS)
+        rc = Tss2_Tcti_Receive (tcti_context,
+                                response_size,
+                                response,
+                                TSS2_TCTI_TIMEOUT_BLOCK);
+    if (rc == TSS2_RC_SUCCESS &&
+        !tpm2_header_valid (response, *response_size))
+        rc = TSS2_TCTI_RC_MALFORMED_RESPONSE;
+    if (rc == TSS2_RC_SUCCESS)
+        trail->record (AUDIT_TYPE_MGR_RESPONSE,
+                       tpm2_header_code (response),
+                       response,
+                       *response_size);
+    else
+        trail->record (AUDIT_TYPE_MGR_RESPONSE, rc, NULL, 0);
+    return rc;
+}
+/*
+ * Flush a single context (object or session) from the TPM.
+ */
+static TSS2_RC
+tpm_flush_context (TSS2_TCTI_CONTEXT *tcti_context,
+                   TctiSgxAuditTrail *trail,
+                   TPM2_HANDLE handle)
+{
+    uint8_t command [TPM2_HEADER_SIZE + sizeof (TPM2_HANDLE)];
+    uint8_t response [TPM2_HEADER_SIZE];
+    size_t size = sizeof (response);
+    TSS2_RC rc;
+
+    tpm2_header_set (command,
+                     TPM2_ST_NO_SESSIONS,
+                     sizeof (command),
+                     TPM2_CC_FlushContext);
+    tpm2_set_uint32 (&command [TPM2_HEADER_SIZE], handle);
+    rc = tcti_transact (tcti_context,
+                        trail,
+                        command,
+                        sizeof (command),
+                        response,
+                        &size);
+    if (rc != TSS2_RC_SUCCESS)
+        return rc;
+    return tpm2_header_code (response);
+}
+/*
+ * Save the context of 'handle' into 'context', a TPMS_CONTEXT.
+ */
+static TSS2_RC
+tpm_context_save (TSS2_TCTI_CONTEXT *tcti_context,
+                  TctiSgxAuditTrail *trail,
+                  TPM2_HANDLE handle,
+                  vector<uint8_t> &context)
+{
+    uint8_t command [TPM2_HEADER_SIZE + sizeof (TPM2_HANDLE)];
+    uint8_t response [TPM2_MAX_RESPONSE_SIZE];
+    size_t size = sizeof (response);
+    TSS2_RC rc;
+
+    tpm2_header_set (command,
+                     TPM2_ST_NO_SESSIONS,
+                     sizeof (command),
+                     TPM2_CC_ContextSave);
+    tpm2_set_uint32 (&command [TPM2_HEADER_SIZE], handle);
+    rc = tcti_transact (tcti_context,
+                        trail,
+                        command,
+                        sizeof (command),
+                        response,
+                        &size);
+    if (rc != TSS2_RC_SUCCESS)
+        return rc;
+    if (tpm2_header_code (response) != TPM2_RC_SUCCESS)
+        return tpm2_header_code (response);
+    context.assign (&response [TPM2_HEADER_SIZE], response + size);
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Load a context saved by tpm_context_save, '*handle' is where it's
+ * loaded.
+ */
+static TSS2_RC
+tpm_context_load (TSS2_TCTI_CONTEXT *tcti_context,
+                  TctiSgxAuditTrail *trail,
+                  vector<uint8_t> const &context,
+                  TPM2_HANDLE *handle)
+{
+    vector<uint8_t> command (TPM2_HEADER_SIZE + context.size ());
+    uint8_t response [TPM2_HEADER_SIZE + sizeof (TPM2_HANDLE)];
+    size_t size = sizeof (response);
+    TSS2_RC rc;
+
+    tpm2_header_set (command.data (),
+                     TPM2_ST_NO_SESSIONS,
+                     command.size (),
+                     TPM2_CC_ContextLoad);
+    copy (context.begin (), context.end (), &command [TPM2_HEADER_SIZE]);
+    rc = tcti_transact (tcti_context, trail, command.data (), command.size (),
+                        response, &size);
+    if (rc != TSS2_RC_SUCCESS)
+        return rc;
+    if (tpm2_header_code (response) != TPM2_RC_SUCCESS)
+        return tpm2_header_code (response);
+    if (size != sizeof (response))
+        return TSS2_TCTI_RC_MALFORMED_RESPONSE;
+    *handle = tpm2_get_uint32 (&response [TPM2_HEADER_SIZE]);
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Get the handles from 'first' to the end of its range that are loaded
+ * on 'tcti_context'.
+ */
+static TSS2_RC
+tpm_get_handles (TSS2_TCTI_CONTEXT *tcti_context,
+                 TctiSgxAuditTrail *trail,
+                 TPM2_HANDLE first,
+                 vector<TPM2_HANDLE> &handles)
+{
+    uint8_t response [TPM2_MAX_RESPONSE_SIZE];
+    vector<uint8_t> command;
+    size_t size;
+    bool more = true;
+    TSS2_RC rc;
+
+    while (more) {
+        TctiSgxHandleMap::handles_command (first, command);
+        size = sizeof (response);
+        rc = tcti_transact (tcti_context,
+                            trail,
+                            command.data (),
+                            command.size (),
+                            response, &size);
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+        if (tpm2_header_code (response) != TPM2_RC_SUCCESS)
+            return tpm2_header_code (response);
+        if (TctiSgxHandleMap::parse_handles (response, size, first, handles,
+                                             &more) != 0)
+            return TSS2_TCTI_RC_MALFORMED_RESPONSE;
+        if (more)
+            first = handles.back () + 1;
+    }
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Create the manager's own connection to the TPM if it doesn't have one
+ * yet. This is used for work on the caches shared by all sessions.
+ */
+bool
+TctiSgxMgr::connect ()
+{
+    if (this->tcti_context != NULL)
+        return true;
+    if (this->init_cb == NULL)
+        return false;
+    this->tcti_context = this->init_cb (this->user_data);
+    if (this->tcti_context == NULL) {
+        cout << __func__ << ": tcti init callback failed to create a TCTI"
+            << endl;
+        return false;
+    }
+    return true;
+}
+/*
+ * Generate up to 'refill' keys for the key pool. This is done over the
+ * manager's own connection since the keys don't belong to any one
+ * session.
+ */
+void
+TctiSgxMgr::maintain_keys (size_t refill)
+{
+    uint8_t response [TPM2_MAX_RESPONSE_SIZE];
+    vector<uint8_t> command;
+    size_t spec, size;
+    TSS2_RC rc;
+
+    if (!this->key_pool.enabled () || !this->connect ())
+        return;
+    for (; refill > 0; --refill) {
+        if (!this->key_pool.refill_command (&spec, command))
+            break;
+        size = sizeof (response);
+        rc = tcti_transact (this->tcti_context,
+                            &this->audit_trail,
+                            command.data (),
+                            command.size (),
+                            response,
+                            &size);
+        if (rc != TSS2_RC_SUCCESS ||
+            !this->key_pool.refill_response (spec, response, size))
+        {
+            cout << __func__ << ": failed to generate pooled key: 0x" << hex
+                << (rc == TSS2_RC_SUCCESS ? tpm2_header_code (response) : rc)
+                << dec << endl;
+            break;
+        }
+    }
+}
+/*
+ * Check whether the pcrUpdateCounter has moved. PCRs may be extended by
+ * TPM users other than our clients, this puts a bound on how long a
+ * cached PCR_Read can be stale.
+ */
+void
+TctiSgxMgr::maintain_rsp_cache ()
+{
+    uint8_t response [TPM2_MAX_RESPONSE_SIZE];
+    vector<uint8_t> command;
+    size_t size = sizeof (response);
+    TSS2_RC rc;
+
+    if (!this->rsp_cache.has_pcr_entries () || !this->connect ())
+        return;
+    TctiSgxRspCache::pcr_update_counter_command (command);
+    rc = tcti_transact (this->tcti_context,
+                        &this->audit_trail,
+                        command.data (),
+                        command.size (),
+                        response,
+                        &size);
+    if (rc != TSS2_RC_SUCCESS) {
+        cout << __func__ << ": failed to read pcrUpdateCounter: 0x" << hex
+            << rc << dec << endl;
+        return;
+    }
+    this->rsp_cache.pcr_update_counter_response (response, size);
+}
+/*
+ * Check up to 'refill' of the responses loaded from the warm cache file
+ * against the TPM, starting with the TPM identity, and write the file if
+ * anything changed.
+ */
+void
+TctiSgxMgr::maintain_warm_cache (size_t refill)
+{
+    uint8_t response [TPM2_MAX_RESPONSE_SIZE];
+    vector<uint8_t> command;
+    size_t size;
+    TSS2_RC rc;
+
+    if (!this->warm_cache.enabled () || !this->connect ())
+        return;
+    for (; refill > 0; --refill) {
+        if (!this->warm_cache.verify_command (command))
+            break;
+        size = sizeof (response);
+        rc = tcti_transact (this->tcti_context,
+                            &this->audit_trail,
+                            command.data (),
+                            command.size (),
+                            response,
+                            &size);
+        if (rc != TSS2_RC_SUCCESS) {
+            cout << __func__ << ": failed to check warm cache entry: 0x"
+                << hex << rc << dec << endl;
+            break;
         }
+        this->warm_cache.verify_response (command, response, size);
+    }
+    if (this->warm_cache.save () != 0)
+        cout << __func__ << ": failed to save warm cache" << endl;
+}
+/*
+ * One pass of background maintenance over all sessions. A session that is
+ * in use is skipped, we'll get to it next time around. One whose lease
+ * has run out gives up its downstream resources instead. Keys are only
+ * generated when no session is using the TPM: creating a key can take
+ * long enough that we don't want a client waiting behind it.
+ */
+void
+TctiSgxMgr::maintain ()
+{
+    list <TctiSgxSession*>::const_iterator itr;
+    list <TctiSgxSession*> expired;
+    vector<uint64_t> ids;
+    TctiSgxSession *session;
+    chrono::milliseconds lease;
+    size_t refill, i;
+    bool busy = false, idle;
+
+    {
+        lock_guard<mutex> guard (this->worker_mutex);
+        refill = this->refill_per_interval;
+    }
+    this->conn_pool.expire ();
+    this->lock ();
+    this->reap_parked (expired);
+    this->reap_idle (expired);
+    lease = chrono::milliseconds (this->lease_idle_ms);
+    for (itr = this->sessions.begin (); itr != this->sessions.end (); ++itr)
+        ids.push_back ((*itr)->id);
+    this->unlock ();
+    for (itr = expired.begin (); itr != expired.end (); ++itr)
+        this->session_free (*itr);
+
+    for (i = 0; i < ids.size (); ++i) {
+        this->lock ();
+        session = this->session_find (ids [i]);
+        if (session == NULL) {
+            this->unlock ();
+            continue;
+        }
+        if (!session->try_lock ()) {
+            this->unlock ();
+            busy = true;
+            continue;
+        }
+        idle = lease.count () > 0 && !session->parked &&
+            session->last_used + lease <= chrono::steady_clock::now ();
+        this->unlock ();
+        busy = busy || session->busy ();
+        if (idle)
+            session->suspend ();
+        else
+            session->maintain (refill);
+        session->unlock ();
+    }
+    if (!busy) {
+        this->maintain_rsp_cache ();
+        this->maintain_warm_cache (refill);
+        this->maintain_keys (refill);
     }
-    return;
 }
 
 TctiSgxSession::TctiSgxSession (uint64_t id,
-                                TSS2_TCTI_CONTEXT *tcti_context)
-: tcti_context (tcti_context), id (id) {}
+                                TSS2_TCTI_CONTEXT *tcti_context,
+                                TctiSgxSessionConfig const &config,
+                                unsigned backend,
+                                bool multiplexed)
+: tcti_context (tcti_context), local_pending (false), in_flight (false),
+  key_pool (config.key_pool), entropy_reserve (config.entropy_reserve),
+  rsp_cache (config.rsp_cache), rsp_cache_generation (0),
+  single_flight (config.single_flight), flight_leader (false),
+  warm_cache (config.warm_cache), interceptors (config.interceptors),
+  intercept_command_size (0), intercept_code (0), intercept_depth (0),
+  cost_table (config.cost_table), sent_code (0), sent_variant (0),
+  audit_trail (config.audit_log, &this->id), placement (config.placement),
+  admission (config.admission), tag (0), admitted (false), admitted_tag (0),
+  admitted_size (0), queue_depth (0), quota (config.quota),
+  scheduler (NULL), priority (TCTI_SGX_PRIORITY_NORMAL),
+  turn (0), deadline_set (false), backends (config.backends),
+  backend (0), conn_pool (config.conn_pool), locality (0),
+  mux (multiplexed ? config.mux : NULL), pinned (false),
+  sent_sessions (false), suspended (false), lost (false),
+  hash_alg (TPM2_ALG_NULL), hash_sequence (0), id (id), parked (false),
+  last_used (chrono::steady_clock::now ()), home_node (-1),
+  ctx_cache (multiplexed ? 0 : config.ctx_cache_size),
+  session_pool (multiplexed ?
+                vector<TctiSgxSessionSpec> () : config.session_specs)
+{
+    this->bind (backend, config);
+    if (this->backends != NULL)
+        this->backends->attach (this->backend, this->tag);
+    if (this->placement == NULL)
+        return;
+    this->home_node = this->placement->session_created ();
+    /*
+     * Memory lands on the node that first writes to it. Write to the
+     * buffers every command goes through now, on the thread creating the
+     * session, so they're on the enclave's node rather than wherever the
+     * first command happens to be sent from.
+     */
+    if (this->placement->local ()) {
+        this->command.assign (TPM2_MAX_COMMAND_SIZE, 0);
+        this->command.clear ();
+        this->local_response.assign (TPM2_MAX_RESPONSE_SIZE, 0);
+        this->local_response.clear ();
+        this->intercept_command.assign (TPM2_MAX_COMMAND_SIZE, 0);
+    }
+}
 
 TctiSgxSession::~TctiSgxSession ()
 {
-    Tss2_Tcti_Finalize (this->tcti_context);
-    free (this->tcti_context);
+    bool clean = !this->in_flight;
+
+    /*
+     * Objects held in the context cache have been flushed as far as the
+     * client is concerned. We can only clean them up if the client didn't
+     * leave a command outstanding.
+     */
+    if (clean) {
+        this->evict_contexts (true);
+        this->flush_session_pool ();
+        this->hash_abandon ();
+    }
+    /* don't leave followers waiting on a response we'll never collect */
+    if (this->flight && this->flight_leader)
+        this->single_flight->fail (this->flight);
+    this->admit_release ();
+    this->turn_release ();
+    this->landed (false);
+    if (this->backends != NULL)
+        this->backends->detach (this->backend, this->tag);
+    /* a connection with a response still to come can't be reused */
+    this->hang_up (clean);
+    if (this->mux != NULL)
+        this->mux->detach ();
+    if (this->placement != NULL)
+        this->placement->session_destroyed (this->home_node);
+}
+/*
+ * Point the session at 'backend' and its scheduler. The caches the
+ * manager fills from its own connection and single flight are all about
+ * the TPM of backend 0, sessions on other backends go without them.
+ */
+void
+TctiSgxSession::bind (unsigned backend,
+                      TctiSgxSessionConfig const &config)
+{
+    bool first = backend == 0;
+
+    this->backend = backend;
+    this->key_pool = first ? config.key_pool : NULL;
+    this->rsp_cache = first ? config.rsp_cache : NULL;
+    this->single_flight = first ? config.single_flight : NULL;
+    this->warm_cache = first ? config.warm_cache : NULL;
+    this->scheduler = this->backends != NULL ?
+        this->backends->scheduler (backend) : NULL;
 }
 
 void
@@ -112,47 +746,2672 @@ TctiSgxSession::lock ()
 {
     this->mutex.lock ();
 }
+bool
+TctiSgxSession::try_lock ()
+{
+    return this->mutex.try_lock ();
+}
 void
 TctiSgxSession::unlock ()
 {
-    this->mutex.unlock ();
+    this->mutex.unlock ();
+}
+/*
+ * True when the client has a command outstanding. Caller must hold the
+ * session lock.
+ */
+bool
+TctiSgxSession::busy () const
+{
+    return this->in_flight || this->local_pending || this->flight;
+}
+/*
+ * Send a command of the manager's own making to the TPM and wait for the
+ * response. This is only safe when there's no command in flight on the
+ * session.
+ */
+TSS2_RC
+TctiSgxSession::transact (uint8_t const *command,
+                          size_t command_size,
+                          uint8_t *response,
+                          size_t *response_size)
+{
+    return tcti_transact (this->tcti_context,
+                          &this->audit_trail,
+                          command,
+                          command_size,
+                          response,
+                          response_size);
+}
+
+TSS2_RC
+TctiSgxSession::flush_context (TPM2_HANDLE handle)
+{
+    return tpm_flush_context (this->tcti_context, &this->audit_trail, handle);
+}
+/*
+ * Flush the objects that the context cache wants evicted: either the
+ * ones in excess of the cache size or, when 'all' is true, every object
+ * held in the cache. Failure to flush an object is logged but otherwise
+ * ignored since the client has no way to know about the object.
+ */
+TSS2_RC
+TctiSgxSession::evict_contexts (bool all)
+{
+    TPM2_HANDLE handle;
+    TSS2_RC rc;
+
+    while (this->ctx_cache.evict (&handle, all)) {
+        rc = this->flush_context (handle);
+        if (rc != TSS2_RC_SUCCESS) {
+            cout << __func__ << ": failed to flush context 0x" << hex
+                << handle << ": 0x" << rc << dec << endl;
+            if ((rc & TSS2_RC_LAYER_MASK) != TSS2_TPM_RC_LAYER)
+                return rc;
+        }
+    }
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Leave the connection as a new one would be for the connection pool or
+ * the next multiplexed session: nothing the client left loaded and at
+ * locality 0.
+ */
+TSS2_RC
+TctiSgxSession::scrub ()
+{
+    vector<TPM2_HANDLE> handles;
+    size_t i;
+    TSS2_RC rc;
+
+    rc = tpm_get_handles (this->tcti_context,
+                          &this->audit_trail,
+                          TPM2_TRANSIENT_FIRST,
+                          handles);
+    if (rc == TSS2_RC_SUCCESS)
+        rc = tpm_get_handles (this->tcti_context,
+                              &this->audit_trail,
+                              TPM2_LOADED_SESSION_FIRST,
+                              handles);
+    for (i = 0; rc == TSS2_RC_SUCCESS && i < handles.size (); ++i)
+        rc = this->flush_context (handles [i]);
+    if (rc == TSS2_RC_SUCCESS && this->locality != 0)
+        rc = Tss2_Tcti_SetLocality (this->tcti_context, 0);
+    if (rc != TSS2_RC_SUCCESS)
+        cout << __func__ << ": failed to clean up connection: 0x" << hex
+             << rc << dec << endl;
+    return rc;
+}
+/*
+ * Make sure the session has a downstream connection. A multiplexed
+ * session takes a channel, waiting for one no longer than '*deadline' if
+ * that's given. Any other session has a connection of its own unless it
+ * connects lazily or was suspended, it's given one (from the connection
+ * pool if it can be) and what it had loaded is put back.
+ */
+TSS2_RC
+TctiSgxSession::channel_acquire (
+    chrono::steady_clock::time_point const *deadline)
+{
+    TSS2_RC rc;
+
+    if (this->lost)
+        return TSS2_TCTI_RC_NO_CONNECTION;
+    if (this->tcti_context == NULL && this->mux != NULL) {
+        rc = this->mux->acquire (this->backend, deadline,
+                                 &this->tcti_context);
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+    } else if (this->tcti_context == NULL) {
+        if (this->conn_pool != NULL)
+            this->tcti_context = this->conn_pool->take (this->backend);
+        if (this->tcti_context == NULL && this->backends != NULL)
+            this->tcti_context = this->backends->connect (this->backend);
+        if (this->tcti_context == NULL)
+            return TSS2_TCTI_RC_NO_CONNECTION;
+    }
+    return this->suspended ? this->wake () : TSS2_RC_SUCCESS;
+}
+/*
+ * Give the channel back unless the session still needs it: a command is
+ * outstanding, something is loaded, a hash sequence is going or the
+ * locality isn't the one every channel starts at.
+ */
+void
+TctiSgxSession::channel_release ()
+{
+    if (this->mux == NULL || this->tcti_context == NULL || this->in_flight ||
+        this->pinned || this->hash_sequence != 0 || this->locality != 0)
+        return;
+    this->mux->release (this->backend, this->tcti_context, true);
+    this->tcti_context = NULL;
+}
+/*
+ * Let go of the downstream connection: back to the connection pool or
+ * the multiplexer if it's 'clean' and either is in use and it can be left
+ * as a new one would be, closed otherwise.
+ */
+void
+TctiSgxSession::hang_up (bool clean)
+{
+    if (this->tcti_context == NULL)
+        return;
+    clean = clean &&
+        (this->mux != NULL ||
+         (this->conn_pool != NULL && this->conn_pool->enabled ())) &&
+        this->scrub () == TSS2_RC_SUCCESS;
+    if (this->mux != NULL) {
+        this->mux->release (this->backend, this->tcti_context, clean);
+    } else if (clean) {
+        this->conn_pool->give (this->backend, this->tcti_context);
+    } else if (this->conn_pool != NULL && this->conn_pool->enabled ()) {
+        this->conn_pool->discard (this->tcti_context);
+    } else {
+        Tss2_Tcti_Finalize (this->tcti_context);
+        free (this->tcti_context);
+    }
+    this->tcti_context = NULL;
+}
+/*
+ * Ask the TPM which bytes of each command are handles, if the handle map
+ * doesn't know yet. It needs to before it maps the client's handles for
+ * things that have moved.
+ */
+TSS2_RC
+TctiSgxSession::fetch_commands ()
+{
+    uint8_t response [TPM2_MAX_RESPONSE_SIZE];
+    vector<uint8_t> command;
+    TPM2_CC next = TPM2_CC_FIRST;
+    size_t size;
+    int more;
+    TSS2_RC rc;
+
+    more = this->handle_map.has_commands () ? 0 : 1;
+    while (more == 1) {
+        TctiSgxHandleMap::commands_command (next, command);
+        size = sizeof (response);
+        rc = this->transact (command.data (), command.size (), response,
+                             &size);
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+        more = this->handle_map.add_commands (response, size, &next);
+        if (more < 0)
+            return tpm2_header_code (response) != TPM2_RC_SUCCESS ?
+                tpm2_header_code (response) : TSS2_TCTI_RC_MALFORMED_RESPONSE;
+    }
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Give up the session's downstream resources once its lease has run out:
+ * the objects and sessions the client has loaded are saved and flushed
+ * and the connection (or channel) goes, leaving the TPM's slots to those
+ * who need them. The first command after that reconnects and loads them
+ * again, the client's handles are mapped to wherever they land. Only what
+ * the client loaded is touched, whatever else the connection sees may be
+ * another client's. A session that's in use or driving a hash sequence
+ * is left alone: TRY_AGAIN. So is one that has lost track of what it has
+ * loaded: BAD_SEQUENCE. Caller must hold the session lock.
+ */
+TSS2_RC
+TctiSgxSession::suspend ()
+{
+    vector<vector<uint8_t> > contexts;
+    vector<TPM2_HANDLE> handles, sessions;
+    size_t objects, i;
+    TPM2_HANDLE handle;
+    TSS2_RC rc;
+
+    /* a client idle this long isn't coming for the response of its turn */
+    this->turn_release ();
+    if (this->busy () || this->hash_sequence != 0)
+        return TSS2_TCTI_RC_TRY_AGAIN;
+    if (this->tcti_context == NULL)
+        return TSS2_RC_SUCCESS;
+    if (!this->loaded.exact ())
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    rc = this->evict_contexts (true);
+    if (rc == TSS2_RC_SUCCESS)
+        rc = this->flush_session_pool ();
+    if (rc == TSS2_RC_SUCCESS)
+        rc = tpm_get_handles (this->tcti_context,
+                              &this->audit_trail,
+                              TPM2_TRANSIENT_FIRST,
+                              handles);
+    if (rc == TSS2_RC_SUCCESS)
+        rc = tpm_get_handles (this->tcti_context,
+                              &this->audit_trail,
+                              TPM2_LOADED_SESSION_FIRST,
+                              sessions);
+    this->loaded.select (handles);
+    this->loaded.select (sessions);
+    objects = handles.size ();
+    handles.insert (handles.end (), sessions.begin (), sessions.end ());
+    if (rc == TSS2_RC_SUCCESS && !handles.empty ())
+        rc = this->fetch_commands ();
+    if (rc != TSS2_RC_SUCCESS)
+        return rc;
+    /* saving a session unloads it, saving an object doesn't */
+    contexts.resize (handles.size ());
+    for (i = 0; i < handles.size (); ++i) {
+        rc = tpm_context_save (this->tcti_context,
+                               &this->audit_trail,
+                               handles [i],
+                               contexts [i]);
+        if (rc != TSS2_RC_SUCCESS)
+            break;
+    }
+    if (rc != TSS2_RC_SUCCESS) {
+        cout << __func__ << ": failed to save context 0x" << hex
+             << handles [i] << ": 0x" << rc << dec << endl;
+        while (i-- > objects)
+            tpm_context_load (this->tcti_context,
+                              &this->audit_trail,
+                              contexts [i],
+                              &handle);
+        return rc;
+    }
+    for (i = 0; i < objects; ++i)
+        tpm_flush_context (this->tcti_context, &this->audit_trail, handles [i]);
+    this->saved_handles.swap (handles);
+    this->saved_contexts.swap (contexts);
+    this->suspended = true;
+    this->pinned = false;
+    this->hang_up (true);
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Load what suspend saved on the session's new connection. A session
+ * whose contexts won't load has lost what the client had and stays that
+ * way, every command gets NO_CONNECTION.
+ */
+TSS2_RC
+TctiSgxSession::wake ()
+{
+    vector<TPM2_HANDLE> to;
+    TPM2_HANDLE handle;
+    size_t i;
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+
+    for (i = 0; i < this->saved_contexts.size (); ++i) {
+        rc = tpm_context_load (this->tcti_context,
+                               &this->audit_trail,
+                               this->saved_contexts [i],
+                               &handle);
+        if (rc != TSS2_RC_SUCCESS)
+            break;
+        to.push_back (handle);
+    }
+    if (rc == TSS2_RC_SUCCESS && this->locality != 0)
+        rc = Tss2_Tcti_SetLocality (this->tcti_context, this->locality);
+    if (rc != TSS2_RC_SUCCESS) {
+        cout << __func__ << ": failed to restore session " << this->id
+             << ": 0x" << hex << rc << dec << endl;
+        for (i = 0; i < to.size (); ++i)
+            tpm_flush_context (this->tcti_context, &this->audit_trail, to [i]);
+        this->lost = true;
+        this->hang_up (false);
+        return TSS2_TCTI_RC_NO_CONNECTION;
+    }
+    this->handle_map.moved (this->saved_handles, to);
+    this->loaded.moved (this->saved_handles, to);
+    this->pinned = !to.empty ();
+    this->saved_handles.clear ();
+    this->saved_contexts.clear ();
+    this->suspended = false;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Called with what receiving a multiplexed session's command got: 'rc'
+ * and the response. A command that loads something pins the channel to
+ * the session. Once pinned, a command that may have unloaded something
+ * (flushing, saving, completing a sequence or any command with sessions,
+ * which may not continue) has us ask the TPM what's still there, the
+ * channel is free to go when that's nothing. A channel whose state we
+ * can't know stays pinned.
+ */
+void
+TctiSgxSession::channel_settle (TSS2_RC rc,
+                                uint8_t const *response,
+                                size_t size)
+{
+    vector<TPM2_HANDLE> handles;
+
+    if (this->mux == NULL || this->tcti_context == NULL || this->in_flight)
+        return;
+    if (rc != TSS2_RC_SUCCESS || !tpm2_header_valid (response, size)) {
+        this->pinned = true;
+        return;
+    }
+    if (tpm2_header_code (response) != TPM2_RC_SUCCESS) {
+        this->channel_release ();
+        return;
+    }
+    switch (this->sent_code) {
+    case TPM2_CC_CreatePrimary:
+    case TPM2_CC_Load:
+    case TPM2_CC_LoadExternal:
+    case TPM2_CC_CreateLoaded:
+    case TPM2_CC_StartAuthSession:
+    case TPM2_CC_HashSequenceStart:
+    case TPM2_CC_HMAC_Start:
+    case TPM2_CC_ContextLoad:
+        this->pinned = true;
+        break;
+    case TPM2_CC_FlushContext:
+    case TPM2_CC_ContextSave:
+    case TPM2_CC_SequenceComplete:
+    case TPM2_CC_EventSequenceComplete:
+        this->sent_sessions = true;
+        /* fall through */
+    default:
+        if (!this->pinned || !this->sent_sessions)
+            break;
+        rc = tpm_get_handles (this->tcti_context,
+                              &this->audit_trail,
+                              TPM2_TRANSIENT_FIRST,
+                              handles);
+        if (rc == TSS2_RC_SUCCESS)
+            rc = tpm_get_handles (this->tcti_context,
+                                  &this->audit_trail,
+                                  TPM2_LOADED_SESSION_FIRST,
+                                  handles);
+        this->pinned = rc != TSS2_RC_SUCCESS || !handles.empty ();
+    }
+    this->channel_release ();
+}
+/*
+ * Flush every session waiting in the session pool.
+ */
+TSS2_RC
+TctiSgxSession::flush_session_pool ()
+{
+    TPM2_HANDLE handle;
+    TSS2_RC rc;
+
+    while (this->session_pool.evict (&handle)) {
+        rc = this->flush_context (handle);
+        if (rc != TSS2_RC_SUCCESS) {
+            cout << __func__ << ": failed to flush session 0x" << hex
+                << handle << ": 0x" << rc << dec << endl;
+            if ((rc & TSS2_RC_LAYER_MASK) != TSS2_TPM_RC_LAYER)
+                return rc;
+        }
+    }
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Get up to '*size' random bytes from the TPM with a single GetRandom
+ * command. The TPM may return fewer bytes than requested (no more than
+ * the size of its largest digest), '*size' is updated with the number
+ * returned.
+ */
+TSS2_RC
+TctiSgxSession::tpm_get_random (uint8_t *buf,
+                                size_t *size)
+{
+    uint8_t command [TPM2_HEADER_SIZE + sizeof (uint16_t)];
+    uint8_t response [TPM2_MAX_RESPONSE_SIZE];
+    size_t response_size = sizeof (response);
+    uint16_t count;
+    TSS2_RC rc;
+
+    tpm2_header_set (command,
+                     TPM2_ST_NO_SESSIONS,
+                     sizeof (command),
+                     TPM2_CC_GetRandom);
+    tpm2_set_uint16 (&command [TPM2_HEADER_SIZE],
+                     *size > UINT16_MAX ? UINT16_MAX : *size);
+    rc = this->transact (command, sizeof (command), response, &response_size);
+    if (rc != TSS2_RC_SUCCESS)
+        return rc;
+    if (tpm2_header_code (response) != TPM2_RC_SUCCESS)
+        return tpm2_header_code (response);
+    if (response_size < TPM2_HEADER_SIZE + sizeof (uint16_t))
+        return TSS2_TCTI_RC_MALFORMED_RESPONSE;
+    count = tpm2_get_uint16 (&response [TPM2_HEADER_SIZE]);
+    if (count == 0 || count > *size ||
+        response_size != TPM2_HEADER_SIZE + sizeof (uint16_t) + count)
+        return TSS2_TCTI_RC_MALFORMED_RESPONSE;
+    memcpy (buf, &response [TPM2_HEADER_SIZE + sizeof (uint16_t)], count);
+    *size = count;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Background work for an idle session, called by the maintenance thread
+ * with the session locked: start up to 'refill' sessions for the session
+ * pool, preload up to as many objects the context cache expects the
+ * client back for and top up the entropy reserve.
+ */
+void
+TctiSgxSession::maintain (size_t refill)
+{
+    uint8_t response [TPM2_MAX_RESPONSE_SIZE];
+    vector<uint8_t> command;
+    chrono::steady_clock::time_point now = chrono::steady_clock::now ();
+    size_t spec, size, have, preloads = refill;
+    TSS2_RC rc;
+
+    /* a session not connected yet or suspended isn't connected for this */
+    if (this->busy () || this->suspended ||
+        (this->mux == NULL && this->tcti_context == NULL))
+        return;
+    /* a multiplexed session doesn't wait for a channel for this */
+    if (this->entropy.size () < this->entropy_reserve &&
+        this->channel_acquire (&now) != TSS2_RC_SUCCESS)
+        return;
+    while (this->entropy.size () < this->entropy_reserve) {
+        have = this->entropy.size ();
+        size = this->entropy_reserve - have;
+        this->entropy.resize (this->entropy_reserve);
+        rc = this->tpm_get_random (&this->entropy [have], &size);
+        this->entropy.resize (rc == TSS2_RC_SUCCESS ? have + size : have);
+        if (rc != TSS2_RC_SUCCESS) {
+            cout << __func__ << ": failed to get random bytes: 0x" << hex
+                << rc << dec << endl;
+            break;
+        }
+    }
+    this->channel_release ();
+    for (; refill > 0; --refill) {
+        if (!this->session_pool.refill_command (&spec, command))
+            break;
+        size = sizeof (response);
+        rc = this->transact (command.data (), command.size (), response, &size);
+        if (rc != TSS2_RC_SUCCESS ||
+            !this->session_pool.refill_response (spec, response, size))
+        {
+            cout << __func__ << ": failed to start pooled session: 0x" << hex
+                << (rc == TSS2_RC_SUCCESS ? tpm2_header_code (response) : rc)
+                << dec << endl;
+            break;
+        }
+    }
+    for (; preloads > 0; --preloads) {
+        if (!this->ctx_cache.preload_command (command))
+            break;
+        size = sizeof (response);
+        rc = this->transact (command.data (), command.size (), response, &size);
+        if (rc != TSS2_RC_SUCCESS ||
+            !this->ctx_cache.preload_response (command.data (),
+                                               command.size (),
+                                               response,
+                                               size))
+        {
+            cout << __func__ << ": failed to preload context: 0x" << hex
+                << (rc == TSS2_RC_SUCCESS ? tpm2_header_code (response) : rc)
+                << dec << endl;
+            break;
+        }
+    }
+}
+/*
+ * Get the session ready for the enclave taking it over. The enclave
+ * before it may have gone away at any point so whatever it left
+ * outstanding is settled: the response to a command still with the TPM
+ * is collected (and handed to the sessions following it, if any) and
+ * thrown away, and the hash sequence the old enclave was driving is
+ * abandoned. Objects in the context cache and the session pool are kept,
+ * that's the point. Caller must hold the session lock.
+ */
+void
+TctiSgxSession::resume ()
+{
+    uint8_t response [TPM2_MAX_RESPONSE_SIZE];
+    size_t size = sizeof (response);
+    TSS2_RC rc;
+
+    if (this->flight && !this->flight_leader)
+        this->flight.reset ();
+    if (this->in_flight) {
+        rc = this->receive_tpm (&size, response, TSS2_TCTI_TIMEOUT_BLOCK);
+        if (rc != TSS2_RC_SUCCESS) {
+            cout << __func__ << ": failed to collect response: 0x" << hex
+                 << rc << dec << endl;
+            this->landed (false);
+        }
+        this->channel_settle (rc, response, size);
+        if (this->flight && rc == TSS2_RC_SUCCESS &&
+            tpm2_header_valid (response, size))
+        {
+            this->single_flight->complete (this->flight, response, size);
+            this->flight.reset ();
+        }
+    }
+    if (this->flight) {
+        this->single_flight->fail (this->flight);
+        this->flight.reset ();
+    }
+    this->local_pending = false;
+    this->intercept_depth = 0;
+    this->hash_abandon ();
+    this->admit_release ();
+    this->turn_release ();
+}
+/*
+ * Move the session to the downstream connection 'target'. A command the
+ * TPM is working on is seen through first, its response waits for the
+ * client like the ones we answer ourselves. The objects and sessions the
+ * client loaded on the current connection are then saved, loaded on
+ * 'target' and the client's handles for them mapped to where they are
+ * now. Whatever else the connection sees may be another client's and is
+ * left alone. Objects held by the context cache and pooled sessions are
+ * flushed rather than moved, the client doesn't know about them.
+ * On success the session owns 'target' and the old connection is
+ * finalized. On failure what was moved is put back and the caller keeps
+ * 'target'. A session sharing a command with others can't move until
+ * that's settled: TRY_AGAIN. When 'target' isn't 'same_tpm' contexts
+ * can't follow, only a session with nothing loaded can move:
+ * BAD_SEQUENCE. So can't one that has lost track of what it has loaded.
+ * Caller must hold the session lock.
+ */
+TSS2_RC
+TctiSgxSession::migrate (TSS2_TCTI_CONTEXT *target,
+                         bool same_tpm)
+{
+    uint8_t response [TPM2_MAX_RESPONSE_SIZE];
+    vector<vector<uint8_t> > contexts;
+    vector<TPM2_HANDLE> from, to, sessions;
+    size_t objects, size, i;
+    TPM2_HANDLE handle;
+    TSS2_RC rc;
+
+    if (this->flight)
+        return TSS2_TCTI_RC_TRY_AGAIN;
+    /* a suspended session has nothing loaded, it wakes up on 'target' */
+    if (this->tcti_context == NULL) {
+        if (!same_tpm && !this->saved_contexts.empty ())
+            return TSS2_TCTI_RC_BAD_SEQUENCE;
+        this->tcti_context = target;
+        rc = this->suspended ? this->wake () : TSS2_RC_SUCCESS;
+        if (rc != TSS2_RC_SUCCESS)
+            this->tcti_context = NULL;
+        return rc;
+    }
+    if (this->in_flight) {
+        size = sizeof (response);
+        rc = this->receive_tpm (&size, response, TSS2_TCTI_TIMEOUT_BLOCK);
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+        this->local_response.assign (response, response + size);
+        this->local_pending = true;
+        /* what it loaded moves with the rest */
+        this->loaded.response (response, size);
+    }
+    rc = this->evict_contexts (true);
+    if (rc == TSS2_RC_SUCCESS)
+        rc = this->flush_session_pool ();
+    if (rc != TSS2_RC_SUCCESS)
+        return rc;
+    if (!this->loaded.exact ())
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    rc = tpm_get_handles (this->tcti_context,
+                          &this->audit_trail,
+                          TPM2_TRANSIENT_FIRST,
+                          from);
+    if (rc == TSS2_RC_SUCCESS)
+        rc = tpm_get_handles (this->tcti_context,
+                              &this->audit_trail,
+                              TPM2_LOADED_SESSION_FIRST,
+                              sessions);
+    if (rc != TSS2_RC_SUCCESS)
+        return rc;
+    this->loaded.select (from);
+    this->loaded.select (sessions);
+    objects = from.size ();
+    from.insert (from.end (), sessions.begin (), sessions.end ());
+    if (!same_tpm && !from.empty ())
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    if (!from.empty ()) {
+        rc = this->fetch_commands ();
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+    }
+    /*
+     * Saving a session unloads it, saving an object doesn't. Sessions
+     * saved before a failure are loaded again.
+     */
+    contexts.resize (from.size ());
+    for (i = 0; i < from.size (); ++i) {
+        rc = tpm_context_save (this->tcti_context,
+                               &this->audit_trail,
+                               from [i],
+                               contexts [i]);
+        if (rc != TSS2_RC_SUCCESS)
+            break;
+    }
+    if (rc != TSS2_RC_SUCCESS) {
+        cout << __func__ << ": failed to save context 0x" << hex << from [i]
+             << ": 0x" << rc << dec << endl;
+        while (i-- > objects)
+            tpm_context_load (this->tcti_context,
+                              &this->audit_trail,
+                              contexts [i],
+                              &handle);
+        return rc;
+    }
+    for (i = 0; i < from.size (); ++i) {
+        rc = tpm_context_load (target,
+                               &this->audit_trail,
+                               contexts [i],
+                               &handle);
+        if (rc != TSS2_RC_SUCCESS)
+            break;
+        to.push_back (handle);
+    }
+    if (rc != TSS2_RC_SUCCESS) {
+        cout << __func__ << ": failed to load context 0x" << hex << from [i]
+             << ": 0x" << rc << dec << endl;
+        for (i = 0; i < from.size (); ++i) {
+            if (i < objects) {
+                if (i < to.size ())
+                    tpm_flush_context (target, &this->audit_trail, to [i]);
+                continue;
+            }
+            if (i < to.size ())
+                tpm_context_save (target,
+                                  &this->audit_trail,
+                                  to [i],
+                                  contexts [i]);
+            tpm_context_load (this->tcti_context,
+                              &this->audit_trail,
+                              contexts [i],
+                              &handle);
+        }
+        return rc;
+    }
+    for (i = 0; i < objects; ++i)
+        tpm_flush_context (this->tcti_context, &this->audit_trail, from [i]);
+    Tss2_Tcti_Finalize (this->tcti_context);
+    free (this->tcti_context);
+    this->tcti_context = target;
+    /* everything that knows a handle on the old connection */
+    this->handle_map.moved (from, to);
+    this->ctx_cache.moved (from, to);
+    this->loaded.moved (from, to);
+    for (i = 0; i < from.size (); ++i) {
+        if (this->hash_sequence != 0 && this->hash_sequence == from [i]) {
+            this->hash_sequence = to [i];
+            break;
+        }
+    }
+    if (this->local_pending &&
+        this->handle_map.response_handle (this->handle_map.last ()) &&
+        tpm2_header_valid (this->local_response.data (),
+                           this->local_response.size ()) &&
+        tpm2_header_code (this->local_response.data ()) == TPM2_RC_SUCCESS &&
+        this->local_response.size () >= TPM2_HEADER_SIZE + 4)
+    {
+        handle = tpm2_get_uint32 (&this->local_response [TPM2_HEADER_SIZE]);
+        for (i = 0; i < from.size (); ++i) {
+            if (handle == from [i]) {
+                tpm2_set_uint32 (&this->local_response [TPM2_HEADER_SIZE],
+                                 to [i]);
+                break;
+            }
+        }
+    }
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Move the session to 'target', a connection to 'backend'. Saved contexts
+ * can only be loaded on the TPM that saved them so a session can only
+ * change backends with nothing loaded, suspended or not. A session
+ * without a connection (multiplexed and not holding a channel, or not
+ * connected yet) takes no 'target', it connects to its new backend when
+ * it needs to. Caller must hold the session lock.
+ */
+TSS2_RC
+TctiSgxSession::rehome (unsigned backend,
+                        TSS2_TCTI_CONTEXT *target,
+                        TctiSgxSessionConfig const &config)
+{
+    TSS2_RC rc;
+
+    if (target != NULL) {
+        rc = this->migrate (target, false);
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+    } else if (this->tcti_context != NULL || !this->saved_contexts.empty ()) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+    /* a drained command's turn was on the old backend's TPM */
+    this->turn_release ();
+    if (this->backends != NULL) {
+        this->backends->detach (this->backend, this->tag);
+        this->backends->attach (backend, this->tag);
+    }
+    this->bind (backend, config);
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Give back the place the command outstanding took with admission
+ * control, if it has one.
+ */
+void
+TctiSgxSession::admit_release ()
+{
+    if (!this->admitted)
+        return;
+    this->admission->release (this->admitted_tag, this->admitted_size);
+    this->admitted = false;
+}
+/*
+ * Give the TPM back to the scheduler, if the command in flight has it.
+ */
+void
+TctiSgxSession::turn_release ()
+{
+    if (this->turn == 0)
+        return;
+    this->scheduler->release (this->turn);
+    this->turn = 0;
+}
+bool
+TctiSgxSession::expired () const
+{
+    return this->deadline_set &&
+        chrono::steady_clock::now () >= this->deadline;
+}
+/*
+ * Milliseconds left until the deadline, 0 once it has passed.
+ */
+int32_t
+TctiSgxSession::remaining_ms () const
+{
+    int64_t left;
+
+    left = chrono::duration_cast<chrono::milliseconds> (
+        this->deadline - chrono::steady_clock::now ()).count ();
+    if (left < 0)
+        return 0;
+    return left > INT32_MAX ? INT32_MAX : (int32_t)left;
+}
+/*
+ * Answer a command whose deadline passed before it could be sent the way
+ * the TPM answers a command that was cancelled.
+ */
+TSS2_RC
+TctiSgxSession::expire ()
+{
+    cout << __func__ << ": session 0x" << hex << this->id << dec
+         << " command expired before it was sent" << endl;
+    this->local_response.resize (TPM2_HEADER_SIZE);
+    tpm2_header_set (this->local_response.data (),
+                     TPM2_ST_NO_SESSIONS,
+                     TPM2_HEADER_SIZE,
+                     TPM2_RC_CANCELED);
+    this->local_pending = true;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Admit the commands a helper ocall is about to send to the TPM on the
+ * client's behalf, 'code' carrying 'size' bytes of the client's data, the
+ * way transmit admits the client's own: admission control, the quota,
+ * then a channel and a turn with the TPM. There's no deadline from the
+ * client so with the cost table enforced the command's timeout is used
+ * for one. TRY_AGAIN with nothing held if the command is turned away,
+ * otherwise release_tpm gives it all back once the helper is done.
+ */
+TSS2_RC
+TctiSgxSession::admit_tpm (TPM2_CC code, size_t size)
+{
+    uint64_t cost_us;
+    int32_t timeout;
+    TSS2_RC rc;
+
+    this->admit_release ();
+    this->turn_release ();
+    this->deadline_set = false;
+    if (this->cost_table != NULL && this->cost_table->enforced ()) {
+        timeout = this->cost_table->timeout (code);
+        this->deadline_set = timeout != TSS2_TCTI_TIMEOUT_BLOCK;
+        if (this->deadline_set)
+            this->deadline = chrono::steady_clock::now () +
+                chrono::milliseconds (timeout);
+    }
+    size += TPM2_HEADER_SIZE;
+    if (this->admission != NULL) {
+        if (!this->admission->admit (this->tag, size, &this->queue_depth))
+            return TSS2_TCTI_RC_TRY_AGAIN;
+        this->admitted = true;
+        this->admitted_tag = this->tag;
+        this->admitted_size = size;
+    }
+    cost_us = this->cost_table != NULL ?
+        this->cost_table->expected_us (code) : 0;
+    if (this->quota != NULL &&
+        !this->quota->take (this->tag, cost_us / 1000.0, this->quota_bucket))
+    {
+        this->release_tpm ();
+        return TSS2_TCTI_RC_TRY_AGAIN;
+    }
+    rc = this->channel_acquire (this->deadline_set ? &this->deadline : NULL);
+    if (rc != TSS2_RC_SUCCESS) {
+        this->release_tpm ();
+        return rc;
+    }
+    if (this->scheduler != NULL &&
+        !this->scheduler->acquire (
+            this->scheduler->priority_of (code, this->priority),
+            cost_us,
+            this->deadline_set ? &this->deadline : NULL,
+            &this->turn))
+    {
+        this->release_tpm ();
+        return TSS2_TCTI_RC_TRY_AGAIN;
+    }
+    return TSS2_RC_SUCCESS;
+}
+void
+TctiSgxSession::release_tpm ()
+{
+    this->turn_release ();
+    this->channel_release ();
+    this->admit_release ();
+    this->deadline_set = false;
+}
+
+/*
+ * Admit the command and send it. A command that doesn't fit under the
+ * admission limits or is over quota fails with TRY_AGAIN before anything
+ * else is done with it, the client can send it again later. It holds its
+ * place until its response is collected. Quotas are checked last so a
+ * command turned away isn't charged to them.
+ * A 'deadline_ms' other than 0 is how long the client is willing to wait
+ * for the response. A command still waiting for the TPM when that runs
+ * out is answered with TPM2_RC_CANCELED without being sent, one the TPM
+ * is still working on is cancelled.
+ */
+TSS2_RC
+TctiSgxSession::transmit (size_t size,
+                          uint8_t const *command,
+                          uint32_t deadline_ms)
+{
+    double cost_ms = 0;
+    TSS2_RC rc;
+
+    this->admit_release ();
+    this->turn_release ();
+    this->deadline_set = deadline_ms != 0;
+    if (this->deadline_set)
+        this->deadline = chrono::steady_clock::now () +
+            chrono::milliseconds (deadline_ms);
+    if (this->admission != NULL) {
+        if (!this->admission->admit (this->tag, size, &this->queue_depth))
+            return TSS2_TCTI_RC_TRY_AGAIN;
+        this->admitted = true;
+        this->admitted_tag = this->tag;
+        this->admitted_size = size;
+    }
+    if (this->quota != NULL) {
+        if (this->cost_table != NULL && size >= TPM2_HEADER_SIZE)
+            cost_ms = this->cost_table->expected_us (
+                tpm2_header_code (command),
+                TctiSgxCostTable::variant (command, size)) / 1000.0;
+        if (!this->quota->take (this->tag, cost_ms, this->quota_bucket)) {
+            this->admit_release ();
+            return TSS2_TCTI_RC_TRY_AGAIN;
+        }
+    }
+    /* what a suspended session had loaded must be back before mapping */
+    if (this->suspended || this->lost) {
+        rc = this->channel_acquire (this->deadline_set ?
+                                    &this->deadline : NULL);
+        if (rc != TSS2_RC_SUCCESS) {
+            this->admit_release ();
+            return rc;
+        }
+    }
+    command = this->handle_map.command (command, size);
+    rc = this->send (size, command);
+    if (rc != TSS2_RC_SUCCESS)
+        this->admit_release ();
+    return rc;
+}
+/*
+ * Note what the command going to the TPM loads and unloads. Which of the
+ * sessions it uses it ends depends on how many handles it has, we ask the
+ * TPM once the client has a session that could be one of them.
+ */
+void
+TctiSgxSession::track (size_t size, uint8_t const *command)
+{
+    if (this->tcti_context != NULL && this->loaded.has_sessions () &&
+        tpm2_header_valid (command, size) &&
+        tpm2_header_tag (command) == TPM2_ST_SESSIONS)
+        this->fetch_commands ();
+    this->loaded.command (command,
+                          size,
+                          size >= TPM2_HEADER_SIZE ?
+                              this->handle_map.command_handles (
+                                  tpm2_header_code (command)) :
+                              -1);
+}
+TSS2_RC
+TctiSgxSession::send (size_t size, uint8_t const *command)
+{
+    uint8_t response [TPM2_MAX_RESPONSE_SIZE];
+    size_t response_size;
+    bool answered;
+    TSS2_RC rc;
+
+    this->audit_trail.record (AUDIT_TYPE_COMMAND,
+                              size >= TPM2_HEADER_SIZE ?
+                                  tpm2_header_code (command) : 0,
+                              command,
+                              size);
+    if (this->flight) {
+        if (this->flight_leader)
+            this->single_flight->fail (this->flight);
+        this->flight.reset ();
+    }
+    this->intercept_depth = 0;
+    if (this->interceptors.wants (command, size)) {
+        if (size > TPM2_MAX_COMMAND_SIZE)
+            return TSS2_TCTI_RC_BAD_VALUE;
+        this->intercept_code = tpm2_header_code (command);
+        this->intercept_command.resize (TPM2_MAX_COMMAND_SIZE);
+        memcpy (this->intercept_command.data (), command, size);
+        this->intercept_depth =
+            this->interceptors.command (this->id,
+                                        this->intercept_command.data (),
+                                        &size,
+                                        response,
+                                        &response_size,
+                                        &answered);
+        this->intercept_command_size = size;
+        command = this->intercept_command.data ();
+        if (answered) {
+            this->local_response.assign (response, response + response_size);
+            this->local_pending = true;
+            this->loaded.cancel ();
+            return TSS2_RC_SUCCESS;
+        }
+    }
+    this->track (size, command);
+    this->local_pending =
+        this->ctx_cache.command (command, size, this->local_response) ||
+        this->session_pool.command (command, size, this->local_response) ||
+        (this->key_pool != NULL &&
+         this->key_pool->command (command, size, this->local_response)) ||
+        (this->warm_cache != NULL &&
+         this->warm_cache->command (command, size, this->local_response)) ||
+        (this->rsp_cache != NULL &&
+         this->rsp_cache->command (command,
+                                   size,
+                                   this->local_response,
+                                   &this->rsp_cache_generation));
+    rc = this->evict_contexts (false);
+    if (rc != TSS2_RC_SUCCESS || this->local_pending)
+        return rc;
+    if (this->ctx_cache.enabled () || this->session_pool.enabled () ||
+        (this->rsp_cache != NULL && this->rsp_cache->enabled ()) ||
+        (this->single_flight != NULL && this->single_flight->enabled ()) ||
+        (this->warm_cache != NULL && this->warm_cache->enabled ()))
+        this->command.assign (command, command + size);
+    if (this->single_flight != NULL)
+        this->flight = this->single_flight->join (command,
+                                                  size,
+                                                  &this->flight_leader);
+    /* another session is already sending this command */
+    if (this->flight && !this->flight_leader)
+        return TSS2_RC_SUCCESS;
+    rc = this->transmit_tpm (size, command);
+    if (rc != TSS2_RC_SUCCESS && this->flight) {
+        this->single_flight->fail (this->flight);
+        this->flight.reset ();
+    }
+    if (rc == TSS2_TCTI_RC_TRY_AGAIN && this->expired ())
+        rc = this->expire ();
+    return rc;
+}
+/*
+ * Send a command downstream, noting what was sent and when for the cost
+ * table. A multiplexed session takes a channel first. With the scheduler
+ * on the command then waits for its turn with the TPM and keeps it until
+ * its response has been read, a command that waits too long or past its
+ * deadline fails with TRY_AGAIN. The channel comes before the turn so the
+ * session holding the TPM never waits for a channel.
+ */
+TSS2_RC
+TctiSgxSession::transmit_tpm (size_t size, uint8_t const *command)
+{
+    TPM2_CC code = size >= TPM2_HEADER_SIZE ? tpm2_header_code (command) : 0;
+    uint32_t variant = TctiSgxCostTable::variant (command, size);
+    TSS2_RC rc;
+
+    rc = this->channel_acquire (this->deadline_set ? &this->deadline : NULL);
+    if (rc != TSS2_RC_SUCCESS)
+        return rc;
+    if (this->scheduler != NULL && this->turn == 0 &&
+        !this->scheduler->acquire (
+            this->scheduler->priority_of (code, this->priority),
+            this->cost_table != NULL ?
+                this->cost_table->expected_us (code, variant) : 0,
+            this->deadline_set ? &this->deadline : NULL,
+            &this->turn))
+    {
+        this->channel_release ();
+        return TSS2_TCTI_RC_TRY_AGAIN;
+    }
+    rc = Tss2_Tcti_Transmit (this->tcti_context, size, command);
+    if (rc != TSS2_RC_SUCCESS) {
+        this->turn_release ();
+        this->channel_release ();
+        return rc;
+    }
+    this->in_flight = true;
+    this->sent_sessions = size >= TPM2_HEADER_SIZE &&
+        tpm2_header_tag (command) == TPM2_ST_SESSIONS;
+    this->sent_code = code;
+    this->sent_variant = variant;
+    this->sent_at = chrono::steady_clock::now ();
+    if (this->backends != NULL)
+        this->backends->sent (this->backend);
+    return rc;
+}
+/*
+ * The command in flight is done with, 'answered' if it got a response.
+ */
+void
+TctiSgxSession::landed (bool answered)
+{
+    if (this->in_flight && this->backends != NULL)
+        this->backends->received (this->backend,
+            chrono::duration_cast<chrono::microseconds> (
+                chrono::steady_clock::now () - this->sent_at).count (),
+            answered);
+    this->in_flight = false;
+}
+/*
+ * Receive from the downstream TCTI waiting no longer than 'timeout'. Not
+ * every TCTI can do that, mssim 2.x rejects anything but
+ * TSS2_TCTI_TIMEOUT_BLOCK: with those we block.
+ */
+TSS2_RC
+TctiSgxSession::receive_wait (size_t *size, uint8_t *response, int32_t timeout)
+{
+    size_t capacity = *size;
+    TSS2_RC rc;
+
+    rc = Tss2_Tcti_Receive (this->tcti_context, size, response, timeout);
+    if (rc == TSS2_TCTI_RC_BAD_VALUE && timeout != TSS2_TCTI_TIMEOUT_BLOCK) {
+        *size = capacity;
+        rc = Tss2_Tcti_Receive (this->tcti_context,
+                                size,
+                                response,
+                                TSS2_TCTI_TIMEOUT_BLOCK);
+    }
+    return rc;
+}
+/*
+ * Receive from the downstream TCTI. When the client is willing to block
+ * we wait no longer than the command's deadline or, if the cost table is
+ * enforced, its timeout for the command, whichever comes first. If the
+ * TPM hasn't answered by then we cancel the command and wait for whatever
+ * the TPM makes of that: a response to the command if it was too far
+ * along, otherwise TPM2_RC_CANCELED. Latencies of commands that ran to
+ * completion go back into the table. They're measured from transmit to
+ * receive so they're an upper bound when the client polls.
+ */
+TSS2_RC
+TctiSgxSession::receive_downstream (size_t *size,
+                                    uint8_t *response,
+                                    int32_t timeout)
+{
+    size_t capacity = *size;
+    bool timed_out = false, late = false, enforce;
+    int32_t wait;
+    TSS2_RC rc;
+
+    if (this->cost_table == NULL && !this->deadline_set)
+        return this->receive_wait (size, response, timeout);
+    enforce = this->cost_table != NULL && this->cost_table->enforced ();
+    if (timeout == TSS2_TCTI_TIMEOUT_BLOCK &&
+        (enforce || this->deadline_set))
+    {
+        wait = enforce ?
+            this->cost_table->timeout (this->sent_code) :
+            TSS2_TCTI_TIMEOUT_BLOCK;
+        if (this->deadline_set &&
+            (wait == TSS2_TCTI_TIMEOUT_BLOCK || this->remaining_ms () < wait))
+        {
+            wait = this->remaining_ms ();
+            late = true;
+        }
+        rc = this->receive_wait (size, response, wait);
+        if (rc == TSS2_TCTI_RC_TRY_AGAIN) {
+            cout << __func__ << ": command 0x" << hex << this->sent_code
+                 << dec << (late ? " missed its deadline" : " timed out")
+                 << ", canceling" << endl;
+            if (!late)
+                this->cost_table->timed_out (this->sent_code);
+            timed_out = true;
+            rc = Tss2_Tcti_Cancel (this->tcti_context);
+            if (rc != TSS2_RC_SUCCESS)
+                cout << __func__ << ": cancel failed: 0x" << hex << rc
+                     << dec << endl;
+            *size = capacity;
+            rc = Tss2_Tcti_Receive (this->tcti_context,
+                                    size,
+                                    response,
+                                    TSS2_TCTI_TIMEOUT_BLOCK);
+        }
+    } else {
+        rc = this->receive_wait (size, response, timeout);
+    }
+    if (rc == TSS2_RC_SUCCESS && !timed_out && this->cost_table != NULL &&
+        tpm2_header_valid (response, *size) &&
+        tpm2_header_code (response) != TPM2_RC_CANCELED)
+    {
+        this->cost_table->record (this->sent_code,
+            chrono::duration_cast<chrono::microseconds> (
+                chrono::steady_clock::now () - this->sent_at).count (),
+            this->sent_variant);
+    }
+    return rc;
+}
+/*
+ * Get the response to the command in flight from the TPM.
+ */
+TSS2_RC
+TctiSgxSession::receive_tpm (size_t *size, uint8_t *response, int32_t timeout)
+{
+    size_t capacity = *size;
+    TSS2_RC rc;
+
+    /* a session without a connection or channel has nothing outstanding */
+    if (this->tcti_context == NULL)
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    rc = this->receive_downstream (size, response, timeout);
+    if (rc == TSS2_TCTI_RC_TRY_AGAIN)
+        return rc;
+    this->landed (rc == TSS2_RC_SUCCESS);
+    if (rc != TSS2_RC_SUCCESS || this->command.empty () ||
+        !tpm2_header_valid (response, *size))
+    {
+        this->turn_release ();
+        return rc;
+    }
+    /*
+     * The TPM has run out of room for objects or sessions. Make room by
+     * flushing the ones we've been holding on to for our client and try
+     * again.
+     */
+    if ((tpm2_header_code (response) == TPM2_RC_OBJECT_MEMORY &&
+         this->ctx_cache.idle_count () > 0) ||
+        (tpm2_header_code (response) == TPM2_RC_SESSION_MEMORY &&
+         this->session_pool.available () > 0))
+    {
+        if (tpm2_header_code (response) == TPM2_RC_OBJECT_MEMORY)
+            rc = this->evict_contexts (true);
+        else
+            rc = this->flush_session_pool ();
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+        /* the response to the client's command is logged as usual */
+        this->audit_trail.record (AUDIT_TYPE_MGR_COMMAND,
+                                  tpm2_header_code (this->command.data ()),
+                                  this->command.data (),
+                                  this->command.size ());
+        rc = this->transmit_tpm (this->command.size (),
+                                 this->command.data ());
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+        *size = capacity;
+        rc = this->receive_downstream (size, response, timeout);
+        this->landed (rc == TSS2_RC_SUCCESS);
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+    }
+    /* the response is read, whoever is next can have the TPM */
+    this->turn_release ();
+    this->ctx_cache.response (this->command.data (),
+                              this->command.size (),
+                              response,
+                              *size);
+    if (this->rsp_cache != NULL)
+        this->rsp_cache->response (this->command.data (),
+                                   this->command.size (),
+                                   response,
+                                   *size,
+                                   this->rsp_cache_generation);
+    if (this->warm_cache != NULL)
+        this->warm_cache->response (this->command.data (),
+                                    this->command.size (),
+                                    response,
+                                    *size);
+    return rc;
+}
+TSS2_RC
+TctiSgxSession::receive (size_t *size, uint8_t *response, int32_t timeout)
+{
+    size_t capacity = *size;
+    bool sent;
+    int waited;
+    TSS2_RC rc;
+
+    /*
+     * Following another session's command: take a copy of its response
+     * or, if it doesn't get one, send the command ourselves. A client
+     * that won't wait that long is told to come back.
+     */
+    if (this->flight && !this->flight_leader) {
+        waited = this->single_flight->wait (this->flight, timeout,
+                                            this->local_response);
+        if (waited < 0)
+            return TSS2_TCTI_RC_TRY_AGAIN;
+        if (waited > 0) {
+            this->local_pending = true;
+        } else {
+            rc = this->transmit_tpm (this->command.size (),
+                                     this->command.data ());
+            if (rc == TSS2_TCTI_RC_TRY_AGAIN && this->expired ()) {
+                this->expire ();
+            } else if (rc != TSS2_RC_SUCCESS) {
+                this->flight.reset ();
+                this->admit_release ();
+                /* TRY_AGAIN here would read as no response yet */
+                return rc == TSS2_TCTI_RC_TRY_AGAIN ?
+                    TSS2_TCTI_RC_IO_ERROR : rc;
+            }
+        }
+        this->flight.reset ();
+    }
+    if (this->local_pending) {
+        if (*size < this->local_response.size ())
+            return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+        memcpy (response,
+                this->local_response.data (),
+                this->local_response.size ());
+        *size = this->local_response.size ();
+        this->local_pending = false;
+        rc = TSS2_RC_SUCCESS;
+    } else {
+        sent = this->in_flight;
+        rc = this->receive_tpm (size, response, timeout);
+        if (rc == TSS2_TCTI_RC_TRY_AGAIN)
+            return rc;
+        if (sent)
+            this->channel_settle (rc, response, *size);
+        if (this->flight) {
+            if (rc == TSS2_RC_SUCCESS && tpm2_header_valid (response, *size))
+                this->single_flight->complete (this->flight, response, *size);
+            else
+                this->single_flight->fail (this->flight);
+            this->flight.reset ();
+        }
+    }
+    if (rc == TSS2_RC_SUCCESS)
+        this->loaded.response (response, *size);
+    if (rc == TSS2_RC_SUCCESS && this->intercept_depth > 0)
+        this->interceptors.response (this->id,
+                                     this->intercept_code,
+                                     this->intercept_depth,
+                                     this->intercept_command.data (),
+                                     this->intercept_command_size,
+                                     response,
+                                     size,
+                                     capacity);
+    this->intercept_depth = 0;
+    if (rc == TSS2_RC_SUCCESS)
+        this->handle_map.response (response, *size);
+    this->admit_release ();
+    this->turn_release ();
+    if (rc == TSS2_RC_SUCCESS)
+        this->audit_trail.record (AUDIT_TYPE_RESPONSE,
+                                  tpm2_header_valid (response, *size) ?
+                                      tpm2_header_code (response) : 0,
+                                  response,
+                                  *size);
+    else
+        this->audit_trail.record (AUDIT_TYPE_RESPONSE, rc, NULL, 0);
+    return rc;
+}
+TSS2_RC
+TctiSgxSession::cancel ()
+{
+    bool leader = this->flight_leader;
+
+    if (this->flight) {
+        if (leader)
+            this->single_flight->fail (this->flight);
+        this->flight.reset ();
+        /* a follower has nothing outstanding with the TPM */
+        if (!leader)
+            return TSS2_RC_SUCCESS;
+    }
+    /* a multiplexed session without a channel has nothing to cancel */
+    if (this->tcti_context == NULL)
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    return Tss2_Tcti_Cancel (this->tcti_context);
+}
+/*
+ * Locality is the connection's, a multiplexed session keeps its channel
+ * for as long as it's not 0.
+ */
+TSS2_RC
+TctiSgxSession::set_locality (uint8_t locality)
+{
+    TSS2_RC rc;
+
+    rc = this->channel_acquire (NULL);
+    if (rc != TSS2_RC_SUCCESS)
+        return rc;
+    rc = Tss2_Tcti_SetLocality (this->tcti_context, locality);
+    if (rc == TSS2_RC_SUCCESS)
+        this->locality = locality;
+    this->channel_release ();
+    return rc;
+}
+/*
+ * Set the tag of the enclave the session belongs to for admission
+ * control and backend placement. 0 is no enclave in particular.
+ */
+TSS2_RC
+TctiSgxSession::set_tag (uint64_t tag)
+{
+    if (this->backends != NULL && tag != this->tag) {
+        this->backends->detach (this->backend, this->tag);
+        this->backends->attach (this->backend, tag);
+    }
+    this->tag = tag;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Set the session's priority class for the scheduler.
+ */
+TSS2_RC
+TctiSgxSession::set_priority (uint32_t priority)
+{
+    if (priority >= TCTI_SGX_PRIORITY_CLASSES)
+        return TSS2_TCTI_RC_BAD_VALUE;
+    this->priority = priority;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Get the number of commands that were outstanding in the scope that
+ * turned away the last command this session sent.
+ */
+TSS2_RC
+TctiSgxSession::get_queue_depth (uint32_t *depth)
+{
+    *depth = this->queue_depth;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Set or, when 'quota' is NULL, remove this session's own quota.
+ */
+void
+TctiSgxSession::set_quota (tcti_sgx_quota_t const *quota)
+{
+    this->quota_bucket.configure (quota, chrono::steady_clock::now ());
+}
+/*
+ * Returns 0 on success, -1 if the session has no quota of its own.
+ */
+int
+TctiSgxSession::get_quota_stats (tcti_sgx_quota_stats_t *stats)
+{
+    if (!this->quota_bucket.enabled)
+        return -1;
+    this->quota_bucket.get_stats (stats);
+    return 0;
+}
+/*
+ * Fill 'buf' with 'size' random bytes, first from the entropy reserve and
+ * then with as many GetRandom commands as it takes. Bytes taken from the
+ * reserve are wiped. Only going to the TPM needs admitting.
+ */
+TSS2_RC
+TctiSgxSession::get_random (size_t size,
+                            uint8_t *buf)
+{
+    size_t count;
+    TSS2_RC rc;
+
+    if (this->busy ())
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    count = min (size, this->entropy.size ());
+    if (count > 0) {
+        memcpy (buf, &this->entropy [this->entropy.size () - count], count);
+        memset (&this->entropy [this->entropy.size () - count], 0, count);
+        this->entropy.resize (this->entropy.size () - count);
+        buf += count;
+        size -= count;
+    }
+    if (size == 0)
+        return TSS2_RC_SUCCESS;
+    rc = this->admit_tpm (TPM2_CC_GetRandom, 0);
+    while (rc == TSS2_RC_SUCCESS && size > 0) {
+        count = size;
+        rc = this->tpm_get_random (buf, &count);
+        if (rc != TSS2_RC_SUCCESS)
+            break;
+        buf += count;
+        size -= count;
+    }
+    this->release_tpm ();
+    return rc;
+}
+
+/*
+ * Build a command for 'handle' authorized with a password session with
+ * an empty password followed by 'params'.
+ */
+static void
+build_pw_command (TPM2_CC code,
+                  TPM2_HANDLE handle,
+                  uint8_t const *params,
+                  size_t params_size,
+                  vector<uint8_t> &command)
+{
+    /* sessionHandle | nonceCaller | sessionAttributes | hmac */
+    size_t offset = TPM2_HEADER_SIZE + 4 + 4 + 4 + 2 + 1 + 2;
+
+    command.assign (offset + params_size, 0);
+    tpm2_header_set (command.data (), TPM2_ST_SESSIONS, command.size (), code);
+    tpm2_set_uint32 (&command [TPM2_HEADER_SIZE], handle);
+    tpm2_set_uint32 (&command [TPM2_HEADER_SIZE + 4], 9);
+    tpm2_set_uint32 (&command [TPM2_HEADER_SIZE + 8], TPM2_RS_PW);
+    if (params_size > 0)
+        memcpy (&command [offset], params, params_size);
+}
+/*
+ * Flush the hash sequence, if there is one, and forget about it.
+ */
+void
+TctiSgxSession::hash_abandon ()
+{
+    TSS2_RC rc;
+
+    if (this->hash_sequence != 0) {
+        rc = this->flush_context (this->hash_sequence);
+        if (rc != TSS2_RC_SUCCESS)
+            cout << __func__ << ": failed to flush hash sequence 0x" << hex
+                << this->hash_sequence << ": 0x" << rc << dec << endl;
+    }
+    this->hash_alg = TPM2_ALG_NULL;
+    this->hash_sequence = 0;
+    this->hash_data.clear ();
+}
+/*
+ * Add 'data' to the hash sequence. Whole chunks of TPM2_MAX_DIGEST_BUFFER
+ * bytes are sent to the TPM with SequenceUpdate as long as there's more
+ * data behind them: the last chunk is kept for SequenceComplete (or Hash
+ * if it's the only one). The sequence is started with the first update.
+ */
+TSS2_RC
+TctiSgxSession::hash_feed (uint8_t const *data,
+                           size_t size)
+{
+    uint8_t response [TPM2_MAX_RESPONSE_SIZE];
+    uint8_t params [2 + TPM2_MAX_DIGEST_BUFFER];
+    vector<uint8_t> command;
+    size_t count, response_size;
+    TSS2_RC rc;
+
+    while (this->hash_data.size () + size > TPM2_MAX_DIGEST_BUFFER) {
+        count = TPM2_MAX_DIGEST_BUFFER - this->hash_data.size ();
+        this->hash_data.insert (this->hash_data.end (), data, data + count);
+        data += count;
+        size -= count;
+        rc = this->channel_acquire (NULL);
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+        if (this->hash_sequence == 0) {
+            /* empty auth and the hash algorithm */
+            uint8_t start [TPM2_HEADER_SIZE + 4];
+
+            tpm2_header_set (start,
+                             TPM2_ST_NO_SESSIONS,
+                             sizeof (start),
+                             TPM2_CC_HashSequenceStart);
+            tpm2_set_uint16 (&start [TPM2_HEADER_SIZE], 0);
+            tpm2_set_uint16 (&start [TPM2_HEADER_SIZE + 2], this->hash_alg);
+            response_size = sizeof (response);
+            rc = this->transact (start, sizeof (start), response, &response_size);
+            if (rc != TSS2_RC_SUCCESS)
+                return rc;
+            if (tpm2_header_code (response) != TPM2_RC_SUCCESS)
+                return tpm2_header_code (response);
+            if (response_size < TPM2_HEADER_SIZE + 4)
+                return TSS2_TCTI_RC_MALFORMED_RESPONSE;
+            this->hash_sequence = tpm2_get_uint32 (&response [TPM2_HEADER_SIZE]);
+        }
+        tpm2_set_uint16 (params, this->hash_data.size ());
+        memcpy (&params [2], this->hash_data.data (), this->hash_data.size ());
+        build_pw_command (TPM2_CC_SequenceUpdate,
+                          this->hash_sequence,
+                          params,
+                          2 + this->hash_data.size (),
+                          command);
+        response_size = sizeof (response);
+        rc = this->transact (command.data (),
+                             command.size (),
+                             response,
+                             &response_size);
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+        if (tpm2_header_code (response) != TPM2_RC_SUCCESS)
+            return tpm2_header_code (response);
+        this->hash_data.clear ();
+    }
+    this->hash_data.insert (this->hash_data.end (), data, data + size);
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Whether the hash ocalls can go on with a sequence for 'hash_alg'.
+ */
+TSS2_RC
+TctiSgxSession::hash_check (TPMI_ALG_HASH hash_alg)
+{
+    if (this->busy ())
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    if (hash_alg == TPM2_ALG_NULL ||
+        (this->hash_alg != TPM2_ALG_NULL && this->hash_alg != hash_alg))
+        return TSS2_TCTI_RC_BAD_VALUE;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Add 'data' to the hash sequence for the hash ocalls, starting one if
+ * there isn't one in progress. Data that still fits in the last chunk is
+ * only kept, anything more has to be admitted before it goes to the TPM:
+ * turned away with TRY_AGAIN the sequence is left as it was so the client
+ * can try again. Once the arguments have been checked, any other failure
+ * abandons the sequence. The enclave side follows the same rule, commands
+ * sent in between don't touch the sequence.
+ */
+TSS2_RC
+TctiSgxSession::hash_update (TPMI_ALG_HASH hash_alg,
+                             uint8_t const *data,
+                             size_t size)
+{
+    TSS2_RC rc;
+
+    rc = this->hash_check (hash_alg);
+    if (rc != TSS2_RC_SUCCESS)
+        return rc;
+    if (this->hash_data.size () + size <= TPM2_MAX_DIGEST_BUFFER) {
+        this->hash_alg = hash_alg;
+        this->hash_data.insert (this->hash_data.end (), data, data + size);
+        return TSS2_RC_SUCCESS;
+    }
+    rc = this->admit_tpm (TPM2_CC_SequenceUpdate, size);
+    if (rc != TSS2_RC_SUCCESS) {
+        if (rc != TSS2_TCTI_RC_TRY_AGAIN)
+            this->hash_abandon ();
+        return rc;
+    }
+    this->hash_alg = hash_alg;
+    rc = this->hash_feed (data, size);
+    if (rc != TSS2_RC_SUCCESS)
+        this->hash_abandon ();
+    this->release_tpm ();
+    return rc;
+}
+/*
+ * Add 'data' to the hash sequence and complete it. A sequence that never
+ * grew beyond a single chunk is hashed with a single TPM2_Hash instead.
+ * The response parameters (the digest followed by the ticket for
+ * 'hierarchy') are copied to 'result'. The commands are admitted as one,
+ * turned away with TRY_AGAIN the sequence is left as it was so the client
+ * can try again. Otherwise, once the arguments have been checked, the
+ * sequence is over when this returns.
+ */
+TSS2_RC
+TctiSgxSession::hash_complete (TPMI_ALG_HASH hash_alg,
+                               TPMI_RH_HIERARCHY hierarchy,
+                               uint8_t const *data,
+                               size_t size,
+                               uint8_t *result,
+                               size_t result_size)
+{
+    uint8_t response [TPM2_MAX_RESPONSE_SIZE];
+    uint8_t params [2 + TPM2_MAX_DIGEST_BUFFER + 2 + 4];
+    size_t params_size, response_size = sizeof (response), offset, length;
+    vector<uint8_t> command;
+    TSS2_RC rc;
+
+    rc = this->hash_check (hash_alg);
+    if (rc != TSS2_RC_SUCCESS)
+        return rc;
+    rc = this->admit_tpm (this->hash_sequence == 0 &&
+                          this->hash_data.size () + size <=
+                              TPM2_MAX_DIGEST_BUFFER ?
+                              TPM2_CC_Hash : TPM2_CC_SequenceComplete,
+                          size);
+    if (rc != TSS2_RC_SUCCESS) {
+        if (rc != TSS2_TCTI_RC_TRY_AGAIN)
+            this->hash_abandon ();
+        return rc;
+    }
+    this->hash_alg = hash_alg;
+    rc = this->hash_feed (data, size);
+    if (rc != TSS2_RC_SUCCESS) {
+        this->hash_abandon ();
+        this->release_tpm ();
+        return rc;
+    }
+    tpm2_set_uint16 (params, this->hash_data.size ());
+    memcpy (&params [2], this->hash_data.data (), this->hash_data.size ());
+    params_size = 2 + this->hash_data.size ();
+    if (this->hash_sequence == 0) {
+        tpm2_set_uint16 (&params [params_size], hash_alg);
+        tpm2_set_uint32 (&params [params_size + 2], hierarchy);
+        params_size += 6;
+        command.assign (TPM2_HEADER_SIZE + params_size, 0);
+        tpm2_header_set (command.data (),
+                         TPM2_ST_NO_SESSIONS,
+                         command.size (),
+                         TPM2_CC_Hash);
+        memcpy (&command [TPM2_HEADER_SIZE], params, params_size);
+        offset = TPM2_HEADER_SIZE;
+    } else {
+        tpm2_set_uint32 (&params [params_size], hierarchy);
+        params_size += 4;
+        build_pw_command (TPM2_CC_SequenceComplete,
+                          this->hash_sequence,
+                          params,
+                          params_size,
+                          command);
+        /* the parameters sit between parameterSize and the auth area */
+        offset = TPM2_HEADER_SIZE + 4;
+    }
+    rc = this->transact (command.data (),
+                         command.size (),
+                         response,
+                         &response_size);
+    if (rc == TSS2_RC_SUCCESS && tpm2_header_code (response) != TPM2_RC_SUCCESS)
+        rc = tpm2_header_code (response);
+    if (rc != TSS2_RC_SUCCESS) {
+        this->hash_abandon ();
+        this->release_tpm ();
+        return rc;
+    }
+    /* SequenceComplete flushes the sequence object */
+    this->hash_sequence = 0;
+    this->hash_abandon ();
+    this->release_tpm ();
+    if (response_size < offset)
+        return TSS2_TCTI_RC_MALFORMED_RESPONSE;
+    length = response_size - offset;
+    if (offset > TPM2_HEADER_SIZE) {
+        length = tpm2_get_uint32 (&response [TPM2_HEADER_SIZE]);
+        if (length > response_size - offset)
+            return TSS2_TCTI_RC_MALFORMED_RESPONSE;
+    }
+    if (length > result_size)
+        return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+    memcpy (result, &response [offset], length);
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * Function to initialize the application / untrusted library. The 'callback'
+ * parameter is a caller provided function used to initialize a TCTI
+ * instance used to communicate with the 'downstream' TPM. This allows for
+ * flexible configuration by the application hosting the enclave.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_init (downstream_tcti_init_cb callback,
+                   void *user_data)
+{
+    if (callback == NULL) {
+        callback = mssim_tcti_init;
+    }
+    TctiSgxMgr::get_instance (callback, user_data);
+    return 0;
+}
+
+/*
+ * Set the number of transient objects each session may keep loaded in the
+ * TPM after its client has flushed them. A size of 0 (the default)
+ * disables the context cache. This only affects sessions created after
+ * the call.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_ctx_cache_size (size_t size)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.lock ();
+    mgr.session_config.ctx_cache_size = size;
+    mgr.unlock ();
+    return 0;
+}
+
+/*
+ * Invoke 'fn' on the session identified by 'id' or, when 'id' is 0, on
+ * every session. Each session is locked while 'fn' runs. This is how the
+ * per-session counters are collected: it's the manager looking, not the
+ * enclave, so the session's lease isn't renewed.
+ */
+template <typename F> static TSS2_RC
+session_foreach (uint64_t id,
+                 F fn)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    list <TctiSgxSession*>::const_iterator itr;
+    TctiSgxSession *session;
+
+    mgr.lock ();
+    if (id != 0) {
+        session = mgr.session_find (id);
+        if (session == NULL || session->parked) {
+            mgr.unlock ();
+            return TSS2_TCTI_RC_BAD_VALUE;
+        }
+        session->lock ();
+        fn (session);
+        session->unlock ();
+        mgr.unlock ();
+        return TSS2_RC_SUCCESS;
+    }
+    for (itr = mgr.sessions.begin (); itr != mgr.sessions.end (); ++itr) {
+        (*itr)->lock ();
+        fn (*itr);
+        (*itr)->unlock ();
+    }
+    mgr.unlock ();
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * Get the context cache counters for the session identified by 'id'. The
+ * counters for all sessions are summed when 'id' is 0.
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_mgr_get_ctx_cache_stats (uint64_t id,
+                                  tcti_sgx_ctx_cache_stats_t *stats)
+{
+    if (stats == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    memset (stats, 0, sizeof (*stats));
+    return session_foreach (id, [stats] (TctiSgxSession *session) {
+        tcti_sgx_ctx_cache_stats_t session_stats;
+
+        session->ctx_cache.get_stats (&session_stats);
+        stats->hits += session_stats.hits;
+        stats->misses += session_stats.misses;
+        stats->evictions += session_stats.evictions;
+        stats->entries += session_stats.entries;
+        stats->preloads += session_stats.preloads;
+    });
+}
+
+/*
+ * Configure the maintenance thread: it wakes up every 'interval_ms' and
+ * does background work (like refilling the session and key pools) when the
+ * TPM is idle. Each pool gets at most 'refill_per_interval' new sessions or
+ * keys per pass. An interval of 0 stops the thread.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_maintenance (uint32_t interval_ms,
+                              size_t refill_per_interval)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    bool start;
+
+    {
+        lock_guard<mutex> guard (mgr.worker_mutex);
+        mgr.maintenance_interval = interval_ms;
+        mgr.refill_per_interval = refill_per_interval;
+    }
+    mgr.lock ();
+    start = !mgr.session_config.session_specs.empty () ||
+        mgr.session_config.entropy_reserve > 0 || mgr.lease_idle_ms != 0 ||
+        mgr.lease_expire_ms != 0;
+    mgr.unlock ();
+    start = start || mgr.key_pool.enabled () || mgr.rsp_cache.enabled () ||
+        mgr.warm_cache.enabled ();
+    if (interval_ms == 0)
+        mgr.worker_stop ();
+    else if (start)
+        mgr.worker_start ();
+    return 0;
+}
+
+/*
+ * Keep a pool of 'depth' pre-started, unbound and unsalted sessions of
+ * 'type' (TPM2_SE_HMAC or TPM2_SE_POLICY) with the given 'auth_hash' and
+ * parameter encryption algorithm 'symmetric' (NULL for none) for each
+ * session. The pools are filled by the maintenance thread. This only
+ * affects sessions created after the call.
+ * Returns 0 on success, -1 if the session parameters aren't supported.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_add_session_pool (TPM2_SE type,
+                               TPM2_ALG_ID auth_hash,
+                               TPMT_SYM_DEF const *symmetric,
+                               size_t depth)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    TctiSgxSessionSpec spec;
+
+    if (!TctiSgxSessionPool::make_spec (type, auth_hash, symmetric, depth, &spec))
+        return -1;
+    mgr.lock ();
+    mgr.session_config.session_specs.push_back (spec);
+    mgr.unlock ();
+    mgr.worker_start ();
+    return 0;
+}
+
+/*
+ * Get the session pool counters for the session identified by 'id'. The
+ * counters for all sessions are summed when 'id' is 0.
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_mgr_get_session_pool_stats (uint64_t id,
+                                     tcti_sgx_session_pool_stats_t *stats)
+{
+    if (stats == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    memset (stats, 0, sizeof (*stats));
+    return session_foreach (id, [stats] (TctiSgxSession *session) {
+        tcti_sgx_session_pool_stats_t session_stats;
+
+        session->session_pool.get_stats (&session_stats);
+        stats->hits += session_stats.hits;
+        stats->misses += session_stats.misses;
+        stats->started += session_stats.started;
+        stats->available += session_stats.available;
+    });
+}
+
+/*
+ * Have the maintenance thread keep 'size' random bytes from the TPM on
+ * hand for each session so that the enclave's entropy pool can be
+ * refilled (tcti_sgx_get_random_ocall) without waiting on the TPM. A size
+ * of 0 (the default) disables this. This only affects sessions created
+ * after the call.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_entropy_reserve (size_t size)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.lock ();
+    mgr.session_config.entropy_reserve = size;
+    mgr.unlock ();
+    if (size > 0)
+        mgr.worker_start ();
+    return 0;
+}
+
+/*
+ * Keep a pool of 'depth' keys created from the template 'in_public' (a
+ * marshalled TPM2B_PUBLIC) under the persistent key 'parent'. The keys
+ * are created by the maintenance thread when the TPM is otherwise idle
+ * using a password session with 'parent_auth' (NULL for an empty
+ * password). A TPM2_Create from a client is answered from the pool only
+ * if it's the same command: same parent, password session and template
+ * with an empty inSensitive, outsideInfo and creationPCR. Keys older than
+ * 'max_age_ms' are discarded, 0 disables the age limit.
+ * Returns 0 on success, -1 if the parameters aren't supported.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_add_key_pool (TPM2_HANDLE parent,
+                           TPM2B_AUTH const *parent_auth,
+                           uint8_t const *in_public,
+                           size_t in_public_size,
+                           size_t depth,
+                           uint32_t max_age_ms)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    TctiSgxKeySpec spec;
+
+    if (!TctiSgxKeyPool::make_spec (parent,
+                                    parent_auth,
+                                    in_public,
+                                    in_public_size,
+                                    depth,
+                                    max_age_ms,
+                                    &spec))
+        return -1;
+    mgr.key_pool.add_spec (spec);
+    mgr.worker_start ();
+    return 0;
+}
+
+/*
+ * Get the key pool counters. There's a single key pool shared by all
+ * sessions.
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_mgr_get_key_pool_stats (tcti_sgx_key_pool_stats_t *stats)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    if (stats == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    mgr.key_pool.get_stats (stats);
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * Cache up to 'size' responses to read-only commands (ReadPublic of
+ * persistent objects, NV_ReadPublic, NV_Read with a password and
+ * PCR_Read) and answer byte-identical commands from any session with
+ * them. Cached responses are dropped when a client sends a command that
+ * changes what they describe. A size of 0 (the default) disables the
+ * cache. Only enable this when the manager's clients are the only ones
+ * changing the NV indices and persistent objects they read: other than
+ * PCR changes, which the maintenance thread looks for, changes made by
+ * other TPM users aren't seen.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_rsp_cache_size (size_t size)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.rsp_cache.set_size (size);
+    if (size > 0)
+        mgr.worker_start ();
+    return 0;
+}
+
+/*
+ * Get the response cache counters. There's a single response cache shared
+ * by all sessions.
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_mgr_get_rsp_cache_stats (tcti_sgx_rsp_cache_stats_t *stats)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    if (stats == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    mgr.rsp_cache.get_stats (stats);
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * Enable or disable deduplication of identical read-only commands that
+ * are in flight at the same time: while one session is waiting on the
+ * TPM for the response to one of the commands the response cache knows
+ * to be read-only, other sessions sending the same command wait for and
+ * get a copy of that response rather than sending the command again.
+ * Disabled by default.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_single_flight (int enable)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.single_flight.set_enabled (enable != 0);
+    return 0;
+}
+
+/*
+ * Get the single flight counters. 'flights' counts commands sent to the
+ * TPM that other sessions could share, 'joined' the commands that were
+ * answered with another session's response rather than sent and
+ * 'fallbacks' the ones that had to be sent after all because the session
+ * they were waiting on didn't get a response.
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_mgr_get_single_flight_stats (tcti_sgx_single_flight_stats_t *stats)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    if (stats == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    mgr.single_flight.get_stats (stats);
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * Keep the TPM metadata clients ask for when they start (fixed
+ * capabilities and the public areas of persistent objects) in the file at
+ * 'path' so that it survives restarts. What's in the file is used to
+ * answer those queries straight away, the maintenance thread checks it
+ * against the TPM in the background and writes the file back when it
+ * changes. A file for a different TPM is discarded. A NULL 'path' (the
+ * default) disables the cache.
+ * Returns 0 on success, -1 if the file exists but can't be read.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_warm_cache (char const *path)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    if (mgr.warm_cache.set_path (path) != 0)
+        return -1;
+    if (path != NULL)
+        mgr.worker_start ();
+    return 0;
+}
+
+/*
+ * Get the warm cache counters. There's a single warm cache shared by all
+ * sessions.
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_mgr_get_warm_cache_stats (tcti_sgx_warm_cache_stats_t *stats)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    if (stats == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    mgr.warm_cache.get_stats (stats);
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * Add 'interceptor' to the end of the chain of interceptors that see the
+ * commands sessions send and their responses. It sees the 'count' command
+ * codes in 'codes', or all commands when 'count' is 0. Interceptors see a
+ * command before the manager's own caches and pools and are called in the
+ * order they were added. This only affects sessions created after the
+ * call.
+ * Returns 0 on success, -1 if the parameters aren't valid.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_add_interceptor (tcti_sgx_interceptor_t const *interceptor,
+                              TPM2_CC const *codes,
+                              size_t count)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    if (interceptor == NULL || (codes == NULL && count > 0) ||
+        (interceptor->command == NULL && interceptor->response == NULL))
+        return -1;
+    mgr.lock ();
+    mgr.session_config.interceptors.add (*interceptor, codes, count);
+    mgr.unlock ();
+    return 0;
+}
+
+/*
+ * Override the duration class of the command with 'code' and the time a
+ * blocking receive waits for its response before the command is
+ * canceled. A 'timeout_ms' of 0 uses the default for the class. Every
+ * command has a class and timeout out of the box: short (20ms), medium
+ * (750ms), long (2s, for commands not known to be any other) or extra
+ * long (5 minutes, for key generation).
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_command_cost (TPM2_CC code,
+                               tcti_sgx_duration_t duration,
+                               uint32_t timeout_ms)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    if (duration > TCTI_SGX_DURATION_EXTRA_LONG ||
+        timeout_ms > INT32_MAX)
+        return -1;
+    return mgr.cost_table.set (code, duration, timeout_ms);
+}
+
+/*
+ * Cancel commands that a blocking receive has waited on for longer than
+ * their timeout in the cost table if 'enable' is non-zero. Off by
+ * default: the table is only used to estimate what commands cost.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_command_timeouts (int enable)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.cost_table.set_enforced (enable != 0);
+    return 0;
+}
+
+/*
+ * Get what the manager expects the command with 'code' to cost, including
+ * the latency learned from the commands sessions have sent.
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_mgr_get_command_cost (TPM2_CC code,
+                               tcti_sgx_command_cost_t *cost)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    if (cost == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    mgr.cost_table.get (code, cost);
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * Log every command sessions send and every response they get to the
+ * file at 'path', appending if it exists. A 'path' of NULL (the default)
+ * turns logging off. The log holds the digests of commands and responses
+ * rather than their bytes and is chained so tampering can be detected,
+ * see tcti-sgx-audit-verify. Records are written and synced by a
+ * background thread, sessions don't wait on the disk. Returns -1 for a
+ * 'path' other than NULL when the audit log wasn't built
+ * (--enable-audit-log).
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_audit_log (char const *path)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    return mgr.audit_log.open (path);
+}
+
+/*
+ * Get the audit log counters.
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_mgr_get_audit_log_stats (tcti_sgx_audit_log_stats_t *stats)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    if (stats == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    mgr.audit_log.get_stats (stats);
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * Keep sessions an enclave parks with Tss2_Tcti_Sgx_Park for 'timeout_ms'
+ * milliseconds (default 60000) waiting for an enclave to resume them.
+ * Parked sessions hold on to a connection and whatever the enclave loaded
+ * into the TPM, those nobody comes back for are finalized like any other.
+ * The new timeout applies to sessions parked from now on.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_park_timeout (uint32_t timeout_ms)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.lock ();
+    mgr.park_timeout = timeout_ms;
+    mgr.unlock ();
+    return 0;
+}
+
+/*
+ * Keep the manager's own threads on one NUMA node and place each
+ * session's buffers on the node it was created from, see
+ * tcti_sgx_placement_t. 'node' only matters for TCTI_SGX_PLACEMENT_NODE.
+ * Returns -1 for an unknown policy or a node without CPUs.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_placement (tcti_sgx_placement_t policy,
+                            unsigned node)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    return mgr.placement.set (policy, node);
+}
+
+/*
+ * Get the counters for NUMA node 'node'. Nodes are numbered from 0, a
+ * host without NUMA is node 0.
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_mgr_get_node_stats (unsigned node,
+                             tcti_sgx_node_stats_t *stats)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    if (stats == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    if (mgr.placement.get_stats (node, stats) != 0)
+        return TSS2_TCTI_RC_BAD_VALUE;
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * Limit the commands that can be outstanding with the TPM at once, for
+ * the manager as a whole or for each enclave (the sessions that set the
+ * same tag with Tss2_Tcti_Sgx_SetTag). 'commands' is the number of
+ * commands and 'bytes' their total size, 0 means no limit. A command that
+ * doesn't fit fails with TSS2_TCTI_RC_TRY_AGAIN, the enclave can find out
+ * how many commands it would have been queued behind with
+ * Tss2_Tcti_Sgx_GetQueueDepth.
+ * Returns -1 for an unknown scope.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_admission_limit (tcti_sgx_scope_t scope,
+                                  uint32_t commands,
+                                  size_t bytes)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    return mgr.admission.set_limit (scope, commands, bytes);
+}
+
+/*
+ * Get the admission control counters.
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_mgr_get_admission_stats (tcti_sgx_admission_stats_t *stats)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    if (stats == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    mgr.admission.get_stats (stats);
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * Rate limit what's sent to the TPM, for the manager as a whole
+ * ('key' is ignored), for an enclave ('key' is the tag it set with
+ * Tss2_Tcti_Sgx_SetTag) or for the session with id 'key'. A command has
+ * to fit in every quota that applies to it, one that doesn't fails with
+ * TSS2_TCTI_RC_TRY_AGAIN. The TPM time a command takes is estimated from
+ * the command cost table. A NULL 'quota' removes the quota.
+ * Returns -1 for an unknown scope, an enclave tag of 0 or an unknown
+ * session.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_quota (tcti_sgx_scope_t scope,
+                        uint64_t key,
+                        tcti_sgx_quota_t const *quota)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    if (scope != TCTI_SGX_SCOPE_SESSION)
+        return mgr.quota.set (scope, key, quota);
+    if (key == 0)
+        return -1;
+    if (session_foreach (key, [quota] (TctiSgxSession *session) {
+            session->set_quota (quota);
+        }) != TSS2_RC_SUCCESS)
+        return -1;
+    return 0;
+}
+
+/*
+ * Get the counters of a quota set with tcti_sgx_mgr_set_quota.
+ * Returns TSS2_TCTI_RC_BAD_VALUE if there's no such quota.
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_mgr_get_quota_stats (tcti_sgx_scope_t scope,
+                              uint64_t key,
+                              tcti_sgx_quota_stats_t *stats)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    int ret = -1;
+
+    if (stats == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    if (scope != TCTI_SGX_SCOPE_SESSION)
+        ret = mgr.quota.get_stats (scope, key, stats);
+    else if (key != 0)
+        session_foreach (key, [stats, &ret] (TctiSgxSession *session) {
+            ret = session->get_quota_stats (stats);
+        });
+    return ret == 0 ? TSS2_RC_SUCCESS : TSS2_TCTI_RC_BAD_VALUE;
+}
+
+/*
+ * Turn the priority scheduler on or off. With it on commands take turns
+ * with the TPM, best priority class first. A command moves up a class
+ * for every 'aging_ms' it has waited (0 for never) so lower classes
+ * aren't starved, and fails with TSS2_TCTI_RC_TRY_AGAIN if it has waited
+ * 'wait_ms'.
+ * Returns -1 if 'wait_ms' is 0.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_scheduler (int enable,
+                            uint32_t aging_ms,
+                            uint32_t wait_ms)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    unsigned i;
+
+    for (i = 0; i < BACKENDS_MAX; ++i)
+        if (mgr.backends.scheduler (i)->set (enable, aging_ms, wait_ms) != 0)
+            return -1;
+    return 0;
+}
+
+/*
+ * Set how the scheduler picks the next command within a priority class:
+ * in the order they arrived or shortest first, by what the command cost
+ * table expects them to cost.
+ * Returns -1 for an unknown policy.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_scheduler_policy (tcti_sgx_sched_policy_t policy)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    unsigned i;
+
+    for (i = 0; i < BACKENDS_MAX; ++i)
+        if (mgr.backends.scheduler (i)->set_policy (policy) != 0)
+            return -1;
+    return 0;
+}
+
+/*
+ * Schedule commands with code 'code' in class 'priority' whichever
+ * session sends them.
+ * Returns -1 for an unknown class.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_command_priority (TPM2_CC code,
+                                   tcti_sgx_priority_t priority)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    unsigned i;
+
+    for (i = 0; i < BACKENDS_MAX; ++i)
+        if (mgr.backends.scheduler (i)->set_command (code, priority) != 0)
+            return -1;
+    return 0;
+}
+
+/*
+ * Set the priority class of the session identified by 'id', overriding
+ * whatever the enclave set with Tss2_Tcti_Sgx_SetPriority. Sessions start
+ * out in TCTI_SGX_PRIORITY_NORMAL.
+ * Returns -1 for an unknown class or session.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_session_priority (uint64_t id,
+                                   tcti_sgx_priority_t priority)
+{
+    TSS2_RC rc = TSS2_TCTI_RC_BAD_VALUE;
+
+    if (id == 0)
+        return -1;
+    if (session_foreach (id, [priority, &rc] (TctiSgxSession *session) {
+            rc = session->set_priority (priority);
+        }) != TSS2_RC_SUCCESS || rc != TSS2_RC_SUCCESS)
+        return -1;
+    return 0;
+}
+
+/*
+ * Get the counters for class 'priority', summed over the schedulers of
+ * all backends.
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_mgr_get_priority_stats (tcti_sgx_priority_t priority,
+                                 tcti_sgx_priority_stats_t *stats)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    tcti_sgx_priority_stats_t backend;
+    unsigned i;
+
+    if (stats == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    memset (stats, 0, sizeof (*stats));
+    for (i = 0; i < BACKENDS_MAX; ++i) {
+        if (mgr.backends.scheduler (i)->get_stats (priority, &backend) != 0)
+            return TSS2_TCTI_RC_BAD_VALUE;
+        stats->commands += backend.commands;
+        stats->aged += backend.aged;
+        stats->timeouts += backend.timeouts;
+        stats->expired += backend.expired;
+        stats->wait_us += backend.wait_us;
+        stats->max_wait_us = max (stats->max_wait_us, backend.max_wait_us);
+        stats->service_us += backend.service_us;
+    }
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * Get a connection to 'backend' for a session, from the connection pool
+ * if it has one.
+ */
+static TSS2_TCTI_CONTEXT*
+backend_connect (TctiSgxMgr &mgr,
+                 unsigned backend)
+{
+    TSS2_TCTI_CONTEXT *tcti_context;
+
+    tcti_context = mgr.conn_pool.take (backend);
+    if (tcti_context == NULL)
+        tcti_context = mgr.backends.connect (backend);
+    return tcti_context;
+}
+
+/*
+ * Move the session identified by 'id', or every session when 'id' is 0,
+ * to a new connection to the backend it's on. The enclave keeps the
+ * handles it holds and sees nothing of the move. A session that can't be
+ * moved stays where it is, the first error is returned. Multiplexed
+ * sessions and those not connected (yet, or since being suspended) have
+ * no connection of their own and are left alone. Only what a session's
+ * client loaded moves, so this works without a resource manager
+ * downstream, but a session that has lost track of that (see
+ * TctiSgxLoaded) can't move: BAD_SEQUENCE. A session in use right then is
+ * skipped: TRY_AGAIN. Sessions are moved one at a time with only their
+ * own lock held, nobody waits on the manager for the TPM.
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_mgr_migrate_session (uint64_t id)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    list <TctiSgxSession*>::const_iterator itr;
+    vector<uint64_t> ids;
+    TctiSgxSession *session;
+    TSS2_TCTI_CONTEXT *target;
+    TSS2_RC rc, first = TSS2_RC_SUCCESS;
+    size_t i;
+
+    mgr.lock ();
+    for (itr = mgr.sessions.begin (); itr != mgr.sessions.end (); ++itr)
+        if ((id == 0 || (*itr)->id == id) && !(*itr)->parked)
+            ids.push_back ((*itr)->id);
+    mgr.unlock ();
+    if (id != 0 && ids.empty ())
+        return TSS2_TCTI_RC_BAD_VALUE;
+
+    for (i = 0; i < ids.size (); ++i) {
+        mgr.lock ();
+        session = mgr.session_find (ids [i]);
+        if (session == NULL || session->parked) {
+            mgr.unlock ();
+            continue;
+        }
+        if (!session->try_lock ()) {
+            mgr.unlock ();
+            if (first == TSS2_RC_SUCCESS)
+                first = TSS2_TCTI_RC_TRY_AGAIN;
+            continue;
+        }
+        mgr.unlock ();
+        rc = TSS2_RC_SUCCESS;
+        if (session->connected () && !session->multiplexed ()) {
+            target = backend_connect (mgr, session->get_backend ());
+            if (target == NULL) {
+                rc = TSS2_TCTI_RC_NO_CONNECTION;
+            } else {
+                rc = session->migrate (target);
+                if (rc != TSS2_RC_SUCCESS) {
+                    Tss2_Tcti_Finalize (target);
+                    free (target);
+                }
+            }
+        }
+        session->unlock ();
+        if (rc != TSS2_RC_SUCCESS && first == TSS2_RC_SUCCESS)
+            first = rc;
+    }
+    return first;
+}
+
+/*
+ * Add a TPM that sessions can be placed on, connected to with 'callback'
+ * and 'user_data'. The TPM the manager was initialized with is backend 0.
+ * The key pool, the response and warm caches and single flight are about
+ * backend 0's TPM, sessions on other backends go without them. Each
+ * backend has a scheduler of its own.
+ * Returns the index of the new backend, -1 if 'callback' is NULL or
+ * there are too many backends.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_add_backend (downstream_tcti_init_cb callback,
+                          void *user_data)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    return mgr.backends.add (callback, user_data);
+}
+
+/*
+ * Set how new sessions are placed on the backends. The default is
+ * TCTI_SGX_BACKEND_LEAST_LOADED.
+ * Returns -1 for an unknown policy.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_backend_policy (tcti_sgx_backend_policy_t policy)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    return mgr.backends.set_policy (policy);
+}
+
+/*
+ * Get the load and latency counters for 'backend'.
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_mgr_get_backend_stats (unsigned backend,
+                                tcti_sgx_backend_stats_t *stats)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    if (stats == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    if (mgr.backends.get_stats (backend, stats) != 0)
+        return TSS2_TCTI_RC_BAD_VALUE;
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * Keep up to 'max_idle' connections to each backend open after their
+ * sessions go away, for new sessions to reuse. A connection is cleaned
+ * up before it's pooled: whatever is still loaded is flushed and the
+ * locality goes back to 0. Connections idle for more than 'max_idle_ms'
+ * are closed, 0 keeps them until they're needed or the pool shrinks. A
+ * 'max_idle' of 0 (the default) closes connections with their session.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_conn_pool (size_t max_idle,
+                            uint32_t max_idle_ms)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.conn_pool.set_limits (max_idle, max_idle_ms);
+    return 0;
 }
 
-TSS2_RC
-TctiSgxSession::transmit (size_t size, uint8_t const *command)
+TSS2_RC SO_EXPORT
+tcti_sgx_mgr_get_conn_pool_stats (tcti_sgx_conn_pool_stats_t *stats)
 {
-    return Tss2_Tcti_Transmit (this->tcti_context, size, command);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    if (stats == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    mgr.conn_pool.get_stats (stats);
+    return TSS2_RC_SUCCESS;
 }
-TSS2_RC
-TctiSgxSession::receive (size_t *size, uint8_t *response, int32_t timeout)
+
+/*
+ * Have sessions created from now on share up to 'connections' downstream
+ * connections to each backend instead of each having its own. A session
+ * takes a connection when it sends a command and gives it back with the
+ * response, unless it leaves something loaded or changes its locality: it
+ * then keeps the connection until it's back to nothing, so sessions never
+ * see each other's objects. A session waits no more than 'wait_ms' for a
+ * connection before its command fails with TRY_AGAIN. Multiplexed
+ * sessions go without the context cache and the session pool, both keep
+ * things loaded on the session's connection. A 'connections' of 0 (the
+ * default) gives each new session its own connection.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_mux (size_t connections,
+                      uint32_t wait_ms)
 {
-    return Tss2_Tcti_Receive (this->tcti_context, size, response, timeout);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.mux.set_limits (connections, wait_ms);
+    return 0;
 }
-TSS2_RC
-TctiSgxSession::cancel ()
+
+TSS2_RC SO_EXPORT
+tcti_sgx_mgr_get_mux_stats (tcti_sgx_mux_stats_t *stats)
 {
-    return Tss2_Tcti_Cancel (this->tcti_context);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    if (stats == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    mgr.mux.get_stats (stats);
+    return TSS2_RC_SUCCESS;
 }
-TSS2_RC
-TctiSgxSession::set_locality (uint8_t locality)
+
+/*
+ * Enable or disable lazy connection: sessions created from then on don't
+ * connect downstream until they have something for the TPM, usually the
+ * first command sent. tcti_sgx_init_ocall returns as soon as the session
+ * exists and a backend that can't be connected to makes that command fail
+ * with NO_CONNECTION instead. Sessions that are never used never connect.
+ * Disabled by default.
+ */
+int SO_EXPORT
+tcti_sgx_mgr_set_lazy_connect (int enable)
 {
-    return Tss2_Tcti_SetLocality (this->tcti_context, locality);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.lock ();
+    mgr.lazy_connect = enable != 0;
+    mgr.unlock ();
+    return 0;
 }
 
 /*
- * Function to initialize the application / untrusted library. The 'callback'
- * parameter is a caller provided function used to initialize a TCTI
- * instance used to communicate with the 'downstream' TPM. This allows for
- * flexible configuration by the application hosting the enclave.
+ * Lease downstream resources to sessions. A session no enclave has used
+ * for 'idle_ms' milliseconds is suspended by the maintenance thread: what
+ * it has loaded is saved and flushed and its connection closed (or given
+ * back to the connection pool or the multiplexer). Its next command
+ * reconnects and loads it all again. One unused for 'expire_ms' is
+ * finalized as though its enclave had, the enclave's next call fails with
+ * BAD_VALUE. Parked sessions have their own timeout. A value of 0 (the
+ * default) turns either off. Suspending needs the maintenance thread.
+ * Only what the session's own client loaded is saved, so this works
+ * without a resource manager downstream, but a session that has lost
+ * track of that (see TctiSgxLoaded) stays connected.
  */
 int SO_EXPORT
-tcti_sgx_mgr_init (downstream_tcti_init_cb callback,
-                   void *user_data)
+tcti_sgx_mgr_set_lease (uint32_t idle_ms,
+                        uint32_t expire_ms)
 {
-    if (callback == NULL) {
-        callback = mssim_tcti_init;
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.lock ();
+    mgr.lease_idle_ms = idle_ms;
+    mgr.lease_expire_ms = expire_ms;
+    mgr.unlock ();
+    if (idle_ms != 0 || expire_ms != 0)
+        mgr.worker_start ();
+    return 0;
+}
+
+/*
+ * Fill 'buf' with 'size' bytes from RAND_SRC.
+ */
+static int
+read_random (void *buf,
+             size_t size)
+{
+    ssize_t ret;
+    int fd;
+
+    fd = open (RAND_SRC, O_RDONLY);
+    if (fd == -1) {
+        cout << __func__ << ": failed to open " << RAND_SRC << ": "
+            << strerror (errno) << endl;
+        return -1;
+    }
+    ret = read (fd, buf, size);
+    close (fd);
+    if (ret != (ssize_t)size) {
+        cout << __func__ << ": failed to read " << size << " bytes from "
+            << RAND_SRC << ": " << strerror (errno) << endl;
+        return -1;
     }
-    TctiSgxMgr::get_instance (callback, user_data);
     return 0;
 }
 
@@ -164,32 +3423,145 @@ tcti_sgx_init_ocall ()
 {
     TctiSgxSession *session;
     TctiSgxMgr& mgr = TctiSgxMgr::get_instance (mssim_tcti_init, NULL);
-    int fd;
+    list <TctiSgxSession*> expired;
+    list <TctiSgxSession*>::const_iterator itr;
     uint64_t id;
     TSS2_TCTI_CONTEXT *tcti_context;
+    unsigned backend;
+    bool multiplexed, lazy;
 
-    fd = open (RAND_SRC, O_RDONLY);
-    if (fd == -1) {
-        cout << __func__ << ": failed to open " << RAND_SRC << ": "
-            << strerror (errno) << endl;
+    if (read_random (&id, sizeof (id)) != 0)
         return 0;
+    backend = mgr.backends.place (0);
+    mgr.lock ();
+    lazy = mgr.lazy_connect;
+    mgr.unlock ();
+    /*
+     * A multiplexed session gets a channel when it has a command to send,
+     * a lazy one connects then.
+     */
+    multiplexed = mgr.mux.attach ();
+    if (multiplexed || lazy) {
+        tcti_context = NULL;
+    } else {
+        tcti_context = backend_connect (mgr, backend);
+        if (tcti_context == NULL) {
+            cout << __func__ << ": tcti init callback failed to create a TCTI" << endl;
+            return 0;
+        }
     }
-    if (read (fd, &id, sizeof (id)) != sizeof (id))
-    {
-        cout << __func__ << ": failed to read " << sizeof (session->id)
-            << " bytes from " << RAND_SRC << ": " << strerror (errno) << endl;
-        return 0;
+    mgr.lock ();
+    mgr.reap_parked (expired);
+    mgr.reap_idle (expired);
+    session = new TctiSgxSession (id,
+                                  tcti_context,
+                                  mgr.session_config,
+                                  backend,
+                                  multiplexed);
+    mgr.sessions.push_front (session);
+    mgr.unlock ();
+    for (itr = expired.begin (); itr != expired.end (); ++itr)
+        mgr.session_free (*itr);
+    return id;
+}
+
+/*
+ * function called by enclave to get the token that resumes its session
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_get_resume_token_ocall (uint64_t id,
+                                 size_t size,
+                                 uint8_t *token)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance (NULL, NULL);
+    TctiSgxSession *session;
+    vector<uint8_t> fresh (RESUME_TOKEN_SIZE);
+
+    if (token == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    if (size != RESUME_TOKEN_SIZE)
+        return TSS2_TCTI_RC_BAD_VALUE;
+    mgr.lock ();
+    session = mgr.session_lookup (id);
+    if (session == NULL) {
+        mgr.unlock ();
+        return TSS2_TCTI_RC_BAD_VALUE;
     }
-    tcti_context = mgr.init_cb (mgr.user_data);
-    if (tcti_context == NULL) {
-        cout << __func__ << ": tcti init callback failed to create a TCTI" << endl;
-        return 0;
+    if (session->resume_token.empty ()) {
+        if (read_random (fresh.data (), fresh.size ()) != 0) {
+            mgr.unlock ();
+            return TSS2_TCTI_RC_GENERAL_FAILURE;
+        }
+        session->resume_token.swap (fresh);
     }
-    session = new TctiSgxSession (id, tcti_context);
+    memcpy (token, session->resume_token.data (), size);
+    mgr.unlock ();
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * function called by enclave to leave its session for its successor
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_park_ocall (uint64_t id)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance (NULL, NULL);
+    list <TctiSgxSession*>::const_iterator itr;
+    list <TctiSgxSession*> expired;
+    TctiSgxSession *session;
+
     mgr.lock ();
-    mgr.sessions.push_front (session);
+    mgr.reap_parked (expired);
+    session = mgr.session_lookup (id);
+    if (session != NULL) {
+        session->parked = true;
+        session->parked_until = chrono::steady_clock::now () +
+            chrono::milliseconds (mgr.park_timeout);
+    }
+    mgr.unlock ();
+    for (itr = expired.begin (); itr != expired.end (); ++itr)
+        mgr.session_free (*itr);
+    return session != NULL ? TSS2_RC_SUCCESS : TSS2_TCTI_RC_BAD_VALUE;
+}
+
+/*
+ * function called by enclave to take over the session 'token' resumes,
+ * parked or not: an enclave that crashed never got to park its session.
+ * The session gets a new ID so the enclave before can't use it anymore.
+ * Returns 0 when there's no such session.
+ */
+uint64_t SO_EXPORT
+tcti_sgx_resume_ocall (size_t size,
+                       const uint8_t *token)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance (NULL, NULL);
+    list <TctiSgxSession*>::const_iterator itr;
+    list <TctiSgxSession*> expired;
+    TctiSgxSession *session;
+    uint64_t id;
+
+    if (token == NULL || size != RESUME_TOKEN_SIZE)
+        return 0;
+    if (read_random (&id, sizeof (id)) != 0)
+        return 0;
+    mgr.lock ();
+    mgr.reap_parked (expired);
+    session = mgr.session_claim (token, size);
+    if (session != NULL) {
+        session->parked = false;
+        session->id = id;
+    }
     mgr.unlock ();
-    return session->id;
+    for (itr = expired.begin (); itr != expired.end (); ++itr)
+        mgr.session_free (*itr);
+    if (session == NULL) {
+        cout << __func__ << ": no session for resume token" << endl;
+        return 0;
+    }
+    session->lock ();
+    session->resume ();
+    session->unlock ();
+    return id;
 }
 
 TSS2_RC SO_EXPORT
@@ -206,12 +3578,41 @@ tcti_sgx_transmit_ocall (uint64_t id,
     mgr.unlock ();
     if (session == NULL)
         return TSS2_TCTI_RC_BAD_VALUE;
+    mgr.placement.served (session->home_node);
     session->lock ();
     ret = session->transmit (size, command);
     session->unlock ();
     return ret;
 }
 
+/*
+ * Send a command that must be answered within 'deadline_ms'. A command
+ * that can't be sent to the TPM in time is answered with TPM2_RC_CANCELED,
+ * one the TPM hasn't answered in time is cancelled. A 'deadline_ms' of 0
+ * is no deadline.
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_transmit_deadline_ocall (uint64_t id,
+                                  size_t size,
+                                  const uint8_t *command,
+                                  uint32_t deadline_ms)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance (NULL, NULL);
+    TctiSgxSession *session;
+    TSS2_RC ret;
+
+    mgr.lock ();
+    session = mgr.session_lookup (id);
+    mgr.unlock ();
+    if (session == NULL)
+        return TSS2_TCTI_RC_BAD_VALUE;
+    mgr.placement.served (session->home_node);
+    session->lock ();
+    ret = session->transmit (size, command, deadline_ms);
+    session->unlock ();
+    return ret;
+}
+
 TSS2_RC SO_EXPORT
 tcti_sgx_receive_ocall (uint64_t id,
                         size_t size,
@@ -222,8 +3623,7 @@ tcti_sgx_receive_ocall (uint64_t id,
     TctiSgxSession *session;
     TSS2_RC ret;
 
-    /* we only support blocking calls currently */
-    if (timeout != TSS2_TCTI_TIMEOUT_BLOCK)
+    if (timeout < 0 && timeout != TSS2_TCTI_TIMEOUT_BLOCK)
         return TSS2_TCTI_RC_BAD_VALUE;
 
     mgr.lock ();
@@ -231,6 +3631,7 @@ tcti_sgx_receive_ocall (uint64_t id,
     mgr.unlock ();
     if (session == NULL)
         return TSS2_TCTI_RC_BAD_VALUE;
+    mgr.placement.served (session->home_node);
     session->lock ();
     ret = session->receive (&size, response, timeout);
     session->unlock ();
@@ -243,9 +3644,7 @@ tcti_sgx_finalize_ocall (uint64_t id)
 {
     TctiSgxMgr& mgr = TctiSgxMgr::get_instance (NULL, NULL);
 
-    mgr.lock ();
     mgr.session_remove (id);
-    mgr.unlock ();
 }
 
 TSS2_RC SO_EXPORT
@@ -260,6 +3659,7 @@ tcti_sgx_cancel_ocall (uint64_t id)
     mgr.unlock ();
     if (session == NULL)
         return TSS2_TCTI_RC_BAD_VALUE;
+    mgr.placement.served (session->home_node);
     session->lock ();
     ret = session->cancel ();
     session->unlock ();
@@ -290,8 +3690,203 @@ tcti_sgx_set_locality_ocall (uint64_t id,
     mgr.unlock ();
     if (session == NULL)
         return TSS2_TCTI_RC_BAD_VALUE;
+    mgr.placement.served (session->home_node);
     session->lock ();
     ret = session->set_locality (locality);
     session->unlock ();
     return ret;
 }
+
+/*
+ * When sessions follow their enclave, move a session that has just been
+ * tagged to its enclave's backend. One that can't move, because it has
+ * something loaded already, stays where it is. Caller must hold the
+ * session lock.
+ */
+static void
+follow_enclave (TctiSgxMgr &mgr,
+                TctiSgxSession *session)
+{
+    TSS2_TCTI_CONTEXT *target;
+    unsigned backend;
+    TSS2_RC rc;
+
+    if (!mgr.backends.enclave_backend (session->get_tag (), &backend) ||
+        backend == session->get_backend ())
+        return;
+    target = NULL;
+    if (session->connected () && !session->multiplexed ()) {
+        target = backend_connect (mgr, backend);
+        if (target == NULL)
+            return;
+    }
+    rc = session->rehome (backend, target, mgr.session_config);
+    if (rc != TSS2_RC_SUCCESS) {
+        cout << __func__ << ": session " << session->id << " stays on "
+             << "backend " << session->get_backend () << ": 0x" << hex << rc
+             << dec << endl;
+        if (target != NULL) {
+            Tss2_Tcti_Finalize (target);
+            free (target);
+        }
+    }
+}
+
+/*
+ * function called by enclave to tag its session for admission control
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_set_tag_ocall (uint64_t id,
+                        uint64_t tag)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance (NULL, NULL);
+    TctiSgxSession *session;
+    TSS2_RC ret;
+
+    mgr.lock ();
+    session = mgr.session_lookup (id);
+    mgr.unlock ();
+    if (session == NULL)
+        return TSS2_TCTI_RC_BAD_VALUE;
+    session->lock ();
+    ret = session->set_tag (tag);
+    if (ret == TSS2_RC_SUCCESS)
+        follow_enclave (mgr, session);
+    session->unlock ();
+    return ret;
+}
+
+/*
+ * function called by enclave to set the priority class of its session
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_set_priority_ocall (uint64_t id,
+                             uint32_t priority)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance (NULL, NULL);
+    TctiSgxSession *session;
+    TSS2_RC ret;
+
+    mgr.lock ();
+    session = mgr.session_lookup (id);
+    mgr.unlock ();
+    if (session == NULL)
+        return TSS2_TCTI_RC_BAD_VALUE;
+    session->lock ();
+    ret = session->set_priority (priority);
+    session->unlock ();
+    return ret;
+}
+
+/*
+ * function called by enclave to find out how busy the TPM was when its
+ * command was turned away
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_get_queue_depth_ocall (uint64_t id,
+                                uint32_t *depth)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance (NULL, NULL);
+    TctiSgxSession *session;
+    TSS2_RC ret;
+
+    if (depth == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    mgr.lock ();
+    session = mgr.session_lookup (id);
+    mgr.unlock ();
+    if (session == NULL)
+        return TSS2_TCTI_RC_BAD_VALUE;
+    session->lock ();
+    ret = session->get_queue_depth (depth);
+    session->unlock ();
+    return ret;
+}
+
+/*
+ * function called by enclave to refill its entropy pool
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_get_random_ocall (uint64_t id,
+                           size_t size,
+                           uint8_t *random)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance (NULL, NULL);
+    TctiSgxSession *session;
+    TSS2_RC ret;
+
+    if (random == NULL && size > 0)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    mgr.lock ();
+    session = mgr.session_lookup (id);
+    mgr.unlock ();
+    if (session == NULL)
+        return TSS2_TCTI_RC_BAD_VALUE;
+    mgr.placement.served (session->home_node);
+    session->lock ();
+    ret = session->get_random (size, random);
+    session->unlock ();
+    return ret;
+}
+
+/*
+ * function called by enclave to feed data to a hash sequence
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_hash_update_ocall (uint64_t id,
+                            TPMI_ALG_HASH hash_alg,
+                            size_t size,
+                            const uint8_t *data)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance (NULL, NULL);
+    TctiSgxSession *session;
+    TSS2_RC ret;
+
+    if (data == NULL && size > 0)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    mgr.lock ();
+    session = mgr.session_lookup (id);
+    mgr.unlock ();
+    if (session == NULL)
+        return TSS2_TCTI_RC_BAD_VALUE;
+    mgr.placement.served (session->home_node);
+    session->lock ();
+    ret = session->hash_update (hash_alg, data, size);
+    session->unlock ();
+    return ret;
+}
+
+/*
+ * function called by enclave to complete a hash sequence
+ */
+TSS2_RC SO_EXPORT
+tcti_sgx_hash_complete_ocall (uint64_t id,
+                              TPMI_ALG_HASH hash_alg,
+                              TPMI_RH_HIERARCHY hierarchy,
+                              size_t size,
+                              const uint8_t *data,
+                              size_t result_size,
+                              uint8_t *result)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance (NULL, NULL);
+    TctiSgxSession *session;
+    TSS2_RC ret;
+
+    if ((data == NULL && size > 0) || result == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    mgr.lock ();
+    session = mgr.session_lookup (id);
+    mgr.unlock ();
+    if (session == NULL)
+        return TSS2_TCTI_RC_BAD_VALUE;
+    mgr.placement.served (session->home_node);
+    session->lock ();
+    ret = session->hash_complete (hash_alg,
+                                  hierarchy,
+                                  data,
+                                  size,
+                                  result,
+                                  result_size);
+    session->unlock ();
+    return ret;
+}
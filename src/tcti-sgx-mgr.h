@@ -16,8 +16,425 @@ extern "C" {
 
 typedef TSS2_TCTI_CONTEXT* (*downstream_tcti_init_cb) (void *user_data);
 
+/*
+ * Counters describing the transient object context cache. When queried
+ * with a session id of 0 the counters from all sessions are summed.
+ * 'entries' is the number of objects currently held loaded on behalf of
+ * clients that believe they've been flushed, 'preloads' the objects loaded
+ * again ahead of the client asking for them.
+ */
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t entries;
+    uint64_t preloads;
+} tcti_sgx_ctx_cache_stats_t;
+
+/*
+ * Counters describing the pool of pre-started authorization sessions.
+ * 'started' counts sessions started by the manager to fill the pool and
+ * 'available' is the number of sessions currently waiting in the pool.
+ */
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t started;
+    uint64_t available;
+} tcti_sgx_session_pool_stats_t;
+
+/*
+ * Counters describing the pool of pre-generated keys. 'generated' counts
+ * keys created by the manager to fill the pool, 'expired' the ones thrown
+ * away for being too old and 'available' is the number of keys currently
+ * waiting in the pool.
+ */
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t generated;
+    uint64_t expired;
+    uint64_t available;
+} tcti_sgx_key_pool_stats_t;
+
+/*
+ * Counters describing the cache of responses to read-only commands.
+ * 'invalidations' counts cached responses dropped because a command
+ * that changes what they describe went by and 'entries' is the number of
+ * responses currently cached. The hit rate is hits / (hits + misses).
+ */
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+    uint64_t entries;
+} tcti_sgx_rsp_cache_stats_t;
+
+/*
+ * Counters describing the deduplication of identical read-only commands
+ * in flight at the same time. 'joined' counts commands answered with the
+ * response to another session's command and 'fallbacks' the ones that had
+ * to be sent after all.
+ */
+typedef struct {
+    uint64_t flights;
+    uint64_t joined;
+    uint64_t fallbacks;
+} tcti_sgx_single_flight_stats_t;
+
+/*
+ * Counters describing the persistent cache of TPM metadata. 'stale'
+ * counts responses from the cache file the TPM no longer agreed with and
+ * 'entries' is the number of responses currently cached.
+ */
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stale;
+    uint64_t entries;
+} tcti_sgx_warm_cache_stats_t;
+
+/*
+ * Counters describing the audit log. 'records' counts the records
+ * written, 'stalls' the times a session had to wait on the writer and
+ * 'errors' the records that couldn't be written.
+ */
+typedef struct {
+    uint64_t records;
+    uint64_t stalls;
+    uint64_t errors;
+} tcti_sgx_audit_log_stats_t;
+
+/*
+ * Who an admission limit or quota applies to: everything the manager sends
+ * to the TPM, what each enclave sends or what a single session sends.
+ * Admission limits can't be set per session.
+ */
+typedef enum {
+    TCTI_SGX_SCOPE_MANAGER = 0,
+    TCTI_SGX_SCOPE_ENCLAVE,
+    TCTI_SGX_SCOPE_SESSION,
+} tcti_sgx_scope_t;
+
+/*
+ * Counters describing admission control. 'admitted' and 'rejected' count
+ * the commands let through and turned away, 'commands' and 'bytes'
+ * describe the commands currently outstanding.
+ */
+typedef struct {
+    uint64_t admitted;
+    uint64_t rejected;
+    uint64_t commands;
+    uint64_t bytes;
+} tcti_sgx_admission_stats_t;
+
+/*
+ * A rate limit: 'commands_per_sec' commands and 'tpm_ms_per_sec'
+ * milliseconds of estimated TPM time each second, with bursts of up to
+ * 'commands_burst' commands and 'tpm_ms_burst' milliseconds. A rate of 0
+ * is no limit, a burst of 0 is one second's worth.
+ */
+typedef struct {
+    uint32_t commands_per_sec;
+    uint32_t commands_burst;
+    uint32_t tpm_ms_per_sec;
+    uint32_t tpm_ms_burst;
+} tcti_sgx_quota_t;
+
+/*
+ * Counters describing a quota. 'admitted' and 'throttled' count the
+ * commands let through and turned away, 'tpm_ms' is the estimated TPM
+ * time charged to the quota.
+ */
+typedef struct {
+    uint64_t admitted;
+    uint64_t throttled;
+    uint64_t tpm_ms;
+} tcti_sgx_quota_stats_t;
+
+/*
+ * Where the manager's threads run on hosts with more than one NUMA node.
+ * TCTI_SGX_PLACEMENT_NONE: anywhere the OS likes.
+ * TCTI_SGX_PLACEMENT_NODE: on the CPUs of the given node.
+ * TCTI_SGX_PLACEMENT_ENCLAVE: on the node most sessions were created
+ * from, which is where the enclave's threads run.
+ * With a policy set, each session's buffers are placed on the node of
+ * the thread that created it.
+ */
+typedef enum {
+    TCTI_SGX_PLACEMENT_NONE = 0,
+    TCTI_SGX_PLACEMENT_NODE,
+    TCTI_SGX_PLACEMENT_ENCLAVE,
+} tcti_sgx_placement_t;
+
+/*
+ * Counters describing a NUMA node. 'cpus' is the number of CPUs on the
+ * node, 'sessions' the number of sessions created on the node that are
+ * still around, 'ocalls' counts ocalls serviced by its CPUs and
+ * 'remote_ocalls' those of them for sessions created on another node.
+ */
+typedef struct {
+    uint64_t cpus;
+    uint64_t sessions;
+    uint64_t ocalls;
+    uint64_t remote_ocalls;
+} tcti_sgx_node_stats_t;
+
+/*
+ * Duration classes for TPM commands, from the PTP spec. Extra long covers
+ * the commands that generate keys.
+ */
+typedef enum {
+    TCTI_SGX_DURATION_SHORT = 0,
+    TCTI_SGX_DURATION_MEDIUM,
+    TCTI_SGX_DURATION_LONG,
+    TCTI_SGX_DURATION_EXTRA_LONG,
+} tcti_sgx_duration_t;
+
+/*
+ * What the manager expects a command to cost. 'timeout_ms' is how long a
+ * blocking receive waits for the TPM before the command is canceled when
+ * timeouts are enforced (see tcti_sgx_mgr_set_command_timeouts),
+ * 'expected_us' the moving average of the 'samples' latencies observed
+ * (the timeout until there are any) and 'timeouts' the number of times
+ * the command was canceled.
+ */
+typedef struct {
+    tcti_sgx_duration_t duration;
+    uint32_t timeout_ms;
+    uint64_t expected_us;
+    uint64_t samples;
+    uint64_t timeouts;
+} tcti_sgx_command_cost_t;
+
+/*
+ * Priority classes for scheduling commands on the TPM, best first. The
+ * values match the TSS2_TCTI_SGX_PRIORITY_* ones enclaves use.
+ */
+typedef enum {
+    TCTI_SGX_PRIORITY_HIGH = 0,
+    TCTI_SGX_PRIORITY_NORMAL,
+    TCTI_SGX_PRIORITY_LOW,
+} tcti_sgx_priority_t;
+#define TCTI_SGX_PRIORITY_CLASSES 3
+
+/*
+ * How the scheduler picks the next command within a priority class.
+ * TCTI_SGX_SCHED_FIFO: first come first served.
+ * TCTI_SGX_SCHED_SJF: shortest job first by the command's expected cost,
+ * with long jobs moving up as they wait.
+ * TCTI_SGX_SCHED_DEADLINE: earliest deadline first, commands without a
+ * deadline have until the scheduler's wait limit.
+ */
+typedef enum {
+    TCTI_SGX_SCHED_FIFO = 0,
+    TCTI_SGX_SCHED_SJF,
+    TCTI_SGX_SCHED_DEADLINE,
+} tcti_sgx_sched_policy_t;
+
+/*
+ * Counters describing a priority class. 'commands' is the number of
+ * commands that got the TPM, 'aged' how many of those got it by waiting
+ * long enough to move up a class, 'timeouts' how many commands gave up
+ * waiting and 'expired' how many were dropped because their deadline
+ * passed while they waited. 'wait_us' and 'max_wait_us' are the total and
+ * longest time commands waited for the TPM, 'service_us' the total time
+ * they had it.
+ */
+typedef struct {
+    uint64_t commands;
+    uint64_t aged;
+    uint64_t timeouts;
+    uint64_t expired;
+    uint64_t wait_us;
+    uint64_t max_wait_us;
+    uint64_t service_us;
+} tcti_sgx_priority_stats_t;
+
+/*
+ * How the manager picks the backend for a new session when it has more
+ * than one TPM to connect to.
+ * TCTI_SGX_BACKEND_LEAST_LOADED: the backend with the least load, the
+ * sessions on it plus the commands it has in flight.
+ * TCTI_SGX_BACKEND_TWO_CHOICES: the less loaded of two backends picked at
+ * random, which keeps sessions created at the same time from all piling
+ * onto the same backend.
+ * TCTI_SGX_BACKEND_ENCLAVE: the backend the enclave's other sessions are
+ * on, the least loaded one for its first. Enclaves are told apart by the
+ * tag their sessions set, a session that has nothing loaded moves to its
+ * enclave's backend when it sets its tag.
+ */
+typedef enum {
+    TCTI_SGX_BACKEND_LEAST_LOADED = 0,
+    TCTI_SGX_BACKEND_TWO_CHOICES,
+    TCTI_SGX_BACKEND_ENCLAVE,
+} tcti_sgx_backend_policy_t;
+
+/*
+ * Counters describing a backend. 'sessions' is the number of sessions on
+ * the backend and 'outstanding' the number of commands it has in flight.
+ * 'commands' counts the commands sent to it and 'errors' those that got
+ * no response. 'latency_us' is the moving average of the time from
+ * sending a command to collecting its response, 'max_latency_us' the
+ * longest.
+ */
+typedef struct {
+    uint64_t sessions;
+    uint64_t outstanding;
+    uint64_t commands;
+    uint64_t errors;
+    uint64_t latency_us;
+    uint64_t max_latency_us;
+} tcti_sgx_backend_stats_t;
+
+/*
+ * Counters describing the pool of downstream connections. 'hits' and
+ * 'misses' count new sessions that did and didn't get a pooled
+ * connection, 'returned' the connections put back by sessions that went
+ * away and 'discarded' the ones closed because they couldn't be cleaned
+ * up, the pool was full or they were idle for too long. 'idle' is the
+ * number of connections currently waiting in the pool.
+ */
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t returned;
+    uint64_t discarded;
+    uint64_t idle;
+} tcti_sgx_conn_pool_stats_t;
+
+/*
+ * Counters describing the downstream connections multiplexed sessions
+ * share. 'sessions' is the number of multiplexed sessions and
+ * 'connections' the number of channels open to all backends. 'acquired'
+ * counts the times a session took a channel, 'waited' those it had to wait
+ * for one to be given back and 'timeouts' the times it gave up waiting.
+ * 'discarded' counts the channels closed because a session went away
+ * leaving them in a state no one else could use.
+ */
+typedef struct {
+    uint64_t sessions;
+    uint64_t connections;
+    uint64_t acquired;
+    uint64_t waited;
+    uint64_t timeouts;
+    uint64_t discarded;
+} tcti_sgx_mux_stats_t;
+
+/*
+ * What an interceptor's command hook did with a command: pass it on to
+ * the next interceptor and eventually the TPM, or answer it itself.
+ */
+typedef enum {
+    TCTI_SGX_INTERCEPT_PASS = 0,
+    TCTI_SGX_INTERCEPT_RESPOND,
+} tcti_sgx_intercept_t;
+
+/*
+ * Hooks called by the manager for the commands a session sends and their
+ * responses. 'command' is called with the command before it's sent to the
+ * TPM: it may rewrite the command in place (up to TPM2_MAX_COMMAND_SIZE
+ * bytes, updating '*command_size') and either pass it on or write the
+ * response (up to '*response_size', TPM2_MAX_RESPONSE_SIZE, bytes) and
+ * respond. 'response' is called with the response to a command the
+ * interceptor passed on: it may rewrite the response in place, up to
+ * 'capacity' bytes. 'id' identifies the session. Either hook may be NULL.
+ */
+typedef struct {
+    tcti_sgx_intercept_t (*command) (void *user_data,
+                                     uint64_t id,
+                                     uint8_t *command,
+                                     size_t *command_size,
+                                     uint8_t *response,
+                                     size_t *response_size);
+    void (*response) (void *user_data,
+                      uint64_t id,
+                      uint8_t const *command,
+                      size_t command_size,
+                      uint8_t *response,
+                      size_t *response_size,
+                      size_t capacity);
+    void *user_data;
+} tcti_sgx_interceptor_t;
+
 int tcti_sgx_mgr_init (downstream_tcti_init_cb callback,
                        void *user_data);
+int tcti_sgx_mgr_set_ctx_cache_size (size_t size);
+TSS2_RC tcti_sgx_mgr_get_ctx_cache_stats (uint64_t id,
+                                          tcti_sgx_ctx_cache_stats_t *stats);
+int tcti_sgx_mgr_set_maintenance (uint32_t interval_ms,
+                                  size_t refill_per_interval);
+int tcti_sgx_mgr_add_session_pool (TPM2_SE type,
+                                   TPM2_ALG_ID auth_hash,
+                                   TPMT_SYM_DEF const *symmetric,
+                                   size_t depth);
+TSS2_RC tcti_sgx_mgr_get_session_pool_stats (uint64_t id,
+                                             tcti_sgx_session_pool_stats_t *stats);
+int tcti_sgx_mgr_set_entropy_reserve (size_t size);
+int tcti_sgx_mgr_add_key_pool (TPM2_HANDLE parent,
+                               TPM2B_AUTH const *parent_auth,
+                               uint8_t const *in_public,
+                               size_t in_public_size,
+                               size_t depth,
+                               uint32_t max_age_ms);
+TSS2_RC tcti_sgx_mgr_get_key_pool_stats (tcti_sgx_key_pool_stats_t *stats);
+int tcti_sgx_mgr_set_rsp_cache_size (size_t size);
+TSS2_RC tcti_sgx_mgr_get_rsp_cache_stats (tcti_sgx_rsp_cache_stats_t *stats);
+int tcti_sgx_mgr_set_single_flight (int enable);
+TSS2_RC tcti_sgx_mgr_get_single_flight_stats (tcti_sgx_single_flight_stats_t *stats);
+int tcti_sgx_mgr_set_warm_cache (char const *path);
+TSS2_RC tcti_sgx_mgr_get_warm_cache_stats (tcti_sgx_warm_cache_stats_t *stats);
+int tcti_sgx_mgr_add_interceptor (tcti_sgx_interceptor_t const *interceptor,
+                                  TPM2_CC const *codes,
+                                  size_t count);
+int tcti_sgx_mgr_set_command_cost (TPM2_CC code,
+                                   tcti_sgx_duration_t duration,
+                                   uint32_t timeout_ms);
+TSS2_RC tcti_sgx_mgr_get_command_cost (TPM2_CC code,
+                                       tcti_sgx_command_cost_t *cost);
+int tcti_sgx_mgr_set_command_timeouts (int enable);
+int tcti_sgx_mgr_set_audit_log (char const *path);
+TSS2_RC tcti_sgx_mgr_get_audit_log_stats (tcti_sgx_audit_log_stats_t *stats);
+int tcti_sgx_mgr_set_park_timeout (uint32_t timeout_ms);
+int tcti_sgx_mgr_set_placement (tcti_sgx_placement_t policy,
+                                unsigned node);
+TSS2_RC tcti_sgx_mgr_get_node_stats (unsigned node,
+                                     tcti_sgx_node_stats_t *stats);
+int tcti_sgx_mgr_set_admission_limit (tcti_sgx_scope_t scope,
+                                      uint32_t commands,
+                                      size_t bytes);
+TSS2_RC tcti_sgx_mgr_get_admission_stats (tcti_sgx_admission_stats_t *stats);
+int tcti_sgx_mgr_set_quota (tcti_sgx_scope_t scope,
+                            uint64_t key,
+                            tcti_sgx_quota_t const *quota);
+TSS2_RC tcti_sgx_mgr_get_quota_stats (tcti_sgx_scope_t scope,
+                                      uint64_t key,
+                                      tcti_sgx_quota_stats_t *stats);
+int tcti_sgx_mgr_set_scheduler (int enable,
+                                uint32_t aging_ms,
+                                uint32_t wait_ms);
+int tcti_sgx_mgr_set_scheduler_policy (tcti_sgx_sched_policy_t policy);
+int tcti_sgx_mgr_set_command_priority (TPM2_CC code,
+                                       tcti_sgx_priority_t priority);
+int tcti_sgx_mgr_set_session_priority (uint64_t id,
+                                       tcti_sgx_priority_t priority);
+TSS2_RC tcti_sgx_mgr_get_priority_stats (tcti_sgx_priority_t priority,
+                                         tcti_sgx_priority_stats_t *stats);
+TSS2_RC tcti_sgx_mgr_migrate_session (uint64_t id);
+int tcti_sgx_mgr_add_backend (downstream_tcti_init_cb callback,
+                              void *user_data);
+int tcti_sgx_mgr_set_backend_policy (tcti_sgx_backend_policy_t policy);
+TSS2_RC tcti_sgx_mgr_get_backend_stats (unsigned backend,
+                                        tcti_sgx_backend_stats_t *stats);
+int tcti_sgx_mgr_set_conn_pool (size_t max_idle,
+                                uint32_t max_idle_ms);
+TSS2_RC tcti_sgx_mgr_get_conn_pool_stats (tcti_sgx_conn_pool_stats_t *stats);
+int tcti_sgx_mgr_set_mux (size_t connections,
+                          uint32_t wait_ms);
+TSS2_RC tcti_sgx_mgr_get_mux_stats (tcti_sgx_mux_stats_t *stats);
+int tcti_sgx_mgr_set_lease (uint32_t idle_ms,
+                            uint32_t expire_ms);
+int tcti_sgx_mgr_set_lazy_connect (int enable);
 
 #if defined (__cplusplus)
 }
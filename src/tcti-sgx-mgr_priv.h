@@ -5,26 +5,270 @@
 #ifndef TCTI_SGX_MGR_PRIV_H
 #define TCTI_SGX_MGR_PRIV_H
 
+#include <chrono>
+#include <condition_variable>
 #include <list>
+#include <memory>
 #include <mutex>
+#include <thread>
+#include <vector>
 
 #include <tss2/tss2_tcti.h>
 #include "tcti-sgx-mgr.h"
+#include "tcti-sgx-mgr-admission.h"
+#include "tcti-sgx-mgr-audit-log.h"
+#include "tcti-sgx-mgr-backends.h"
+#include "tcti-sgx-mgr-conn-pool.h"
+#include "tcti-sgx-mgr-cost-table.h"
+#include "tcti-sgx-mgr-ctx-cache.h"
+#include "tcti-sgx-mgr-handle-map.h"
+#include "tcti-sgx-mgr-interceptor.h"
+#include "tcti-sgx-mgr-key-pool.h"
+#include "tcti-sgx-mgr-loaded.h"
+#include "tcti-sgx-mgr-mux.h"
+#include "tcti-sgx-mgr-placement.h"
+#include "tcti-sgx-mgr-quota.h"
+#include "tcti-sgx-mgr-rsp-cache.h"
+#include "tcti-sgx-mgr-scheduler.h"
+#include "tcti-sgx-mgr-session-pool.h"
+#include "tcti-sgx-mgr-single-flight.h"
+#include "tcti-sgx-mgr-warm-cache.h"
+
+/*
+ * Per-session settings. The manager keeps one of these that is copied
+ * into each session when it's created. 'key_pool', 'rsp_cache',
+ * 'single_flight', 'warm_cache', 'cost_table', 'audit_log', 'placement',
+ * 'admission', 'quota', 'backends', 'conn_pool' and 'mux' are shared by
+ * all sessions and owned by the manager.
+ */
+struct TctiSgxSessionConfig {
+    size_t ctx_cache_size;
+    std::vector<TctiSgxSessionSpec> session_specs;
+    TctiSgxKeyPool *key_pool;
+    size_t entropy_reserve;
+    TctiSgxRspCache *rsp_cache;
+    TctiSgxSingleFlight *single_flight;
+    TctiSgxWarmCache *warm_cache;
+    TctiSgxInterceptorChain interceptors;
+    TctiSgxCostTable *cost_table;
+    TctiSgxAuditLog *audit_log;
+    TctiSgxPlacement *placement;
+    TctiSgxAdmission *admission;
+    TctiSgxQuota *quota;
+    TctiSgxBackends *backends;
+    TctiSgxConnPool *conn_pool;
+    TctiSgxMux *mux;
+    TctiSgxSessionConfig ()
+        : ctx_cache_size (0), key_pool (NULL), entropy_reserve (0),
+          rsp_cache (NULL), single_flight (NULL), warm_cache (NULL),
+          cost_table (NULL), audit_log (NULL), placement (NULL),
+          admission (NULL), quota (NULL), backends (NULL),
+          conn_pool (NULL), mux (NULL) {}
+};
 
 class TctiSgxSession {
     TSS2_TCTI_CONTEXT *tcti_context;
     std::mutex mutex;
+    /* the last command sent downstream, kept so it can be resent */
+    std::vector<uint8_t> command;
+    /* response produced by the manager for a command it answered itself */
+    std::vector<uint8_t> local_response;
+    bool local_pending;
+    /* a command has been sent downstream and its response not collected */
+    bool in_flight;
+    TctiSgxKeyPool *key_pool;
+    /* random bytes fetched ahead of time for tcti_sgx_get_random_ocall */
+    std::vector<uint8_t> entropy;
+    size_t entropy_reserve;
+    TctiSgxRspCache *rsp_cache;
+    /* response cache generation when the command in flight was sent */
+    uint64_t rsp_cache_generation;
+    TctiSgxSingleFlight *single_flight;
+    /* the shared command we're leading or following, if any */
+    std::shared_ptr<TctiSgxFlight> flight;
+    bool flight_leader;
+    TctiSgxWarmCache *warm_cache;
+    TctiSgxInterceptorChain interceptors;
+    /*
+     * The command as rewritten by the interceptors, the code it had when
+     * the client sent it and the number of interceptors whose response
+     * hooks are waiting on its response.
+     */
+    std::vector<uint8_t> intercept_command;
+    size_t intercept_command_size;
+    TPM2_CC intercept_code;
+    size_t intercept_depth;
+    TctiSgxCostTable *cost_table;
+    /* code and variant of the command in flight and when it was sent */
+    TPM2_CC sent_code;
+    uint32_t sent_variant;
+    std::chrono::steady_clock::time_point sent_at;
+    /* what the session and the manager on its behalf send and receive */
+    TctiSgxAuditTrail audit_trail;
+    TctiSgxPlacement *placement;
+    /*
+     * The enclave tag the session counts against for admission, whether
+     * the command outstanding was admitted and with what tag and size, and
+     * the queue depth the last command turned away was given.
+     */
+    TctiSgxAdmission *admission;
+    uint64_t tag;
+    bool admitted;
+    uint64_t admitted_tag;
+    size_t admitted_size;
+    uint32_t queue_depth;
+    void admit_release ();
+    /* the quotas and this session's own bucket */
+    TctiSgxQuota *quota;
+    TctiSgxBucket quota_bucket;
+    /*
+     * The session's priority class and the turn with the TPM the command
+     * in flight has from the scheduler, 0 if none.
+     */
+    TctiSgxScheduler *scheduler;
+    unsigned priority;
+    uint64_t turn;
+    void turn_release ();
+    /*
+     * When the command outstanding must have been answered by, if the
+     * client gave it a deadline.
+     */
+    bool deadline_set;
+    std::chrono::steady_clock::time_point deadline;
+    bool expired () const;
+    int32_t remaining_ms () const;
+    TSS2_RC expire ();
+    /* admission for what the helper ocalls send on the client's behalf */
+    TSS2_RC admit_tpm (TPM2_CC code, size_t size);
+    void release_tpm ();
+    /* the client's handles for what's on this connection, once moved */
+    TctiSgxHandleMap handle_map;
+    /* what the client has loaded on this connection, in the TPM's terms */
+    TctiSgxLoaded loaded;
+    void track (size_t size, uint8_t const *command);
+    /* the backend this session's connection is to */
+    TctiSgxBackends *backends;
+    unsigned backend;
+    void bind (unsigned backend, TctiSgxSessionConfig const &config);
+    void landed (bool answered);
+    /* where the connection goes when we're done with it */
+    TctiSgxConnPool *conn_pool;
+    uint8_t locality;
+    TSS2_RC scrub ();
+    /*
+     * The shared connections, for a multiplexed session, and whether it
+     * has left something on the channel it holds. A multiplexed session
+     * only has a 'tcti_context' while it holds a channel, any other once
+     * it has connected.
+     */
+    TctiSgxMux *mux;
+    bool pinned;
+    bool sent_sessions;
+    TSS2_RC channel_acquire (
+        std::chrono::steady_clock::time_point const *deadline);
+    void channel_settle (TSS2_RC rc, uint8_t const *response, size_t size);
+    void channel_release ();
+    void hang_up (bool clean);
+    /*
+     * What suspend saved when the session's lease ran out: the handles
+     * things had on the connection and their contexts, objects first. A
+     * session whose contexts wouldn't load again is lost.
+     */
+    bool suspended;
+    bool lost;
+    std::vector<TPM2_HANDLE> saved_handles;
+    std::vector<std::vector<uint8_t> > saved_contexts;
+    TSS2_RC wake ();
+    TSS2_RC fetch_commands ();
+    /*
+     * Hash sequence driven by the hash ocalls. 'hash_data' holds the
+     * bytes not yet sent to the TPM, never more than a chunk. The
+     * sequence object is only started once there's more than one chunk
+     * to hash.
+     */
+    TPMI_ALG_HASH hash_alg;
+    TPMI_DH_OBJECT hash_sequence;
+    std::vector<uint8_t> hash_data;
+    TSS2_RC hash_check (TPMI_ALG_HASH hash_alg);
+    TSS2_RC hash_feed (uint8_t const *data, size_t size);
+    void hash_abandon ();
+    TSS2_RC send (size_t size, uint8_t const *command);
+    TSS2_RC transmit_tpm (size_t size, uint8_t const *command);
+    TSS2_RC receive_wait (size_t *size, uint8_t *response, int32_t timeout);
+    TSS2_RC receive_downstream (size_t *size,
+                                uint8_t *response,
+                                int32_t timeout);
+    TSS2_RC receive_tpm (size_t *size, uint8_t *response, int32_t timeout);
+    TSS2_RC transact (uint8_t const *command,
+                      size_t command_size,
+                      uint8_t *response,
+                      size_t *response_size);
+    TSS2_RC flush_context (TPM2_HANDLE handle);
+    TSS2_RC evict_contexts (bool all);
+    TSS2_RC flush_session_pool ();
+    TSS2_RC tpm_get_random (uint8_t *buf, size_t *size);
 public:
-    uint64_t id;
+    /*
+     * Changed under the manager's lock when the session is resumed, read
+     * without it by the session's audit trail.
+     */
+    std::atomic<uint64_t> id;
+    /*
+     * Token that hands this session to a new enclave, empty until the
+     * enclave asks for it, and whether the enclave has parked the session
+     * and until when we keep it. Protected by the manager's lock.
+     */
+    std::vector<uint8_t> resume_token;
+    bool parked;
+    std::chrono::steady_clock::time_point parked_until;
+    /* when an enclave last looked the session up, for its lease */
+    std::chrono::steady_clock::time_point last_used;
+    /* node the session was created on, -1 without a placement */
+    int home_node;
+    TctiSgxCtxCache ctx_cache;
+    TctiSgxSessionPool session_pool;
     TctiSgxSession (uint64_t id,
-                    TSS2_TCTI_CONTEXT *tcti_context);
+                    TSS2_TCTI_CONTEXT *tcti_context,
+                    TctiSgxSessionConfig const &config = TctiSgxSessionConfig (),
+                    unsigned backend = 0,
+                    bool multiplexed = false);
     ~TctiSgxSession ();
     void lock ();
+    bool try_lock ();
     void unlock ();
-    TSS2_RC transmit (size_t size, uint8_t const *command);
+    bool busy () const;
+    void maintain (size_t refill);
+    void resume ();
+    TSS2_RC suspend ();
+    TSS2_RC migrate (TSS2_TCTI_CONTEXT *target, bool same_tpm = true);
+    TSS2_RC rehome (unsigned backend,
+                    TSS2_TCTI_CONTEXT *target,
+                    TctiSgxSessionConfig const &config);
+    uint64_t get_tag () const { return this->tag; }
+    unsigned get_backend () const { return this->backend; }
+    bool multiplexed () const { return this->mux != NULL; }
+    bool connected () const { return this->tcti_context != NULL; }
+    TSS2_RC transmit (size_t size,
+                      uint8_t const *command,
+                      uint32_t deadline_ms = 0);
     TSS2_RC receive (size_t *size, uint8_t *response, int32_t timeout);
     TSS2_RC cancel ();
     TSS2_RC set_locality (uint8_t locality);
+    TSS2_RC set_tag (uint64_t tag);
+    TSS2_RC get_queue_depth (uint32_t *depth);
+    TSS2_RC set_priority (uint32_t priority);
+    void set_quota (tcti_sgx_quota_t const *quota);
+    int get_quota_stats (tcti_sgx_quota_stats_t *stats);
+    TSS2_RC get_random (size_t size, uint8_t *buf);
+    TSS2_RC hash_update (TPMI_ALG_HASH hash_alg,
+                         uint8_t const *data,
+                         size_t size);
+    TSS2_RC hash_complete (TPMI_ALG_HASH hash_alg,
+                           TPMI_RH_HIERARCHY hierarchy,
+                           uint8_t const *data,
+                           size_t size,
+                           uint8_t *result,
+                           size_t result_size);
 };
 
 class TctiSgxMgr {
@@ -33,10 +277,54 @@ private:
                 void *user_data);
     TctiSgxMgr (TctiSgxMgr const&);
     void operator=(TctiSgxMgr const&);
+    /*
+     * The maintenance thread does background work (like refilling session
+     * pools) on sessions that are idle, fills the key pool and checks the
+     * PCRs haven't changed under the response cache and checks the warm
+     * cache against the TPM when the TPM isn't busy. 'worker_mutex'
+     * protects the interval settings and the 'worker_exit' flag.
+     */
+    std::thread worker;
+    std::condition_variable worker_cond;
+    bool worker_exit;
+    /* connection used by the maintenance thread for the shared caches */
+    TSS2_TCTI_CONTEXT *tcti_context;
+    void worker_run ();
+    bool connect ();
+    void maintain_keys (size_t refill);
+    void maintain_rsp_cache ();
+    void maintain_warm_cache (size_t refill);
 public:
     downstream_tcti_init_cb  init_cb;
     void *user_data;
+    TctiSgxSessionConfig session_config;
+    TctiSgxKeyPool key_pool;
+    TctiSgxRspCache rsp_cache;
+    TctiSgxSingleFlight single_flight;
+    TctiSgxWarmCache warm_cache;
+    TctiSgxCostTable cost_table;
+    TctiSgxPlacement placement;
+    TctiSgxAdmission admission;
+    TctiSgxQuota quota;
+    TctiSgxBackends backends;
+    TctiSgxConnPool conn_pool;
+    TctiSgxMux mux;
+    TctiSgxAuditLog audit_log;
+    /* what the manager sends on its own connection */
+    TctiSgxAuditTrail audit_trail;
+    std::mutex worker_mutex;
+    uint32_t maintenance_interval;
+    size_t refill_per_interval;
     std::list <TctiSgxSession*> sessions;
+    /*
+     * How long parked sessions are kept and how long an idle session
+     * keeps its downstream resources and exists at all, protected by
+     * 'sessions_mutex'. So is whether new sessions connect on first use.
+     */
+    uint32_t park_timeout;
+    uint32_t lease_idle_ms;
+    uint32_t lease_expire_ms;
+    bool lazy_connect;
     std::mutex sessions_mutex;
     static TctiSgxMgr& get_instance (downstream_tcti_init_cb init_cb,
                                      void *user_data)
@@ -51,8 +339,16 @@ public:
     ~TctiSgxMgr ();
     void lock ();
     void unlock ();
+    TctiSgxSession* session_find (uint64_t id);
     TctiSgxSession* session_lookup (uint64_t id);
     void session_remove (uint64_t id);
+    TctiSgxSession* session_claim (uint8_t const *token, size_t size);
+    void reap_parked (std::list<TctiSgxSession*> &expired);
+    void reap_idle (std::list<TctiSgxSession*> &expired);
+    void session_free (TctiSgxSession *session);
+    void worker_start ();
+    void worker_stop ();
+    void maintain ();
 };
 
 #if defined (__cplusplus)
@@ -64,6 +360,10 @@ uint64_t tcti_sgx_init_ocall ();
 TSS2_RC tcti_sgx_transmit_ocall (uint64_t id,
                                  size_t size,
                                  const uint8_t *command);
+TSS2_RC tcti_sgx_transmit_deadline_ocall (uint64_t id,
+                                          size_t size,
+                                          const uint8_t *command,
+                                          uint32_t deadline_ms);
 TSS2_RC tcti_sgx_receive_ocall (uint64_t id,
                                 size_t size,
                                 uint8_t *response,
@@ -75,6 +375,32 @@ TSS2_RC tcti_sgx_get_poll_handles_ocall (uint64_t id,
                                          size_t *num_handles);
 TSS2_RC tcti_sgx_set_locality_ocall (uint64_t id,
                                      uint8_t locality);
+TSS2_RC tcti_sgx_get_random_ocall (uint64_t id,
+                                   size_t size,
+                                   uint8_t *random);
+TSS2_RC tcti_sgx_hash_update_ocall (uint64_t id,
+                                    TPMI_ALG_HASH hash_alg,
+                                    size_t size,
+                                    const uint8_t *data);
+TSS2_RC tcti_sgx_hash_complete_ocall (uint64_t id,
+                                      TPMI_ALG_HASH hash_alg,
+                                      TPMI_RH_HIERARCHY hierarchy,
+                                      size_t size,
+                                      const uint8_t *data,
+                                      size_t result_size,
+                                      uint8_t *result);
+TSS2_RC tcti_sgx_get_resume_token_ocall (uint64_t id,
+                                         size_t size,
+                                         uint8_t *token);
+TSS2_RC tcti_sgx_park_ocall (uint64_t id);
+TSS2_RC tcti_sgx_set_tag_ocall (uint64_t id,
+                                uint64_t tag);
+TSS2_RC tcti_sgx_get_queue_depth_ocall (uint64_t id,
+                                        uint32_t *depth);
+TSS2_RC tcti_sgx_set_priority_ocall (uint64_t id,
+                                     uint32_t priority);
+uint64_t tcti_sgx_resume_ocall (size_t size,
+                                const uint8_t *token);
 #if defined (__cplusplus)
 }
 #endif
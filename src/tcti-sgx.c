@@ -3,9 +3,11 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 #include <sgx_error.h>
+#include <string.h>
 
 #include "tss2-tcti-sgx.h"
 #include "tcti-sgx_priv.h"
+#include "tpm2-header.h"
 #include "util.h"
 
 /*
@@ -33,6 +35,107 @@ sgx_status_t tcti_sgx_cancel_ocall (TSS2_RC *rc,
 sgx_status_t tcti_sgx_set_locality_ocall (TSS2_RC *rc,
                                           uint64_t session_id,
                                           uint8_t locality);
+sgx_status_t tcti_sgx_get_random_ocall (TSS2_RC *rc,
+                                        uint64_t session_id,
+                                        size_t size,
+                                        uint8_t *random);
+sgx_status_t tcti_sgx_hash_update_ocall (TSS2_RC *rc,
+                                         uint64_t session_id,
+                                         TPMI_ALG_HASH hash_alg,
+                                         size_t size,
+                                         const uint8_t *data);
+sgx_status_t tcti_sgx_hash_complete_ocall (TSS2_RC *rc,
+                                           uint64_t session_id,
+                                           TPMI_ALG_HASH hash_alg,
+                                           TPMI_RH_HIERARCHY hierarchy,
+                                           size_t size,
+                                           const uint8_t *data,
+                                           size_t result_size,
+                                           uint8_t *result);
+sgx_status_t tcti_sgx_get_resume_token_ocall (TSS2_RC *rc,
+                                              uint64_t session_id,
+                                              size_t size,
+                                              uint8_t *token);
+sgx_status_t tcti_sgx_park_ocall (TSS2_RC *rc,
+                                  uint64_t session_id);
+sgx_status_t tcti_sgx_resume_ocall (uint64_t *session_id,
+                                    size_t size,
+                                    const uint8_t *token);
+sgx_status_t tcti_sgx_set_tag_ocall (TSS2_RC *rc,
+                                     uint64_t session_id,
+                                     uint64_t tag);
+sgx_status_t tcti_sgx_get_queue_depth_ocall (TSS2_RC *rc,
+                                             uint64_t session_id,
+                                             uint32_t *depth);
+sgx_status_t tcti_sgx_set_priority_ocall (TSS2_RC *rc,
+                                          uint64_t session_id,
+                                          uint32_t priority);
+sgx_status_t tcti_sgx_transmit_deadline_ocall (TSS2_RC *rc,
+                                               uint64_t session_id,
+                                               size_t size,
+                                               const uint8_t *command,
+                                               uint32_t deadline_ms);
+
+/*
+ * Answer a TPM2_GetRandom command from the entropy pool if the caller has
+ * asked us to. On success the response is left in the context for
+ * tcti_sgx_receive to pick up and 1 is returned. If the command isn't a
+ * GetRandom, or the pool can't be refilled, 0 is returned and the command
+ * should be sent to the TPM as usual.
+ */
+static int
+tcti_sgx_get_random_local (TCTI_CONTEXT_SGX *sgx_context,
+                           size_t size,
+                           uint8_t const *command)
+{
+    uint16_t requested;
+    uint8_t *random = &sgx_context->local_response [TPM2_HEADER_SIZE + 2];
+
+    if (!(sgx_context->entropy_flags & TSS2_TCTI_SGX_ENTROPY_GET_RANDOM) ||
+        size != TPM2_HEADER_SIZE + 2 || !tpm2_header_valid (command, size) ||
+        tpm2_header_tag (command) != TPM2_ST_NO_SESSIONS ||
+        tpm2_header_code (command) != TPM2_CC_GetRandom)
+        return 0;
+    requested = tpm2_get_uint16 (&command [TPM2_HEADER_SIZE]);
+    if (requested > TCTI_SGX_RANDOM_MAX)
+        requested = TCTI_SGX_RANDOM_MAX;
+    if (Tss2_Tcti_Sgx_GetRandom ((TSS2_TCTI_CONTEXT*)sgx_context,
+                                 random,
+                                 requested) != TSS2_RC_SUCCESS)
+        return 0;
+    sgx_context->local_data = sgx_context->local_response;
+    sgx_context->local_size = TPM2_HEADER_SIZE + 2 + requested;
+    tpm2_header_set (sgx_context->local_response,
+                     TPM2_ST_NO_SESSIONS,
+                     sgx_context->local_size,
+                     TPM2_RC_SUCCESS);
+    tpm2_set_uint16 (&sgx_context->local_response [TPM2_HEADER_SIZE],
+                     requested);
+    return 1;
+}
+/*
+ * Answer a GetCapability command for fixed TPM properties from the
+ * capability cache. Returns 1 when the response is left in the context
+ * for tcti_sgx_receive to pick up. When the command is cacheable but
+ * we don't have the response yet we remember the command so the response
+ * can be cached when it comes back.
+ */
+static int
+tcti_sgx_get_cap_local (TCTI_CONTEXT_SGX *sgx_context,
+                        size_t size,
+                        uint8_t const *command)
+{
+    if (!tcti_sgx_cap_cache_cacheable (command, size))
+        return 0;
+    sgx_context->local_data = tcti_sgx_cap_cache_lookup (command,
+                                                         size,
+                                                         &sgx_context->local_size);
+    if (sgx_context->local_data != NULL)
+        return 1;
+    memcpy (sgx_context->cap_command, command, size);
+    sgx_context->cap_pending = 1;
+    return 0;
+}
 
 /*
  * This is the function that is hooked into the standard TSS2_TCTI_CONTEXT
@@ -63,18 +166,42 @@ tcti_sgx_transmit (TSS2_TCTI_CONTEXT *tcti_context,
     }
     if (TCTI_SGX_STATE (tcti_context) != READY_TO_TRANSMIT)
         return TSS2_TCTI_RC_BAD_SEQUENCE;
+    ((TCTI_CONTEXT_SGX*)tcti_context)->cap_pending = 0;
+    if (tcti_sgx_get_random_local ((TCTI_CONTEXT_SGX*)tcti_context,
+                                   size,
+                                   command) ||
+        tcti_sgx_get_cap_local ((TCTI_CONTEXT_SGX*)tcti_context,
+                                size,
+                                command)) {
+        ((TCTI_CONTEXT_SGX*)tcti_context)->deadline_ms = 0;
+        TCTI_SGX_STATE (tcti_context) = READY_TO_RECEIVE;
+        return TSS2_RC_SUCCESS;
+    }
 
-    status = tcti_sgx_transmit_ocall (&retval,
-                                      TCTI_SGX_ID (tcti_context),
-                                      size,
-                                      command);
+    if (((TCTI_CONTEXT_SGX*)tcti_context)->deadline_ms != 0)
+        status = tcti_sgx_transmit_deadline_ocall (
+            &retval,
+            TCTI_SGX_ID (tcti_context),
+            size,
+            command,
+            ((TCTI_CONTEXT_SGX*)tcti_context)->deadline_ms);
+    else
+        status = tcti_sgx_transmit_ocall (&retval,
+                                          TCTI_SGX_ID (tcti_context),
+                                          size,
+                                          command);
     /*
      * Map SGX error codes to TSS2_RC error codes. If no SGX error return
      * the 'retval' parameter that contains the TSS2_RC value from outside
-     * the enclave.
+     * the enclave. There's only a response to receive if the command
+     * went out: one turned away with TSS2_TCTI_RC_TRY_AGAIN can be sent
+     * again, with its deadline.
      */
     if (status == SGX_SUCCESS) {
-        TCTI_SGX_STATE (tcti_context) = READY_TO_RECEIVE;
+        if (retval == TSS2_RC_SUCCESS) {
+            ((TCTI_CONTEXT_SGX*)tcti_context)->deadline_ms = 0;
+            TCTI_SGX_STATE (tcti_context) = READY_TO_RECEIVE;
+        }
         return retval;
     } else {
         return TSS2_TCTI_RC_GENERAL_FAILURE;
@@ -98,6 +225,7 @@ tcti_sgx_receive (TSS2_TCTI_CONTEXT *tcti_context,
                   uint8_t *response,
                   int32_t timeout)
 {
+    TCTI_CONTEXT_SGX *sgx_context = (TCTI_CONTEXT_SGX*)tcti_context;
     sgx_status_t status;
     TSS2_RC retval;
 
@@ -110,6 +238,19 @@ tcti_sgx_receive (TSS2_TCTI_CONTEXT *tcti_context,
     }
     if (TCTI_SGX_STATE (tcti_context) != READY_TO_RECEIVE)
         return TSS2_TCTI_RC_BAD_SEQUENCE;
+    if (sgx_context->local_size != 0 && size != NULL) {
+        if (response == NULL) {
+            *size = sgx_context->local_size;
+            return TSS2_RC_SUCCESS;
+        }
+        if (*size < sgx_context->local_size)
+            return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+        memcpy (response, sgx_context->local_data, sgx_context->local_size);
+        *size = sgx_context->local_size;
+        sgx_context->local_size = 0;
+        TCTI_SGX_STATE (tcti_context) = READY_TO_TRANSMIT;
+        return TSS2_RC_SUCCESS;
+    }
 
     status = tcti_sgx_receive_ocall (&retval,
                                      TCTI_SGX_ID (tcti_context),
@@ -117,7 +258,17 @@ tcti_sgx_receive (TSS2_TCTI_CONTEXT *tcti_context,
                                      response,
                                      timeout);
     if (status == SGX_SUCCESS) {
+        /* no response yet, the client may poll again */
+        if (retval == TSS2_TCTI_RC_TRY_AGAIN)
+            return retval;
         TCTI_SGX_STATE (tcti_context) = READY_TO_TRANSMIT;
+        if (sgx_context->cap_pending && retval == TSS2_RC_SUCCESS &&
+            *size >= TPM2_HEADER_SIZE && tpm2_header_size (response) <= *size)
+            tcti_sgx_cap_cache_insert (sgx_context->cap_command,
+                                       sizeof (sgx_context->cap_command),
+                                       response,
+                                       tpm2_header_size (response));
+        sgx_context->cap_pending = 0;
         return retval;
     } else {
         return TSS2_TCTI_RC_GENERAL_FAILURE;
@@ -159,6 +310,7 @@ tcti_sgx_finalize (TSS2_TCTI_CONTEXT *tcti_context)
 TSS2_RC
 tcti_sgx_cancel (TSS2_TCTI_CONTEXT *tcti_context)
 {
+    TCTI_CONTEXT_SGX *sgx_context = (TCTI_CONTEXT_SGX*)tcti_context;
     sgx_status_t status;
     TSS2_RC retval;
 
@@ -171,6 +323,13 @@ tcti_sgx_cancel (TSS2_TCTI_CONTEXT *tcti_context)
     }
     if (TCTI_SGX_STATE (tcti_context) != READY_TO_RECEIVE)
         return TSS2_TCTI_RC_BAD_SEQUENCE;
+    sgx_context->cap_pending = 0;
+    /* nothing to cancel if the TPM never saw the command */
+    if (sgx_context->local_size != 0) {
+        sgx_context->local_size = 0;
+        TCTI_SGX_STATE (tcti_context) = READY_TO_TRANSMIT;
+        return TSS2_RC_SUCCESS;
+    }
 
     status = tcti_sgx_cancel_ocall (&retval, TCTI_SGX_ID (tcti_context));
 
@@ -252,6 +411,29 @@ tcti_sgx_set_locality (TSS2_TCTI_CONTEXT *tcti_context,
     else
         return TSS2_TCTI_RC_GENERAL_FAILURE;
 }
+/*
+ * Set up everything in the context but the session ID.
+ */
+static void
+tcti_sgx_init_context (TSS2_TCTI_CONTEXT *tcti_context)
+{
+    TSS2_TCTI_MAGIC (tcti_context) = TCTI_SGX_MAGIC;
+    TSS2_TCTI_VERSION (tcti_context) = 1;
+    TSS2_TCTI_TRANSMIT (tcti_context) = tcti_sgx_transmit;
+    TSS2_TCTI_RECEIVE (tcti_context) = tcti_sgx_receive;
+    TSS2_TCTI_FINALIZE (tcti_context) = tcti_sgx_finalize;
+    TSS2_TCTI_CANCEL (tcti_context) = tcti_sgx_cancel;
+    TSS2_TCTI_GET_POLL_HANDLES (tcti_context) = tcti_sgx_get_poll_handles;
+    TSS2_TCTI_SET_LOCALITY (tcti_context) = tcti_sgx_set_locality;
+    ((TCTI_CONTEXT_SGX*)tcti_context)->entropy_refill = TCTI_SGX_ENTROPY_DEFAULT;
+    ((TCTI_CONTEXT_SGX*)tcti_context)->entropy_avail = 0;
+    ((TCTI_CONTEXT_SGX*)tcti_context)->entropy_flags = 0;
+    ((TCTI_CONTEXT_SGX*)tcti_context)->local_size = 0;
+    ((TCTI_CONTEXT_SGX*)tcti_context)->local_data = NULL;
+    ((TCTI_CONTEXT_SGX*)tcti_context)->cap_pending = 0;
+    ((TCTI_CONTEXT_SGX*)tcti_context)->hash_alg = TPM2_ALG_NULL;
+    ((TCTI_CONTEXT_SGX*)tcti_context)->deadline_ms = 0;
+}
 /*
  * This is the initialization function for the SGX TCTI. It inplements a
  * protocol similar to the TSS SAPI that enables the user to obtain the
@@ -287,14 +469,7 @@ Tss2_Tcti_Sgx_Init (TSS2_TCTI_CONTEXT *tcti_context,
         *size = sizeof (TCTI_CONTEXT_SGX);
         return TSS2_RC_SUCCESS;
     }
-    TSS2_TCTI_MAGIC (tcti_context) = TCTI_SGX_MAGIC;
-    TSS2_TCTI_VERSION (tcti_context) = 1;
-    TSS2_TCTI_TRANSMIT (tcti_context) = tcti_sgx_transmit;
-    TSS2_TCTI_RECEIVE (tcti_context) = tcti_sgx_receive;
-    TSS2_TCTI_FINALIZE (tcti_context) = tcti_sgx_finalize;
-    TSS2_TCTI_CANCEL (tcti_context) = tcti_sgx_cancel;
-    TSS2_TCTI_GET_POLL_HANDLES (tcti_context) = tcti_sgx_get_poll_handles;
-    TSS2_TCTI_SET_LOCALITY (tcti_context) = tcti_sgx_set_locality;
+    tcti_sgx_init_context (tcti_context);
 
     status = tcti_sgx_init_ocall (&TCTI_SGX_ID (tcti_context));
     if (status != SGX_SUCCESS)
@@ -306,3 +481,465 @@ Tss2_Tcti_Sgx_Init (TSS2_TCTI_CONTEXT *tcti_context,
     TCTI_SGX_STATE (tcti_context) = READY_TO_TRANSMIT;
     return TSS2_RC_SUCCESS;
 }
+/*
+ * Configure the entropy pool used by Tss2_Tcti_Sgx_GetRandom. Each time
+ * the pool runs dry 'refill_size' bytes are fetched from the TPM with a
+ * single ocall. The manager outside the enclave gathers them with as few
+ * maximum size TPM2_GetRandom commands as it can (and may have them on
+ * hand already, see tcti_sgx_mgr_set_entropy_reserve). When 'flags'
+ * includes TSS2_TCTI_SGX_ENTROPY_GET_RANDOM, TPM2_GetRandom commands
+ * sent through this TCTI are answered from the pool as well.
+ * This function returns:
+ * - TSS2_TCTI_RC_BAD_VALUE: when 'refill_size' is 0 or larger than the
+ *   pool (TCTI_SGX_ENTROPY_MAX).
+ * - TSS2_RC_SUCCESS: otherwise.
+ */
+TSS2_RC
+Tss2_Tcti_Sgx_SetEntropy (TSS2_TCTI_CONTEXT *tcti_context,
+                          size_t refill_size,
+                          uint32_t flags)
+{
+    TCTI_CONTEXT_SGX *sgx_context = (TCTI_CONTEXT_SGX*)tcti_context;
+
+    if (tcti_context == NULL ||
+        TSS2_TCTI_MAGIC (tcti_context) != TCTI_SGX_MAGIC) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (refill_size == 0 || refill_size > TCTI_SGX_ENTROPY_MAX)
+        return TSS2_TCTI_RC_BAD_VALUE;
+    sgx_context->entropy_refill = refill_size;
+    sgx_context->entropy_flags = flags;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Fill 'buf' with 'size' random bytes from the TPM. They're taken from the
+ * entropy pool which is refilled by an ocall when it's empty. Bytes are
+ * wiped from the pool as they're handed out. Refilling the pool uses the
+ * connection to the TPM so it can't happen while there's a command
+ * outstanding.
+ * This function returns:
+ * - TSS2_TCTI_RC_BAD_REFERENCE: when 'buf' is NULL.
+ * - TSS2_TCTI_RC_BAD_SEQUENCE: when the pool must be refilled while the
+ *   context is waiting on a response.
+ * - TSS2_TCTI_RC_GENERAL_FAILURE: when an SGX error occurs.
+ * - the error from outside the enclave if the refill fails.
+ */
+TSS2_RC
+Tss2_Tcti_Sgx_GetRandom (TSS2_TCTI_CONTEXT *tcti_context,
+                         uint8_t *buf,
+                         size_t size)
+{
+    TCTI_CONTEXT_SGX *sgx_context = (TCTI_CONTEXT_SGX*)tcti_context;
+    sgx_status_t status;
+    TSS2_RC retval;
+    size_t count;
+    uint8_t *src;
+
+    if (tcti_context == NULL ||
+        TSS2_TCTI_MAGIC (tcti_context) != TCTI_SGX_MAGIC) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (buf == NULL && size > 0)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+
+    while (size > 0) {
+        if (sgx_context->entropy_avail == 0) {
+            if (TCTI_SGX_STATE (tcti_context) != READY_TO_TRANSMIT)
+                return TSS2_TCTI_RC_BAD_SEQUENCE;
+            status = tcti_sgx_get_random_ocall (&retval,
+                                                TCTI_SGX_ID (tcti_context),
+                                                sgx_context->entropy_refill,
+                                                sgx_context->entropy);
+            if (status != SGX_SUCCESS)
+                return TSS2_TCTI_RC_GENERAL_FAILURE;
+            if (retval != TSS2_RC_SUCCESS)
+                return retval;
+            sgx_context->entropy_avail = sgx_context->entropy_refill;
+        }
+        count = size < sgx_context->entropy_avail ?
+            size : sgx_context->entropy_avail;
+        sgx_context->entropy_avail -= count;
+        src = &sgx_context->entropy [sgx_context->entropy_avail];
+        memcpy (buf, src, count);
+        memset (src, 0, count);
+        buf += count;
+        size -= count;
+    }
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Hash 'size' bytes of 'data' with the TPM as part of a hash sequence that
+ * is completed by Tss2_Tcti_Sgx_HashComplete. The data crosses the enclave
+ * boundary in a single ocall no matter how large it is: outside the
+ * enclave the manager starts the sequence and feeds it to the TPM in
+ * chunks of up to TPM2_MAX_DIGEST_BUFFER bytes. The hash sequence uses the
+ * connection to the TPM so this can't happen while there's a command
+ * outstanding. Commands sent in between don't end the sequence.
+ * This function returns:
+ * - TSS2_TCTI_RC_BAD_REFERENCE: when 'data' is NULL.
+ * - TSS2_TCTI_RC_BAD_VALUE: when 'hash_alg' isn't the algorithm of the
+ *   sequence already in progress.
+ * - TSS2_TCTI_RC_BAD_SEQUENCE: when the context is waiting on a response.
+ * - TSS2_TCTI_RC_GENERAL_FAILURE: when an SGX error occurs.
+ * - TSS2_TCTI_RC_TRY_AGAIN: when the manager turned the data away, the
+ *   sequence is left as it was.
+ * - any other error from outside the enclave, in which case the sequence
+ *   is abandoned.
+ */
+TSS2_RC
+Tss2_Tcti_Sgx_HashUpdate (TSS2_TCTI_CONTEXT *tcti_context,
+                          TPMI_ALG_HASH hash_alg,
+                          uint8_t const *data,
+                          size_t size)
+{
+    TCTI_CONTEXT_SGX *sgx_context = (TCTI_CONTEXT_SGX*)tcti_context;
+    sgx_status_t status;
+    TSS2_RC retval;
+
+    if (tcti_context == NULL ||
+        TSS2_TCTI_MAGIC (tcti_context) != TCTI_SGX_MAGIC) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (data == NULL && size > 0)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    if (hash_alg == TPM2_ALG_NULL ||
+        (sgx_context->hash_alg != TPM2_ALG_NULL &&
+         sgx_context->hash_alg != hash_alg))
+        return TSS2_TCTI_RC_BAD_VALUE;
+    if (TCTI_SGX_STATE (tcti_context) != READY_TO_TRANSMIT)
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+
+    status = tcti_sgx_hash_update_ocall (&retval,
+                                         TCTI_SGX_ID (tcti_context),
+                                         hash_alg,
+                                         size,
+                                         data);
+    if (status != SGX_SUCCESS)
+        return TSS2_TCTI_RC_GENERAL_FAILURE;
+    if (retval == TSS2_RC_SUCCESS)
+        sgx_context->hash_alg = hash_alg;
+    else if (retval != TSS2_TCTI_RC_TRY_AGAIN)
+        sgx_context->hash_alg = TPM2_ALG_NULL;
+    return retval;
+}
+/*
+ * Unmarshal the digest and ticket returned by tcti_sgx_hash_complete_ocall.
+ */
+static TSS2_RC
+hash_result_unmarshal (uint8_t const *buf,
+                       size_t size,
+                       TPM2B_DIGEST *digest,
+                       TPMT_TK_HASHCHECK *validation)
+{
+    uint16_t digest_size, ticket_size;
+    size_t offset;
+
+    if (size < 2)
+        return TSS2_TCTI_RC_MALFORMED_RESPONSE;
+    digest_size = tpm2_get_uint16 (buf);
+    offset = 2 + digest_size;
+    if (digest_size > sizeof (digest->buffer) || size < offset + 8)
+        return TSS2_TCTI_RC_MALFORMED_RESPONSE;
+    ticket_size = tpm2_get_uint16 (&buf [offset + 6]);
+    if (ticket_size > sizeof (validation->digest.buffer) ||
+        size < offset + 8 + ticket_size)
+        return TSS2_TCTI_RC_MALFORMED_RESPONSE;
+    digest->size = digest_size;
+    memcpy (digest->buffer, &buf [2], digest_size);
+    if (validation != NULL) {
+        validation->tag = tpm2_get_uint16 (&buf [offset]);
+        validation->hierarchy = tpm2_get_uint32 (&buf [offset + 2]);
+        validation->digest.size = ticket_size;
+        memcpy (validation->digest.buffer, &buf [offset + 8], ticket_size);
+    }
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Hash the last 'size' bytes of 'data' and get the digest of everything
+ * passed to Tss2_Tcti_Sgx_HashUpdate since the sequence started. Without
+ * any preceding Tss2_Tcti_Sgx_HashUpdate this hashes 'data' alone, which
+ * makes hashing a single buffer a single ocall. The ticket for 'hierarchy'
+ * is returned in 'validation' unless it's NULL.
+ * This function returns:
+ * - TSS2_TCTI_RC_BAD_REFERENCE: when 'digest' is NULL or 'data' is NULL.
+ * - TSS2_TCTI_RC_BAD_VALUE: when 'hash_alg' isn't the algorithm of the
+ *   sequence in progress.
+ * - TSS2_TCTI_RC_BAD_SEQUENCE: when the context is waiting on a response.
+ * - TSS2_TCTI_RC_GENERAL_FAILURE: when an SGX error occurs.
+ * - TSS2_TCTI_RC_MALFORMED_RESPONSE: when the result can't be unmarshalled.
+ * - TSS2_TCTI_RC_TRY_AGAIN: when the manager turned the call away, the
+ *   sequence is left as it was.
+ * - any other error from outside the enclave.
+ * Otherwise the sequence is over when this function returns, whether it
+ * succeeds or not.
+ */
+TSS2_RC
+Tss2_Tcti_Sgx_HashComplete (TSS2_TCTI_CONTEXT *tcti_context,
+                            TPMI_ALG_HASH hash_alg,
+                            TPMI_RH_HIERARCHY hierarchy,
+                            uint8_t const *data,
+                            size_t size,
+                            TPM2B_DIGEST *digest,
+                            TPMT_TK_HASHCHECK *validation)
+{
+    TCTI_CONTEXT_SGX *sgx_context = (TCTI_CONTEXT_SGX*)tcti_context;
+    uint8_t result [TCTI_SGX_HASH_RESULT_MAX];
+    sgx_status_t status;
+    TSS2_RC retval;
+
+    if (tcti_context == NULL ||
+        TSS2_TCTI_MAGIC (tcti_context) != TCTI_SGX_MAGIC) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (digest == NULL || (data == NULL && size > 0))
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    if (hash_alg == TPM2_ALG_NULL ||
+        (sgx_context->hash_alg != TPM2_ALG_NULL &&
+         sgx_context->hash_alg != hash_alg))
+        return TSS2_TCTI_RC_BAD_VALUE;
+    if (TCTI_SGX_STATE (tcti_context) != READY_TO_TRANSMIT)
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+
+    status = tcti_sgx_hash_complete_ocall (&retval,
+                                           TCTI_SGX_ID (tcti_context),
+                                           hash_alg,
+                                           hierarchy,
+                                           size,
+                                           data,
+                                           sizeof (result),
+                                           result);
+    if (status != SGX_SUCCESS || retval != TSS2_TCTI_RC_TRY_AGAIN)
+        sgx_context->hash_alg = TPM2_ALG_NULL;
+    if (status != SGX_SUCCESS)
+        return TSS2_TCTI_RC_GENERAL_FAILURE;
+    if (retval != TSS2_RC_SUCCESS)
+        return retval;
+    return hash_result_unmarshal (result, sizeof (result), digest, validation);
+}
+/*
+ * Get the token that resumes this context's session after the enclave is
+ * restarted, see Tss2_Tcti_Sgx_Park and Tss2_Tcti_Sgx_InitResume. The
+ * token is a bearer credential for the session: an enclave that keeps it
+ * across a restart should seal it. It stays the same until the session is
+ * resumed.
+ * This function returns:
+ * - TSS2_TCTI_RC_BAD_REFERENCE: when 'token' is NULL.
+ * - TSS2_TCTI_RC_BAD_VALUE: when 'size' isn't
+ *   TSS2_TCTI_SGX_RESUME_TOKEN_SIZE.
+ * - TSS2_TCTI_RC_GENERAL_FAILURE: when an SGX error occurs.
+ * - the error from outside the enclave.
+ */
+TSS2_RC
+Tss2_Tcti_Sgx_GetResumeToken (TSS2_TCTI_CONTEXT *tcti_context,
+                              uint8_t *token,
+                              size_t size)
+{
+    sgx_status_t status;
+    TSS2_RC retval;
+
+    if (tcti_context == NULL ||
+        TSS2_TCTI_MAGIC (tcti_context) != TCTI_SGX_MAGIC) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (token == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    if (size != TSS2_TCTI_SGX_RESUME_TOKEN_SIZE)
+        return TSS2_TCTI_RC_BAD_VALUE;
+
+    status = tcti_sgx_get_resume_token_ocall (&retval,
+                                              TCTI_SGX_ID (tcti_context),
+                                              size,
+                                              token);
+    if (status != SGX_SUCCESS)
+        return TSS2_TCTI_RC_GENERAL_FAILURE;
+    return retval;
+}
+/*
+ * Hand this context's session over to the manager outside the enclave to
+ * keep until an enclave presents its resume token to
+ * Tss2_Tcti_Sgx_InitResume. The connection to the TPM and the objects
+ * loaded through it are kept for a while (see
+ * tcti_sgx_mgr_set_park_timeout) instead of being torn down with the
+ * enclave. The context is detached from the session on success and only
+ * good for Tss2_Tcti_Finalize.
+ * This function returns:
+ * - TSS2_TCTI_RC_BAD_SEQUENCE: when the context is waiting on a response.
+ * - TSS2_TCTI_RC_GENERAL_FAILURE: when an SGX error occurs.
+ * - the error from outside the enclave.
+ */
+TSS2_RC
+Tss2_Tcti_Sgx_Park (TSS2_TCTI_CONTEXT *tcti_context)
+{
+    sgx_status_t status;
+    TSS2_RC retval;
+
+    if (tcti_context == NULL ||
+        TSS2_TCTI_MAGIC (tcti_context) != TCTI_SGX_MAGIC) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (TCTI_SGX_STATE (tcti_context) != READY_TO_TRANSMIT)
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+
+    status = tcti_sgx_park_ocall (&retval, TCTI_SGX_ID (tcti_context));
+    if (status != SGX_SUCCESS)
+        return TSS2_TCTI_RC_GENERAL_FAILURE;
+    if (retval != TSS2_RC_SUCCESS)
+        return retval;
+    TCTI_SGX_ID (tcti_context) = 0;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Initialize the SGX TCTI like Tss2_Tcti_Sgx_Init but pick up the session
+ * parked under 'token' rather than starting a new one. Whatever was loaded
+ * in the TPM through the session is still there. A token resumes its
+ * session once.
+ * This function returns:
+ * - TSS2_TCTI_RC_BAD_VALUE: when 'tcti_context' and 'size' are both NULL,
+ *   when 'token_size' isn't TSS2_TCTI_SGX_RESUME_TOKEN_SIZE or when no
+ *   session is parked under 'token'.
+ * - TSS2_TCTI_RC_BAD_REFERENCE: when 'token' is NULL.
+ * - TSS2_TCTI_RC_GENERAL_FAILURE: when the resume ocall fails.
+ * - TSS2_RC_SUCCESS: otherwise. As with Tss2_Tcti_Sgx_Init a NULL context
+ *   and non NULL 'size' gets the size of the context.
+ */
+TSS2_RC
+Tss2_Tcti_Sgx_InitResume (TSS2_TCTI_CONTEXT *tcti_context,
+                          size_t *size,
+                          uint8_t const *token,
+                          size_t token_size)
+{
+    sgx_status_t status;
+
+    if (tcti_context == NULL && size == NULL)
+        return TSS2_TCTI_RC_BAD_VALUE;
+    if (tcti_context == NULL && size != NULL) {
+        *size = sizeof (TCTI_CONTEXT_SGX);
+        return TSS2_RC_SUCCESS;
+    }
+    if (token == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    if (token_size != TSS2_TCTI_SGX_RESUME_TOKEN_SIZE)
+        return TSS2_TCTI_RC_BAD_VALUE;
+    tcti_sgx_init_context (tcti_context);
+
+    status = tcti_sgx_resume_ocall (&TCTI_SGX_ID (tcti_context),
+                                    token_size,
+                                    token);
+    if (status != SGX_SUCCESS)
+        return TSS2_TCTI_RC_GENERAL_FAILURE;
+    if (TCTI_SGX_ID (tcti_context) == 0)
+        return TSS2_TCTI_RC_BAD_VALUE;
+    TCTI_SGX_STATE (tcti_context) = READY_TO_TRANSMIT;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Tag the session with 'tag'. The manager outside the enclave holds all
+ * the sessions with the same tag to a common limit on the commands they
+ * have outstanding with the TPM (see tcti_sgx_mgr_set_admission_limit),
+ * an enclave should use the same tag for all of its contexts. A tag of
+ * 0, the default, only counts against the limit for the whole manager.
+ * This function returns:
+ * - TSS2_TCTI_RC_GENERAL_FAILURE: when an SGX error occurs.
+ * - the error from outside the enclave.
+ */
+TSS2_RC
+Tss2_Tcti_Sgx_SetTag (TSS2_TCTI_CONTEXT *tcti_context,
+                      uint64_t tag)
+{
+    sgx_status_t status;
+    TSS2_RC retval;
+
+    if (tcti_context == NULL ||
+        TSS2_TCTI_MAGIC (tcti_context) != TCTI_SGX_MAGIC) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+
+    status = tcti_sgx_set_tag_ocall (&retval, TCTI_SGX_ID (tcti_context), tag);
+    if (status != SGX_SUCCESS)
+        return TSS2_TCTI_RC_GENERAL_FAILURE;
+    return retval;
+}
+/*
+ * After a transmit fails with TSS2_TCTI_RC_TRY_AGAIN, get the number of
+ * commands that were already waiting on the TPM in the scope that turned
+ * the command away. Callers can use it to decide how long to back off or
+ * whether to shed the work altogether.
+ * This function returns:
+ * - TSS2_TCTI_RC_BAD_REFERENCE: when 'depth' is NULL.
+ * - TSS2_TCTI_RC_GENERAL_FAILURE: when an SGX error occurs.
+ * - the error from outside the enclave.
+ */
+TSS2_RC
+Tss2_Tcti_Sgx_GetQueueDepth (TSS2_TCTI_CONTEXT *tcti_context,
+                             uint32_t *depth)
+{
+    sgx_status_t status;
+    TSS2_RC retval;
+
+    if (tcti_context == NULL ||
+        TSS2_TCTI_MAGIC (tcti_context) != TCTI_SGX_MAGIC) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (depth == NULL)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+
+    status = tcti_sgx_get_queue_depth_ocall (&retval,
+                                             TCTI_SGX_ID (tcti_context),
+                                             depth);
+    if (status != SGX_SUCCESS)
+        return TSS2_TCTI_RC_GENERAL_FAILURE;
+    return retval;
+}
+/*
+ * Set the priority class, one of the TSS2_TCTI_SGX_PRIORITY_* values,
+ * the manager outside the enclave schedules the session's commands on
+ * the TPM in. Sessions start out in TSS2_TCTI_SGX_PRIORITY_NORMAL and the
+ * manager can override the class, and the class of particular commands,
+ * as it sees fit.
+ * This function returns:
+ * - TSS2_TCTI_RC_GENERAL_FAILURE: when an SGX error occurs.
+ * - the error from outside the enclave.
+ */
+TSS2_RC
+Tss2_Tcti_Sgx_SetPriority (TSS2_TCTI_CONTEXT *tcti_context,
+                           uint32_t priority)
+{
+    sgx_status_t status;
+    TSS2_RC retval;
+
+    if (tcti_context == NULL ||
+        TSS2_TCTI_MAGIC (tcti_context) != TCTI_SGX_MAGIC) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+
+    status = tcti_sgx_set_priority_ocall (&retval,
+                                          TCTI_SGX_ID (tcti_context),
+                                          priority);
+    if (status != SGX_SUCCESS)
+        return TSS2_TCTI_RC_GENERAL_FAILURE;
+    return retval;
+}
+/*
+ * Give the next command sent through this context a deadline: the manager
+ * answers it with TPM2_RC_CANCELED if it can't be sent to the TPM within
+ * 'deadline_ms' milliseconds and cancels it if the TPM hasn't answered by
+ * then. The deadline is relative since the enclave has no trusted clock
+ * to give an absolute one. It applies to one command, 0 clears it.
+ * This function returns:
+ * - TSS2_TCTI_RC_BAD_CONTEXT: when the context isn't ours.
+ * - TSS2_TCTI_RC_BAD_SEQUENCE: when a response is waiting to be received.
+ */
+TSS2_RC
+Tss2_Tcti_Sgx_SetDeadline (TSS2_TCTI_CONTEXT *tcti_context,
+                           uint32_t deadline_ms)
+{
+    if (tcti_context == NULL ||
+        TSS2_TCTI_MAGIC (tcti_context) != TCTI_SGX_MAGIC) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (TCTI_SGX_STATE (tcti_context) != READY_TO_TRANSMIT)
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+
+    ((TCTI_CONTEXT_SGX*)tcti_context)->deadline_ms = deadline_ms;
+    return TSS2_RC_SUCCESS;
+}
@@ -5,6 +5,9 @@
 #ifndef TSS2_TCTI_SGX_PRIV_H
 #define TSS2_TCTI_SGX_PRIV_H
 
+#include "tcti-sgx-cap-cache.h"
+#include "tpm2-header.h"
+
 /*
  * generate your own:
  * cat /dev/random | tr -dc 'a-f0-9' | fold -w 16 | head -n 1
@@ -12,6 +15,23 @@
 #define TCTI_SGX_MAGIC 0x4e50bc1dcdb7623c
 #define TCTI_SGX_ID(context) ((TCTI_CONTEXT_SGX*)context)->id
 #define TCTI_SGX_STATE(context) ((TCTI_CONTEXT_SGX*)context)->state
+/*
+ * Size of the entropy pool and the default number of bytes fetched from
+ * the TPM each time it runs dry.
+ */
+#define TCTI_SGX_ENTROPY_MAX 4096
+#define TCTI_SGX_ENTROPY_DEFAULT 1024
+/*
+ * Largest randomBytes we return for a TPM2_GetRandom answered from the
+ * pool. The TPM limits this to the size of its largest digest.
+ */
+#define TCTI_SGX_RANDOM_MAX 64
+/*
+ * Largest result from the hash ocalls: the marshalled digest
+ * (TPM2B_DIGEST) followed by the ticket (TPMT_TK_HASHCHECK).
+ */
+#define TCTI_SGX_HASH_RESULT_MAX \
+    (2 * sizeof (((TPM2B_DIGEST*)0)->buffer) + 2 + 2 + 4 + 2)
 
 /*
  * There is a small state machine maintained by this TCTI. It is used to
@@ -44,6 +64,39 @@ typedef struct {
     TSS2_TCTI_CONTEXT_COMMON_V1 common;
     uint64_t                    id;
     tcti_sgx_state_t state;
+    /*
+     * Entropy pool: random bytes from the TPM fetched in bulk and handed
+     * out by Tss2_Tcti_Sgx_GetRandom. The unused bytes are the first
+     * 'entropy_avail' in 'entropy'.
+     */
+    size_t entropy_refill;
+    size_t entropy_avail;
+    uint32_t entropy_flags;
+    uint8_t entropy [TCTI_SGX_ENTROPY_MAX];
+    /*
+     * Response to a command answered from inside the enclave. It's
+     * waiting to be collected when 'local_size' is not 0. 'local_data'
+     * points either to 'local_response' or into the capability cache.
+     */
+    size_t local_size;
+    uint8_t const *local_data;
+    uint8_t local_response [TPM2_HEADER_SIZE + 2 + TCTI_SGX_RANDOM_MAX];
+    /*
+     * A cacheable GetCapability command sent to the TPM. Its response is
+     * added to the capability cache when it's received.
+     */
+    int cap_pending;
+    uint8_t cap_command [TCTI_SGX_CAP_COMMAND_SIZE];
+    /*
+     * Hash algorithm of the hash sequence being fed by
+     * Tss2_Tcti_Sgx_HashUpdate, TPM2_ALG_NULL when there isn't one.
+     */
+    TPMI_ALG_HASH hash_alg;
+    /*
+     * Milliseconds the next command sent has to be answered in, set by
+     * Tss2_Tcti_Sgx_SetDeadline. 0 for no deadline.
+     */
+    uint32_t deadline_ms;
 } TCTI_CONTEXT_SGX;
 
 TSS2_RC tcti_sgx_transmit (TSS2_TCTI_CONTEXT *tcti_context,
@@ -0,0 +1,105 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TPM2_HEADER_H
+#define TPM2_HEADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <tss2/tss2_tpm2_types.h>
+
+/*
+ * Helpers for picking apart and building the headers on TPM2 command and
+ * response buffers. Everything in a TPM2 buffer is big endian. These are
+ * used from both sides of the enclave boundary so they must stay plain C
+ * and depend on nothing more than the tss2 type definitions.
+ *
+ * Command header:  tag (2) | size (4) | commandCode (4)
+ * Response header: tag (2) | size (4) | responseCode (4)
+ */
+#define TPM2_HEADER_SIZE 10
+#define TPM2_HEADER_TAG_OFFSET 0
+#define TPM2_HEADER_SIZE_OFFSET 2
+#define TPM2_HEADER_CODE_OFFSET 6
+
+static inline uint16_t
+tpm2_get_uint16 (uint8_t const *buf)
+{
+    return (uint16_t)((buf [0] << 8) | buf [1]);
+}
+static inline uint32_t
+tpm2_get_uint32 (uint8_t const *buf)
+{
+    return ((uint32_t)buf [0] << 24) | ((uint32_t)buf [1] << 16) |
+           ((uint32_t)buf [2] << 8)  |  (uint32_t)buf [3];
+}
+static inline uint64_t
+tpm2_get_uint64 (uint8_t const *buf)
+{
+    return ((uint64_t)tpm2_get_uint32 (buf) << 32) |
+           tpm2_get_uint32 (&buf [4]);
+}
+static inline void
+tpm2_set_uint16 (uint8_t *buf,
+                 uint16_t value)
+{
+    buf [0] = (uint8_t)(value >> 8);
+    buf [1] = (uint8_t)value;
+}
+static inline void
+tpm2_set_uint32 (uint8_t *buf,
+                 uint32_t value)
+{
+    buf [0] = (uint8_t)(value >> 24);
+    buf [1] = (uint8_t)(value >> 16);
+    buf [2] = (uint8_t)(value >> 8);
+    buf [3] = (uint8_t)value;
+}
+static inline void
+tpm2_set_uint64 (uint8_t *buf,
+                 uint64_t value)
+{
+    tpm2_set_uint32 (buf, (uint32_t)(value >> 32));
+    tpm2_set_uint32 (&buf [4], (uint32_t)value);
+}
+/*
+ * Returns non-zero when 'buf' holds at least a header and the size field
+ * from the header agrees with the size of the buffer.
+ */
+static inline int
+tpm2_header_valid (uint8_t const *buf,
+                   size_t size)
+{
+    return buf != NULL && size >= TPM2_HEADER_SIZE &&
+        tpm2_get_uint32 (&buf [TPM2_HEADER_SIZE_OFFSET]) == size;
+}
+static inline TPM2_ST
+tpm2_header_tag (uint8_t const *buf)
+{
+    return tpm2_get_uint16 (&buf [TPM2_HEADER_TAG_OFFSET]);
+}
+static inline uint32_t
+tpm2_header_size (uint8_t const *buf)
+{
+    return tpm2_get_uint32 (&buf [TPM2_HEADER_SIZE_OFFSET]);
+}
+/* commandCode for command buffers, responseCode for response buffers */
+static inline uint32_t
+tpm2_header_code (uint8_t const *buf)
+{
+    return tpm2_get_uint32 (&buf [TPM2_HEADER_CODE_OFFSET]);
+}
+static inline void
+tpm2_header_set (uint8_t *buf,
+                 TPM2_ST tag,
+                 uint32_t size,
+                 uint32_t code)
+{
+    tpm2_set_uint16 (&buf [TPM2_HEADER_TAG_OFFSET], tag);
+    tpm2_set_uint32 (&buf [TPM2_HEADER_SIZE_OFFSET], size);
+    tpm2_set_uint32 (&buf [TPM2_HEADER_CODE_OFFSET], code);
+}
+
+#endif /* TPM2_HEADER_H */
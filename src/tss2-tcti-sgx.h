@@ -12,7 +12,53 @@
 extern "C" {
 #endif
 
+/*
+ * Flags for Tss2_Tcti_Sgx_SetEntropy.
+ * TSS2_TCTI_SGX_ENTROPY_GET_RANDOM: answer TPM2_GetRandom commands sent
+ * through the TCTI from the entropy pool.
+ */
+#define TSS2_TCTI_SGX_ENTROPY_GET_RANDOM 0x1
+/* size of the token Tss2_Tcti_Sgx_InitResume takes */
+#define TSS2_TCTI_SGX_RESUME_TOKEN_SIZE 32
+/* priority classes for Tss2_Tcti_Sgx_SetPriority, best first */
+#define TSS2_TCTI_SGX_PRIORITY_HIGH 0
+#define TSS2_TCTI_SGX_PRIORITY_NORMAL 1
+#define TSS2_TCTI_SGX_PRIORITY_LOW 2
+
 TSS2_RC Tss2_Tcti_Sgx_Init (TSS2_TCTI_CONTEXT *context, size_t *size);
+TSS2_RC Tss2_Tcti_Sgx_SetEntropy (TSS2_TCTI_CONTEXT *context,
+                                  size_t refill_size,
+                                  uint32_t flags);
+TSS2_RC Tss2_Tcti_Sgx_GetRandom (TSS2_TCTI_CONTEXT *context,
+                                 uint8_t *buf,
+                                 size_t size);
+TSS2_RC Tss2_Tcti_Sgx_HashUpdate (TSS2_TCTI_CONTEXT *context,
+                                  TPMI_ALG_HASH hash_alg,
+                                  uint8_t const *data,
+                                  size_t size);
+TSS2_RC Tss2_Tcti_Sgx_HashComplete (TSS2_TCTI_CONTEXT *context,
+                                    TPMI_ALG_HASH hash_alg,
+                                    TPMI_RH_HIERARCHY hierarchy,
+                                    uint8_t const *data,
+                                    size_t size,
+                                    TPM2B_DIGEST *digest,
+                                    TPMT_TK_HASHCHECK *validation);
+TSS2_RC Tss2_Tcti_Sgx_GetResumeToken (TSS2_TCTI_CONTEXT *context,
+                                      uint8_t *token,
+                                      size_t size);
+TSS2_RC Tss2_Tcti_Sgx_Park (TSS2_TCTI_CONTEXT *context);
+TSS2_RC Tss2_Tcti_Sgx_InitResume (TSS2_TCTI_CONTEXT *context,
+                                  size_t *size,
+                                  uint8_t const *token,
+                                  size_t token_size);
+TSS2_RC Tss2_Tcti_Sgx_SetTag (TSS2_TCTI_CONTEXT *context,
+                              uint64_t tag);
+TSS2_RC Tss2_Tcti_Sgx_GetQueueDepth (TSS2_TCTI_CONTEXT *context,
+                                     uint32_t *depth);
+TSS2_RC Tss2_Tcti_Sgx_SetPriority (TSS2_TCTI_CONTEXT *context,
+                                   uint32_t priority);
+TSS2_RC Tss2_Tcti_Sgx_SetDeadline (TSS2_TCTI_CONTEXT *context,
+                                   uint32_t deadline_ms);
 
 #if defined (__cplusplus)
 }
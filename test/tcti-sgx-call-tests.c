@@ -327,6 +327,103 @@ tcti_call_set_locality_bad_sequence_test (void **state)
     rc = tcti_sgx_set_locality (context, 0);
     assert_int_equal (rc, TSS2_TCTI_RC_BAD_SEQUENCE);
 }
+/*
+ * A command turned away by admission control can be sent again, the
+ * queue depth the manager gave is there to decide when.
+ */
+static void
+tcti_call_transmit_try_again_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = *state;
+    uint8_t command = 0;
+    uint32_t depth = 0;
+
+    will_return (__wrap_tcti_sgx_transmit_ocall, TSS2_TCTI_RC_TRY_AGAIN);
+    will_return (__wrap_tcti_sgx_transmit_ocall, SGX_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit (context, 0, &command),
+                      TSS2_TCTI_RC_TRY_AGAIN);
+    assert_int_equal (TCTI_SGX_STATE (context), READY_TO_TRANSMIT);
+
+    assert_int_equal (Tss2_Tcti_Sgx_GetQueueDepth (context, NULL),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+    will_return (__wrap_tcti_sgx_get_queue_depth_ocall, 12);
+    will_return (__wrap_tcti_sgx_get_queue_depth_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_get_queue_depth_ocall, SGX_SUCCESS);
+    assert_int_equal (Tss2_Tcti_Sgx_GetQueueDepth (context, &depth),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (depth, 12);
+
+    will_return (__wrap_tcti_sgx_transmit_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_transmit_ocall, SGX_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit (context, 0, &command),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (TCTI_SGX_STATE (context), READY_TO_RECEIVE);
+}
+static void
+tcti_call_set_tag_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = *state;
+
+    will_return (__wrap_tcti_sgx_set_tag_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_set_tag_ocall, SGX_SUCCESS);
+    assert_int_equal (Tss2_Tcti_Sgx_SetTag (context, 0x5a), TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_set_tag_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_set_tag_ocall, SGX_ERROR_UNEXPECTED);
+    assert_int_equal (Tss2_Tcti_Sgx_SetTag (context, 0x5a),
+                      TSS2_TCTI_RC_GENERAL_FAILURE);
+    assert_int_equal (Tss2_Tcti_Sgx_SetTag (NULL, 0x5a),
+                      TSS2_TCTI_RC_BAD_CONTEXT);
+}
+static void
+tcti_call_set_priority_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = *state;
+
+    will_return (__wrap_tcti_sgx_set_priority_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_set_priority_ocall, SGX_SUCCESS);
+    assert_int_equal (Tss2_Tcti_Sgx_SetPriority (context,
+                                                 TSS2_TCTI_SGX_PRIORITY_HIGH),
+                      TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_set_priority_ocall, TSS2_TCTI_RC_BAD_VALUE);
+    will_return (__wrap_tcti_sgx_set_priority_ocall, SGX_SUCCESS);
+    assert_int_equal (Tss2_Tcti_Sgx_SetPriority (context, 7),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (Tss2_Tcti_Sgx_SetPriority (NULL,
+                                                 TSS2_TCTI_SGX_PRIORITY_LOW),
+                      TSS2_TCTI_RC_BAD_CONTEXT);
+}
+/*
+ * A deadline goes out with the next command and stays set if the command
+ * is turned away.
+ */
+static void
+tcti_call_set_deadline_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = *state;
+    uint8_t command;
+
+    assert_int_equal (Tss2_Tcti_Sgx_SetDeadline (NULL, 100),
+                      TSS2_TCTI_RC_BAD_CONTEXT);
+    assert_int_equal (Tss2_Tcti_Sgx_SetDeadline (context, 100),
+                      TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_transmit_deadline_ocall,
+                 TSS2_TCTI_RC_TRY_AGAIN);
+    will_return (__wrap_tcti_sgx_transmit_deadline_ocall, SGX_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit (context, 0, &command),
+                      TSS2_TCTI_RC_TRY_AGAIN);
+    will_return (__wrap_tcti_sgx_transmit_deadline_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_transmit_deadline_ocall, SGX_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit (context, 0, &command),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_Tcti_Sgx_SetDeadline (context, 100),
+                      TSS2_TCTI_RC_BAD_SEQUENCE);
+
+    TCTI_SGX_STATE (context) = READY_TO_TRANSMIT;
+    will_return (__wrap_tcti_sgx_transmit_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_transmit_ocall, SGX_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit (context, 0, &command),
+                      TSS2_RC_SUCCESS);
+}
 int
 main(void)
 {
@@ -382,6 +479,18 @@ main(void)
         cmocka_unit_test_setup_teardown (tcti_call_set_locality_bad_sequence_test,
                                          tcti_struct_setup,
                                          tcti_struct_teardown),
+        cmocka_unit_test_setup_teardown (tcti_call_transmit_try_again_test,
+                                         tcti_struct_setup,
+                                         tcti_struct_teardown),
+        cmocka_unit_test_setup_teardown (tcti_call_set_tag_test,
+                                         tcti_struct_setup,
+                                         tcti_struct_teardown),
+        cmocka_unit_test_setup_teardown (tcti_call_set_priority_test,
+                                         tcti_struct_setup,
+                                         tcti_struct_teardown),
+        cmocka_unit_test_setup_teardown (tcti_call_set_deadline_test,
+                                         tcti_struct_setup,
+                                         tcti_struct_teardown),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
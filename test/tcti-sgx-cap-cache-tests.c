@@ -0,0 +1,191 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sgx_error.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "tss2-tcti-sgx.h"
+#include "tcti-sgx_priv.h"
+#include "tcti-sgx-cap-cache.h"
+#include "tcti-sgx-common.h"
+#include "tpm2-header.h"
+
+/*
+ * This module tests the cache of GetCapability responses for fixed TPM
+ * properties.
+ */
+
+static size_t
+build_getcap_cmd (uint8_t *buf,
+                  TPM2_CAP capability,
+                  uint32_t property,
+                  uint32_t count)
+{
+    tpm2_header_set (buf,
+                     TPM2_ST_NO_SESSIONS,
+                     TCTI_SGX_CAP_COMMAND_SIZE,
+                     TPM2_CC_GetCapability);
+    tpm2_set_uint32 (&buf [TPM2_HEADER_SIZE], capability);
+    tpm2_set_uint32 (&buf [TPM2_HEADER_SIZE + 4], property);
+    tpm2_set_uint32 (&buf [TPM2_HEADER_SIZE + 8], count);
+    return TCTI_SGX_CAP_COMMAND_SIZE;
+}
+/*
+ * Build a response to a TPM2_CAP_TPM_PROPERTIES query with 'count'
+ * consecutive properties starting at 'property'.
+ */
+static size_t
+build_properties_rsp (uint8_t *buf,
+                      uint32_t property,
+                      uint32_t count)
+{
+    size_t size = TPM2_HEADER_SIZE + 1 + 4 + 4 + count * 8;
+    uint8_t *p = &buf [TPM2_HEADER_SIZE];
+    uint32_t i;
+
+    tpm2_header_set (buf, TPM2_ST_NO_SESSIONS, size, TPM2_RC_SUCCESS);
+    p [0] = 0;
+    tpm2_set_uint32 (p + 1, TPM2_CAP_TPM_PROPERTIES);
+    tpm2_set_uint32 (p + 5, count);
+    for (i = 0; i < count; ++i) {
+        tpm2_set_uint32 (p + 9 + i * 8, property + i);
+        tpm2_set_uint32 (p + 13 + i * 8, 0x494e5443);
+    }
+    return size;
+}
+
+static int
+cap_cache_setup (void **state)
+{
+    tcti_sgx_cap_cache_reset ();
+    return tcti_struct_setup (state);
+}
+/*
+ * The first query for a fixed property goes to the TPM and its response
+ * is cached. The second is answered without any ocalls.
+ */
+static void
+cap_cache_fill_and_hit_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = *state;
+    uint8_t cmd [TCTI_SGX_CAP_COMMAND_SIZE], rsp [256], expected [256];
+    size_t size = sizeof (rsp), expected_size;
+
+    build_getcap_cmd (cmd, TPM2_CAP_TPM_PROPERTIES, TPM2_PT_MANUFACTURER, 1);
+    expected_size = build_properties_rsp (expected, TPM2_PT_MANUFACTURER, 1);
+
+    will_return (__wrap_tcti_sgx_transmit_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_transmit_ocall, SGX_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit (context, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+    /* the mock receive ocall leaves the response buffer alone */
+    memcpy (rsp, expected, expected_size);
+    will_return (__wrap_tcti_sgx_receive_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_receive_ocall, SGX_SUCCESS);
+    assert_int_equal (tcti_sgx_receive (context,
+                                        &size,
+                                        rsp,
+                                        TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+
+    memset (rsp, 0, sizeof (rsp));
+    size = sizeof (rsp);
+    assert_int_equal (tcti_sgx_transmit (context, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_receive (context,
+                                        &size,
+                                        rsp,
+                                        TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (size, expected_size);
+    assert_memory_equal (rsp, expected, expected_size);
+}
+/*
+ * Only queries for immutable capabilities are cacheable.
+ */
+static void
+cap_cache_cacheable_test (void **state)
+{
+    uint8_t cmd [TCTI_SGX_CAP_COMMAND_SIZE];
+    (void)state;
+
+    build_getcap_cmd (cmd, TPM2_CAP_ALGS, 0, 128);
+    assert_true (tcti_sgx_cap_cache_cacheable (cmd, sizeof (cmd)));
+    build_getcap_cmd (cmd, TPM2_CAP_ECC_CURVES, 0, 128);
+    assert_true (tcti_sgx_cap_cache_cacheable (cmd, sizeof (cmd)));
+    build_getcap_cmd (cmd, TPM2_CAP_TPM_PROPERTIES, TPM2_PT_FIXED, 64);
+    assert_true (tcti_sgx_cap_cache_cacheable (cmd, sizeof (cmd)));
+    build_getcap_cmd (cmd, TPM2_CAP_TPM_PROPERTIES, TPM2_PT_VAR, 1);
+    assert_false (tcti_sgx_cap_cache_cacheable (cmd, sizeof (cmd)));
+    build_getcap_cmd (cmd, TPM2_CAP_HANDLES, 0x81000000, 16);
+    assert_false (tcti_sgx_cap_cache_cacheable (cmd, sizeof (cmd)));
+    build_getcap_cmd (cmd, TPM2_CAP_PCRS, 0, 1);
+    assert_false (tcti_sgx_cap_cache_cacheable (cmd, sizeof (cmd)));
+    tpm2_header_set (cmd, TPM2_ST_SESSIONS, sizeof (cmd), TPM2_CC_GetCapability);
+    assert_false (tcti_sgx_cap_cache_cacheable (cmd, sizeof (cmd)));
+}
+/*
+ * A query that starts in the fixed group but whose response runs into the
+ * variable group isn't cached, nor are error responses.
+ */
+static void
+cap_cache_not_fixed_test (void **state)
+{
+    uint8_t cmd [TCTI_SGX_CAP_COMMAND_SIZE], rsp [256];
+    size_t size;
+    (void)state;
+
+    build_getcap_cmd (cmd, TPM2_CAP_TPM_PROPERTIES, TPM2_PT_VAR - 1, 2);
+    size = build_properties_rsp (rsp, TPM2_PT_VAR - 1, 2);
+    tcti_sgx_cap_cache_insert (cmd, sizeof (cmd), rsp, size);
+    assert_null (tcti_sgx_cap_cache_lookup (cmd, sizeof (cmd), &size));
+
+    build_getcap_cmd (cmd, TPM2_CAP_TPM_PROPERTIES, TPM2_PT_FIXED, 1);
+    tpm2_header_set (rsp, TPM2_ST_NO_SESSIONS, TPM2_HEADER_SIZE, TPM2_RC_FAILURE);
+    tcti_sgx_cap_cache_insert (cmd, sizeof (cmd), rsp, TPM2_HEADER_SIZE);
+    assert_null (tcti_sgx_cap_cache_lookup (cmd, sizeof (cmd), &size));
+}
+/*
+ * The key is the whole command: asking for a different number of
+ * properties is a different query.
+ */
+static void
+cap_cache_key_test (void **state)
+{
+    uint8_t cmd [TCTI_SGX_CAP_COMMAND_SIZE], rsp [256];
+    size_t size, cached_size = 0;
+    (void)state;
+
+    build_getcap_cmd (cmd, TPM2_CAP_TPM_PROPERTIES, TPM2_PT_FIXED, 2);
+    size = build_properties_rsp (rsp, TPM2_PT_FIXED, 2);
+    tcti_sgx_cap_cache_insert (cmd, sizeof (cmd), rsp, size);
+    assert_non_null (tcti_sgx_cap_cache_lookup (cmd, sizeof (cmd), &cached_size));
+    assert_int_equal (cached_size, size);
+    build_getcap_cmd (cmd, TPM2_CAP_TPM_PROPERTIES, TPM2_PT_FIXED, 3);
+    assert_null (tcti_sgx_cap_cache_lookup (cmd, sizeof (cmd), &cached_size));
+}
+int
+main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (cap_cache_fill_and_hit_test,
+                                         cap_cache_setup,
+                                         tcti_struct_teardown),
+        cmocka_unit_test_setup_teardown (cap_cache_cacheable_test,
+                                         cap_cache_setup,
+                                         tcti_struct_teardown),
+        cmocka_unit_test_setup_teardown (cap_cache_not_fixed_test,
+                                         cap_cache_setup,
+                                         tcti_struct_teardown),
+        cmocka_unit_test_setup_teardown (cap_cache_key_test,
+                                         cap_cache_setup,
+                                         tcti_struct_teardown),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,208 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sgx_error.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "tss2-tcti-sgx.h"
+#include "tcti-sgx_priv.h"
+#include "tcti-sgx-common.h"
+#include "tpm2-header.h"
+
+/*
+ * This module tests the entropy pool: random bytes fetched from outside
+ * the enclave in bulk and handed out in small pieces by
+ * Tss2_Tcti_Sgx_GetRandom and, optionally, in response to TPM2_GetRandom
+ * commands sent through the TCTI.
+ */
+
+static void
+expect_refill (uint8_t fill)
+{
+    will_return (__wrap_tcti_sgx_get_random_ocall, fill);
+    will_return (__wrap_tcti_sgx_get_random_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_get_random_ocall, SGX_SUCCESS);
+}
+/*
+ * Small requests are served from a single refill. A new refill happens
+ * only once the pool is empty and a request can span two refills.
+ */
+static void
+tcti_entropy_batch_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = *state;
+    uint8_t buf [24], expected [24];
+
+    assert_int_equal (Tss2_Tcti_Sgx_SetEntropy (context, 32, 0),
+                      TSS2_RC_SUCCESS);
+    expect_refill (0xa5);
+    assert_int_equal (Tss2_Tcti_Sgx_GetRandom (context, buf, 16),
+                      TSS2_RC_SUCCESS);
+    memset (expected, 0xa5, sizeof (expected));
+    assert_memory_equal (buf, expected, 16);
+    assert_int_equal (Tss2_Tcti_Sgx_GetRandom (context, buf, 8),
+                      TSS2_RC_SUCCESS);
+    assert_memory_equal (buf, expected, 8);
+
+    expect_refill (0x5a);
+    assert_int_equal (Tss2_Tcti_Sgx_GetRandom (context, buf, sizeof (buf)),
+                      TSS2_RC_SUCCESS);
+    memset (&expected [8], 0x5a, sizeof (expected) - 8);
+    assert_memory_equal (buf, expected, sizeof (buf));
+    assert_int_equal (((TCTI_CONTEXT_SGX*)context)->entropy_avail, 16);
+}
+/*
+ * Bytes handed out are wiped from the pool.
+ */
+static void
+tcti_entropy_wipe_test (void **state)
+{
+    TCTI_CONTEXT_SGX *sgx_context = *state;
+    uint8_t buf [8], zero [8] = { 0 };
+
+    assert_int_equal (Tss2_Tcti_Sgx_SetEntropy (*state, 16, 0),
+                      TSS2_RC_SUCCESS);
+    expect_refill (0xff);
+    assert_int_equal (Tss2_Tcti_Sgx_GetRandom (*state, buf, sizeof (buf)),
+                      TSS2_RC_SUCCESS);
+    assert_memory_equal (&sgx_context->entropy [8], zero, sizeof (zero));
+}
+
+static void
+tcti_entropy_bad_value_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = *state;
+
+    assert_int_equal (Tss2_Tcti_Sgx_SetEntropy (context, 0, 0),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (Tss2_Tcti_Sgx_SetEntropy (context,
+                                                TCTI_SGX_ENTROPY_MAX + 1,
+                                                0),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (Tss2_Tcti_Sgx_GetRandom (context, NULL, 1),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+}
+/*
+ * The pool can't be refilled while a command is outstanding.
+ */
+static void
+tcti_entropy_bad_sequence_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = *state;
+    uint8_t buf [1];
+
+    TCTI_SGX_STATE (context) = READY_TO_RECEIVE;
+    assert_int_equal (Tss2_Tcti_Sgx_GetRandom (context, buf, sizeof (buf)),
+                      TSS2_TCTI_RC_BAD_SEQUENCE);
+    TCTI_SGX_STATE (context) = READY_TO_TRANSMIT;
+}
+/*
+ * Errors from outside the enclave are passed along and SGX errors are
+ * mapped to GENERAL_FAILURE.
+ */
+static void
+tcti_entropy_ocall_fail_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = *state;
+    uint8_t buf [1];
+
+    will_return (__wrap_tcti_sgx_get_random_ocall, 0);
+    will_return (__wrap_tcti_sgx_get_random_ocall, TSS2_TCTI_RC_IO_ERROR);
+    will_return (__wrap_tcti_sgx_get_random_ocall, SGX_SUCCESS);
+    assert_int_equal (Tss2_Tcti_Sgx_GetRandom (context, buf, sizeof (buf)),
+                      TSS2_TCTI_RC_IO_ERROR);
+    will_return (__wrap_tcti_sgx_get_random_ocall, 0);
+    will_return (__wrap_tcti_sgx_get_random_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_get_random_ocall, SGX_ERROR_UNEXPECTED);
+    assert_int_equal (Tss2_Tcti_Sgx_GetRandom (context, buf, sizeof (buf)),
+                      TSS2_TCTI_RC_GENERAL_FAILURE);
+}
+/*
+ * With TSS2_TCTI_SGX_ENTROPY_GET_RANDOM set a TPM2_GetRandom is answered
+ * from the pool without the transmit / receive ocalls. Requests larger
+ * than the TPM would satisfy are cut down to TCTI_SGX_RANDOM_MAX.
+ */
+static void
+tcti_entropy_get_random_cmd_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = *state;
+    uint8_t cmd [TPM2_HEADER_SIZE + 2], rsp [128], expected [128];
+    size_t size = sizeof (rsp);
+    size_t expected_size = TPM2_HEADER_SIZE + 2 + TCTI_SGX_RANDOM_MAX;
+
+    assert_int_equal (Tss2_Tcti_Sgx_SetEntropy (context,
+                                                256,
+                                                TSS2_TCTI_SGX_ENTROPY_GET_RANDOM),
+                      TSS2_RC_SUCCESS);
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, sizeof (cmd), TPM2_CC_GetRandom);
+    tpm2_set_uint16 (&cmd [TPM2_HEADER_SIZE], 100);
+    expect_refill (0x3c);
+    assert_int_equal (tcti_sgx_transmit (context, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_receive (context,
+                                        &size,
+                                        rsp,
+                                        TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+
+    tpm2_header_set (expected,
+                     TPM2_ST_NO_SESSIONS,
+                     expected_size,
+                     TPM2_RC_SUCCESS);
+    tpm2_set_uint16 (&expected [TPM2_HEADER_SIZE], TCTI_SGX_RANDOM_MAX);
+    memset (&expected [TPM2_HEADER_SIZE + 2], 0x3c, TCTI_SGX_RANDOM_MAX);
+    assert_int_equal (size, expected_size);
+    assert_memory_equal (rsp, expected, expected_size);
+    assert_int_equal (TCTI_SGX_STATE (context), READY_TO_TRANSMIT);
+}
+/*
+ * Without the flag a TPM2_GetRandom goes to the TPM.
+ */
+static void
+tcti_entropy_get_random_cmd_passthrough_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = *state;
+    uint8_t cmd [TPM2_HEADER_SIZE + 2];
+
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, sizeof (cmd), TPM2_CC_GetRandom);
+    tpm2_set_uint16 (&cmd [TPM2_HEADER_SIZE], 16);
+    will_return (__wrap_tcti_sgx_transmit_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_transmit_ocall, SGX_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit (context, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (((TCTI_CONTEXT_SGX*)context)->local_size, 0);
+}
+int
+main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (tcti_entropy_batch_test,
+                                         tcti_struct_setup,
+                                         tcti_struct_teardown),
+        cmocka_unit_test_setup_teardown (tcti_entropy_wipe_test,
+                                         tcti_struct_setup,
+                                         tcti_struct_teardown),
+        cmocka_unit_test_setup_teardown (tcti_entropy_bad_value_test,
+                                         tcti_struct_setup,
+                                         tcti_struct_teardown),
+        cmocka_unit_test_setup_teardown (tcti_entropy_bad_sequence_test,
+                                         tcti_struct_setup,
+                                         tcti_struct_teardown),
+        cmocka_unit_test_setup_teardown (tcti_entropy_ocall_fail_test,
+                                         tcti_struct_setup,
+                                         tcti_struct_teardown),
+        cmocka_unit_test_setup_teardown (tcti_entropy_get_random_cmd_test,
+                                         tcti_struct_setup,
+                                         tcti_struct_teardown),
+        cmocka_unit_test_setup_teardown (tcti_entropy_get_random_cmd_passthrough_test,
+                                         tcti_struct_setup,
+                                         tcti_struct_teardown),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
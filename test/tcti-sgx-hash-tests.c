@@ -0,0 +1,277 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sgx_error.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "tss2-tcti-sgx.h"
+#include "tcti-sgx_priv.h"
+#include "tcti-sgx-common.h"
+#include "tpm2-header.h"
+
+/*
+ * This module tests the hash helpers: Tss2_Tcti_Sgx_HashUpdate and
+ * Tss2_Tcti_Sgx_HashComplete.
+ */
+
+/*
+ * Build the result of the hash complete ocall: a 32 byte digest filled
+ * with 'fill' followed by a NULL ticket.
+ */
+static size_t
+build_hash_result (uint8_t *buf,
+                   uint8_t fill)
+{
+    tpm2_set_uint16 (buf, 32);
+    memset (&buf [2], fill, 32);
+    tpm2_set_uint16 (&buf [34], TPM2_ST_HASHCHECK);
+    tpm2_set_uint32 (&buf [36], TPM2_RH_NULL);
+    tpm2_set_uint16 (&buf [40], 0);
+    return 42;
+}
+
+static void
+expect_hash_complete (uint8_t *result,
+                      size_t size,
+                      TSS2_RC rc)
+{
+    will_return (__wrap_tcti_sgx_hash_complete_ocall, result);
+    will_return (__wrap_tcti_sgx_hash_complete_ocall, size);
+    will_return (__wrap_tcti_sgx_hash_complete_ocall, rc);
+    will_return (__wrap_tcti_sgx_hash_complete_ocall, SGX_SUCCESS);
+}
+/*
+ * Hashing a single buffer takes a single ocall.
+ */
+static void
+tcti_hash_single_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = *state;
+    uint8_t data [64] = { 0 }, result [64], expected [32];
+    TPMT_TK_HASHCHECK validation;
+    TPM2B_DIGEST digest;
+
+    expect_hash_complete (result, build_hash_result (result, 0x3c),
+                          TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_Tcti_Sgx_HashComplete (context,
+                                                  TPM2_ALG_SHA256,
+                                                  TPM2_RH_NULL,
+                                                  data,
+                                                  sizeof (data),
+                                                  &digest,
+                                                  &validation),
+                      TSS2_RC_SUCCESS);
+    memset (expected, 0x3c, sizeof (expected));
+    assert_int_equal (digest.size, sizeof (expected));
+    assert_memory_equal (digest.buffer, expected, sizeof (expected));
+    assert_int_equal (validation.tag, TPM2_ST_HASHCHECK);
+    assert_int_equal (validation.hierarchy, TPM2_RH_NULL);
+    assert_int_equal (validation.digest.size, 0);
+    assert_int_equal (((TCTI_CONTEXT_SGX*)context)->hash_alg, TPM2_ALG_NULL);
+}
+/*
+ * An update starts the sequence and fixes its algorithm until the
+ * sequence is completed.
+ */
+static void
+tcti_hash_sequence_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = *state;
+    uint8_t data [64] = { 0 }, result [64];
+    TPM2B_DIGEST digest;
+
+    will_return (__wrap_tcti_sgx_hash_update_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_hash_update_ocall, SGX_SUCCESS);
+    assert_int_equal (Tss2_Tcti_Sgx_HashUpdate (context,
+                                                TPM2_ALG_SHA256,
+                                                data,
+                                                sizeof (data)),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (((TCTI_CONTEXT_SGX*)context)->hash_alg,
+                      TPM2_ALG_SHA256);
+    assert_int_equal (Tss2_Tcti_Sgx_HashUpdate (context,
+                                                TPM2_ALG_SHA1,
+                                                data,
+                                                sizeof (data)),
+                      TSS2_TCTI_RC_BAD_VALUE);
+
+    expect_hash_complete (result, build_hash_result (result, 0x11),
+                          TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_Tcti_Sgx_HashComplete (context,
+                                                  TPM2_ALG_SHA256,
+                                                  TPM2_RH_NULL,
+                                                  NULL,
+                                                  0,
+                                                  &digest,
+                                                  NULL),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (((TCTI_CONTEXT_SGX*)context)->hash_alg, TPM2_ALG_NULL);
+}
+/*
+ * A failed update abandons the sequence.
+ */
+static void
+tcti_hash_update_fail_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = *state;
+    uint8_t data [64] = { 0 };
+
+    will_return (__wrap_tcti_sgx_hash_update_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_hash_update_ocall, SGX_SUCCESS);
+    Tss2_Tcti_Sgx_HashUpdate (context, TPM2_ALG_SHA256, data, sizeof (data));
+    will_return (__wrap_tcti_sgx_hash_update_ocall, TSS2_TCTI_RC_IO_ERROR);
+    will_return (__wrap_tcti_sgx_hash_update_ocall, SGX_SUCCESS);
+    assert_int_equal (Tss2_Tcti_Sgx_HashUpdate (context,
+                                                TPM2_ALG_SHA256,
+                                                data,
+                                                sizeof (data)),
+                      TSS2_TCTI_RC_IO_ERROR);
+    assert_int_equal (((TCTI_CONTEXT_SGX*)context)->hash_alg, TPM2_ALG_NULL);
+}
+/*
+ * A command sent in the middle of a sequence doesn't end it.
+ */
+static void
+tcti_hash_transmit_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = *state;
+    uint8_t data [64] = { 0 }, command [TPM2_HEADER_SIZE];
+
+    will_return (__wrap_tcti_sgx_hash_update_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_hash_update_ocall, SGX_SUCCESS);
+    Tss2_Tcti_Sgx_HashUpdate (context, TPM2_ALG_SHA256, data, sizeof (data));
+    tpm2_header_set (command, TPM2_ST_NO_SESSIONS, sizeof (command),
+                     TPM2_CC_Load);
+    will_return (__wrap_tcti_sgx_transmit_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_transmit_ocall, SGX_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit (context, sizeof (command), command),
+                      TSS2_RC_SUCCESS);
+    TCTI_SGX_STATE (context) = READY_TO_TRANSMIT;
+    assert_int_equal (((TCTI_CONTEXT_SGX*)context)->hash_alg,
+                      TPM2_ALG_SHA256);
+    will_return (__wrap_tcti_sgx_hash_update_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_hash_update_ocall, SGX_SUCCESS);
+    assert_int_equal (Tss2_Tcti_Sgx_HashUpdate (context,
+                                                TPM2_ALG_SHA256,
+                                                data,
+                                                sizeof (data)),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_Tcti_Sgx_HashUpdate (context,
+                                                TPM2_ALG_SHA1,
+                                                data,
+                                                sizeof (data)),
+                      TSS2_TCTI_RC_BAD_VALUE);
+}
+/*
+ * The manager turning an update or the completion away leaves the
+ * sequence as it was, as it does on its side.
+ */
+static void
+tcti_hash_try_again_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = *state;
+    uint8_t data [64] = { 0 }, result [64];
+    TPM2B_DIGEST digest;
+
+    will_return (__wrap_tcti_sgx_hash_update_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_hash_update_ocall, SGX_SUCCESS);
+    Tss2_Tcti_Sgx_HashUpdate (context, TPM2_ALG_SHA256, data, sizeof (data));
+    will_return (__wrap_tcti_sgx_hash_update_ocall, TSS2_TCTI_RC_TRY_AGAIN);
+    will_return (__wrap_tcti_sgx_hash_update_ocall, SGX_SUCCESS);
+    assert_int_equal (Tss2_Tcti_Sgx_HashUpdate (context,
+                                                TPM2_ALG_SHA256,
+                                                data,
+                                                sizeof (data)),
+                      TSS2_TCTI_RC_TRY_AGAIN);
+    assert_int_equal (((TCTI_CONTEXT_SGX*)context)->hash_alg,
+                      TPM2_ALG_SHA256);
+    expect_hash_complete (result, 0, TSS2_TCTI_RC_TRY_AGAIN);
+    assert_int_equal (Tss2_Tcti_Sgx_HashComplete (context,
+                                                  TPM2_ALG_SHA256,
+                                                  TPM2_RH_NULL,
+                                                  NULL,
+                                                  0,
+                                                  &digest,
+                                                  NULL),
+                      TSS2_TCTI_RC_TRY_AGAIN);
+    assert_int_equal (((TCTI_CONTEXT_SGX*)context)->hash_alg,
+                      TPM2_ALG_SHA256);
+    assert_int_equal (Tss2_Tcti_Sgx_HashUpdate (context,
+                                                TPM2_ALG_SHA1,
+                                                data,
+                                                sizeof (data)),
+                      TSS2_TCTI_RC_BAD_VALUE);
+}
+
+static void
+tcti_hash_bad_params_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = *state;
+    uint8_t data [8] = { 0 };
+    TPM2B_DIGEST digest;
+
+    assert_int_equal (Tss2_Tcti_Sgx_HashUpdate (NULL,
+                                                TPM2_ALG_SHA256,
+                                                data,
+                                                sizeof (data)),
+                      TSS2_TCTI_RC_BAD_CONTEXT);
+    assert_int_equal (Tss2_Tcti_Sgx_HashUpdate (context,
+                                                TPM2_ALG_SHA256,
+                                                NULL,
+                                                sizeof (data)),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+    assert_int_equal (Tss2_Tcti_Sgx_HashUpdate (context,
+                                                TPM2_ALG_NULL,
+                                                data,
+                                                sizeof (data)),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (Tss2_Tcti_Sgx_HashComplete (context,
+                                                  TPM2_ALG_SHA256,
+                                                  TPM2_RH_NULL,
+                                                  data,
+                                                  sizeof (data),
+                                                  NULL,
+                                                  NULL),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+    TCTI_SGX_STATE (context) = READY_TO_RECEIVE;
+    assert_int_equal (Tss2_Tcti_Sgx_HashComplete (context,
+                                                  TPM2_ALG_SHA256,
+                                                  TPM2_RH_NULL,
+                                                  data,
+                                                  sizeof (data),
+                                                  &digest,
+                                                  NULL),
+                      TSS2_TCTI_RC_BAD_SEQUENCE);
+    TCTI_SGX_STATE (context) = READY_TO_TRANSMIT;
+}
+int
+main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (tcti_hash_single_test,
+                                         tcti_struct_setup,
+                                         tcti_struct_teardown),
+        cmocka_unit_test_setup_teardown (tcti_hash_sequence_test,
+                                         tcti_struct_setup,
+                                         tcti_struct_teardown),
+        cmocka_unit_test_setup_teardown (tcti_hash_update_fail_test,
+                                         tcti_struct_setup,
+                                         tcti_struct_teardown),
+        cmocka_unit_test_setup_teardown (tcti_hash_transmit_test,
+                                         tcti_struct_setup,
+                                         tcti_struct_teardown),
+        cmocka_unit_test_setup_teardown (tcti_hash_try_again_test,
+                                         tcti_struct_setup,
+                                         tcti_struct_teardown),
+        cmocka_unit_test_setup_teardown (tcti_hash_bad_params_test,
+                                         tcti_struct_setup,
+                                         tcti_struct_teardown),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,331 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define SESSIONS 4
+
+/* the bytes the last GetRandom sent asked for */
+static uint16_t random_count;
+
+static TSS2_RC
+mock_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    UNUSED (ctx);
+
+    random_count = 0;
+    if (size >= TPM2_HEADER_SIZE + 2 &&
+        tpm2_header_code (command) == TPM2_CC_GetRandom)
+        random_count = tpm2_get_uint16 (&command [TPM2_HEADER_SIZE]);
+    return mock_type (TSS2_RC);
+}
+
+static TSS2_RC
+mock_receive (TSS2_TCTI_CONTEXT *ctx,
+              size_t *size,
+              uint8_t *response,
+              int32_t timeout)
+{
+    UNUSED (ctx);
+    UNUSED (timeout);
+
+    *size = TPM2_HEADER_SIZE;
+    if (random_count > 0) {
+        tpm2_set_uint16 (&response [*size], random_count);
+        memset (&response [*size + 2], 0xaa, random_count);
+        *size += 2 + random_count;
+    }
+    tpm2_header_set (response, TPM2_ST_NO_SESSIONS, *size, TPM2_RC_SUCCESS);
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_TCTI_CONTEXT*
+test_tcti_cb (void *user_data)
+{
+    UNUSED (user_data);
+    TSS2_TCTI_CONTEXT_COMMON_V2 *ctx;
+
+    ctx = (TSS2_TCTI_CONTEXT_COMMON_V2*)calloc (1, sizeof (TSS2_TCTI_CONTEXT_COMMON_V2));
+    ctx->v1.version = 2;
+    ctx->v1.transmit = mock_transmit;
+    ctx->v1.receive = mock_receive;
+    return  (TSS2_TCTI_CONTEXT*)ctx;
+}
+
+static int
+admission_setup (void **state)
+{
+    uint64_t *ids = (uint64_t*)calloc (SESSIONS, sizeof (uint64_t));
+    size_t i;
+
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    for (i = 0; i < SESSIONS; ++i) {
+        ids [i] = tcti_sgx_init_ocall ();
+        assert_int_not_equal (ids [i], 0);
+    }
+    *state = ids;
+    return 0;
+}
+
+static int
+admission_teardown (void **state)
+{
+    uint64_t *ids = (uint64_t*)*state;
+    size_t i;
+
+    for (i = 0; i < SESSIONS; ++i)
+        tcti_sgx_finalize_ocall (ids [i]);
+    free (ids);
+    tcti_sgx_mgr_set_admission_limit (TCTI_SGX_SCOPE_MANAGER, 0, 0);
+    tcti_sgx_mgr_set_admission_limit (TCTI_SGX_SCOPE_ENCLAVE, 0, 0);
+    return 0;
+}
+/*
+ * Send a command 'size' bytes long from session 'id'.
+ */
+static TSS2_RC
+send_cmd (uint64_t id,
+          size_t size)
+{
+    uint8_t cmd [TPM2_HEADER_SIZE + 16] = { 0 };
+
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, size, TPM2_CC_Load);
+    return tcti_sgx_transmit_ocall (id, size, cmd);
+}
+
+static void
+recv_rsp (uint64_t id)
+{
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE];
+
+    assert_int_equal (tcti_sgx_receive_ocall (id,
+                                              sizeof (rsp),
+                                              rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+}
+
+static void
+admission_bad_params (void **state)
+{
+    uint64_t *ids = (uint64_t*)*state;
+    uint32_t depth;
+
+    assert_int_equal (tcti_sgx_mgr_get_admission_stats (NULL),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+    assert_int_equal (tcti_sgx_mgr_set_admission_limit ((tcti_sgx_scope_t)2,
+                                                        1, 0),
+                      -1);
+    assert_int_equal (tcti_sgx_get_queue_depth_ocall (ids [0], NULL),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+    assert_int_equal (tcti_sgx_get_queue_depth_ocall (0, &depth),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (tcti_sgx_set_tag_ocall (0, 1), TSS2_TCTI_RC_BAD_VALUE);
+}
+/*
+ * With the manager at its limit further commands are turned away with
+ * the depth of the queue until a response is collected.
+ */
+static void
+admission_manager_commands (void **state)
+{
+    uint64_t *ids = (uint64_t*)*state;
+    tcti_sgx_admission_stats_t before, after;
+    uint32_t depth = 0;
+
+    assert_int_equal (tcti_sgx_mgr_set_admission_limit (TCTI_SGX_SCOPE_MANAGER,
+                                                        2, 0),
+                      0);
+    assert_int_equal (tcti_sgx_mgr_get_admission_stats (&before),
+                      TSS2_RC_SUCCESS);
+    will_return_count (mock_transmit, TSS2_RC_SUCCESS, 3);
+    assert_int_equal (send_cmd (ids [0], TPM2_HEADER_SIZE), TSS2_RC_SUCCESS);
+    assert_int_equal (send_cmd (ids [1], TPM2_HEADER_SIZE), TSS2_RC_SUCCESS);
+    assert_int_equal (send_cmd (ids [2], TPM2_HEADER_SIZE),
+                      TSS2_TCTI_RC_TRY_AGAIN);
+    assert_int_equal (tcti_sgx_get_queue_depth_ocall (ids [2], &depth),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (depth, 2);
+    assert_int_equal (tcti_sgx_mgr_get_admission_stats (&after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.commands, 2);
+    assert_int_equal (after.bytes, 2 * TPM2_HEADER_SIZE);
+    assert_int_equal (after.rejected - before.rejected, 1);
+
+    recv_rsp (ids [0]);
+    assert_int_equal (send_cmd (ids [2], TPM2_HEADER_SIZE), TSS2_RC_SUCCESS);
+    recv_rsp (ids [1]);
+    recv_rsp (ids [2]);
+    assert_int_equal (tcti_sgx_mgr_get_admission_stats (&after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.commands, 0);
+    assert_int_equal (after.bytes, 0);
+    assert_int_equal (after.admitted - before.admitted, 3);
+}
+/*
+ * The byte limit counts the size of the commands outstanding, a command
+ * on its own is admitted however big it is.
+ */
+static void
+admission_manager_bytes (void **state)
+{
+    uint64_t *ids = (uint64_t*)*state;
+
+    assert_int_equal (tcti_sgx_mgr_set_admission_limit (TCTI_SGX_SCOPE_MANAGER,
+                                                        0, 8),
+                      0);
+    will_return_count (mock_transmit, TSS2_RC_SUCCESS, 2);
+    assert_int_equal (send_cmd (ids [0], TPM2_HEADER_SIZE), TSS2_RC_SUCCESS);
+    assert_int_equal (send_cmd (ids [1], TPM2_HEADER_SIZE),
+                      TSS2_TCTI_RC_TRY_AGAIN);
+    recv_rsp (ids [0]);
+    assert_int_equal (send_cmd (ids [1], TPM2_HEADER_SIZE), TSS2_RC_SUCCESS);
+    recv_rsp (ids [1]);
+}
+/*
+ * Enclaves are held to their own limit, sessions without a tag aren't.
+ */
+static void
+admission_enclave (void **state)
+{
+    uint64_t *ids = (uint64_t*)*state;
+    uint32_t depth = 0;
+
+    assert_int_equal (tcti_sgx_mgr_set_admission_limit (TCTI_SGX_SCOPE_ENCLAVE,
+                                                        1, 0),
+                      0);
+    assert_int_equal (tcti_sgx_set_tag_ocall (ids [0], 7), TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_set_tag_ocall (ids [1], 7), TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_set_tag_ocall (ids [2], 8), TSS2_RC_SUCCESS);
+
+    will_return_count (mock_transmit, TSS2_RC_SUCCESS, 3);
+    assert_int_equal (send_cmd (ids [0], TPM2_HEADER_SIZE), TSS2_RC_SUCCESS);
+    assert_int_equal (send_cmd (ids [1], TPM2_HEADER_SIZE),
+                      TSS2_TCTI_RC_TRY_AGAIN);
+    assert_int_equal (tcti_sgx_get_queue_depth_ocall (ids [1], &depth),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (depth, 1);
+    assert_int_equal (send_cmd (ids [2], TPM2_HEADER_SIZE), TSS2_RC_SUCCESS);
+    assert_int_equal (send_cmd (ids [3], TPM2_HEADER_SIZE), TSS2_RC_SUCCESS);
+    recv_rsp (ids [0]);
+    recv_rsp (ids [2]);
+    recv_rsp (ids [3]);
+}
+/*
+ * A command that doesn't make it to the TPM gives its place back, so
+ * does one left outstanding when its session goes away.
+ */
+static void
+admission_release (void **state)
+{
+    uint64_t *ids = (uint64_t*)*state;
+    tcti_sgx_admission_stats_t stats;
+
+    will_return (mock_transmit, TSS2_TCTI_RC_IO_ERROR);
+    assert_int_equal (send_cmd (ids [0], TPM2_HEADER_SIZE),
+                      TSS2_TCTI_RC_IO_ERROR);
+    assert_int_equal (tcti_sgx_mgr_get_admission_stats (&stats),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats.commands, 0);
+
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    assert_int_equal (send_cmd (ids [1], TPM2_HEADER_SIZE), TSS2_RC_SUCCESS);
+    tcti_sgx_finalize_ocall (ids [1]);
+    assert_int_equal (tcti_sgx_mgr_get_admission_stats (&stats),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats.commands, 0);
+    assert_int_equal (stats.bytes, 0);
+}
+/*
+ * What the helper ocalls send to the TPM is admitted like any other
+ * command, hash data that's only kept doesn't need admitting.
+ */
+static void
+admission_helpers (void **state)
+{
+    uint64_t *ids = (uint64_t*)*state;
+    uint8_t data [4] = { 0 }, random [16], result [64];
+    tcti_sgx_admission_stats_t stats;
+    size_t i;
+
+    assert_int_equal (tcti_sgx_mgr_set_admission_limit (TCTI_SGX_SCOPE_MANAGER,
+                                                        1, 0),
+                      0);
+    will_return_count (mock_transmit, TSS2_RC_SUCCESS, 2);
+    assert_int_equal (send_cmd (ids [0], TPM2_HEADER_SIZE), TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_get_random_ocall (ids [1],
+                                                 sizeof (random),
+                                                 random),
+                      TSS2_TCTI_RC_TRY_AGAIN);
+    assert_int_equal (tcti_sgx_hash_update_ocall (ids [1],
+                                                  TPM2_ALG_SHA256,
+                                                  sizeof (data),
+                                                  data),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_hash_complete_ocall (ids [1],
+                                                    TPM2_ALG_SHA256,
+                                                    TPM2_RH_NULL,
+                                                    0,
+                                                    NULL,
+                                                    sizeof (result),
+                                                    result),
+                      TSS2_TCTI_RC_TRY_AGAIN);
+    assert_int_equal (tcti_sgx_mgr_get_admission_stats (&stats),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats.commands, 1);
+
+    recv_rsp (ids [0]);
+    assert_int_equal (tcti_sgx_get_random_ocall (ids [1],
+                                                 sizeof (random),
+                                                 random),
+                      TSS2_RC_SUCCESS);
+    for (i = 0; i < sizeof (random); ++i)
+        assert_int_equal (random [i], 0xaa);
+    assert_int_equal (tcti_sgx_mgr_get_admission_stats (&stats),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats.commands, 0);
+    assert_int_equal (stats.bytes, 0);
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (admission_bad_params,
+                                         admission_setup,
+                                         admission_teardown),
+        cmocka_unit_test_setup_teardown (admission_manager_commands,
+                                         admission_setup,
+                                         admission_teardown),
+        cmocka_unit_test_setup_teardown (admission_manager_bytes,
+                                         admission_setup,
+                                         admission_teardown),
+        cmocka_unit_test_setup_teardown (admission_enclave,
+                                         admission_setup,
+                                         admission_teardown),
+        cmocka_unit_test_setup_teardown (admission_release,
+                                         admission_setup,
+                                         admission_teardown),
+        cmocka_unit_test_setup_teardown (admission_helpers,
+                                         admission_setup,
+                                         admission_teardown),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
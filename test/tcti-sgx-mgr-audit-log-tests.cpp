@@ -0,0 +1,345 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+using namespace std;
+
+#define GOOD_ID  0x3b9e0d51c6f2a874
+#define LOG_PATH "tcti-sgx-mgr-audit-log-tests.log"
+/* offset of the first record's code field in the log */
+#define FIRST_CODE_OFFSET (16 + 32)
+
+static TSS2_RC
+mock_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    UNUSED (ctx);
+    UNUSED (size);
+    UNUSED (command);
+
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Pops a pointer to a response buffer and its size off of the mock stack
+ * and copies it to the caller.
+ */
+static TSS2_RC
+mock_receive (TSS2_TCTI_CONTEXT *ctx,
+              size_t *size,
+              uint8_t *response,
+              int32_t timeout)
+{
+    UNUSED (ctx);
+    UNUSED (timeout);
+    uint8_t *buf = mock_ptr_type (uint8_t*);
+    size_t buf_size = mock_type (size_t);
+
+    memcpy (response, buf, buf_size);
+    *size = buf_size;
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_TCTI_CONTEXT*
+test_tcti_cb (void *user_data)
+{
+    UNUSED (user_data);
+    TSS2_TCTI_CONTEXT_COMMON_V2 *ctx;
+
+    ctx = (TSS2_TCTI_CONTEXT_COMMON_V2*)calloc (1, sizeof (TSS2_TCTI_CONTEXT_COMMON_V2));
+    ctx->v1.version = 2;
+    ctx->v1.transmit = mock_transmit;
+    ctx->v1.receive = mock_receive;
+    return  (TSS2_TCTI_CONTEXT*)ctx;
+}
+/*
+ * Send a command with 'code' and no parameters from our session and
+ * collect the response 'rc'.
+ */
+static void
+send_cmd (TPM2_CC code,
+          TSS2_RC rc)
+{
+    uint8_t cmd [TPM2_HEADER_SIZE], tpm_rsp [TPM2_HEADER_SIZE];
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE];
+
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, sizeof (cmd), code);
+    tpm2_header_set (tpm_rsp, TPM2_ST_NO_SESSIONS, sizeof (tpm_rsp), rc);
+    assert_int_equal (tcti_sgx_transmit_ocall (GOOD_ID, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+    will_return (mock_receive, tpm_rsp);
+    will_return (mock_receive, sizeof (tpm_rsp));
+    assert_int_equal (tcti_sgx_receive_ocall (GOOD_ID,
+                                              sizeof (rsp),
+                                              rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+}
+
+static int
+audit_log_setup (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    unlink (LOG_PATH);
+    assert_int_equal (tcti_sgx_mgr_set_audit_log (LOG_PATH), 0);
+    mgr.sessions.push_back (new TctiSgxSession (GOOD_ID,
+                                                test_tcti_cb (NULL),
+                                                mgr.session_config));
+    return 0;
+}
+
+static int
+audit_log_teardown (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.session_remove (GOOD_ID);
+    tcti_sgx_mgr_set_audit_log (NULL);
+    unlink (LOG_PATH);
+    return 0;
+}
+
+static void
+audit_log_bad_params (void **state)
+{
+    UNUSED (state);
+
+    assert_int_equal (tcti_sgx_mgr_get_audit_log_stats (NULL),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+}
+/*
+ * Every command and response makes it into the log, in order, with the
+ * digest of its bytes.
+ */
+static void
+audit_log_records (void **state)
+{
+    UNUSED (state);
+    vector<TctiSgxAuditRecord> records;
+    tcti_sgx_audit_log_stats_t before, after;
+
+    assert_int_equal (tcti_sgx_mgr_get_audit_log_stats (&before),
+                      TSS2_RC_SUCCESS);
+    send_cmd (TPM2_CC_Load, TPM2_RC_SUCCESS);
+    send_cmd (TPM2_CC_Unseal, TPM2_RC_CANCELED);
+    send_cmd (TPM2_CC_Load, TPM2_RC_SUCCESS);
+    TctiSgxMgr::get_instance ().audit_log.flush ();
+    assert_int_equal (tcti_sgx_mgr_get_audit_log_stats (&after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.records - before.records, 6);
+    assert_int_equal (after.errors, before.errors);
+
+    assert_int_equal (TctiSgxAuditLog::verify (LOG_PATH, &records), 0);
+    assert_int_equal (records.size (), 6);
+    assert_int_equal (records [0].type, AUDIT_TYPE_COMMAND);
+    assert_int_equal (records [0].code, TPM2_CC_Load);
+    assert_int_equal (records [0].session, GOOD_ID);
+    assert_int_equal (records [0].size, TPM2_HEADER_SIZE);
+    assert_int_equal (records [1].type, AUDIT_TYPE_RESPONSE);
+    assert_int_equal (records [1].code, TPM2_RC_SUCCESS);
+    assert_int_equal (records [2].code, TPM2_CC_Unseal);
+    assert_int_equal (records [3].code, TPM2_RC_CANCELED);
+    assert_int_equal (records [5].seq, 5);
+    assert_true (records [5].time_ns >= records [0].time_ns);
+    /* same command, same digest */
+    assert_memory_equal (records [0].digest,
+                         records [4].digest,
+                         AUDIT_DIGEST_SIZE);
+    assert_memory_not_equal (records [0].digest,
+                             records [2].digest,
+                             AUDIT_DIGEST_SIZE);
+}
+/*
+ * Commands the manager sends itself are logged too, against the session
+ * they're sent for.
+ */
+static void
+audit_log_mgr_records (void **state)
+{
+    UNUSED (state);
+    vector<TctiSgxAuditRecord> records;
+    uint8_t tpm_rsp [TPM2_HEADER_SIZE + 2 + 16], random [16];
+
+    tpm2_header_set (tpm_rsp,
+                     TPM2_ST_NO_SESSIONS,
+                     sizeof (tpm_rsp),
+                     TPM2_RC_SUCCESS);
+    tpm2_set_uint16 (&tpm_rsp [TPM2_HEADER_SIZE], sizeof (random));
+    memset (&tpm_rsp [TPM2_HEADER_SIZE + 2], 0x3c, sizeof (random));
+    will_return (mock_receive, tpm_rsp);
+    will_return (mock_receive, sizeof (tpm_rsp));
+    assert_int_equal (tcti_sgx_get_random_ocall (GOOD_ID,
+                                                 sizeof (random),
+                                                 random),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_set_audit_log (NULL), 0);
+
+    assert_int_equal (TctiSgxAuditLog::verify (LOG_PATH, &records), 0);
+    assert_int_equal (records.size (), 2);
+    assert_int_equal (records [0].type, AUDIT_TYPE_MGR_COMMAND);
+    assert_int_equal (records [0].code, TPM2_CC_GetRandom);
+    assert_int_equal (records [0].session, GOOD_ID);
+    assert_int_equal (records [1].type, AUDIT_TYPE_MGR_RESPONSE);
+    assert_int_equal (records [1].code, TPM2_RC_SUCCESS);
+    assert_int_equal (records [1].size, sizeof (tpm_rsp));
+}
+/*
+ * A log that's closed and reopened is appended to and the chain carries
+ * on through both.
+ */
+static void
+audit_log_reopen (void **state)
+{
+    UNUSED (state);
+    vector<TctiSgxAuditRecord> records;
+
+    send_cmd (TPM2_CC_Load, TPM2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_set_audit_log (NULL), 0);
+    assert_int_equal (tcti_sgx_mgr_set_audit_log (LOG_PATH), 0);
+    send_cmd (TPM2_CC_Unseal, TPM2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_set_audit_log (NULL), 0);
+
+    assert_int_equal (TctiSgxAuditLog::verify (LOG_PATH, &records), 0);
+    assert_int_equal (records.size (), 4);
+    assert_int_equal (records [2].code, TPM2_CC_Unseal);
+    assert_int_equal (records [3].seq, 3);
+}
+/*
+ * Changing a record breaks the chain from that record on.
+ */
+static void
+audit_log_tampered (void **state)
+{
+    UNUSED (state);
+    vector<TctiSgxAuditRecord> records;
+    uint8_t code [4];
+    int fd;
+
+    send_cmd (TPM2_CC_Load, TPM2_RC_SUCCESS);
+    send_cmd (TPM2_CC_Load, TPM2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_set_audit_log (NULL), 0);
+    assert_int_equal (TctiSgxAuditLog::verify (LOG_PATH, NULL), 0);
+
+    fd = open (LOG_PATH, O_WRONLY);
+    assert_true (fd >= 0);
+    tpm2_set_uint32 (code, TPM2_CC_Unseal);
+    assert_int_equal (pwrite (fd, code, sizeof (code), FIRST_CODE_OFFSET + 104),
+                      sizeof (code));
+    close (fd);
+    assert_int_equal (TctiSgxAuditLog::verify (LOG_PATH, &records), -1);
+    assert_int_equal (records.size (), 1);
+}
+/*
+ * The writer keeps up with a session that fills its ring many times
+ * over, nothing is dropped.
+ */
+static void
+audit_log_ring_full (void **state)
+{
+    UNUSED (state);
+    TctiSgxAuditLog log;
+    shared_ptr<TctiSgxAuditRing> ring;
+    vector<TctiSgxAuditRecord> records;
+    uint8_t cmd [TPM2_HEADER_SIZE];
+    size_t i;
+
+    unlink (LOG_PATH ".ring");
+    assert_int_equal (log.open (LOG_PATH ".ring"), 0);
+    ring = log.attach ();
+    assert_non_null (ring.get ());
+    for (i = 0; i < AUDIT_RING_SLOTS * 10; ++i) {
+        tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, sizeof (cmd), i);
+        log.append (*ring, GOOD_ID, AUDIT_TYPE_COMMAND, i, cmd, sizeof (cmd));
+    }
+    ring.reset ();
+    assert_int_equal (log.open (NULL), 0);
+
+    assert_int_equal (TctiSgxAuditLog::verify (LOG_PATH ".ring", &records), 0);
+    assert_int_equal (records.size (), AUDIT_RING_SLOTS * 10);
+    for (i = 0; i < records.size (); ++i)
+        assert_int_equal (records [i].code, i);
+    unlink (LOG_PATH ".ring");
+}
+/*
+ * A file that isn't an audit log is left alone.
+ */
+static void
+audit_log_not_ours (void **state)
+{
+    UNUSED (state);
+    char const junk [] = "not an audit log at all";
+    char buf [sizeof (junk)];
+    struct stat st;
+    int fd;
+
+    assert_int_equal (tcti_sgx_mgr_set_audit_log (NULL), 0);
+    fd = open (LOG_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    assert_true (fd >= 0);
+    assert_int_equal (write (fd, junk, sizeof (junk)), sizeof (junk));
+    close (fd);
+
+    assert_int_equal (tcti_sgx_mgr_set_audit_log (LOG_PATH), -1);
+    assert_int_equal (stat (LOG_PATH, &st), 0);
+    assert_int_equal (st.st_size, sizeof (junk));
+    fd = open (LOG_PATH, O_RDONLY);
+    assert_int_equal (read (fd, buf, sizeof (buf)), sizeof (buf));
+    close (fd);
+    assert_memory_equal (buf, junk, sizeof (junk));
+    /* nothing is logged */
+    send_cmd (TPM2_CC_Load, TPM2_RC_SUCCESS);
+    assert_int_equal (TctiSgxAuditLog::verify (LOG_PATH, NULL), -1);
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (audit_log_bad_params,
+                                         audit_log_setup,
+                                         audit_log_teardown),
+        cmocka_unit_test_setup_teardown (audit_log_records,
+                                         audit_log_setup,
+                                         audit_log_teardown),
+        cmocka_unit_test_setup_teardown (audit_log_mgr_records,
+                                         audit_log_setup,
+                                         audit_log_teardown),
+        cmocka_unit_test_setup_teardown (audit_log_reopen,
+                                         audit_log_setup,
+                                         audit_log_teardown),
+        cmocka_unit_test_setup_teardown (audit_log_tampered,
+                                         audit_log_setup,
+                                         audit_log_teardown),
+        cmocka_unit_test_setup_teardown (audit_log_ring_full,
+                                         audit_log_setup,
+                                         audit_log_teardown),
+        cmocka_unit_test_setup_teardown (audit_log_not_ours,
+                                         audit_log_setup,
+                                         audit_log_teardown),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
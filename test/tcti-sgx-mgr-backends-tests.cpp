@@ -0,0 +1,266 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+/*
+ * A connection that knows which backend it's to and answers GetCapability
+ * with no handles, everything else with success.
+ */
+typedef struct {
+    TSS2_TCTI_CONTEXT_COMMON_V2 common;
+    unsigned backend;
+    TPM2_CC code;
+} test_tcti_t;
+
+static unsigned backend_ids [] = { 0, 1 };
+
+static TSS2_RC
+mock_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    test_tcti_t *tcti = (test_tcti_t*)ctx;
+    UNUSED (size);
+
+    tcti->code = tpm2_header_code (command);
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC
+mock_receive (TSS2_TCTI_CONTEXT *ctx,
+              size_t *size,
+              uint8_t *response,
+              int32_t timeout)
+{
+    test_tcti_t *tcti = (test_tcti_t*)ctx;
+    UNUSED (timeout);
+
+    if (tcti->code != TPM2_CC_GetCapability) {
+        tpm2_header_set (response, TPM2_ST_NO_SESSIONS, TPM2_HEADER_SIZE,
+                         TPM2_RC_SUCCESS);
+        *size = TPM2_HEADER_SIZE;
+        return TSS2_RC_SUCCESS;
+    }
+    /* moreData | capability | count */
+    *size = TPM2_HEADER_SIZE + 9;
+    memset (response, 0, *size);
+    tpm2_header_set (response, TPM2_ST_NO_SESSIONS, *size, TPM2_RC_SUCCESS);
+    tpm2_set_uint32 (&response [TPM2_HEADER_SIZE + 1], TPM2_CAP_HANDLES);
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_TCTI_CONTEXT*
+test_tcti_cb (void *user_data)
+{
+    test_tcti_t *tcti;
+
+    tcti = (test_tcti_t*)calloc (1, sizeof (test_tcti_t));
+    tcti->common.v1.version = 2;
+    tcti->common.v1.transmit = mock_transmit;
+    tcti->common.v1.receive = mock_receive;
+    tcti->backend = user_data == NULL ? 0 : *(unsigned*)user_data;
+    return  (TSS2_TCTI_CONTEXT*)tcti;
+}
+
+static void
+backends_add (void **state)
+{
+    UNUSED (state);
+    TctiSgxBackends backends (test_tcti_cb, NULL);
+    tcti_sgx_backend_stats_t stats;
+    unsigned i;
+
+    assert_int_equal (backends.count (), 1);
+    assert_int_equal (backends.add (NULL, NULL), -1);
+    for (i = 1; i < BACKENDS_MAX; ++i)
+        assert_int_equal (backends.add (test_tcti_cb, &backend_ids [1]), i);
+    assert_int_equal (backends.add (test_tcti_cb, NULL), -1);
+    assert_int_equal (backends.get_stats (BACKENDS_MAX, &stats), -1);
+    assert_int_equal (backends.set_policy ((tcti_sgx_backend_policy_t)3), -1);
+    assert_null (backends.connect (BACKENDS_MAX));
+}
+/*
+ * Sessions and commands in flight both count towards a backend's load.
+ */
+static void
+backends_least_loaded (void **state)
+{
+    UNUSED (state);
+    TctiSgxBackends backends (test_tcti_cb, NULL);
+
+    assert_int_equal (backends.place (0), 0);
+    backends.add (test_tcti_cb, NULL);
+    backends.add (test_tcti_cb, NULL);
+    backends.attach (0, 0);
+    assert_int_equal (backends.place (0), 1);
+    backends.sent (1);
+    assert_int_equal (backends.place (0), 2);
+    backends.attach (2, 0);
+    backends.received (1, 10, true);
+    assert_int_equal (backends.place (0), 1);
+    backends.detach (0, 0);
+    assert_int_equal (backends.place (0), 0);
+}
+/*
+ * Of two different backends the less loaded one wins, so with two
+ * backends it's always the idle one.
+ */
+static void
+backends_two_choices (void **state)
+{
+    UNUSED (state);
+    TctiSgxBackends backends (test_tcti_cb, NULL);
+    unsigned i;
+
+    backends.add (test_tcti_cb, NULL);
+    assert_int_equal (backends.set_policy (TCTI_SGX_BACKEND_TWO_CHOICES), 0);
+    backends.attach (0, 0);
+    for (i = 0; i < 32; ++i)
+        assert_int_equal (backends.place (0), 1);
+}
+/*
+ * An enclave's sessions follow its first one until they're all gone.
+ */
+static void
+backends_enclave (void **state)
+{
+    UNUSED (state);
+    TctiSgxBackends backends (test_tcti_cb, NULL);
+    unsigned backend = 0;
+
+    backends.add (test_tcti_cb, NULL);
+    backends.attach (1, 7);
+    assert_false (backends.enclave_backend (7, &backend));
+    assert_int_equal (backends.set_policy (TCTI_SGX_BACKEND_ENCLAVE), 0);
+    assert_true (backends.enclave_backend (7, &backend));
+    assert_int_equal (backend, 1);
+    assert_false (backends.enclave_backend (0, &backend));
+    backends.attach (1, 0);
+    assert_int_equal (backends.place (7), 1);
+    assert_int_equal (backends.place (8), 0);
+    backends.detach (1, 7);
+    assert_false (backends.enclave_backend (7, &backend));
+}
+
+static void
+backends_stats (void **state)
+{
+    UNUSED (state);
+    TctiSgxBackends backends (test_tcti_cb, NULL);
+    tcti_sgx_backend_stats_t stats;
+
+    backends.sent (0);
+    backends.sent (0);
+    backends.sent (0);
+    backends.received (0, 800, true);
+    backends.received (0, 1600, true);
+    backends.received (0, 0, false);
+    assert_int_equal (backends.get_stats (0, &stats), 0);
+    assert_int_equal (stats.commands, 3);
+    assert_int_equal (stats.outstanding, 0);
+    assert_int_equal (stats.errors, 1);
+    assert_int_equal (stats.latency_us, 800 - 100 + 200);
+    assert_int_equal (stats.max_latency_us, 1600);
+}
+/*
+ * Sessions are spread over the manager's backends, a tagged one joins
+ * the rest of its enclave.
+ */
+static void
+backends_mgr (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_backend_stats_t stats [2];
+    uint8_t buf [TPM2_MAX_RESPONSE_SIZE];
+    uint64_t ids [2];
+    unsigned i;
+
+    tcti_sgx_mgr_init (test_tcti_cb, &backend_ids [0]);
+    assert_int_equal (tcti_sgx_mgr_add_backend (test_tcti_cb,
+                                                &backend_ids [1]),
+                      1);
+    assert_int_equal (tcti_sgx_mgr_get_backend_stats (0, NULL),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+    assert_int_equal (tcti_sgx_mgr_get_backend_stats (2, &stats [0]),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (tcti_sgx_mgr_set_backend_policy (
+                          (tcti_sgx_backend_policy_t)3),
+                      -1);
+    for (i = 0; i < 2; ++i) {
+        ids [i] = tcti_sgx_init_ocall ();
+        assert_int_not_equal (ids [i], 0);
+        assert_int_equal (tcti_sgx_mgr_get_backend_stats (i, &stats [i]),
+                          TSS2_RC_SUCCESS);
+        assert_int_equal (stats [i].sessions, 1);
+    }
+
+    tpm2_header_set (buf, TPM2_ST_NO_SESSIONS, TPM2_HEADER_SIZE,
+                     TPM2_CC_Load);
+    assert_int_equal (tcti_sgx_transmit_ocall (ids [1], TPM2_HEADER_SIZE,
+                                               buf),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_get_backend_stats (1, &stats [1]),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats [1].commands, 1);
+    assert_int_equal (stats [1].outstanding, 1);
+    assert_int_equal (tcti_sgx_receive_ocall (ids [1], sizeof (buf), buf,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_get_backend_stats (1, &stats [1]),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats [1].outstanding, 0);
+
+    assert_int_equal (tcti_sgx_mgr_set_backend_policy (TCTI_SGX_BACKEND_ENCLAVE),
+                      0);
+    assert_int_equal (tcti_sgx_set_tag_ocall (ids [0], 7), TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_set_tag_ocall (ids [1], 7), TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_get_backend_stats (0, &stats [0]),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_get_backend_stats (1, &stats [1]),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats [0].sessions, 2);
+    assert_int_equal (stats [1].sessions, 0);
+    assert_int_equal (tcti_sgx_transmit_ocall (ids [1], TPM2_HEADER_SIZE,
+                                               buf),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_get_backend_stats (0, &stats [0]),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats [0].outstanding, 1);
+
+    for (i = 0; i < 2; ++i)
+        tcti_sgx_finalize_ocall (ids [i]);
+    assert_int_equal (tcti_sgx_mgr_get_backend_stats (0, &stats [0]),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats [0].sessions, 0);
+    assert_int_equal (stats [0].outstanding, 0);
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (backends_add),
+        cmocka_unit_test (backends_least_loaded),
+        cmocka_unit_test (backends_two_choices),
+        cmocka_unit_test (backends_enclave),
+        cmocka_unit_test (backends_stats),
+        cmocka_unit_test (backends_mgr),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
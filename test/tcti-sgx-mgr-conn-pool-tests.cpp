@@ -0,0 +1,324 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+/*
+ * A connection with at most one object loaded, 'loaded', which Load
+ * creates and FlushContext flushes.
+ */
+typedef struct {
+    TSS2_TCTI_CONTEXT_COMMON_V2 common;
+    TPM2_CC code;
+    TPM2_HANDLE handle;
+    uint32_t property;
+    TPM2_HANDLE loaded;
+} test_tcti_t;
+
+static size_t created;
+static size_t closed;
+static uint8_t locality;
+/* have the next connections fail */
+static bool refuse;
+
+static TSS2_RC
+mock_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    test_tcti_t *tcti = (test_tcti_t*)ctx;
+
+    tcti->code = tpm2_header_code (command);
+    tcti->handle = size >= TPM2_HEADER_SIZE + 4 ?
+        tpm2_get_uint32 (&command [TPM2_HEADER_SIZE]) : 0;
+    tcti->property = size >= TPM2_HEADER_SIZE + 8 ?
+        tpm2_get_uint32 (&command [TPM2_HEADER_SIZE + 4]) : 0;
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC
+mock_receive (TSS2_TCTI_CONTEXT *ctx,
+              size_t *size,
+              uint8_t *response,
+              int32_t timeout)
+{
+    test_tcti_t *tcti = (test_tcti_t*)ctx;
+    bool listed;
+    UNUSED (timeout);
+
+    switch (tcti->code) {
+    case TPM2_CC_GetCapability:
+        /* moreData | capability | count | handle */
+        listed = tcti->loaded != 0 && tcti->property == TPM2_TRANSIENT_FIRST;
+        *size = TPM2_HEADER_SIZE + 9 + (listed ? 4 : 0);
+        memset (response, 0, *size);
+        tpm2_set_uint32 (&response [TPM2_HEADER_SIZE + 1], TPM2_CAP_HANDLES);
+        tpm2_set_uint32 (&response [TPM2_HEADER_SIZE + 5], listed ? 1 : 0);
+        if (listed)
+            tpm2_set_uint32 (&response [TPM2_HEADER_SIZE + 9], tcti->loaded);
+        break;
+    case TPM2_CC_Load:
+        tcti->loaded = TPM2_TRANSIENT_FIRST;
+        *size = TPM2_HEADER_SIZE + 4;
+        tpm2_set_uint32 (&response [TPM2_HEADER_SIZE], tcti->loaded);
+        break;
+    case TPM2_CC_FlushContext:
+        if (tcti->handle == tcti->loaded)
+            tcti->loaded = 0;
+        /* fall through */
+    default:
+        *size = TPM2_HEADER_SIZE;
+    }
+    tpm2_header_set (response, TPM2_ST_NO_SESSIONS, *size, TPM2_RC_SUCCESS);
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC
+mock_set_locality (TSS2_TCTI_CONTEXT *ctx,
+                   uint8_t new_locality)
+{
+    UNUSED (ctx);
+    locality = new_locality;
+    return TSS2_RC_SUCCESS;
+}
+
+static void
+mock_finalize (TSS2_TCTI_CONTEXT *ctx)
+{
+    UNUSED (ctx);
+    ++closed;
+}
+
+TSS2_TCTI_CONTEXT*
+test_tcti_cb (void *user_data)
+{
+    UNUSED (user_data);
+    test_tcti_t *tcti;
+
+    if (refuse)
+        return NULL;
+    tcti = (test_tcti_t*)calloc (1, sizeof (test_tcti_t));
+    tcti->common.v1.version = 2;
+    tcti->common.v1.transmit = mock_transmit;
+    tcti->common.v1.receive = mock_receive;
+    tcti->common.v1.setLocality = mock_set_locality;
+    tcti->common.v1.finalize = mock_finalize;
+    ++created;
+    return  (TSS2_TCTI_CONTEXT*)tcti;
+}
+
+static void
+pool_stats_equal (TctiSgxConnPool &pool,
+                  uint64_t hits,
+                  uint64_t misses,
+                  uint64_t returned,
+                  uint64_t discarded,
+                  uint64_t idle)
+{
+    tcti_sgx_conn_pool_stats_t stats;
+
+    pool.get_stats (&stats);
+    assert_int_equal (stats.hits, hits);
+    assert_int_equal (stats.misses, misses);
+    assert_int_equal (stats.returned, returned);
+    assert_int_equal (stats.discarded, discarded);
+    assert_int_equal (stats.idle, idle);
+}
+/*
+ * Each backend keeps its own connections, the most recently returned is
+ * the first taken and the ones over the limit are closed.
+ */
+static void
+conn_pool_limits (void **state)
+{
+    UNUSED (state);
+    TctiSgxConnPool pool;
+    TSS2_TCTI_CONTEXT *conns [3];
+    size_t i;
+
+    assert_false (pool.enabled ());
+    assert_null (pool.take (0));
+    pool_stats_equal (pool, 0, 0, 0, 0, 0);
+
+    pool.set_limits (2, 0);
+    assert_true (pool.enabled ());
+    closed = 0;
+    for (i = 0; i < 3; ++i) {
+        conns [i] = test_tcti_cb (NULL);
+        pool.give (0, conns [i]);
+    }
+    assert_int_equal (closed, 1);
+    pool_stats_equal (pool, 0, 0, 3, 1, 2);
+    assert_null (pool.take (1));
+    assert_ptr_equal (pool.take (0), conns [2]);
+    pool_stats_equal (pool, 1, 1, 3, 1, 1);
+    pool.give (1, conns [2]);
+    pool.set_limits (0, 0);
+    assert_int_equal (closed, 3);
+    pool_stats_equal (pool, 1, 1, 4, 3, 0);
+}
+/*
+ * Connections idle for longer than the limit are closed.
+ */
+static void
+conn_pool_expire (void **state)
+{
+    UNUSED (state);
+    TctiSgxConnPool pool;
+
+    pool.set_limits (4, 1);
+    closed = 0;
+    pool.give (0, test_tcti_cb (NULL));
+    usleep (5000);
+    pool.expire ();
+    assert_int_equal (closed, 1);
+    pool.give (0, test_tcti_cb (NULL));
+    usleep (5000);
+    assert_null (pool.take (0));
+    pool_stats_equal (pool, 0, 1, 2, 2, 0);
+    pool.discard (test_tcti_cb (NULL));
+    assert_int_equal (closed, 3);
+}
+/*
+ * A session that goes away leaves its connection clean for the next one,
+ * unless it has a response still to come.
+ */
+static void
+conn_pool_mgr (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_conn_pool_stats_t stats;
+    uint8_t buf [TPM2_MAX_RESPONSE_SIZE];
+    TctiSgxSession *session;
+    size_t before;
+    uint64_t id;
+
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    assert_int_equal (tcti_sgx_mgr_get_conn_pool_stats (NULL),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+    assert_int_equal (tcti_sgx_mgr_set_conn_pool (1, 0), 0);
+
+    id = tcti_sgx_init_ocall ();
+    assert_int_not_equal (id, 0);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    session = mgr.session_lookup (id);
+    assert_non_null (session);
+    tpm2_header_set (buf, TPM2_ST_NO_SESSIONS, TPM2_HEADER_SIZE,
+                     TPM2_CC_Load);
+    assert_int_equal (tcti_sgx_transmit_ocall (id, TPM2_HEADER_SIZE, buf),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_receive_ocall (id, sizeof (buf), buf,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_set_locality_ocall (id, 3), TSS2_RC_SUCCESS);
+    assert_int_equal (locality, 3);
+    tcti_sgx_finalize_ocall (id);
+    assert_int_equal (locality, 0);
+    assert_int_equal (tcti_sgx_mgr_get_conn_pool_stats (&stats),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats.returned, 1);
+    assert_int_equal (stats.idle, 1);
+
+    before = created;
+    id = tcti_sgx_init_ocall ();
+    assert_int_not_equal (id, 0);
+    assert_int_equal (created, before);
+    assert_int_equal (tcti_sgx_mgr_get_conn_pool_stats (&stats),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats.hits, 1);
+    assert_int_equal (stats.idle, 0);
+    /* it's the same connection, with nothing left loaded */
+    tpm2_header_set (buf, TPM2_ST_NO_SESSIONS, TPM2_HEADER_SIZE + 12,
+                     TPM2_CC_GetCapability);
+    tpm2_set_uint32 (&buf [TPM2_HEADER_SIZE], TPM2_CAP_HANDLES);
+    tpm2_set_uint32 (&buf [TPM2_HEADER_SIZE + 4], TPM2_TRANSIENT_FIRST);
+    tpm2_set_uint32 (&buf [TPM2_HEADER_SIZE + 8], 1);
+    assert_int_equal (tcti_sgx_transmit_ocall (id, TPM2_HEADER_SIZE + 12, buf),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_receive_ocall (id, sizeof (buf), buf,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_get_uint32 (&buf [TPM2_HEADER_SIZE + 5]), 0);
+
+    /* a command left outstanding makes the connection useless */
+    tpm2_header_set (buf, TPM2_ST_NO_SESSIONS, TPM2_HEADER_SIZE,
+                     TPM2_CC_Load);
+    assert_int_equal (tcti_sgx_transmit_ocall (id, TPM2_HEADER_SIZE, buf),
+                      TSS2_RC_SUCCESS);
+    closed = 0;
+    tcti_sgx_finalize_ocall (id);
+    assert_int_equal (closed, 1);
+    assert_int_equal (tcti_sgx_mgr_get_conn_pool_stats (&stats),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats.returned, 1);
+    assert_int_equal (stats.discarded, 1);
+    assert_int_equal (tcti_sgx_mgr_set_conn_pool (0, 0), 0);
+}
+
+/*
+ * A session that connects lazily doesn't until it has a command to send,
+ * a connection that can't be made fails that command.
+ */
+static void
+conn_lazy (void **state)
+{
+    UNUSED (state);
+    uint8_t buf [TPM2_MAX_RESPONSE_SIZE];
+    uint64_t id;
+
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    assert_int_equal (tcti_sgx_mgr_set_lazy_connect (1), 0);
+    created = closed = 0;
+    refuse = true;
+    id = tcti_sgx_init_ocall ();
+    assert_int_not_equal (id, 0);
+    tpm2_header_set (buf, TPM2_ST_NO_SESSIONS, TPM2_HEADER_SIZE,
+                     TPM2_CC_ReadClock);
+    assert_int_equal (tcti_sgx_transmit_ocall (id, TPM2_HEADER_SIZE, buf),
+                      TSS2_TCTI_RC_NO_CONNECTION);
+    refuse = false;
+    assert_int_equal (created, 0);
+    assert_int_equal (tcti_sgx_transmit_ocall (id, TPM2_HEADER_SIZE, buf),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (created, 1);
+    assert_int_equal (tcti_sgx_receive_ocall (id, sizeof (buf), buf,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    tcti_sgx_finalize_ocall (id);
+    assert_int_equal (closed, 1);
+
+    /* one that's never used never connects */
+    id = tcti_sgx_init_ocall ();
+    assert_int_not_equal (id, 0);
+    tcti_sgx_finalize_ocall (id);
+    assert_int_equal (created, 1);
+    assert_int_equal (tcti_sgx_mgr_set_lazy_connect (0), 0);
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (conn_pool_limits),
+        cmocka_unit_test (conn_pool_expire),
+        cmocka_unit_test (conn_pool_mgr),
+        cmocka_unit_test (conn_lazy),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,408 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define GOOD_ID  0x5d0c83b2e7a1f446
+
+/* timeout passed to the last call to receive */
+static int32_t last_timeout;
+/* the TPM doesn't respond until the command is canceled */
+static bool tpm_slow;
+/* the downstream TCTI rejects timeouts other than blocking */
+static bool blocks_only;
+static size_t cancel_count;
+
+static TSS2_RC
+mock_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    UNUSED (ctx);
+    UNUSED (size);
+    UNUSED (command);
+
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Pops a pointer to a response buffer and its size off of the mock stack
+ * and copies it to the caller. A slow TPM times out unless the caller
+ * blocks.
+ */
+static TSS2_RC
+mock_receive (TSS2_TCTI_CONTEXT *ctx,
+              size_t *size,
+              uint8_t *response,
+              int32_t timeout)
+{
+    UNUSED (ctx);
+    uint8_t *buf;
+    size_t buf_size;
+
+    last_timeout = timeout;
+    if (blocks_only && timeout != TSS2_TCTI_TIMEOUT_BLOCK)
+        return TSS2_TCTI_RC_BAD_VALUE;
+    if (tpm_slow && timeout != TSS2_TCTI_TIMEOUT_BLOCK)
+        return TSS2_TCTI_RC_TRY_AGAIN;
+    buf = mock_ptr_type (uint8_t*);
+    buf_size = mock_type (size_t);
+    memcpy (response, buf, buf_size);
+    *size = buf_size;
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC
+mock_cancel (TSS2_TCTI_CONTEXT *ctx)
+{
+    UNUSED (ctx);
+
+    ++cancel_count;
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_TCTI_CONTEXT*
+test_tcti_cb (void *user_data)
+{
+    UNUSED (user_data);
+    TSS2_TCTI_CONTEXT_COMMON_V2 *ctx;
+
+    ctx = (TSS2_TCTI_CONTEXT_COMMON_V2*)calloc (1, sizeof (TSS2_TCTI_CONTEXT_COMMON_V2));
+    ctx->v1.version = 2;
+    ctx->v1.transmit = mock_transmit;
+    ctx->v1.receive = mock_receive;
+    ctx->v1.cancel = mock_cancel;
+    return  (TSS2_TCTI_CONTEXT*)ctx;
+}
+/*
+ * Send a command with 'code' and no parameters from our session and
+ * collect the response 'rc'.
+ */
+static void
+send_cmd (TPM2_CC code,
+          TSS2_RC rc)
+{
+    uint8_t cmd [TPM2_HEADER_SIZE], tpm_rsp [TPM2_HEADER_SIZE];
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE];
+
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, sizeof (cmd), code);
+    tpm2_header_set (tpm_rsp, TPM2_ST_NO_SESSIONS, sizeof (tpm_rsp), rc);
+    assert_int_equal (tcti_sgx_transmit_ocall (GOOD_ID, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+    will_return (mock_receive, tpm_rsp);
+    will_return (mock_receive, sizeof (tpm_rsp));
+    assert_int_equal (tcti_sgx_receive_ocall (GOOD_ID,
+                                              sizeof (rsp),
+                                              rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_memory_equal (rsp, tpm_rsp, sizeof (tpm_rsp));
+}
+
+static int
+cost_table_setup (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    tpm_slow = false;
+    blocks_only = false;
+    cancel_count = 0;
+    tcti_sgx_mgr_set_command_timeouts (1);
+    mgr.sessions.push_back (new TctiSgxSession (GOOD_ID,
+                                                test_tcti_cb (NULL),
+                                                mgr.session_config));
+    return 0;
+}
+
+static int
+cost_table_teardown (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.session_remove (GOOD_ID);
+    return 0;
+}
+
+static void
+cost_table_bad_params (void **state)
+{
+    UNUSED (state);
+
+    assert_int_equal (tcti_sgx_mgr_get_command_cost (TPM2_CC_GetCapability,
+                                                     NULL),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+    assert_int_equal (tcti_sgx_mgr_set_command_cost (TPM2_CC_GetCapability,
+                                                     (tcti_sgx_duration_t)7,
+                                                     0),
+                      -1);
+}
+/*
+ * Commands get the class and timeout from the PTP spec out of the box.
+ */
+static void
+cost_table_defaults (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_command_cost_t cost;
+
+    assert_int_equal (tcti_sgx_mgr_get_command_cost (TPM2_CC_PCR_Read, &cost),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (cost.duration, TCTI_SGX_DURATION_SHORT);
+    assert_int_equal (cost.timeout_ms, 20);
+    assert_int_equal (cost.expected_us, 20000);
+    assert_int_equal (cost.samples, 0);
+    assert_int_equal (tcti_sgx_mgr_get_command_cost (TPM2_CC_GetCapability,
+                                                     &cost),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (cost.duration, TCTI_SGX_DURATION_MEDIUM);
+    assert_int_equal (cost.timeout_ms, 750);
+    assert_int_equal (tcti_sgx_mgr_get_command_cost (TPM2_CC_CreatePrimary,
+                                                     &cost),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (cost.duration, TCTI_SGX_DURATION_EXTRA_LONG);
+    assert_int_equal (cost.timeout_ms, 300000);
+    /* commands we know nothing about are assumed to be long */
+    assert_int_equal (tcti_sgx_mgr_get_command_cost (0x20000001, &cost),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (cost.duration, TCTI_SGX_DURATION_LONG);
+    assert_int_equal (cost.timeout_ms, 2000);
+}
+
+/*
+ * Unless timeouts are enforced a blocking receive blocks, the table only
+ * learns what the command costs.
+ */
+static void
+cost_table_not_enforced (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_command_cost_t before, after;
+
+    tcti_sgx_mgr_set_command_timeouts (0);
+    assert_int_equal (tcti_sgx_mgr_get_command_cost (TPM2_CC_ReadClock,
+                                                     &before),
+                      TSS2_RC_SUCCESS);
+    send_cmd (TPM2_CC_ReadClock, TPM2_RC_SUCCESS);
+    assert_int_equal (last_timeout, TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (tcti_sgx_mgr_get_command_cost (TPM2_CC_ReadClock,
+                                                     &after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.samples - before.samples, 1);
+}
+/*
+ * A downstream TCTI that can't time out is waited on until it answers.
+ */
+static void
+cost_table_blocks_only (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_command_cost_t before, after;
+
+    assert_int_equal (tcti_sgx_mgr_get_command_cost (TPM2_CC_NV_Read, &before),
+                      TSS2_RC_SUCCESS);
+    blocks_only = true;
+    send_cmd (TPM2_CC_NV_Read, TPM2_RC_SUCCESS);
+    assert_int_equal (last_timeout, TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (cancel_count, 0);
+    assert_int_equal (tcti_sgx_mgr_get_command_cost (TPM2_CC_NV_Read, &after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.timeouts, before.timeouts);
+}
+
+static void
+cost_table_override (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_command_cost_t cost;
+
+    assert_int_equal (tcti_sgx_mgr_set_command_cost (TPM2_CC_GetRandom,
+                                                     TCTI_SGX_DURATION_SHORT,
+                                                     0),
+                      0);
+    assert_int_equal (tcti_sgx_mgr_get_command_cost (TPM2_CC_GetRandom, &cost),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (cost.duration, TCTI_SGX_DURATION_SHORT);
+    assert_int_equal (cost.timeout_ms, 20);
+    assert_int_equal (tcti_sgx_mgr_set_command_cost (TPM2_CC_GetRandom,
+                                                     TCTI_SGX_DURATION_SHORT,
+                                                     55),
+                      0);
+    send_cmd (TPM2_CC_GetRandom, TPM2_RC_SUCCESS);
+    assert_int_equal (last_timeout, 55);
+}
+/*
+ * A blocking receive waits as long as the table says and the latency
+ * observed goes back into the table.
+ */
+static void
+cost_table_learned (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_command_cost_t before, after;
+
+    assert_int_equal (tcti_sgx_mgr_get_command_cost (TPM2_CC_Unseal, &before),
+                      TSS2_RC_SUCCESS);
+    send_cmd (TPM2_CC_Unseal, TPM2_RC_SUCCESS);
+    assert_int_equal (last_timeout, before.timeout_ms);
+    send_cmd (TPM2_CC_Unseal, TPM2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_get_command_cost (TPM2_CC_Unseal, &after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.samples - before.samples, 2);
+    assert_int_equal (after.timeouts, before.timeouts);
+    /* the mock TPM answers right away */
+    assert_true (after.expected_us < (uint64_t)before.timeout_ms * 1000);
+    assert_int_equal (after.timeout_ms, before.timeout_ms);
+}
+/*
+ * The TPM takes longer than the timeout: the command is canceled and we
+ * wait for whatever response the TPM has for it. That doesn't count as a
+ * latency sample.
+ */
+static void
+cost_table_timeout (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_command_cost_t before, after;
+
+    assert_int_equal (tcti_sgx_mgr_get_command_cost (TPM2_CC_Load, &before),
+                      TSS2_RC_SUCCESS);
+    tpm_slow = true;
+    send_cmd (TPM2_CC_Load, TPM2_RC_CANCELED);
+    assert_int_equal (cancel_count, 1);
+    assert_int_equal (last_timeout, TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (tcti_sgx_mgr_get_command_cost (TPM2_CC_Load, &after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.timeouts - before.timeouts, 1);
+    assert_int_equal (after.samples, before.samples);
+}
+/*
+ * Build a TPM2_CreatePrimary command for a key of type 'type' with
+ * 'bits' if it's RSA, in 'cmd'. Returns its size.
+ */
+static size_t
+create_primary (uint8_t *cmd,
+                TPM2_ALG_ID type,
+                uint16_t bits)
+{
+    size_t offset = TPM2_HEADER_SIZE;
+
+    tpm2_set_uint32 (&cmd [offset], TPM2_RH_OWNER);
+    offset += 4;
+    /* a password session with an empty password */
+    tpm2_set_uint32 (&cmd [offset], 9);
+    offset += 4;
+    memset (&cmd [offset], 0, 9);
+    offset += 9;
+    /* inSensitive */
+    tpm2_set_uint16 (&cmd [offset], 4);
+    offset += 2;
+    memset (&cmd [offset], 0, 4);
+    offset += 4;
+    /* inPublic */
+    tpm2_set_uint16 (&cmd [offset], type == TPM2_ALG_RSA ? 20 : 8);
+    offset += 2;
+    tpm2_set_uint16 (&cmd [offset], type);
+    tpm2_set_uint16 (&cmd [offset + 2], TPM2_ALG_SHA256);
+    tpm2_set_uint32 (&cmd [offset + 4], 0x30072);
+    tpm2_set_uint16 (&cmd [offset + 8], 0);
+    offset += 10;
+    if (type == TPM2_ALG_RSA) {
+        tpm2_set_uint16 (&cmd [offset], TPM2_ALG_AES);
+        tpm2_set_uint16 (&cmd [offset + 2], 128);
+        tpm2_set_uint16 (&cmd [offset + 4], TPM2_ALG_CFB);
+        tpm2_set_uint16 (&cmd [offset + 6], TPM2_ALG_NULL);
+        tpm2_set_uint16 (&cmd [offset + 8], bits);
+        offset += 10;
+    }
+    tpm2_header_set (cmd, TPM2_ST_SESSIONS, offset, TPM2_CC_CreatePrimary);
+    return offset;
+}
+/*
+ * Keys are expected to cost what keys of their type and size have cost
+ * before, other commands what their command code has.
+ */
+static void
+cost_table_variant (void **state)
+{
+    UNUSED (state);
+    TctiSgxCostTable table;
+    uint8_t cmd [128];
+    uint32_t rsa2048, rsa3072, ecc;
+    size_t size;
+
+    size = create_primary (cmd, TPM2_ALG_RSA, 2048);
+    rsa2048 = TctiSgxCostTable::variant (cmd, size);
+    assert_int_equal (rsa2048, (uint32_t)TPM2_ALG_RSA << 16 | 2048);
+    /* cut short before the key size */
+    tpm2_header_set (cmd, TPM2_ST_SESSIONS, size - 2, TPM2_CC_CreatePrimary);
+    assert_int_equal (TctiSgxCostTable::variant (cmd, size - 2),
+                      (uint32_t)TPM2_ALG_RSA << 16);
+    size = create_primary (cmd, TPM2_ALG_RSA, 3072);
+    rsa3072 = TctiSgxCostTable::variant (cmd, size);
+    size = create_primary (cmd, TPM2_ALG_ECC, 0);
+    ecc = TctiSgxCostTable::variant (cmd, size);
+    assert_int_equal (ecc, (uint32_t)TPM2_ALG_ECC << 16);
+    tpm2_header_set (cmd, TPM2_ST_SESSIONS, TPM2_HEADER_SIZE + 4,
+                     TPM2_CC_CreatePrimary);
+    assert_int_equal (TctiSgxCostTable::variant (cmd, TPM2_HEADER_SIZE + 4),
+                      0);
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, TPM2_HEADER_SIZE,
+                     TPM2_CC_Load);
+    assert_int_equal (TctiSgxCostTable::variant (cmd, TPM2_HEADER_SIZE), 0);
+
+    table.record (TPM2_CC_CreatePrimary, 900000, rsa3072);
+    table.record (TPM2_CC_CreatePrimary, 30000, ecc);
+    assert_int_equal (table.expected_us (TPM2_CC_CreatePrimary, rsa3072),
+                      900000);
+    assert_int_equal (table.expected_us (TPM2_CC_CreatePrimary, ecc), 30000);
+    /* no samples for the variant yet */
+    assert_int_equal (table.expected_us (TPM2_CC_CreatePrimary, rsa2048),
+                      table.expected_us (TPM2_CC_CreatePrimary));
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (cost_table_bad_params,
+                                         cost_table_setup,
+                                         cost_table_teardown),
+        cmocka_unit_test_setup_teardown (cost_table_defaults,
+                                         cost_table_setup,
+                                         cost_table_teardown),
+        cmocka_unit_test_setup_teardown (cost_table_not_enforced,
+                                         cost_table_setup,
+                                         cost_table_teardown),
+        cmocka_unit_test_setup_teardown (cost_table_blocks_only,
+                                         cost_table_setup,
+                                         cost_table_teardown),
+        cmocka_unit_test_setup_teardown (cost_table_override,
+                                         cost_table_setup,
+                                         cost_table_teardown),
+        cmocka_unit_test_setup_teardown (cost_table_learned,
+                                         cost_table_setup,
+                                         cost_table_teardown),
+        cmocka_unit_test_setup_teardown (cost_table_timeout,
+                                         cost_table_setup,
+                                         cost_table_teardown),
+        cmocka_unit_test (cost_table_variant),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
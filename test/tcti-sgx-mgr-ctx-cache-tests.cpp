@@ -0,0 +1,470 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define GOOD_ID 0xf913038a09efdab5
+#define OBJECT_HANDLE 0x80000001
+#define OTHER_HANDLE 0x80000002
+
+/* the last command sent to the downstream TCTI */
+static uint8_t last_command [TPM2_MAX_COMMAND_SIZE];
+static size_t last_command_size;
+
+static TSS2_RC
+mock_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    UNUSED (ctx);
+
+    memcpy (last_command, command, size);
+    last_command_size = size;
+    return mock_type (TSS2_RC);
+}
+/*
+ * Pops a pointer to a response buffer and its size off of the mock stack
+ * and copies it to the caller.
+ */
+static TSS2_RC
+mock_receive (TSS2_TCTI_CONTEXT *ctx,
+              size_t *size,
+              uint8_t *response,
+              int32_t timeout)
+{
+    UNUSED (ctx);
+    UNUSED (timeout);
+    uint8_t *buf = mock_ptr_type (uint8_t*);
+    size_t buf_size = mock_type (size_t);
+
+    memcpy (response, buf, buf_size);
+    *size = buf_size;
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_TCTI_CONTEXT*
+test_tcti_cb (void *user_data)
+{
+    UNUSED (user_data);
+    TSS2_TCTI_CONTEXT_COMMON_V2 *ctx;
+
+    ctx = (TSS2_TCTI_CONTEXT_COMMON_V2*)calloc (1, sizeof (TSS2_TCTI_CONTEXT_COMMON_V2));
+    ctx->v1.version = 2;
+    ctx->v1.transmit = mock_transmit;
+    ctx->v1.receive = mock_receive;
+    return  (TSS2_TCTI_CONTEXT*)ctx;
+}
+/* ContextSave response carrying a TPMS_CONTEXT for an ordinary object */
+static uint8_t save_response [] = {
+    0x80, 0x01, 0x00, 0x00, 0x00, 0x1e, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07, /* sequence */
+    0x80, 0x00, 0x00, 0x00, /* savedHandle */
+    0x40, 0x00, 0x00, 0x01, /* hierarchy */
+    0x00, 0x02, 0xaa, 0xbb  /* contextBlob */
+};
+static uint8_t save_response_other [] = {
+    0x80, 0x01, 0x00, 0x00, 0x00, 0x1e, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08,
+    0x80, 0x00, 0x00, 0x00,
+    0x40, 0x00, 0x00, 0x01,
+    0x00, 0x02, 0xcc, 0xdd
+};
+static uint8_t success_response [] = {
+    0x80, 0x01, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00,
+};
+static uint8_t object_memory_response [] = {
+    0x80, 0x01, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x09, 0x02,
+};
+
+static size_t
+build_handle_cmd (uint8_t *buf,
+                  TPM2_CC cc,
+                  TPM2_HANDLE handle)
+{
+    tpm2_header_set (buf, TPM2_ST_NO_SESSIONS, 14, cc);
+    tpm2_set_uint32 (&buf [TPM2_HEADER_SIZE], handle);
+    return 14;
+}
+/* build a ContextLoad command from the TPMS_CONTEXT in a ContextSave response */
+static size_t
+build_load_cmd (uint8_t *buf,
+                uint8_t const *save_rsp,
+                size_t save_rsp_size)
+{
+    size_t size = save_rsp_size;
+
+    tpm2_header_set (buf, TPM2_ST_NO_SESSIONS, size, TPM2_CC_ContextLoad);
+    memcpy (&buf [TPM2_HEADER_SIZE],
+            &save_rsp [TPM2_HEADER_SIZE],
+            save_rsp_size - TPM2_HEADER_SIZE);
+    return size;
+}
+
+static int
+ctx_cache_setup (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    TctiSgxSessionConfig config;
+    TctiSgxSession *session;
+
+    config.ctx_cache_size = 1;
+    session = new TctiSgxSession (GOOD_ID, test_tcti_cb (NULL), config);
+
+    mgr.sessions.push_back (session);
+    return 0;
+}
+
+static int
+ctx_cache_teardown (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.session_remove (GOOD_ID);
+    return 0;
+}
+/* save the object with 'handle', the TPM responds with 'rsp' */
+static void
+save_object (TPM2_HANDLE handle,
+             uint8_t *rsp,
+             size_t rsp_size)
+{
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], buf [TPM2_MAX_RESPONSE_SIZE];
+    size_t size;
+
+    size = build_handle_cmd (cmd, TPM2_CC_ContextSave, handle);
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit_ocall (GOOD_ID, size, cmd),
+                      TSS2_RC_SUCCESS);
+    will_return (mock_receive, rsp);
+    will_return (mock_receive, rsp_size);
+    assert_int_equal (tcti_sgx_receive_ocall (GOOD_ID,
+                                              sizeof (buf),
+                                              buf,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+}
+/* flush the object with 'handle', this is answered by the cache */
+static void
+flush_object_cached (TPM2_HANDLE handle)
+{
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], buf [TPM2_MAX_RESPONSE_SIZE];
+    size_t size;
+
+    size = build_handle_cmd (cmd, TPM2_CC_FlushContext, handle);
+    assert_int_equal (tcti_sgx_transmit_ocall (GOOD_ID, size, cmd),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_receive_ocall (GOOD_ID,
+                                              sizeof (buf),
+                                              buf,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_memory_equal (buf, success_response, sizeof (success_response));
+}
+/*
+ * Save, flush and reload an object. The flush and the reload must be
+ * answered without going to the TPM and the reload must give back the
+ * original handle.
+ */
+static void
+ctx_cache_reload_hit (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], buf [TPM2_MAX_RESPONSE_SIZE];
+    tcti_sgx_ctx_cache_stats_t stats;
+    size_t size;
+
+    save_object (OBJECT_HANDLE, save_response, sizeof (save_response));
+    flush_object_cached (OBJECT_HANDLE);
+
+    size = build_load_cmd (cmd, save_response, sizeof (save_response));
+    assert_int_equal (tcti_sgx_transmit_ocall (GOOD_ID, size, cmd),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_receive_ocall (GOOD_ID,
+                                              sizeof (buf),
+                                              buf,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_header_size (buf), 14);
+    assert_int_equal (tpm2_header_code (buf), TPM2_RC_SUCCESS);
+    assert_int_equal (tpm2_get_uint32 (&buf [TPM2_HEADER_SIZE]),
+                      OBJECT_HANDLE);
+
+    assert_int_equal (tcti_sgx_mgr_get_ctx_cache_stats (GOOD_ID, &stats),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats.hits, 1);
+    assert_int_equal (stats.misses, 0);
+    assert_int_equal (stats.evictions, 0);
+    assert_int_equal (stats.entries, 0);
+}
+/*
+ * A ContextLoad for a context we've never seen must go to the TPM.
+ */
+static void
+ctx_cache_reload_miss (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], buf [TPM2_MAX_RESPONSE_SIZE];
+    uint8_t load_response [14] = {
+        0x80, 0x01, 0x00, 0x00, 0x00, 0x0e, 0x00, 0x00, 0x00, 0x00,
+        0x80, 0x00, 0x00, 0x02,
+    };
+    tcti_sgx_ctx_cache_stats_t stats;
+    size_t size;
+
+    size = build_load_cmd (cmd, save_response, sizeof (save_response));
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit_ocall (GOOD_ID, size, cmd),
+                      TSS2_RC_SUCCESS);
+    will_return (mock_receive, load_response);
+    will_return (mock_receive, sizeof (load_response));
+    assert_int_equal (tcti_sgx_receive_ocall (GOOD_ID,
+                                              sizeof (buf),
+                                              buf,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_get_ctx_cache_stats (0, &stats),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats.hits, 0);
+    assert_int_equal (stats.misses, 1);
+    /* the loaded object is now known, a ContextSave is answered locally */
+    size = build_handle_cmd (cmd, TPM2_CC_ContextSave, OTHER_HANDLE);
+    assert_int_equal (tcti_sgx_transmit_ocall (GOOD_ID, size, cmd),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_receive_ocall (GOOD_ID,
+                                              sizeof (buf),
+                                              buf,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_memory_equal (&buf [TPM2_HEADER_SIZE],
+                         &save_response [TPM2_HEADER_SIZE],
+                         sizeof (save_response) - TPM2_HEADER_SIZE);
+}
+/*
+ * The cache holds a single idle object. Flushing a second object must
+ * cause the least recently used one to be flushed from the TPM.
+ */
+static void
+ctx_cache_evict (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], buf [TPM2_MAX_RESPONSE_SIZE];
+    tcti_sgx_ctx_cache_stats_t stats;
+    size_t size;
+
+    save_object (OBJECT_HANDLE, save_response, sizeof (save_response));
+    save_object (OTHER_HANDLE,
+                 save_response_other,
+                 sizeof (save_response_other));
+    flush_object_cached (OBJECT_HANDLE);
+
+    size = build_handle_cmd (cmd, TPM2_CC_FlushContext, OTHER_HANDLE);
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    will_return (mock_receive, success_response);
+    will_return (mock_receive, sizeof (success_response));
+    assert_int_equal (tcti_sgx_transmit_ocall (GOOD_ID, size, cmd),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (last_command_size, 14);
+    assert_int_equal (tpm2_header_code (last_command), TPM2_CC_FlushContext);
+    assert_int_equal (tpm2_get_uint32 (&last_command [TPM2_HEADER_SIZE]),
+                      OBJECT_HANDLE);
+    assert_int_equal (tcti_sgx_receive_ocall (GOOD_ID,
+                                              sizeof (buf),
+                                              buf,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_get_ctx_cache_stats (GOOD_ID, &stats),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats.evictions, 1);
+    assert_int_equal (stats.entries, 1);
+    /* the remaining object is still cached */
+    size = build_load_cmd (cmd,
+                           save_response_other,
+                           sizeof (save_response_other));
+    assert_int_equal (tcti_sgx_transmit_ocall (GOOD_ID, size, cmd),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_receive_ocall (GOOD_ID,
+                                              sizeof (buf),
+                                              buf,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_get_uint32 (&buf [TPM2_HEADER_SIZE]),
+                      OTHER_HANDLE);
+}
+/*
+ * When the TPM runs out of object memory the idle objects are flushed
+ * and the command is sent again.
+ */
+static void
+ctx_cache_object_memory_retry (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], buf [TPM2_MAX_RESPONSE_SIZE];
+    tcti_sgx_ctx_cache_stats_t stats;
+    size_t size;
+
+    save_object (OBJECT_HANDLE, save_response, sizeof (save_response));
+    flush_object_cached (OBJECT_HANDLE);
+
+    size = build_handle_cmd (cmd, TPM2_CC_ReadPublic, 0x81000001);
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit_ocall (GOOD_ID, size, cmd),
+                      TSS2_RC_SUCCESS);
+    /* OBJECT_MEMORY, flush of the idle object, resend of the command */
+    will_return (mock_receive, object_memory_response);
+    will_return (mock_receive, sizeof (object_memory_response));
+    will_return_count (mock_transmit, TSS2_RC_SUCCESS, 2);
+    will_return (mock_receive, success_response);
+    will_return (mock_receive, sizeof (success_response));
+    will_return (mock_receive, success_response);
+    will_return (mock_receive, sizeof (success_response));
+    assert_int_equal (tcti_sgx_receive_ocall (GOOD_ID,
+                                              sizeof (buf),
+                                              buf,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_header_code (last_command), TPM2_CC_ReadPublic);
+    assert_int_equal (tpm2_header_code (buf), TPM2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_get_ctx_cache_stats (GOOD_ID, &stats),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats.evictions, 1);
+    assert_int_equal (stats.entries, 0);
+}
+/*
+ * The object the client loads least often is flushed first, one it keeps
+ * coming back to is loaded again ahead of it once flushed.
+ */
+static void
+ctx_cache_frequency (void **state)
+{
+    UNUSED (state);
+    TctiSgxCtxCache cache (1);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE];
+    uint8_t load_response [14] = {
+        0x80, 0x01, 0x00, 0x00, 0x00, 0x0e, 0x00, 0x00, 0x00, 0x00,
+        0x80, 0x00, 0x00, 0x05,
+    };
+    std::vector<uint8_t> rsp, preload;
+    tcti_sgx_ctx_cache_stats_t stats;
+    TPM2_HANDLE handle;
+    size_t size;
+
+    size = build_handle_cmd (cmd, TPM2_CC_ContextSave, OBJECT_HANDLE);
+    cache.response (cmd, size, save_response, sizeof (save_response));
+    size = build_handle_cmd (cmd, TPM2_CC_ContextSave, OTHER_HANDLE);
+    cache.response (cmd, size, save_response_other,
+                    sizeof (save_response_other));
+    assert_false (cache.preload_command (preload));
+
+    /* OBJECT_HANDLE is loaded twice, OTHER_HANDLE once */
+    size = build_handle_cmd (cmd, TPM2_CC_FlushContext, OBJECT_HANDLE);
+    assert_true (cache.command (cmd, size, rsp));
+    size = build_load_cmd (cmd, save_response, sizeof (save_response));
+    assert_true (cache.command (cmd, size, rsp));
+    size = build_handle_cmd (cmd, TPM2_CC_FlushContext, OBJECT_HANDLE);
+    assert_true (cache.command (cmd, size, rsp));
+    size = build_handle_cmd (cmd, TPM2_CC_FlushContext, OTHER_HANDLE);
+    assert_true (cache.command (cmd, size, rsp));
+    assert_true (cache.evict (&handle, false));
+    assert_int_equal (handle, OTHER_HANDLE);
+    assert_false (cache.evict (&handle, false));
+    assert_true (cache.evict (&handle, true));
+    assert_int_equal (handle, OBJECT_HANDLE);
+
+    assert_true (cache.preload_command (preload));
+    assert_int_equal (tpm2_header_code (preload.data ()), TPM2_CC_ContextLoad);
+    assert_true (cache.preload_response (preload.data (), preload.size (),
+                                         load_response,
+                                         sizeof (load_response)));
+    size = build_load_cmd (cmd, save_response, sizeof (save_response));
+    assert_true (cache.command (cmd, size, rsp));
+    assert_int_equal (tpm2_get_uint32 (&rsp [TPM2_HEADER_SIZE]), 0x80000005);
+    /* nothing else was loaded often enough */
+    assert_false (cache.preload_command (preload));
+    cache.get_stats (&stats);
+    assert_int_equal (stats.evictions, 2);
+    assert_int_equal (stats.preloads, 1);
+    assert_int_equal (stats.hits, 2);
+}
+/*
+ * A command that flushes the objects of a hierarchy makes the cache forget
+ * its blobs, the objects it holds idle are only flushed from then on.
+ * Making an object persistent doesn't.
+ */
+static void
+ctx_cache_hierarchy (void **state)
+{
+    UNUSED (state);
+    TctiSgxCtxCache cache (2);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE];
+    std::vector<uint8_t> rsp;
+    TPM2_HANDLE handle;
+    size_t size;
+
+    size = build_handle_cmd (cmd, TPM2_CC_ContextSave, OBJECT_HANDLE);
+    cache.response (cmd, size, save_response, sizeof (save_response));
+    size = build_handle_cmd (cmd, TPM2_CC_ContextSave, OTHER_HANDLE);
+    cache.response (cmd, size, save_response_other,
+                    sizeof (save_response_other));
+    size = build_handle_cmd (cmd, TPM2_CC_FlushContext, OBJECT_HANDLE);
+    assert_true (cache.command (cmd, size, rsp));
+
+    size = build_handle_cmd (cmd, TPM2_CC_EvictControl, TPM2_RH_OWNER);
+    cache.response (cmd, size, success_response, sizeof (success_response));
+    size = build_load_cmd (cmd, save_response, sizeof (save_response));
+    assert_true (cache.command (cmd, size, rsp));
+    size = build_handle_cmd (cmd, TPM2_CC_FlushContext, OBJECT_HANDLE);
+    assert_true (cache.command (cmd, size, rsp));
+
+    size = build_handle_cmd (cmd, TPM2_CC_Clear, TPM2_RH_PLATFORM);
+    cache.response (cmd, size, success_response, sizeof (success_response));
+    size = build_load_cmd (cmd, save_response, sizeof (save_response));
+    assert_false (cache.command (cmd, size, rsp));
+    size = build_handle_cmd (cmd, TPM2_CC_ContextSave, OTHER_HANDLE);
+    assert_false (cache.command (cmd, size, rsp));
+    size = build_handle_cmd (cmd, TPM2_CC_FlushContext, OTHER_HANDLE);
+    assert_false (cache.command (cmd, size, rsp));
+    assert_true (cache.evict (&handle, true));
+    assert_int_equal (handle, OBJECT_HANDLE);
+    assert_false (cache.evict (&handle, true));
+    assert_false (cache.preload_command (rsp));
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (ctx_cache_reload_hit,
+                                         ctx_cache_setup,
+                                         ctx_cache_teardown),
+        cmocka_unit_test_setup_teardown (ctx_cache_reload_miss,
+                                         ctx_cache_setup,
+                                         ctx_cache_teardown),
+        cmocka_unit_test_setup_teardown (ctx_cache_evict,
+                                         ctx_cache_setup,
+                                         ctx_cache_teardown),
+        cmocka_unit_test_setup_teardown (ctx_cache_object_memory_retry,
+                                         ctx_cache_setup,
+                                         ctx_cache_teardown),
+        cmocka_unit_test (ctx_cache_frequency),
+        cmocka_unit_test (ctx_cache_hierarchy),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
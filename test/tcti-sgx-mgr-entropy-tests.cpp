@@ -0,0 +1,190 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define GOOD_ID 0xf913038a09efdab5
+#define BAD_ID  0x5badfe90a830319f
+
+/* the last command sent to the downstream TCTI */
+static uint8_t last_command [TPM2_MAX_COMMAND_SIZE];
+static size_t last_command_size;
+
+static TSS2_RC
+mock_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    UNUSED (ctx);
+
+    memcpy (last_command, command, size);
+    last_command_size = size;
+    return mock_type (TSS2_RC);
+}
+/*
+ * Pops a pointer to a response buffer and its size off of the mock stack
+ * and copies it to the caller.
+ */
+static TSS2_RC
+mock_receive (TSS2_TCTI_CONTEXT *ctx,
+              size_t *size,
+              uint8_t *response,
+              int32_t timeout)
+{
+    UNUSED (ctx);
+    UNUSED (timeout);
+    uint8_t *buf = mock_ptr_type (uint8_t*);
+    size_t buf_size = mock_type (size_t);
+
+    memcpy (response, buf, buf_size);
+    *size = buf_size;
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_TCTI_CONTEXT*
+test_tcti_cb (void *user_data)
+{
+    UNUSED (user_data);
+    TSS2_TCTI_CONTEXT_COMMON_V2 *ctx;
+
+    ctx = (TSS2_TCTI_CONTEXT_COMMON_V2*)calloc (1, sizeof (TSS2_TCTI_CONTEXT_COMMON_V2));
+    ctx->v1.version = 2;
+    ctx->v1.transmit = mock_transmit;
+    ctx->v1.receive = mock_receive;
+    return  (TSS2_TCTI_CONTEXT*)ctx;
+}
+/*
+ * Build a GetRandom response carrying 'count' bytes set to 'fill'.
+ */
+static size_t
+build_random_rsp (uint8_t *buf,
+                  uint16_t count,
+                  uint8_t fill)
+{
+    size_t size = TPM2_HEADER_SIZE + 2 + count;
+
+    tpm2_header_set (buf, TPM2_ST_NO_SESSIONS, size, TPM2_RC_SUCCESS);
+    tpm2_set_uint16 (&buf [TPM2_HEADER_SIZE], count);
+    memset (&buf [TPM2_HEADER_SIZE + 2], fill, count);
+    return size;
+}
+
+static int
+entropy_setup (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    TctiSgxSessionConfig config;
+    TctiSgxSession *session;
+
+    config.entropy_reserve = 16;
+    session = new TctiSgxSession (GOOD_ID, test_tcti_cb (NULL), config);
+    mgr.sessions.push_back (session);
+    return 0;
+}
+
+static int
+entropy_teardown (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.session_remove (GOOD_ID);
+    return 0;
+}
+
+static void
+entropy_bad_id (void **state)
+{
+    UNUSED (state);
+    uint8_t buf [1];
+
+    assert_int_equal (tcti_sgx_get_random_ocall (BAD_ID, sizeof (buf), buf),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (tcti_sgx_get_random_ocall (GOOD_ID, sizeof (buf), NULL),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+}
+/*
+ * The maintenance thread fills the reserve. An ocall for more than the
+ * reserve holds takes what's there and gets the rest from the TPM with
+ * as many GetRandom commands as it takes.
+ */
+static void
+entropy_reserve (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    uint8_t rsp0 [TPM2_MAX_RESPONSE_SIZE], rsp1 [TPM2_MAX_RESPONSE_SIZE];
+    uint8_t rsp2 [TPM2_MAX_RESPONSE_SIZE], buf [28], expected [28];
+
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    will_return (mock_receive, rsp0);
+    will_return (mock_receive, build_random_rsp (rsp0, 16, 0x11));
+    mgr.maintain ();
+    assert_int_equal (tpm2_header_code (last_command), TPM2_CC_GetRandom);
+    assert_int_equal (tpm2_get_uint16 (&last_command [TPM2_HEADER_SIZE]), 16);
+
+    /* the TPM hands out fewer bytes than asked for */
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    will_return (mock_receive, rsp1);
+    will_return (mock_receive, build_random_rsp (rsp1, 8, 0x22));
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    will_return (mock_receive, rsp2);
+    will_return (mock_receive, build_random_rsp (rsp2, 4, 0x33));
+    assert_int_equal (tcti_sgx_get_random_ocall (GOOD_ID, sizeof (buf), buf),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_get_uint16 (&last_command [TPM2_HEADER_SIZE]), 4);
+    memset (expected, 0x11, 16);
+    memset (&expected [16], 0x22, 8);
+    memset (&expected [24], 0x33, 4);
+    assert_memory_equal (buf, expected, sizeof (buf));
+}
+/*
+ * Errors from the TPM are passed back to the enclave.
+ */
+static void
+entropy_tpm_error (void **state)
+{
+    UNUSED (state);
+    uint8_t rsp [TPM2_HEADER_SIZE], buf [4];
+
+    tpm2_header_set (rsp, TPM2_ST_NO_SESSIONS, sizeof (rsp), TPM2_RC_FAILURE);
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    will_return (mock_receive, rsp);
+    will_return (mock_receive, sizeof (rsp));
+    assert_int_equal (tcti_sgx_get_random_ocall (GOOD_ID, sizeof (buf), buf),
+                      TPM2_RC_FAILURE);
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (entropy_bad_id,
+                                         entropy_setup,
+                                         entropy_teardown),
+        cmocka_unit_test_setup_teardown (entropy_reserve,
+                                         entropy_setup,
+                                         entropy_teardown),
+        cmocka_unit_test_setup_teardown (entropy_tpm_error,
+                                         entropy_setup,
+                                         entropy_teardown),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,245 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#include "tcti-sgx-mgr-fake-tpm.h"
+
+using namespace std;
+
+/* items per GetCapability response, small so the manager has to page */
+#define FAKE_PAGE_SIZE 2
+
+/*
+ * The commands the fake TPM knows, with the attributes it reports, in
+ * the order it reports them.
+ */
+static TPMA_CC const fake_commands [] = {
+    TPM2_CC_Load | (1 << TPMA_CC_CHANDLES_SHIFT) | TPMA_CC_RHANDLE,
+    TPM2_CC_ContextLoad | TPMA_CC_RHANDLE,
+    TPM2_CC_ContextSave | (1 << TPMA_CC_CHANDLES_SHIFT),
+    TPM2_CC_FlushContext,
+    TPM2_CC_ReadPublic | (1 << TPMA_CC_CHANDLES_SHIFT),
+    TPM2_CC_GetCapability,
+};
+
+TPM2_HANDLE fake_base = OBJECT_A;
+bool fake_fail_load;
+fake_tpm_t *fake_shared;
+fake_tpm_t *fake_last;
+size_t fake_created;
+size_t fake_closed;
+bool fake_closed_unlocked;
+
+static void
+fake_rc (fake_tpm_t *tpm,
+         TPM2_RC rc)
+{
+    tpm2_header_set (tpm->response, TPM2_ST_NO_SESSIONS, TPM2_HEADER_SIZE,
+                     rc);
+    tpm->response_size = TPM2_HEADER_SIZE;
+}
+
+static void
+fake_uint32 (fake_tpm_t *tpm,
+             uint32_t value)
+{
+    tpm2_header_set (tpm->response, TPM2_ST_NO_SESSIONS,
+                     TPM2_HEADER_SIZE + 4, TPM2_RC_SUCCESS);
+    tpm2_set_uint32 (&tpm->response [TPM2_HEADER_SIZE], value);
+    tpm->response_size = TPM2_HEADER_SIZE + 4;
+}
+
+/*
+ * The TPM whose objects the connection 'tpm' sees.
+ */
+static fake_tpm_t*
+fake_objects (fake_tpm_t *tpm)
+{
+    return tpm->shared != NULL ? tpm->shared : tpm;
+}
+
+static int
+fake_find (fake_tpm_t *tpm,
+           TPM2_HANDLE handle)
+{
+    int i;
+
+    tpm = fake_objects (tpm);
+    for (i = 0; i < FAKE_OBJECTS_MAX; ++i)
+        if (handle != 0 && tpm->handles [i] == handle)
+            return i;
+    return -1;
+}
+
+static void
+fake_create (fake_tpm_t *tpm,
+             uint32_t value)
+{
+    fake_tpm_t *objects = fake_objects (tpm);
+    TPM2_HANDLE handle = objects->base;
+    int i;
+
+    while (fake_find (tpm, handle) >= 0)
+        ++handle;
+    for (i = 0; i < FAKE_OBJECTS_MAX && objects->handles [i] != 0; ++i);
+    if (i == FAKE_OBJECTS_MAX) {
+        fake_rc (tpm, TPM2_RC_OBJECT_MEMORY);
+        return;
+    }
+    objects->handles [i] = handle;
+    objects->values [i] = value;
+    fake_uint32 (tpm, handle);
+}
+/*
+ * Answer GetCapability for the commands or the handles in the range of
+ * 'first', FAKE_PAGE_SIZE at a time.
+ */
+void
+fake_capability (fake_tpm_t *tpm,
+                 TPM2_CAP capability,
+                 uint32_t first)
+{
+    fake_tpm_t *objects = fake_objects (tpm);
+    vector<uint32_t> items;
+    size_t count, i;
+
+    if (capability == TPM2_CAP_COMMANDS) {
+        for (i = 0; i < sizeof (fake_commands) / sizeof (fake_commands [0]);
+             ++i)
+            if ((fake_commands [i] & TPMA_CC_COMMANDINDEX_MASK) >= first)
+                items.push_back (fake_commands [i]);
+    } else {
+        for (i = 0; i < FAKE_OBJECTS_MAX; ++i)
+            if (objects->handles [i] >= first &&
+                (objects->handles [i] & TPM2_HR_RANGE_MASK) ==
+                    (first & TPM2_HR_RANGE_MASK))
+                items.push_back (objects->handles [i]);
+        sort (items.begin (), items.end ());
+    }
+    count = items.size () > FAKE_PAGE_SIZE ? FAKE_PAGE_SIZE : items.size ();
+    tpm->response_size = TPM2_HEADER_SIZE + 9 + count * 4;
+    tpm2_header_set (tpm->response, TPM2_ST_NO_SESSIONS, tpm->response_size,
+                     TPM2_RC_SUCCESS);
+    tpm->response [TPM2_HEADER_SIZE] = items.size () > count;
+    tpm2_set_uint32 (&tpm->response [TPM2_HEADER_SIZE + 1], capability);
+    tpm2_set_uint32 (&tpm->response [TPM2_HEADER_SIZE + 5], count);
+    for (i = 0; i < count; ++i)
+        tpm2_set_uint32 (&tpm->response [TPM2_HEADER_SIZE + 9 + i * 4],
+                         items [i]);
+}
+
+static TSS2_RC
+fake_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    fake_tpm_t *tpm = (fake_tpm_t*)ctx;
+    uint32_t arg = 0;
+    int i;
+
+    assert_true (size >= TPM2_HEADER_SIZE + 4);
+    arg = tpm2_get_uint32 (&command [TPM2_HEADER_SIZE]);
+    i = fake_find (tpm, arg);
+    switch (tpm2_header_code (command)) {
+    case TPM2_CC_GetCapability:
+        fake_capability (tpm, arg,
+                         tpm2_get_uint32 (&command [TPM2_HEADER_SIZE + 4]));
+        break;
+    case TPM2_CC_Load:
+        fake_create (tpm, tpm2_get_uint32 (&command [TPM2_HEADER_SIZE + 4]));
+        break;
+    case TPM2_CC_ContextLoad:
+        if (tpm->fail_load)
+            fake_rc (tpm, TPM2_RC_FAILURE);
+        else
+            fake_create (tpm, arg);
+        break;
+    case TPM2_CC_ContextSave:
+    case TPM2_CC_ReadPublic:
+        if (i < 0)
+            fake_rc (tpm, TPM2_RC_HANDLE);
+        else
+            fake_uint32 (tpm, fake_objects (tpm)->values [i]);
+        break;
+    case TPM2_CC_FlushContext:
+        if (i < 0) {
+            fake_rc (tpm, TPM2_RC_HANDLE);
+        } else {
+            fake_objects (tpm)->handles [i] = 0;
+            fake_rc (tpm, TPM2_RC_SUCCESS);
+        }
+        break;
+    default:
+        fake_rc (tpm, TPM2_RC_FAILURE);
+    }
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC
+fake_receive (TSS2_TCTI_CONTEXT *ctx,
+              size_t *size,
+              uint8_t *response,
+              int32_t timeout)
+{
+    fake_tpm_t *tpm = (fake_tpm_t*)ctx;
+    UNUSED (timeout);
+
+    if (*size < tpm->response_size)
+        return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+    memcpy (response, tpm->response, tpm->response_size);
+    *size = tpm->response_size;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Count the connection closed and note whether another thread could have
+ * had the manager lock meanwhile.
+ */
+static void
+fake_finalize (TSS2_TCTI_CONTEXT *ctx)
+{
+    UNUSED (ctx);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    ++fake_closed;
+    thread other ([&mgr] () {
+        fake_closed_unlocked = mgr.sessions_mutex.try_lock ();
+        if (fake_closed_unlocked)
+            mgr.sessions_mutex.unlock ();
+    });
+    other.join ();
+}
+
+TSS2_TCTI_CONTEXT*
+test_tcti_cb (void *user_data)
+{
+    UNUSED (user_data);
+    fake_tpm_t *tpm;
+
+    tpm = (fake_tpm_t*)calloc (1, sizeof (fake_tpm_t));
+    tpm->common.v1.version = 2;
+    tpm->common.v1.transmit = fake_transmit;
+    tpm->common.v1.receive = fake_receive;
+    tpm->common.v1.finalize = fake_finalize;
+    tpm->shared = fake_shared;
+    tpm->base = fake_base;
+    tpm->fail_load = fake_fail_load;
+    fake_last = tpm;
+    ++fake_created;
+    return  (TSS2_TCTI_CONTEXT*)tpm;
+}
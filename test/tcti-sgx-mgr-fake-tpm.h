@@ -0,0 +1,54 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TCTI_SGX_MGR_FAKE_TPM_H
+#define TCTI_SGX_MGR_FAKE_TPM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <tss2/tss2_tcti.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#define OBJECT_A 0x80000000
+#define OBJECT_B 0x80000001
+#define FAKE_OBJECTS_MAX 8
+
+/*
+ * A TPM behind a single connection. Objects are just a value: Load takes
+ * a parent handle and the value, ReadPublic returns it and a saved context
+ * is the value again. New objects get the lowest free handle from 'base'.
+ * test_tcti_cb gives every connection a TPM of its own unless told to
+ * have them share one, as connections with no resource manager in
+ * between do: then the objects are those of 'shared'.
+ */
+typedef struct fake_tpm fake_tpm_t;
+struct fake_tpm {
+    TSS2_TCTI_CONTEXT_COMMON_V2 common;
+    fake_tpm_t *shared;
+    TPM2_HANDLE base;
+    TPM2_HANDLE handles [FAKE_OBJECTS_MAX];
+    uint32_t values [FAKE_OBJECTS_MAX];
+    bool fail_load;
+    uint8_t response [TPM2_MAX_RESPONSE_SIZE];
+    size_t response_size;
+};
+
+/* what connections created from now on are like */
+extern TPM2_HANDLE fake_base;
+extern bool fake_fail_load;
+extern fake_tpm_t *fake_shared;
+/* the last connection created, how many were and how many were closed */
+extern fake_tpm_t *fake_last;
+extern size_t fake_created;
+extern size_t fake_closed;
+/* whether the manager lock was free when the last connection closed */
+extern bool fake_closed_unlocked;
+
+void fake_capability (fake_tpm_t *tpm,
+                      TPM2_CAP capability,
+                      uint32_t first);
+TSS2_TCTI_CONTEXT* test_tcti_cb (void *user_data);
+
+#endif /* TCTI_SGX_MGR_FAKE_TPM_H */
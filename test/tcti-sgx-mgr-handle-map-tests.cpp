@@ -0,0 +1,328 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#include "tcti-sgx-mgr-fake-tpm.h"
+
+using namespace std;
+
+#define SESSION_A 0x02000000
+
+static TSS2_RC
+send_cmd (uint64_t id,
+          TPM2_CC code,
+          TPM2_HANDLE handle,
+          uint32_t value)
+{
+    uint8_t cmd [TPM2_HEADER_SIZE + 8];
+    size_t size = TPM2_HEADER_SIZE + (code == TPM2_CC_Load ? 8 : 4);
+
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, size, code);
+    tpm2_set_uint32 (&cmd [TPM2_HEADER_SIZE], handle);
+    tpm2_set_uint32 (&cmd [TPM2_HEADER_SIZE + 4], value);
+    return tcti_sgx_transmit_ocall (id, size, cmd);
+}
+/*
+ * Collect the response to the last command, returns the handle or value
+ * that follows the header.
+ */
+static uint32_t
+recv_uint32 (uint64_t id)
+{
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE];
+
+    assert_int_equal (tcti_sgx_receive_ocall (id,
+                                              sizeof (rsp),
+                                              rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_header_code (rsp), TPM2_RC_SUCCESS);
+    if (tpm2_header_size (rsp) < TPM2_HEADER_SIZE + 4)
+        return 0;
+    return tpm2_get_uint32 (&rsp [TPM2_HEADER_SIZE]);
+}
+
+static uint32_t
+call (uint64_t id,
+      TPM2_CC code,
+      TPM2_HANDLE handle,
+      uint32_t value)
+{
+    assert_int_equal (send_cmd (id, code, handle, value), TSS2_RC_SUCCESS);
+    return recv_uint32 (id);
+}
+/*
+ * Point the map at a connection where OBJECT_A is OBJECT_A + 5 and
+ * SESSION_A is SESSION_A + 3.
+ */
+static void
+map_setup (TctiSgxHandleMap &map)
+{
+    fake_tpm_t tpm;
+    vector<TPM2_HANDLE> from, to;
+    TPM2_CC next = TPM2_CC_FIRST;
+
+    memset (&tpm, 0, sizeof (tpm));
+    do {
+        fake_capability (&tpm, TPM2_CAP_COMMANDS, next);
+    } while (map.add_commands (tpm.response, tpm.response_size, &next) == 1);
+    assert_true (map.has_commands ());
+    assert_true (map.response_handle (TPM2_CC_Load));
+    assert_false (map.response_handle (TPM2_CC_ReadPublic));
+    from.push_back (OBJECT_A);
+    from.push_back (SESSION_A);
+    to.push_back (OBJECT_A + 5);
+    to.push_back (SESSION_A + 3);
+    map.moved (from, to);
+    assert_int_equal (map.size (), 2);
+}
+/*
+ * Handles in the handle and authorization areas are translated, nothing
+ * is while the map is empty.
+ */
+static void
+handle_map_command (void **state)
+{
+    UNUSED (state);
+    TctiSgxHandleMap map;
+    uint8_t cmd [TPM2_HEADER_SIZE + 4 + 4 + 4 + 2 + 1 + 2];
+    uint8_t const *out;
+
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, TPM2_HEADER_SIZE + 4,
+                     TPM2_CC_ReadPublic);
+    tpm2_set_uint32 (&cmd [TPM2_HEADER_SIZE], OBJECT_A);
+    assert_ptr_equal (map.command (cmd, TPM2_HEADER_SIZE + 4), cmd);
+    map_setup (map);
+
+    out = map.command (cmd, TPM2_HEADER_SIZE + 4);
+    assert_true (out != cmd);
+    assert_int_equal (tpm2_get_uint32 (&out [TPM2_HEADER_SIZE]), OBJECT_A + 5);
+    assert_int_equal (tpm2_get_uint32 (&cmd [TPM2_HEADER_SIZE]), OBJECT_A);
+
+    /* authSize | sessionHandle | nonce | attributes | hmac */
+    memset (cmd, 0, sizeof (cmd));
+    tpm2_header_set (cmd, TPM2_ST_SESSIONS, sizeof (cmd), TPM2_CC_ReadPublic);
+    tpm2_set_uint32 (&cmd [TPM2_HEADER_SIZE], OBJECT_B);
+    tpm2_set_uint32 (&cmd [TPM2_HEADER_SIZE + 4], 9);
+    tpm2_set_uint32 (&cmd [TPM2_HEADER_SIZE + 8], SESSION_A);
+    out = map.command (cmd, sizeof (cmd));
+    assert_int_equal (tpm2_get_uint32 (&out [TPM2_HEADER_SIZE]), OBJECT_B);
+    assert_int_equal (tpm2_get_uint32 (&out [TPM2_HEADER_SIZE + 8]),
+                      SESSION_A + 3);
+    /* a bad authorization area is left alone */
+    tpm2_set_uint32 (&cmd [TPM2_HEADER_SIZE + 4], 64);
+    out = map.command (cmd, sizeof (cmd));
+    assert_int_equal (tpm2_get_uint32 (&out [TPM2_HEADER_SIZE + 8]),
+                      SESSION_A);
+}
+/*
+ * A handle from the TPM the client already uses for something else is
+ * made up. Flushing forgets a handle, Startup forgets them all.
+ */
+static void
+handle_map_response (void **state)
+{
+    UNUSED (state);
+    TctiSgxHandleMap map;
+    uint8_t cmd [TPM2_HEADER_SIZE + 8];
+    uint8_t rsp [TPM2_HEADER_SIZE + 4];
+    uint8_t const *out;
+    TPM2_HANDLE client;
+
+    map_setup (map);
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, sizeof (cmd), TPM2_CC_Load);
+    tpm2_header_set (rsp, TPM2_ST_NO_SESSIONS, sizeof (rsp), TPM2_RC_SUCCESS);
+    map.command (cmd, sizeof (cmd));
+    tpm2_set_uint32 (&rsp [TPM2_HEADER_SIZE], OBJECT_B);
+    map.response (rsp, sizeof (rsp));
+    assert_int_equal (tpm2_get_uint32 (&rsp [TPM2_HEADER_SIZE]), OBJECT_B);
+
+    map.command (cmd, sizeof (cmd));
+    tpm2_set_uint32 (&rsp [TPM2_HEADER_SIZE], OBJECT_A);
+    map.response (rsp, sizeof (rsp));
+    client = tpm2_get_uint32 (&rsp [TPM2_HEADER_SIZE]);
+    assert_int_not_equal (client, OBJECT_A);
+    assert_int_equal (client & TPM2_HR_RANGE_MASK, TPM2_HR_TRANSIENT);
+    assert_int_equal (map.size (), 3);
+
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, TPM2_HEADER_SIZE + 4,
+                     TPM2_CC_FlushContext);
+    tpm2_set_uint32 (&cmd [TPM2_HEADER_SIZE], client);
+    out = map.command (cmd, TPM2_HEADER_SIZE + 4);
+    assert_int_equal (tpm2_get_uint32 (&out [TPM2_HEADER_SIZE]), OBJECT_A);
+    tpm2_header_set (rsp, TPM2_ST_NO_SESSIONS, TPM2_HEADER_SIZE,
+                     TPM2_RC_SUCCESS);
+    map.response (rsp, TPM2_HEADER_SIZE);
+    assert_int_equal (map.size (), 2);
+
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, TPM2_HEADER_SIZE + 2,
+                     TPM2_CC_Startup);
+    map.command (cmd, TPM2_HEADER_SIZE + 2);
+    map.response (rsp, TPM2_HEADER_SIZE);
+    assert_false (map.active ());
+}
+
+static int
+migrate_setup (void **state)
+{
+    uint64_t *id = (uint64_t*)calloc (1, sizeof (uint64_t));
+
+    fake_base = OBJECT_A;
+    fake_shared = NULL;
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    *id = tcti_sgx_init_ocall ();
+    assert_int_not_equal (*id, 0);
+    *state = id;
+    return 0;
+}
+
+static int
+migrate_teardown (void **state)
+{
+    uint64_t *id = (uint64_t*)*state;
+
+    tcti_sgx_finalize_ocall (*id);
+    free (id);
+    return 0;
+}
+/*
+ * Objects move to the new connection, the response to a command in
+ * flight follows them and the client's handles keep working, even where
+ * the new connection gives out a handle the client already holds.
+ */
+static void
+migrate_objects (void **state)
+{
+    uint64_t id = *(uint64_t*)*state;
+    fake_tpm_t *first = fake_last;
+    TPM2_HANDLE c, d;
+
+    assert_int_equal (tcti_sgx_mgr_migrate_session (id + 1),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (call (id, TPM2_CC_Load, TPM2_RH_OWNER, 0xa), OBJECT_A);
+    assert_int_equal (call (id, TPM2_CC_Load, TPM2_RH_OWNER, 0xb), OBJECT_B);
+    call (id, TPM2_CC_FlushContext, OBJECT_A, 0);
+    assert_int_equal (send_cmd (id, TPM2_CC_Load, TPM2_RH_OWNER, 0xc),
+                      TSS2_RC_SUCCESS);
+
+    fake_base = OBJECT_B;
+    assert_int_equal (tcti_sgx_mgr_migrate_session (id), TSS2_RC_SUCCESS);
+    assert_true (fake_last != first);
+    c = recv_uint32 (id);
+    assert_int_equal (c, OBJECT_A);
+    assert_int_equal (call (id, TPM2_CC_ReadPublic, c, 0), 0xc);
+    assert_int_equal (call (id, TPM2_CC_ReadPublic, OBJECT_B, 0), 0xb);
+
+    /* the TPM reuses OBJECT_B for 'd', the client still holds it for 'b' */
+    call (id, TPM2_CC_FlushContext, c, 0);
+    d = call (id, TPM2_CC_Load, TPM2_RH_OWNER, 0xd);
+    assert_int_not_equal (d, OBJECT_B);
+    assert_int_equal (call (id, TPM2_CC_ReadPublic, d, 0), 0xd);
+    assert_int_equal (call (id, TPM2_CC_ReadPublic, OBJECT_B, 0), 0xb);
+
+    /* moving again starts from the client's handles as they are now */
+    fake_base = 0x80000010;
+    assert_int_equal (tcti_sgx_mgr_migrate_session (0), TSS2_RC_SUCCESS);
+    assert_int_equal (call (id, TPM2_CC_ReadPublic, d, 0), 0xd);
+    assert_int_equal (call (id, TPM2_CC_ReadPublic, OBJECT_B, 0), 0xb);
+}
+/*
+ * With connections that see each other's objects only the session's own
+ * move, the other session's object stays where it is. The session is
+ * moved without the manager lock.
+ */
+static void
+migrate_shared (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    TctiSgxSession *session;
+    fake_tpm_t shared;
+    uint64_t a, b;
+
+    memset (&shared, 0, sizeof (shared));
+    shared.base = OBJECT_A;
+    fake_shared = &shared;
+    a = tcti_sgx_init_ocall ();
+    b = tcti_sgx_init_ocall ();
+    assert_int_not_equal (a, 0);
+    assert_int_not_equal (b, 0);
+    assert_int_equal (call (a, TPM2_CC_Load, TPM2_RH_OWNER, 0xa), OBJECT_A);
+    assert_int_equal (call (b, TPM2_CC_Load, TPM2_RH_OWNER, 0xb), OBJECT_B);
+
+    /* one that's in use is left alone, the manager isn't held up */
+    session = mgr.session_find (a);
+    assert_non_null (session);
+    session->lock ();
+    assert_int_equal (tcti_sgx_mgr_migrate_session (a),
+                      TSS2_TCTI_RC_TRY_AGAIN);
+    session->unlock ();
+    fake_closed_unlocked = false;
+    assert_int_equal (tcti_sgx_mgr_migrate_session (a), TSS2_RC_SUCCESS);
+    assert_true (fake_closed_unlocked);
+    assert_int_equal (shared.handles [0], 0);
+    assert_int_equal (shared.handles [1], OBJECT_B);
+    assert_int_equal (shared.handles [2], OBJECT_B + 1);
+    assert_int_equal (call (a, TPM2_CC_ReadPublic, OBJECT_A, 0), 0xa);
+    assert_int_equal (call (b, TPM2_CC_ReadPublic, OBJECT_B, 0), 0xb);
+    tcti_sgx_finalize_ocall (a);
+    tcti_sgx_finalize_ocall (b);
+    fake_shared = NULL;
+}
+/*
+ * A connection that can't take the objects is given back, the session
+ * carries on where it was.
+ */
+static void
+migrate_fail (void **state)
+{
+    uint64_t id = *(uint64_t*)*state;
+    fake_tpm_t *first = fake_last;
+
+    assert_int_equal (call (id, TPM2_CC_Load, TPM2_RH_OWNER, 0xa), OBJECT_A);
+    assert_int_equal (call (id, TPM2_CC_Load, TPM2_RH_OWNER, 0xb), OBJECT_B);
+    fake_fail_load = true;
+    fake_base = 0x80000010;
+    assert_int_equal (tcti_sgx_mgr_migrate_session (id), TPM2_RC_FAILURE);
+    fake_fail_load = false;
+    assert_int_equal (call (id, TPM2_CC_ReadPublic, OBJECT_A, 0), 0xa);
+    assert_int_equal (call (id, TPM2_CC_ReadPublic, OBJECT_B, 0), 0xb);
+    assert_int_equal (first->handles [0], OBJECT_A);
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (handle_map_command),
+        cmocka_unit_test (handle_map_response),
+        cmocka_unit_test_setup_teardown (migrate_objects,
+                                         migrate_setup,
+                                         migrate_teardown),
+        cmocka_unit_test_setup_teardown (migrate_shared,
+                                         migrate_setup,
+                                         migrate_teardown),
+        cmocka_unit_test_setup_teardown (migrate_fail,
+                                         migrate_setup,
+                                         migrate_teardown),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
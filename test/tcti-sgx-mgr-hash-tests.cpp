@@ -0,0 +1,394 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define GOOD_ID     0x6e0b3d2c91f4a857
+#define OTHER_ID    0x1f7c52e98ad0b364
+#define SEQ_HANDLE  0x80000001
+
+/* the command codes sent to the downstream TCTI and the last command */
+static TPM2_CC codes [8];
+static size_t code_count;
+static uint8_t last_command [TPM2_MAX_COMMAND_SIZE];
+static size_t last_command_size;
+
+static TSS2_RC
+mock_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    UNUSED (ctx);
+
+    if (code_count < sizeof (codes) / sizeof (codes [0]))
+        codes [code_count++] = tpm2_header_code (command);
+    memcpy (last_command, command, size);
+    last_command_size = size;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Pops a pointer to a response buffer and its size off of the mock stack
+ * and copies it to the caller.
+ */
+static TSS2_RC
+mock_receive (TSS2_TCTI_CONTEXT *ctx,
+              size_t *size,
+              uint8_t *response,
+              int32_t timeout)
+{
+    UNUSED (ctx);
+    UNUSED (timeout);
+    uint8_t *buf = mock_ptr_type (uint8_t*);
+    size_t buf_size = mock_type (size_t);
+
+    memcpy (response, buf, buf_size);
+    *size = buf_size;
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_TCTI_CONTEXT*
+test_tcti_cb (void *user_data)
+{
+    UNUSED (user_data);
+    TSS2_TCTI_CONTEXT_COMMON_V2 *ctx;
+
+    ctx = (TSS2_TCTI_CONTEXT_COMMON_V2*)calloc (1, sizeof (TSS2_TCTI_CONTEXT_COMMON_V2));
+    ctx->v1.version = 2;
+    ctx->v1.transmit = mock_transmit;
+    ctx->v1.receive = mock_receive;
+    return  (TSS2_TCTI_CONTEXT*)ctx;
+}
+
+static void
+expect_rsp (uint8_t *rsp,
+            size_t size)
+{
+    will_return (mock_receive, rsp);
+    will_return (mock_receive, size);
+}
+/*
+ * A digest filled with 'fill' and a NULL ticket. Responses with sessions
+ * get the parameterSize in front and a password auth area behind.
+ */
+static size_t
+build_hash_rsp (uint8_t *buf,
+                TPM2_ST tag,
+                uint8_t fill)
+{
+    size_t offset = tag == TPM2_ST_SESSIONS ? 4 : 0;
+    uint8_t *p = &buf [TPM2_HEADER_SIZE + offset];
+    size_t size = TPM2_HEADER_SIZE + offset + 42;
+
+    tpm2_set_uint16 (p, 32);
+    memset (&p [2], fill, 32);
+    tpm2_set_uint16 (&p [34], TPM2_ST_HASHCHECK);
+    tpm2_set_uint32 (&p [36], TPM2_RH_NULL);
+    tpm2_set_uint16 (&p [40], 0);
+    if (tag == TPM2_ST_SESSIONS) {
+        tpm2_set_uint32 (&buf [TPM2_HEADER_SIZE], 42);
+        /* empty nonce, continueSession, empty hmac */
+        tpm2_set_uint16 (&buf [size], 0);
+        buf [size + 2] = 1;
+        tpm2_set_uint16 (&buf [size + 3], 0);
+        size += 5;
+    }
+    tpm2_header_set (buf, tag, size, TPM2_RC_SUCCESS);
+    return size;
+}
+
+static int
+hash_setup (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.sessions.push_back (new TctiSgxSession (GOOD_ID,
+                                                test_tcti_cb (NULL),
+                                                mgr.session_config));
+    code_count = 0;
+    return 0;
+}
+
+static int
+hash_teardown (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.session_remove (GOOD_ID);
+    return 0;
+}
+
+static void
+hash_bad_params (void **state)
+{
+    UNUSED (state);
+    uint8_t data [8] = { 0 }, result [64];
+
+    assert_int_equal (tcti_sgx_hash_update_ocall (GOOD_ID,
+                                                  TPM2_ALG_SHA256,
+                                                  sizeof (data),
+                                                  NULL),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+    assert_int_equal (tcti_sgx_hash_update_ocall (0,
+                                                  TPM2_ALG_SHA256,
+                                                  sizeof (data),
+                                                  data),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (tcti_sgx_hash_complete_ocall (GOOD_ID,
+                                                    TPM2_ALG_SHA256,
+                                                    TPM2_RH_NULL,
+                                                    sizeof (data),
+                                                    data,
+                                                    sizeof (result),
+                                                    NULL),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+    assert_int_equal (tcti_sgx_hash_complete_ocall (GOOD_ID,
+                                                    TPM2_ALG_NULL,
+                                                    TPM2_RH_NULL,
+                                                    sizeof (data),
+                                                    data,
+                                                    sizeof (result),
+                                                    result),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (code_count, 0);
+}
+/*
+ * Data that fits in a single buffer is hashed with TPM2_Hash.
+ */
+static void
+hash_single (void **state)
+{
+    UNUSED (state);
+    uint8_t data [100], rsp [TPM2_MAX_RESPONSE_SIZE], result [64];
+    size_t rsp_size;
+
+    memset (data, 0x5a, sizeof (data));
+    rsp_size = build_hash_rsp (rsp, TPM2_ST_NO_SESSIONS, 0x77);
+    expect_rsp (rsp, rsp_size);
+    assert_int_equal (tcti_sgx_hash_complete_ocall (GOOD_ID,
+                                                    TPM2_ALG_SHA256,
+                                                    TPM2_RH_NULL,
+                                                    sizeof (data),
+                                                    data,
+                                                    sizeof (result),
+                                                    result),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (code_count, 1);
+    assert_int_equal (codes [0], TPM2_CC_Hash);
+    assert_int_equal (tpm2_get_uint16 (&last_command [TPM2_HEADER_SIZE]),
+                      sizeof (data));
+    assert_memory_equal (result, &rsp [TPM2_HEADER_SIZE], 42);
+}
+/*
+ * Data larger than a buffer is fed to a hash sequence in chunks. The last
+ * chunk goes with SequenceComplete.
+ */
+static void
+hash_sequence (void **state)
+{
+    UNUSED (state);
+    uint8_t data [2 * TPM2_MAX_DIGEST_BUFFER + 452];
+    uint8_t start_rsp [TPM2_HEADER_SIZE + 4], update_rsp [TPM2_HEADER_SIZE + 9];
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE], result [42];
+    size_t rsp_size;
+
+    memset (data, 0xa5, sizeof (data));
+    tpm2_header_set (start_rsp,
+                     TPM2_ST_NO_SESSIONS,
+                     sizeof (start_rsp),
+                     TPM2_RC_SUCCESS);
+    tpm2_set_uint32 (&start_rsp [TPM2_HEADER_SIZE], SEQ_HANDLE);
+    tpm2_header_set (update_rsp,
+                     TPM2_ST_SESSIONS,
+                     sizeof (update_rsp),
+                     TPM2_RC_SUCCESS);
+    rsp_size = build_hash_rsp (rsp, TPM2_ST_SESSIONS, 0x99);
+
+    expect_rsp (start_rsp, sizeof (start_rsp));
+    expect_rsp (update_rsp, sizeof (update_rsp));
+    assert_int_equal (tcti_sgx_hash_update_ocall (GOOD_ID,
+                                                  TPM2_ALG_SHA256,
+                                                  TPM2_MAX_DIGEST_BUFFER + 1,
+                                                  data),
+                      TSS2_RC_SUCCESS);
+    expect_rsp (update_rsp, sizeof (update_rsp));
+    expect_rsp (rsp, rsp_size);
+    assert_int_equal (tcti_sgx_hash_complete_ocall (GOOD_ID,
+                                                    TPM2_ALG_SHA256,
+                                                    TPM2_RH_NULL,
+                                                    sizeof (data) - TPM2_MAX_DIGEST_BUFFER - 1,
+                                                    &data [TPM2_MAX_DIGEST_BUFFER + 1],
+                                                    sizeof (result),
+                                                    result),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (code_count, 4);
+    assert_int_equal (codes [0], TPM2_CC_HashSequenceStart);
+    assert_int_equal (codes [1], TPM2_CC_SequenceUpdate);
+    assert_int_equal (codes [2], TPM2_CC_SequenceUpdate);
+    assert_int_equal (codes [3], TPM2_CC_SequenceComplete);
+    assert_int_equal (tpm2_get_uint32 (&last_command [TPM2_HEADER_SIZE]),
+                      SEQ_HANDLE);
+    /* handle, authorization area, then what's left of the data */
+    assert_int_equal (tpm2_get_uint16 (&last_command [TPM2_HEADER_SIZE + 17]),
+                      452);
+    /* just the parameters, 'result' has no room for the auth area */
+    assert_memory_equal (result, &rsp [TPM2_HEADER_SIZE + 4], 42);
+}
+/*
+ * The algorithm can't change in the middle of a sequence.
+ */
+static void
+hash_alg_mismatch (void **state)
+{
+    UNUSED (state);
+    uint8_t data [16] = { 0 }, result [64];
+
+    assert_int_equal (tcti_sgx_hash_update_ocall (GOOD_ID,
+                                                  TPM2_ALG_SHA256,
+                                                  sizeof (data),
+                                                  data),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_hash_complete_ocall (GOOD_ID,
+                                                    TPM2_ALG_SHA1,
+                                                    TPM2_RH_NULL,
+                                                    sizeof (data),
+                                                    data,
+                                                    sizeof (result),
+                                                    result),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (code_count, 0);
+}
+/*
+ * A command sent in the middle of a sequence doesn't end it, nor does
+ * data turned away with TRY_AGAIN: the enclave keeps its side of the
+ * sequence in both cases too.
+ */
+static void
+hash_interleaved (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    uint8_t data [TPM2_MAX_DIGEST_BUFFER + 1];
+    uint8_t start_rsp [TPM2_HEADER_SIZE + 4], update_rsp [TPM2_HEADER_SIZE + 9];
+    uint8_t cmd [TPM2_HEADER_SIZE], rsp [TPM2_MAX_RESPONSE_SIZE];
+    uint8_t result [42];
+
+    memset (data, 0xa5, sizeof (data));
+    tpm2_header_set (start_rsp,
+                     TPM2_ST_NO_SESSIONS,
+                     sizeof (start_rsp),
+                     TPM2_RC_SUCCESS);
+    tpm2_set_uint32 (&start_rsp [TPM2_HEADER_SIZE], SEQ_HANDLE);
+    tpm2_header_set (update_rsp,
+                     TPM2_ST_SESSIONS,
+                     sizeof (update_rsp),
+                     TPM2_RC_SUCCESS);
+    expect_rsp (start_rsp, sizeof (start_rsp));
+    expect_rsp (update_rsp, sizeof (update_rsp));
+    assert_int_equal (tcti_sgx_hash_update_ocall (GOOD_ID,
+                                                  TPM2_ALG_SHA256,
+                                                  sizeof (data),
+                                                  data),
+                      TSS2_RC_SUCCESS);
+
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, sizeof (cmd), TPM2_CC_Load);
+    tpm2_header_set (rsp, TPM2_ST_NO_SESSIONS, TPM2_HEADER_SIZE,
+                     TPM2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit_ocall (GOOD_ID, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+    expect_rsp (rsp, TPM2_HEADER_SIZE);
+    assert_int_equal (tcti_sgx_receive_ocall (GOOD_ID, sizeof (rsp), rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+
+    /* another session's command takes the only place there is */
+    mgr.sessions.push_back (new TctiSgxSession (OTHER_ID,
+                                                test_tcti_cb (NULL),
+                                                mgr.session_config));
+    assert_int_equal (tcti_sgx_mgr_set_admission_limit (TCTI_SGX_SCOPE_MANAGER,
+                                                        1, 0),
+                      0);
+    assert_int_equal (tcti_sgx_transmit_ocall (OTHER_ID, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_hash_update_ocall (GOOD_ID,
+                                                  TPM2_ALG_SHA256,
+                                                  TPM2_MAX_DIGEST_BUFFER,
+                                                  data),
+                      TSS2_TCTI_RC_TRY_AGAIN);
+    assert_int_equal (tcti_sgx_hash_update_ocall (GOOD_ID,
+                                                  TPM2_ALG_SHA1,
+                                                  sizeof (data),
+                                                  data),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    expect_rsp (rsp, TPM2_HEADER_SIZE);
+    assert_int_equal (tcti_sgx_receive_ocall (OTHER_ID, sizeof (rsp), rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    tcti_sgx_mgr_set_admission_limit (TCTI_SGX_SCOPE_MANAGER, 0, 0);
+    mgr.session_remove (OTHER_ID);
+
+    expect_rsp (update_rsp, sizeof (update_rsp));
+    assert_int_equal (tcti_sgx_hash_update_ocall (GOOD_ID,
+                                                  TPM2_ALG_SHA256,
+                                                  TPM2_MAX_DIGEST_BUFFER,
+                                                  data),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (code_count, 5);
+    assert_int_equal (codes [0], TPM2_CC_HashSequenceStart);
+    assert_int_equal (codes [1], TPM2_CC_SequenceUpdate);
+    assert_int_equal (codes [2], TPM2_CC_Load);
+    assert_int_equal (codes [3], TPM2_CC_Load);
+    assert_int_equal (codes [4], TPM2_CC_SequenceUpdate);
+    assert_int_equal (tpm2_get_uint32 (&last_command [TPM2_HEADER_SIZE]),
+                      SEQ_HANDLE);
+    expect_rsp (rsp, build_hash_rsp (rsp, TPM2_ST_SESSIONS, 0x99));
+    assert_int_equal (tcti_sgx_hash_complete_ocall (GOOD_ID,
+                                                    TPM2_ALG_SHA256,
+                                                    TPM2_RH_NULL,
+                                                    0,
+                                                    data,
+                                                    sizeof (result),
+                                                    result),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (codes [5], TPM2_CC_SequenceComplete);
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (hash_bad_params,
+                                         hash_setup,
+                                         hash_teardown),
+        cmocka_unit_test_setup_teardown (hash_single,
+                                         hash_setup,
+                                         hash_teardown),
+        cmocka_unit_test_setup_teardown (hash_sequence,
+                                         hash_setup,
+                                         hash_teardown),
+        cmocka_unit_test_setup_teardown (hash_alg_mismatch,
+                                         hash_setup,
+                                         hash_teardown),
+        cmocka_unit_test_setup_teardown (hash_interleaved,
+                                         hash_setup,
+                                         hash_teardown),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -48,6 +48,10 @@ ssize_t
 __wrap_read (int fd,
              void *buf,
              size_t count);
+int
+__real_close (int fd);
+int
+__wrap_close (int fd);
 }
 
 void*
@@ -113,6 +117,20 @@ __wrap_read (int fd,
     }
 }
 
+/* times the mock fd was closed */
+static size_t closed;
+int
+__wrap_close (int fd)
+{
+    if (fd == TEST_FD) {
+        printf ("%s: mock close\n", __func__);
+        ++closed;
+        return 0;
+    } else {
+        return __real_close (fd);
+    }
+}
+
 TSS2_TCTI_CONTEXT*
 callback_ctx (void *user_data)
 {
@@ -124,6 +142,7 @@ static int
 tcti_sgx_mgr_init_setup(void **state)
 {
     UNUSED (state);
+    closed = 0;
     return tcti_sgx_mgr_init (callback_ctx, NULL);
 }
 
@@ -148,6 +167,7 @@ tcti_sgx_mgr_init_ocall_read_fail (void **state)
     will_return (__wrap_read, -1);
     uint64_t id = tcti_sgx_init_ocall ();
     assert_int_equal (id, 0);
+    assert_int_equal (closed, 1);
 }
 
 #define TEST_ID  0xe981fd3173ea6a9c
@@ -177,6 +197,8 @@ tcti_sgx_mgr_init_ocall_success (void **state)
     will_return (callback_ctx, TEST_CTX);
     uint64_t id = tcti_sgx_init_ocall ();
     assert_int_equal (id, TEST_ID);
+    /* nothing is left open behind the session */
+    assert_int_equal (closed, 1);
 }
 
 int
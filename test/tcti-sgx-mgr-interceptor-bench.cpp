@@ -0,0 +1,182 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+using namespace std;
+
+/*
+ * Measure what the interceptor chain adds to a command sent through a
+ * session. The downstream TCTI answers every command immediately so what's
+ * measured is the session's own work. Build with
+ * 'make test/tcti-sgx-mgr-interceptor-bench'.
+ */
+
+#define ITERATIONS_DEFAULT 1000000
+
+static uint8_t mock_response [TPM2_HEADER_SIZE + 18];
+
+static TSS2_RC
+mock_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    UNUSED (ctx);
+    UNUSED (size);
+    UNUSED (command);
+
+    return TSS2_RC_SUCCESS;
+}
+static TSS2_RC
+mock_receive (TSS2_TCTI_CONTEXT *ctx,
+              size_t *size,
+              uint8_t *response,
+              int32_t timeout)
+{
+    UNUSED (ctx);
+    UNUSED (timeout);
+
+    memcpy (response, mock_response, sizeof (mock_response));
+    *size = sizeof (mock_response);
+    return TSS2_RC_SUCCESS;
+}
+static TSS2_TCTI_CONTEXT*
+mock_tcti (void)
+{
+    TSS2_TCTI_CONTEXT_COMMON_V2 *ctx;
+
+    ctx = (TSS2_TCTI_CONTEXT_COMMON_V2*)calloc (1, sizeof (TSS2_TCTI_CONTEXT_COMMON_V2));
+    ctx->v1.version = 2;
+    ctx->v1.transmit = mock_transmit;
+    ctx->v1.receive = mock_receive;
+    return  (TSS2_TCTI_CONTEXT*)ctx;
+}
+
+static tcti_sgx_intercept_t
+pass_command (void *user_data,
+              uint64_t id,
+              uint8_t *command,
+              size_t *command_size,
+              uint8_t *response,
+              size_t *response_size)
+{
+    UNUSED (user_data);
+    UNUSED (id);
+    UNUSED (command);
+    UNUSED (command_size);
+    UNUSED (response);
+    UNUSED (response_size);
+
+    return TCTI_SGX_INTERCEPT_PASS;
+}
+static void
+pass_response (void *user_data,
+               uint64_t id,
+               uint8_t const *command,
+               size_t command_size,
+               uint8_t *response,
+               size_t *response_size,
+               size_t capacity)
+{
+    UNUSED (user_data);
+    UNUSED (id);
+    UNUSED (command);
+    UNUSED (command_size);
+    UNUSED (response);
+    UNUSED (response_size);
+    UNUSED (capacity);
+}
+/*
+ * Send 'iterations' GetRandom commands through a session with the
+ * interceptors in 'config' and print the average time per command.
+ */
+static void
+run (char const *name,
+     TctiSgxSessionConfig const &config,
+     unsigned long iterations)
+{
+    uint8_t command [TPM2_HEADER_SIZE + 2], response [TPM2_MAX_RESPONSE_SIZE];
+    TSS2_TCTI_CONTEXT *tcti = mock_tcti ();
+    chrono::steady_clock::time_point start;
+    chrono::nanoseconds elapsed;
+    unsigned long i;
+    size_t size;
+
+    tpm2_header_set (command,
+                     TPM2_ST_NO_SESSIONS,
+                     sizeof (command),
+                     TPM2_CC_GetRandom);
+    tpm2_set_uint16 (&command [TPM2_HEADER_SIZE], 16);
+    {
+        /* the session frees the TCTI */
+        TctiSgxSession session (1, tcti, config);
+
+        start = chrono::steady_clock::now ();
+        for (i = 0; i < iterations; ++i) {
+            session.transmit (sizeof (command), command);
+            size = sizeof (response);
+            session.receive (&size, response, TSS2_TCTI_TIMEOUT_BLOCK);
+        }
+        elapsed = chrono::duration_cast<chrono::nanoseconds> (
+            chrono::steady_clock::now () - start);
+    }
+    printf ("%-40s %8.1f ns/command\n",
+            name,
+            (double)elapsed.count () / iterations);
+}
+
+int
+main (int argc,
+      char *argv [])
+{
+    unsigned long iterations = ITERATIONS_DEFAULT;
+    tcti_sgx_interceptor_t interceptor = {
+        pass_command,
+        pass_response,
+        NULL,
+    };
+    TPM2_CC code;
+    size_t i;
+
+    if (argc > 1)
+        iterations = strtoul (argv [1], NULL, 0);
+    if (iterations == 0) {
+        fprintf (stderr, "usage: %s [iterations]\n", argv [0]);
+        return 1;
+    }
+    tpm2_header_set (mock_response,
+                     TPM2_ST_NO_SESSIONS,
+                     sizeof (mock_response),
+                     TPM2_RC_SUCCESS);
+    tpm2_set_uint16 (&mock_response [TPM2_HEADER_SIZE], 16);
+
+    TctiSgxSessionConfig none;
+    run ("no interceptors", none, iterations);
+
+    TctiSgxSessionConfig other;
+    for (i = 0, code = TPM2_CC_PCR_Read; i < 8; ++i, ++code)
+        other.interceptors.add (interceptor, &code, 1);
+    run ("8 interceptors for other commands", other, iterations);
+
+    TctiSgxSessionConfig one;
+    code = TPM2_CC_GetRandom;
+    one.interceptors.add (interceptor, &code, 1);
+    run ("1 pass through interceptor", one, iterations);
+
+    TctiSgxSessionConfig all;
+    for (i = 0; i < 8; ++i)
+        all.interceptors.add (interceptor, NULL, 0);
+    run ("8 pass through interceptors", all, iterations);
+    return 0;
+}
@@ -0,0 +1,314 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define GOOD_ID 0x51c0e8a7b2d94f36
+
+/* number of commands sent to the downstream TCTI and the last one */
+static size_t transmit_count;
+static uint8_t last_command [TPM2_MAX_COMMAND_SIZE];
+/* the hooks called, in order */
+static char calls [16];
+static size_t call_count;
+
+static TSS2_RC
+mock_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    UNUSED (ctx);
+
+    memcpy (last_command, command, size);
+    ++transmit_count;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Pops a pointer to a response buffer and its size off of the mock stack
+ * and copies it to the caller.
+ */
+static TSS2_RC
+mock_receive (TSS2_TCTI_CONTEXT *ctx,
+              size_t *size,
+              uint8_t *response,
+              int32_t timeout)
+{
+    UNUSED (ctx);
+    UNUSED (timeout);
+    uint8_t *buf = mock_ptr_type (uint8_t*);
+    size_t buf_size = mock_type (size_t);
+
+    memcpy (response, buf, buf_size);
+    *size = buf_size;
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_TCTI_CONTEXT*
+test_tcti_cb (void *user_data)
+{
+    UNUSED (user_data);
+    TSS2_TCTI_CONTEXT_COMMON_V2 *ctx;
+
+    ctx = (TSS2_TCTI_CONTEXT_COMMON_V2*)calloc (1, sizeof (TSS2_TCTI_CONTEXT_COMMON_V2));
+    ctx->v1.version = 2;
+    ctx->v1.transmit = mock_transmit;
+    ctx->v1.receive = mock_receive;
+    return  (TSS2_TCTI_CONTEXT*)ctx;
+}
+/* a successful response with 'fill' in place of the parameters */
+static size_t
+build_rsp (uint8_t *buf,
+           uint8_t fill)
+{
+    size_t size = TPM2_HEADER_SIZE + 16;
+
+    tpm2_header_set (buf, TPM2_ST_NO_SESSIONS, size, TPM2_RC_SUCCESS);
+    memset (&buf [TPM2_HEADER_SIZE], fill, 16);
+    return size;
+}
+
+static size_t
+build_get_random_cmd (uint8_t *buf,
+                      uint16_t count)
+{
+    tpm2_header_set (buf,
+                     TPM2_ST_NO_SESSIONS,
+                     TPM2_HEADER_SIZE + 2,
+                     TPM2_CC_GetRandom);
+    tpm2_set_uint16 (&buf [TPM2_HEADER_SIZE], count);
+    return TPM2_HEADER_SIZE + 2;
+}
+/*
+ * Hooks that note they've been called with the first character of their
+ * user data: lower case for commands, upper case for responses. The
+ * command hook rewrites the GetRandom byte count when the second
+ * character is 'r' and answers when it's 'a'. The response hook fills the
+ * parameters with the second character.
+ */
+static tcti_sgx_intercept_t
+note_command (void *user_data,
+              uint64_t id,
+              uint8_t *command,
+              size_t *command_size,
+              uint8_t *response,
+              size_t *response_size)
+{
+    char const *name = (char const*)user_data;
+
+    assert_int_equal (id, GOOD_ID);
+    assert_true (*response_size >= TPM2_HEADER_SIZE + 16);
+    calls [call_count++] = name [0];
+    if (name [1] == 'r')
+        tpm2_set_uint16 (&command [TPM2_HEADER_SIZE], 32);
+    if (name [1] != 'a')
+        return TCTI_SGX_INTERCEPT_PASS;
+    assert_true (*command_size >= TPM2_HEADER_SIZE);
+    *response_size = build_rsp (response, 0xaa);
+    return TCTI_SGX_INTERCEPT_RESPOND;
+}
+static void
+note_response (void *user_data,
+               uint64_t id,
+               uint8_t const *command,
+               size_t command_size,
+               uint8_t *response,
+               size_t *response_size,
+               size_t capacity)
+{
+    char const *name = (char const*)user_data;
+
+    UNUSED (command);
+    UNUSED (command_size);
+    assert_int_equal (id, GOOD_ID);
+    assert_true (*response_size <= capacity);
+    calls [call_count++] = name [0] - 'a' + 'A';
+    memset (&response [TPM2_HEADER_SIZE], name [1], 16);
+}
+
+static tcti_sgx_interceptor_t
+make_interceptor (char const *name)
+{
+    tcti_sgx_interceptor_t interceptor = {
+        note_command,
+        note_response,
+        (void*)name,
+    };
+
+    return interceptor;
+}
+/*
+ * Create the session with the interceptors in 'config' and send 'cmd'.
+ * When 'tpm_rsp' isn't NULL the command is expected to go to the TPM.
+ */
+static void
+send_cmd (TctiSgxSessionConfig const &config,
+          uint8_t const *cmd,
+          size_t size,
+          uint8_t *tpm_rsp,
+          size_t tpm_rsp_size,
+          uint8_t *rsp)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    size_t count = transmit_count;
+
+    mgr.sessions.push_back (new TctiSgxSession (GOOD_ID,
+                                                test_tcti_cb (NULL),
+                                                config));
+    call_count = 0;
+    memset (calls, 0, sizeof (calls));
+    assert_int_equal (tcti_sgx_transmit_ocall (GOOD_ID, size, cmd),
+                      TSS2_RC_SUCCESS);
+    if (tpm_rsp != NULL) {
+        will_return (mock_receive, tpm_rsp);
+        will_return (mock_receive, tpm_rsp_size);
+    }
+    assert_int_equal (tcti_sgx_receive_ocall (GOOD_ID,
+                                              TPM2_MAX_RESPONSE_SIZE,
+                                              rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (transmit_count - count, tpm_rsp != NULL ? 1 : 0);
+}
+
+static int
+interceptor_setup (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    return 0;
+}
+
+static int
+interceptor_teardown (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.session_remove (GOOD_ID);
+    return 0;
+}
+
+static void
+interceptor_bad_params (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_interceptor_t interceptor = { NULL, NULL, NULL };
+
+    assert_int_equal (tcti_sgx_mgr_add_interceptor (NULL, NULL, 0), -1);
+    assert_int_equal (tcti_sgx_mgr_add_interceptor (&interceptor, NULL, 0),
+                      -1);
+    interceptor = make_interceptor ("ap");
+    assert_int_equal (tcti_sgx_mgr_add_interceptor (&interceptor, NULL, 1),
+                      -1);
+}
+/*
+ * Interceptors see the commands in the order they were added and the
+ * responses in the reverse order. They can rewrite both.
+ */
+static void
+interceptor_order (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], tpm_rsp [TPM2_MAX_RESPONSE_SIZE];
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE], expected [16];
+    TctiSgxSessionConfig config;
+    TPM2_CC code = TPM2_CC_GetRandom;
+    size_t size;
+
+    config.interceptors.add (make_interceptor ("ar"), &code, 1);
+    config.interceptors.add (make_interceptor ("bp"), NULL, 0);
+    size = build_get_random_cmd (cmd, 16);
+    send_cmd (config, cmd, size, tpm_rsp, build_rsp (tpm_rsp, 0x11), rsp);
+    assert_string_equal (calls, "abBA");
+    assert_int_equal (tpm2_get_uint16 (&last_command [TPM2_HEADER_SIZE]), 32);
+    memset (expected, 'r', sizeof (expected));
+    assert_memory_equal (&rsp [TPM2_HEADER_SIZE], expected, sizeof (expected));
+}
+/*
+ * An interceptor that answers a command stops it: the interceptors after
+ * it and the TPM never see it. The response still goes through the
+ * interceptors before it.
+ */
+static void
+interceptor_answer (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], rsp [TPM2_MAX_RESPONSE_SIZE];
+    uint8_t expected [16];
+    TctiSgxSessionConfig config;
+    size_t size;
+
+    config.interceptors.add (make_interceptor ("ap"), NULL, 0);
+    config.interceptors.add (make_interceptor ("ba"), NULL, 0);
+    config.interceptors.add (make_interceptor ("cp"), NULL, 0);
+    size = build_get_random_cmd (cmd, 16);
+    send_cmd (config, cmd, size, NULL, 0, rsp);
+    assert_string_equal (calls, "abA");
+    memset (expected, 'p', sizeof (expected));
+    assert_memory_equal (&rsp [TPM2_HEADER_SIZE], expected, sizeof (expected));
+}
+/*
+ * Interceptors only see the command codes they're registered for.
+ */
+static void
+interceptor_dispatch (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], tpm_rsp [TPM2_MAX_RESPONSE_SIZE];
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE];
+    TctiSgxSessionConfig config;
+    TPM2_CC codes [] = { TPM2_CC_PCR_Read, 0x20000001 };
+    size_t size, tpm_rsp_size;
+
+    config.interceptors.add (make_interceptor ("aa"), codes, 2);
+    size = build_get_random_cmd (cmd, 16);
+    tpm_rsp_size = build_rsp (tpm_rsp, 0x22);
+    send_cmd (config, cmd, size, tpm_rsp, tpm_rsp_size, rsp);
+    assert_int_equal (call_count, 0);
+    assert_memory_equal (rsp, tpm_rsp, tpm_rsp_size);
+    interceptor_teardown (state);
+
+    /* a vendor command */
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, TPM2_HEADER_SIZE, 0x20000001);
+    send_cmd (config, cmd, TPM2_HEADER_SIZE, NULL, 0, rsp);
+    assert_string_equal (calls, "a");
+    interceptor_teardown (state);
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, TPM2_HEADER_SIZE, 0x20000002);
+    send_cmd (config, cmd, TPM2_HEADER_SIZE, tpm_rsp, tpm_rsp_size, rsp);
+    assert_int_equal (call_count, 0);
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (interceptor_bad_params,
+                                         interceptor_setup,
+                                         interceptor_teardown),
+        cmocka_unit_test_setup_teardown (interceptor_order,
+                                         interceptor_setup,
+                                         interceptor_teardown),
+        cmocka_unit_test_setup_teardown (interceptor_answer,
+                                         interceptor_setup,
+                                         interceptor_teardown),
+        cmocka_unit_test_setup_teardown (interceptor_dispatch,
+                                         interceptor_setup,
+                                         interceptor_teardown),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,314 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define GOOD_ID 0xf913038a09efdab5
+#define PARENT_HANDLE 0x81000001
+
+/* the last command sent to the downstream TCTI */
+static uint8_t last_command [TPM2_MAX_COMMAND_SIZE];
+static size_t last_command_size;
+
+static TSS2_RC
+mock_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    UNUSED (ctx);
+
+    memcpy (last_command, command, size);
+    last_command_size = size;
+    return mock_type (TSS2_RC);
+}
+/*
+ * Pops a pointer to a response buffer and its size off of the mock stack
+ * and copies it to the caller.
+ */
+static TSS2_RC
+mock_receive (TSS2_TCTI_CONTEXT *ctx,
+              size_t *size,
+              uint8_t *response,
+              int32_t timeout)
+{
+    UNUSED (ctx);
+    UNUSED (timeout);
+    uint8_t *buf = mock_ptr_type (uint8_t*);
+    size_t buf_size = mock_type (size_t);
+
+    memcpy (response, buf, buf_size);
+    *size = buf_size;
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_TCTI_CONTEXT*
+test_tcti_cb (void *user_data)
+{
+    UNUSED (user_data);
+    TSS2_TCTI_CONTEXT_COMMON_V2 *ctx;
+
+    ctx = (TSS2_TCTI_CONTEXT_COMMON_V2*)calloc (1, sizeof (TSS2_TCTI_CONTEXT_COMMON_V2));
+    ctx->v1.version = 2;
+    ctx->v1.transmit = mock_transmit;
+    ctx->v1.receive = mock_receive;
+    return  (TSS2_TCTI_CONTEXT*)ctx;
+}
+/*
+ * Not a real TPMT_PUBLIC, the manager only cares that the size field of
+ * the TPM2B agrees with the buffer size.
+ */
+static uint8_t const in_public [] = {
+    0x00, 0x06, 0x00, 0x23, 0x00, 0x0b, 0x00, 0x06,
+};
+static uint8_t const password [] = { 'p', 'a', 's', 's' };
+/*
+ * Create under PARENT_HANDLE with a single password session using
+ * 'password' and the parameters the key pool uses.
+ */
+static size_t
+build_create_cmd (uint8_t *buf,
+                  TPMA_SESSION attrs)
+{
+    static uint8_t const in_sensitive [] = { 0x00, 0x04, 0x00, 0x00, 0x00, 0x00 };
+    uint8_t *p = &buf [TPM2_HEADER_SIZE];
+    size_t size;
+
+    tpm2_set_uint32 (p, PARENT_HANDLE);
+    tpm2_set_uint32 (p + 4, 4 + 2 + 1 + 2 + sizeof (password));
+    tpm2_set_uint32 (p + 8, TPM2_RS_PW);
+    tpm2_set_uint16 (p + 12, 0);
+    p [14] = attrs;
+    tpm2_set_uint16 (p + 15, sizeof (password));
+    p += 17;
+    memcpy (p, password, sizeof (password));
+    p += sizeof (password);
+    memcpy (p, in_sensitive, sizeof (in_sensitive));
+    p += sizeof (in_sensitive);
+    memcpy (p, in_public, sizeof (in_public));
+    p += sizeof (in_public);
+    /* outsideInfo and creationPCR */
+    memset (p, 0, 6);
+    p += 6;
+    size = p - buf;
+    tpm2_header_set (buf, TPM2_ST_SESSIONS, size, TPM2_CC_Create);
+    return size;
+}
+/* Create response: parameterSize, stand-in parameters, password session */
+static uint8_t create_response [TPM2_HEADER_SIZE + 4 + 8 + 5];
+
+static int
+key_pool_setup (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    TctiSgxSession *session;
+    TPM2B_AUTH auth;
+    uint8_t *p;
+
+    /* no maintenance thread, the tests drive maintenance directly */
+    tcti_sgx_mgr_set_maintenance (0, 1);
+    if (!mgr.key_pool.enabled ()) {
+        auth.size = sizeof (password);
+        memcpy (auth.buffer, password, sizeof (password));
+        assert_int_equal (tcti_sgx_mgr_add_key_pool (PARENT_HANDLE,
+                                                     &auth,
+                                                     in_public,
+                                                     sizeof (in_public),
+                                                     1,
+                                                     0),
+                          0);
+    }
+    session = new TctiSgxSession (GOOD_ID,
+                                  test_tcti_cb (NULL),
+                                  mgr.session_config);
+    mgr.sessions.push_back (session);
+
+    tpm2_header_set (create_response,
+                     TPM2_ST_SESSIONS,
+                     sizeof (create_response),
+                     TPM2_RC_SUCCESS);
+    p = &create_response [TPM2_HEADER_SIZE];
+    tpm2_set_uint32 (p, 8);
+    memset (p + 4, 0x5a, 8);
+    memset (p + 12, 0, 5);
+    return 0;
+}
+
+static int
+key_pool_teardown (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.session_remove (GOOD_ID);
+    return 0;
+}
+
+static void
+key_pool_bad_params (void **state)
+{
+    UNUSED (state);
+
+    /* transient parent */
+    assert_int_equal (tcti_sgx_mgr_add_key_pool (0x80000000,
+                                                 NULL,
+                                                 in_public,
+                                                 sizeof (in_public),
+                                                 1,
+                                                 0),
+                      -1);
+    /* TPM2B size disagrees with the buffer */
+    assert_int_equal (tcti_sgx_mgr_add_key_pool (PARENT_HANDLE,
+                                                 NULL,
+                                                 in_public,
+                                                 sizeof (in_public) - 1,
+                                                 1,
+                                                 0),
+                      -1);
+    assert_int_equal (tcti_sgx_mgr_get_key_pool_stats (NULL),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+}
+/*
+ * A maintenance pass generates a key for the pool. The next matching
+ * Create from the client is answered with that key without going to the
+ * TPM. The session attributes in the response are those of the client
+ * command.
+ */
+static void
+key_pool_hit (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], buf [TPM2_MAX_RESPONSE_SIZE];
+    tcti_sgx_key_pool_stats_t before, after;
+    size_t size;
+
+    assert_int_equal (tcti_sgx_mgr_get_key_pool_stats (&before),
+                      TSS2_RC_SUCCESS);
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    will_return (mock_receive, create_response);
+    will_return (mock_receive, sizeof (create_response));
+    mgr.maintain ();
+    /* the pool is full, another pass doesn't generate anything */
+    mgr.maintain ();
+
+    size = build_create_cmd (cmd, 0);
+    assert_int_equal (last_command_size, size);
+    assert_memory_equal (last_command, cmd, size);
+
+    size = build_create_cmd (cmd, TPMA_SESSION_CONTINUESESSION);
+    assert_int_equal (tcti_sgx_transmit_ocall (GOOD_ID, size, cmd),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_receive_ocall (GOOD_ID,
+                                              sizeof (buf),
+                                              buf,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    create_response [sizeof (create_response) - 3] =
+        TPMA_SESSION_CONTINUESESSION;
+    assert_memory_equal (buf, create_response, sizeof (create_response));
+
+    assert_int_equal (tcti_sgx_mgr_get_key_pool_stats (&after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.hits - before.hits, 1);
+    assert_int_equal (after.misses - before.misses, 0);
+    assert_int_equal (after.generated - before.generated, 1);
+    assert_int_equal (after.available, 0);
+}
+/*
+ * With nothing in the pool the Create goes to the TPM.
+ */
+static void
+key_pool_miss (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], buf [TPM2_MAX_RESPONSE_SIZE];
+    tcti_sgx_key_pool_stats_t before, after;
+    size_t size;
+
+    assert_int_equal (tcti_sgx_mgr_get_key_pool_stats (&before),
+                      TSS2_RC_SUCCESS);
+    size = build_create_cmd (cmd, 0);
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit_ocall (GOOD_ID, size, cmd),
+                      TSS2_RC_SUCCESS);
+    assert_memory_equal (last_command, cmd, size);
+    will_return (mock_receive, create_response);
+    will_return (mock_receive, sizeof (create_response));
+    assert_int_equal (tcti_sgx_receive_ocall (GOOD_ID,
+                                              sizeof (buf),
+                                              buf,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_get_key_pool_stats (&after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.hits - before.hits, 0);
+    assert_int_equal (after.misses - before.misses, 1);
+}
+/*
+ * No keys are generated while a client has a command outstanding.
+ */
+static void
+key_pool_busy (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    uint8_t cmd [TPM2_HEADER_SIZE], buf [TPM2_MAX_RESPONSE_SIZE];
+    tcti_sgx_key_pool_stats_t before, after;
+
+    assert_int_equal (tcti_sgx_mgr_get_key_pool_stats (&before),
+                      TSS2_RC_SUCCESS);
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, sizeof (cmd), TPM2_CC_Create);
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit_ocall (GOOD_ID, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+    /* would fail for lack of mock values if it sent anything */
+    mgr.maintain ();
+    will_return (mock_receive, create_response);
+    will_return (mock_receive, TPM2_HEADER_SIZE);
+    assert_int_equal (tcti_sgx_receive_ocall (GOOD_ID,
+                                              sizeof (buf),
+                                              buf,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_get_key_pool_stats (&after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.generated - before.generated, 0);
+    assert_int_equal (after.available, 0);
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (key_pool_bad_params,
+                                         key_pool_setup,
+                                         key_pool_teardown),
+        cmocka_unit_test_setup_teardown (key_pool_hit,
+                                         key_pool_setup,
+                                         key_pool_teardown),
+        cmocka_unit_test_setup_teardown (key_pool_miss,
+                                         key_pool_setup,
+                                         key_pool_teardown),
+        cmocka_unit_test_setup_teardown (key_pool_busy,
+                                         key_pool_setup,
+                                         key_pool_teardown),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
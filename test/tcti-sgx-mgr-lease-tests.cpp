@@ -0,0 +1,256 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#include "tcti-sgx-mgr-fake-tpm.h"
+
+static TSS2_RC
+send_cmd (uint64_t id,
+          TPM2_CC code,
+          TPM2_HANDLE handle,
+          uint32_t value)
+{
+    uint8_t cmd [TPM2_HEADER_SIZE + 8];
+    size_t size = TPM2_HEADER_SIZE + (code == TPM2_CC_Load ? 8 : 4);
+
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, size, code);
+    tpm2_set_uint32 (&cmd [TPM2_HEADER_SIZE], handle);
+    tpm2_set_uint32 (&cmd [TPM2_HEADER_SIZE + 4], value);
+    return tcti_sgx_transmit_ocall (id, size, cmd);
+}
+/*
+ * Send a command and collect its response, returns the handle or value
+ * that follows the header.
+ */
+static uint32_t
+call (uint64_t id,
+      TPM2_CC code,
+      TPM2_HANDLE handle,
+      uint32_t value)
+{
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE];
+
+    assert_int_equal (send_cmd (id, code, handle, value), TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_receive_ocall (id,
+                                              sizeof (rsp),
+                                              rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_header_code (rsp), TPM2_RC_SUCCESS);
+    if (tpm2_header_size (rsp) < TPM2_HEADER_SIZE + 4)
+        return 0;
+    return tpm2_get_uint32 (&rsp [TPM2_HEADER_SIZE]);
+}
+
+static int
+lease_setup (void **state)
+{
+    UNUSED (state);
+    fake_base = OBJECT_A;
+    fake_fail_load = false;
+    fake_shared = NULL;
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    /* the test runs maintenance itself */
+    tcti_sgx_mgr_set_maintenance (0, 0);
+    return 0;
+}
+
+static int
+lease_teardown (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_mgr_set_lease (0, 0);
+    tcti_sgx_mgr_set_park_timeout (60000);
+    return 0;
+}
+/*
+ * An idle session's connection is closed with what it had loaded saved,
+ * the next command reconnects and the client's handles still work.
+ */
+static void
+lease_suspend (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    uint64_t id;
+
+    id = tcti_sgx_init_ocall ();
+    assert_int_not_equal (id, 0);
+    assert_int_equal (call (id, TPM2_CC_Load, TPM2_RH_OWNER, 0xa), OBJECT_A);
+    assert_int_equal (tcti_sgx_mgr_set_lease (1, 0), 0);
+    fake_created = fake_closed = 0;
+    usleep (5000);
+    mgr.maintain ();
+    assert_int_equal (fake_closed, 1);
+
+    fake_base = OBJECT_B;
+    assert_int_equal (call (id, TPM2_CC_ReadPublic, OBJECT_A, 0), 0xa);
+    assert_int_equal (fake_created, 1);
+    fake_closed_unlocked = false;
+    tcti_sgx_finalize_ocall (id);
+    assert_int_equal (fake_closed, 2);
+    assert_true (fake_closed_unlocked);
+}
+/*
+ * With connections that see each other's objects a suspended session
+ * only saves and flushes what its client loaded, the other session's
+ * object stays where it is.
+ */
+static void
+lease_shared (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    TctiSgxSession *session;
+    fake_tpm_t shared;
+    uint64_t a, b;
+
+    memset (&shared, 0, sizeof (shared));
+    shared.base = OBJECT_A;
+    fake_shared = &shared;
+    a = tcti_sgx_init_ocall ();
+    b = tcti_sgx_init_ocall ();
+    assert_int_not_equal (a, 0);
+    assert_int_not_equal (b, 0);
+    assert_int_equal (call (a, TPM2_CC_Load, TPM2_RH_OWNER, 0xa), OBJECT_A);
+    assert_int_equal (call (b, TPM2_CC_Load, TPM2_RH_OWNER, 0xb), OBJECT_B);
+
+    session = mgr.session_find (a);
+    assert_non_null (session);
+    session->lock ();
+    assert_int_equal (session->suspend (), TSS2_RC_SUCCESS);
+    session->unlock ();
+    assert_int_equal (shared.handles [0], 0);
+    assert_int_equal (shared.handles [1], OBJECT_B);
+    assert_int_equal (call (b, TPM2_CC_ReadPublic, OBJECT_B, 0), 0xb);
+    /* b takes the handle a had, a gets its object back somewhere else */
+    assert_int_equal (call (b, TPM2_CC_Load, TPM2_RH_OWNER, 0xc), OBJECT_A);
+    assert_int_equal (call (a, TPM2_CC_ReadPublic, OBJECT_A, 0), 0xa);
+    assert_int_equal (call (b, TPM2_CC_ReadPublic, OBJECT_A, 0), 0xc);
+    tcti_sgx_finalize_ocall (a);
+    tcti_sgx_finalize_ocall (b);
+    fake_shared = NULL;
+}
+/*
+ * A session whose contexts won't load on the new connection has lost
+ * them, it fails from then on.
+ */
+static void
+lease_lost (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    uint64_t id;
+
+    id = tcti_sgx_init_ocall ();
+    assert_int_not_equal (id, 0);
+    assert_int_equal (call (id, TPM2_CC_Load, TPM2_RH_OWNER, 0xa), OBJECT_A);
+    assert_int_equal (tcti_sgx_mgr_set_lease (1, 0), 0);
+    usleep (5000);
+    mgr.maintain ();
+
+    fake_fail_load = true;
+    assert_int_equal (send_cmd (id, TPM2_CC_ReadPublic, OBJECT_A, 0),
+                      TSS2_TCTI_RC_NO_CONNECTION);
+    fake_fail_load = false;
+    assert_int_equal (send_cmd (id, TPM2_CC_ReadPublic, OBJECT_A, 0),
+                      TSS2_TCTI_RC_NO_CONNECTION);
+    tcti_sgx_finalize_ocall (id);
+}
+/*
+ * A session unused for longer than the lease allows goes away without
+ * holding up the manager, its enclave's next call finds nothing. The
+ * manager collecting its counters doesn't count as using it.
+ */
+static void
+lease_expire (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    tcti_sgx_ctx_cache_stats_t stats;
+    uint64_t id;
+
+    id = tcti_sgx_init_ocall ();
+    assert_int_not_equal (id, 0);
+    assert_int_equal (call (id, TPM2_CC_Load, TPM2_RH_OWNER, 0xa), OBJECT_A);
+    assert_int_equal (tcti_sgx_mgr_set_lease (0, 1), 0);
+    fake_closed = 0;
+    usleep (5000);
+    assert_int_equal (tcti_sgx_mgr_get_ctx_cache_stats (id, &stats),
+                      TSS2_RC_SUCCESS);
+    mgr.maintain ();
+    assert_int_equal (fake_closed, 1);
+    assert_true (fake_closed_unlocked);
+    assert_int_equal (send_cmd (id, TPM2_CC_ReadPublic, OBJECT_A, 0),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    tcti_sgx_finalize_ocall (id);
+}
+
+/*
+ * Parked sessions nobody came back for are finalized, be it by the next
+ * park or by maintenance, without holding up the manager.
+ */
+static void
+lease_parked (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    uint64_t a, b;
+
+    a = tcti_sgx_init_ocall ();
+    b = tcti_sgx_init_ocall ();
+    assert_int_not_equal (a, 0);
+    assert_int_not_equal (b, 0);
+    assert_int_equal (tcti_sgx_mgr_set_park_timeout (0), 0);
+    assert_int_equal (tcti_sgx_park_ocall (a), TSS2_RC_SUCCESS);
+    fake_closed = 0;
+    fake_closed_unlocked = false;
+    assert_int_equal (tcti_sgx_park_ocall (b), TSS2_RC_SUCCESS);
+    assert_int_equal (fake_closed, 1);
+    assert_true (fake_closed_unlocked);
+
+    fake_closed_unlocked = false;
+    mgr.maintain ();
+    assert_int_equal (fake_closed, 2);
+    assert_true (fake_closed_unlocked);
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (lease_suspend,
+                                         lease_setup,
+                                         lease_teardown),
+        cmocka_unit_test_setup_teardown (lease_shared,
+                                         lease_setup,
+                                         lease_teardown),
+        cmocka_unit_test_setup_teardown (lease_lost,
+                                         lease_setup,
+                                         lease_teardown),
+        cmocka_unit_test_setup_teardown (lease_expire,
+                                         lease_setup,
+                                         lease_teardown),
+        cmocka_unit_test_setup_teardown (lease_parked,
+                                         lease_setup,
+                                         lease_teardown),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
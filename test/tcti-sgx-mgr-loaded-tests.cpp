@@ -0,0 +1,173 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr-loaded.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+using namespace std;
+
+#define OBJECT_A 0x80000000
+#define OBJECT_B 0x80000001
+#define SESSION_A 0x02000000
+#define POLICY_B 0x03000001
+
+/*
+ * Run a command with no sessions and no parameters beyond 'handle'
+ * through 'loaded', answered with 'rc' and, if it isn't 0, 'rhandle'.
+ */
+static void
+run (TctiSgxLoaded &loaded,
+     TPM2_CC code,
+     TPM2_HANDLE handle,
+     TPM2_RC rc,
+     TPM2_HANDLE rhandle)
+{
+    uint8_t cmd [TPM2_HEADER_SIZE + 4], rsp [TPM2_HEADER_SIZE + 4];
+    size_t size = rhandle != 0 ? sizeof (rsp) : TPM2_HEADER_SIZE;
+
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, sizeof (cmd), code);
+    tpm2_set_uint32 (&cmd [TPM2_HEADER_SIZE], handle);
+    loaded.command (cmd, sizeof (cmd), 1);
+    tpm2_header_set (rsp, TPM2_ST_NO_SESSIONS, size, rc);
+    tpm2_set_uint32 (&rsp [TPM2_HEADER_SIZE], rhandle);
+    loaded.response (rsp, size);
+}
+/*
+ * Send a command with one handle and 'session' in its authorization area,
+ * continued or not.
+ */
+static void
+run_session (TctiSgxLoaded &loaded,
+             TPM2_HANDLE session,
+             bool continued,
+             int handles)
+{
+    uint8_t cmd [TPM2_HEADER_SIZE + 4 + 4 + 9], rsp [TPM2_HEADER_SIZE];
+    size_t offset = TPM2_HEADER_SIZE;
+
+    memset (cmd, 0, sizeof (cmd));
+    tpm2_header_set (cmd, TPM2_ST_SESSIONS, sizeof (cmd),
+                     TPM2_CC_ReadPublic);
+    tpm2_set_uint32 (&cmd [offset], OBJECT_A);
+    offset += 4;
+    tpm2_set_uint32 (&cmd [offset], 9);
+    offset += 4;
+    tpm2_set_uint32 (&cmd [offset], session);
+    cmd [offset + 6] = continued ? TPMA_SESSION_CONTINUESESSION : 0;
+    loaded.command (cmd, sizeof (cmd), handles);
+    tpm2_header_set (rsp, TPM2_ST_SESSIONS, sizeof (rsp), TPM2_RC_SUCCESS);
+    loaded.response (rsp, sizeof (rsp));
+}
+
+static vector<TPM2_HANDLE>
+selected (TctiSgxLoaded const &loaded)
+{
+    vector<TPM2_HANDLE> handles;
+
+    handles.push_back (SESSION_A);
+    handles.push_back (0x02000001);
+    handles.push_back (OBJECT_A);
+    handles.push_back (OBJECT_B);
+    loaded.select (handles);
+    return handles;
+}
+/*
+ * Objects come from the responses to commands that load them and go
+ * when they're flushed, failed commands change nothing. Only what the
+ * client loaded is selected.
+ */
+static void
+loaded_objects (void **state)
+{
+    UNUSED (state);
+    TctiSgxLoaded loaded;
+    vector<TPM2_HANDLE> handles;
+
+    run (loaded, TPM2_CC_Load, TPM2_RH_OWNER, TPM2_RC_SUCCESS, OBJECT_B);
+    run (loaded, TPM2_CC_Load, TPM2_RH_OWNER, TPM2_RC_FAILURE, OBJECT_A);
+    handles = selected (loaded);
+    assert_int_equal (handles.size (), 1);
+    assert_int_equal (handles [0], OBJECT_B);
+    run (loaded, TPM2_CC_ContextSave, OBJECT_B, TPM2_RC_SUCCESS, 0);
+    assert_int_equal (selected (loaded).size (), 1);
+    run (loaded, TPM2_CC_FlushContext, OBJECT_B, TPM2_RC_FAILURE, 0);
+    assert_int_equal (selected (loaded).size (), 1);
+    run (loaded, TPM2_CC_FlushContext, OBJECT_B, TPM2_RC_SUCCESS, 0);
+    assert_int_equal (selected (loaded).size (), 0);
+    assert_true (loaded.exact ());
+}
+/*
+ * A session goes when it's saved or used without continueSession. The
+ * TPM lists a loaded policy session in the HMAC session range.
+ */
+static void
+loaded_sessions (void **state)
+{
+    UNUSED (state);
+    TctiSgxLoaded loaded;
+    vector<TPM2_HANDLE> handles;
+
+    run (loaded, TPM2_CC_StartAuthSession, TPM2_RH_NULL, TPM2_RC_SUCCESS,
+         SESSION_A);
+    run (loaded, TPM2_CC_StartAuthSession, TPM2_RH_NULL, TPM2_RC_SUCCESS,
+         POLICY_B);
+    assert_true (loaded.has_sessions ());
+    assert_int_equal (selected (loaded).size (), 2);
+    run_session (loaded, SESSION_A, true, 1);
+    assert_int_equal (selected (loaded).size (), 2);
+    run_session (loaded, SESSION_A, false, 1);
+    handles = selected (loaded);
+    assert_int_equal (handles.size (), 1);
+    assert_int_equal (handles [0], 0x02000001);
+    run (loaded, TPM2_CC_ContextSave, POLICY_B, TPM2_RC_SUCCESS, 0);
+    assert_false (loaded.has_sessions ());
+    assert_true (loaded.exact ());
+}
+/*
+ * Not knowing how many handles a command with sessions has, or a command
+ * that flushes a hierarchy's objects, leaves us not knowing what's
+ * loaded until Startup.
+ */
+static void
+loaded_lost_track (void **state)
+{
+    UNUSED (state);
+    TctiSgxLoaded loaded;
+
+    run (loaded, TPM2_CC_Load, TPM2_RH_OWNER, TPM2_RC_SUCCESS, OBJECT_A);
+    run_session (loaded, SESSION_A, false, -1);
+    assert_true (loaded.exact ());
+    run (loaded, TPM2_CC_StartAuthSession, TPM2_RH_NULL, TPM2_RC_SUCCESS,
+         SESSION_A);
+    run_session (loaded, SESSION_A, false, -1);
+    assert_false (loaded.exact ());
+    run (loaded, TPM2_CC_Startup, TPM2_SU_CLEAR, TPM2_RC_SUCCESS, 0);
+    assert_true (loaded.exact ());
+    assert_int_equal (selected (loaded).size (), 0);
+    run (loaded, TPM2_CC_Clear, TPM2_RH_PLATFORM, TPM2_RC_SUCCESS, 0);
+    assert_false (loaded.exact ());
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (loaded_objects),
+        cmocka_unit_test (loaded_sessions),
+        cmocka_unit_test (loaded_lost_track),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
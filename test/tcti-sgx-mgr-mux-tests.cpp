@@ -0,0 +1,239 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+/*
+ * A connection with at most one object loaded, 'loaded', which Load
+ * creates and FlushContext flushes.
+ */
+typedef struct {
+    TSS2_TCTI_CONTEXT_COMMON_V2 common;
+    TPM2_CC code;
+    TPM2_HANDLE handle;
+    uint32_t property;
+    TPM2_HANDLE loaded;
+} test_tcti_t;
+
+static size_t created;
+static size_t closed;
+
+static TSS2_RC
+mock_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    test_tcti_t *tcti = (test_tcti_t*)ctx;
+
+    tcti->code = tpm2_header_code (command);
+    tcti->handle = size >= TPM2_HEADER_SIZE + 4 ?
+        tpm2_get_uint32 (&command [TPM2_HEADER_SIZE]) : 0;
+    tcti->property = size >= TPM2_HEADER_SIZE + 8 ?
+        tpm2_get_uint32 (&command [TPM2_HEADER_SIZE + 4]) : 0;
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC
+mock_receive (TSS2_TCTI_CONTEXT *ctx,
+              size_t *size,
+              uint8_t *response,
+              int32_t timeout)
+{
+    test_tcti_t *tcti = (test_tcti_t*)ctx;
+    bool listed;
+    UNUSED (timeout);
+
+    switch (tcti->code) {
+    case TPM2_CC_GetCapability:
+        /* moreData | capability | count | handle */
+        listed = tcti->loaded != 0 && tcti->property == TPM2_TRANSIENT_FIRST;
+        *size = TPM2_HEADER_SIZE + 9 + (listed ? 4 : 0);
+        memset (response, 0, *size);
+        tpm2_set_uint32 (&response [TPM2_HEADER_SIZE + 1], TPM2_CAP_HANDLES);
+        tpm2_set_uint32 (&response [TPM2_HEADER_SIZE + 5], listed ? 1 : 0);
+        if (listed)
+            tpm2_set_uint32 (&response [TPM2_HEADER_SIZE + 9], tcti->loaded);
+        break;
+    case TPM2_CC_Load:
+        tcti->loaded = TPM2_TRANSIENT_FIRST;
+        *size = TPM2_HEADER_SIZE + 4;
+        tpm2_set_uint32 (&response [TPM2_HEADER_SIZE], tcti->loaded);
+        break;
+    case TPM2_CC_FlushContext:
+        if (tcti->handle == tcti->loaded)
+            tcti->loaded = 0;
+        /* fall through */
+    default:
+        *size = TPM2_HEADER_SIZE;
+    }
+    tpm2_header_set (response, TPM2_ST_NO_SESSIONS, *size, TPM2_RC_SUCCESS);
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC
+mock_set_locality (TSS2_TCTI_CONTEXT *ctx,
+                   uint8_t locality)
+{
+    UNUSED (ctx);
+    UNUSED (locality);
+    return TSS2_RC_SUCCESS;
+}
+
+static void
+mock_finalize (TSS2_TCTI_CONTEXT *ctx)
+{
+    UNUSED (ctx);
+    ++closed;
+}
+
+TSS2_TCTI_CONTEXT*
+test_tcti_cb (void *user_data)
+{
+    UNUSED (user_data);
+    test_tcti_t *tcti;
+
+    tcti = (test_tcti_t*)calloc (1, sizeof (test_tcti_t));
+    tcti->common.v1.version = 2;
+    tcti->common.v1.transmit = mock_transmit;
+    tcti->common.v1.receive = mock_receive;
+    tcti->common.v1.setLocality = mock_set_locality;
+    tcti->common.v1.finalize = mock_finalize;
+    ++created;
+    return  (TSS2_TCTI_CONTEXT*)tcti;
+}
+/*
+ * Channels are connected as they're needed up to the width, after that
+ * sessions wait for one to be given back.
+ */
+static void
+mux_channels (void **state)
+{
+    UNUSED (state);
+    TctiSgxBackends backends (test_tcti_cb, NULL);
+    TctiSgxMux mux (&backends);
+    tcti_sgx_mux_stats_t stats;
+    TSS2_TCTI_CONTEXT *first, *second;
+
+    assert_false (mux.attach ());
+    mux.set_limits (1, 10);
+    assert_true (mux.attach ());
+    created = closed = 0;
+    assert_int_equal (mux.acquire (0, NULL, &first), TSS2_RC_SUCCESS);
+    assert_int_equal (created, 1);
+    assert_int_equal (mux.acquire (0, NULL, &second), TSS2_TCTI_RC_TRY_AGAIN);
+    mux.release (0, first, true);
+    assert_int_equal (mux.acquire (0, NULL, &second), TSS2_RC_SUCCESS);
+    assert_ptr_equal (second, first);
+    assert_int_equal (created, 1);
+    mux.release (0, second, false);
+    assert_int_equal (closed, 1);
+    mux.get_stats (&stats);
+    assert_int_equal (stats.sessions, 1);
+    assert_int_equal (stats.connections, 0);
+    assert_int_equal (stats.acquired, 2);
+    assert_int_equal (stats.timeouts, 1);
+    assert_int_equal (stats.discarded, 1);
+    mux.detach ();
+}
+
+static TSS2_RC
+send_command (uint64_t id,
+              TPM2_CC code,
+              TPM2_HANDLE handle)
+{
+    uint8_t buf [TPM2_MAX_RESPONSE_SIZE];
+    size_t size = TPM2_HEADER_SIZE + (handle != 0 ? 4 : 0);
+    TSS2_RC rc;
+
+    tpm2_header_set (buf, TPM2_ST_NO_SESSIONS, size, code);
+    if (handle != 0)
+        tpm2_set_uint32 (&buf [TPM2_HEADER_SIZE], handle);
+    rc = tcti_sgx_transmit_ocall (id, size, buf);
+    if (rc != TSS2_RC_SUCCESS)
+        return rc;
+    return tcti_sgx_receive_ocall (id, sizeof (buf), buf,
+                                   TSS2_TCTI_TIMEOUT_BLOCK);
+}
+/*
+ * Two sessions take turns on one connection. One that has something
+ * loaded or a locality of its own keeps it until it's back to nothing.
+ */
+static void
+mux_mgr (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_mux_stats_t stats;
+    uint64_t ids [2];
+    unsigned i;
+
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    assert_int_equal (tcti_sgx_mgr_get_mux_stats (NULL),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+    assert_int_equal (tcti_sgx_mgr_set_mux (1, 10), 0);
+    created = 0;
+    for (i = 0; i < 2; ++i) {
+        ids [i] = tcti_sgx_init_ocall ();
+        assert_int_not_equal (ids [i], 0);
+    }
+    assert_int_equal (created, 0);
+    assert_int_equal (send_command (ids [0], TPM2_CC_ReadClock, 0),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (send_command (ids [1], TPM2_CC_ReadClock, 0),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (created, 1);
+
+    assert_int_equal (send_command (ids [0], TPM2_CC_Load, 0),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (send_command (ids [1], TPM2_CC_ReadClock, 0),
+                      TSS2_TCTI_RC_TRY_AGAIN);
+    assert_int_equal (send_command (ids [0], TPM2_CC_FlushContext,
+                                    TPM2_TRANSIENT_FIRST),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (send_command (ids [1], TPM2_CC_ReadClock, 0),
+                      TSS2_RC_SUCCESS);
+
+    assert_int_equal (tcti_sgx_set_locality_ocall (ids [0], 3),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (send_command (ids [1], TPM2_CC_ReadClock, 0),
+                      TSS2_TCTI_RC_TRY_AGAIN);
+    assert_int_equal (tcti_sgx_set_locality_ocall (ids [0], 0),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (send_command (ids [1], TPM2_CC_ReadClock, 0),
+                      TSS2_RC_SUCCESS);
+
+    assert_int_equal (tcti_sgx_mgr_get_mux_stats (&stats), TSS2_RC_SUCCESS);
+    assert_int_equal (stats.sessions, 2);
+    assert_int_equal (stats.connections, 1);
+    assert_int_equal (stats.timeouts, 2);
+    for (i = 0; i < 2; ++i)
+        tcti_sgx_finalize_ocall (ids [i]);
+    assert_int_equal (tcti_sgx_mgr_set_mux (0, 10), 0);
+    assert_int_equal (tcti_sgx_mgr_get_mux_stats (&stats), TSS2_RC_SUCCESS);
+    assert_int_equal (stats.sessions, 0);
+    assert_int_equal (stats.connections, 0);
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (mux_channels),
+        cmocka_unit_test (mux_mgr),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -128,7 +128,7 @@ tcti_sgx_mgr_receive_ocall_bad_timeout (void **state)
     UNUSED (state);
     TSS2_RC rc;
 
-    rc = tcti_sgx_receive_ocall (GOOD_ID, 0, NULL, 1);
+    rc = tcti_sgx_receive_ocall (GOOD_ID, 0, NULL, -2);
     assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
 }
 
@@ -0,0 +1,234 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+using namespace std;
+
+#define TOPOLOGY_ROOT "tcti-sgx-mgr-placement-tests.d"
+
+static TSS2_RC
+mock_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    UNUSED (ctx);
+    UNUSED (size);
+    UNUSED (command);
+
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_TCTI_CONTEXT*
+test_tcti_cb (void *user_data)
+{
+    UNUSED (user_data);
+    TSS2_TCTI_CONTEXT_COMMON_V2 *ctx;
+
+    ctx = (TSS2_TCTI_CONTEXT_COMMON_V2*)calloc (1, sizeof (TSS2_TCTI_CONTEXT_COMMON_V2));
+    ctx->v1.version = 2;
+    ctx->v1.transmit = mock_transmit;
+    return  (TSS2_TCTI_CONTEXT*)ctx;
+}
+
+static void
+write_cpulist (unsigned node,
+               char const *list)
+{
+    char path [256];
+    FILE *file;
+
+    snprintf (path, sizeof (path), TOPOLOGY_ROOT "/node%u", node);
+    mkdir (path, 0700);
+    snprintf (path, sizeof (path), TOPOLOGY_ROOT "/node%u/cpulist", node);
+    file = fopen (path, "w");
+    assert_non_null (file);
+    fputs (list, file);
+    fclose (file);
+}
+
+static void
+remove_topology (void)
+{
+    char path [256];
+    unsigned node;
+
+    for (node = 0; node < 4; ++node) {
+        snprintf (path, sizeof (path), TOPOLOGY_ROOT "/node%u/cpulist", node);
+        unlink (path);
+        snprintf (path, sizeof (path), TOPOLOGY_ROOT "/node%u", node);
+        rmdir (path);
+    }
+    rmdir (TOPOLOGY_ROOT);
+}
+
+static void
+placement_parse_cpulist (void **state)
+{
+    UNUSED (state);
+    vector<int> cpus;
+
+    assert_int_equal (TctiSgxPlacement::parse_cpulist ("0-3,8,10-11\n", cpus), 0);
+    assert_int_equal (cpus.size (), 7);
+    assert_int_equal (cpus [3], 3);
+    assert_int_equal (cpus [4], 8);
+    assert_int_equal (cpus [6], 11);
+    assert_int_equal (TctiSgxPlacement::parse_cpulist ("\n", cpus), 0);
+    assert_int_equal (cpus.size (), 0);
+    assert_int_equal (TctiSgxPlacement::parse_cpulist ("3-1", cpus), -1);
+    assert_int_equal (TctiSgxPlacement::parse_cpulist ("0,x", cpus), -1);
+}
+/*
+ * Nodes may be numbered with gaps. A node without CPUs can't be picked.
+ */
+static void
+placement_topology (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_node_stats_t stats;
+
+    remove_topology ();
+    mkdir (TOPOLOGY_ROOT, 0700);
+    write_cpulist (0, "0\n");
+    write_cpulist (2, "1-3,5\n");
+    {
+        TctiSgxPlacement placement (TOPOLOGY_ROOT);
+
+        assert_int_equal (placement.node_count (), 3);
+        assert_int_equal (placement.node_of_cpu (0), 0);
+        assert_int_equal (placement.node_of_cpu (5), 2);
+        assert_int_equal (placement.node_of_cpu (4), 0);
+        assert_int_equal (placement.node_of_cpu (64), 0);
+        assert_int_equal (placement.set (TCTI_SGX_PLACEMENT_NODE, 1), -1);
+        assert_int_equal (placement.set (TCTI_SGX_PLACEMENT_NODE, 3), -1);
+        assert_int_equal (placement.set ((tcti_sgx_placement_t)7, 0), -1);
+        assert_int_equal (placement.set (TCTI_SGX_PLACEMENT_NODE, 2), 0);
+        assert_int_equal (placement.target (), 2);
+        assert_true (placement.local ());
+        assert_int_equal (placement.get_stats (2, &stats), 0);
+        assert_int_equal (stats.cpus, 4);
+        assert_int_equal (placement.get_stats (3, &stats), -1);
+    }
+    remove_topology ();
+}
+/*
+ * Without NUMA information every CPU is on node 0.
+ */
+static void
+placement_no_topology (void **state)
+{
+    UNUSED (state);
+    TctiSgxPlacement placement (TOPOLOGY_ROOT);
+    tcti_sgx_node_stats_t stats;
+
+    assert_int_equal (placement.node_count (), 1);
+    assert_int_equal (placement.get_stats (0, &stats), 0);
+    assert_int_equal (stats.cpus, sysconf (_SC_NPROCESSORS_CONF));
+    assert_false (placement.local ());
+}
+/*
+ * Enclave placement follows the sessions.
+ */
+static void
+placement_enclave (void **state)
+{
+    UNUSED (state);
+    TctiSgxPlacement placement;
+    int home;
+
+    assert_int_equal (placement.set (TCTI_SGX_PLACEMENT_ENCLAVE, 0), 0);
+    home = placement.session_created ();
+    assert_int_equal ((unsigned)home, placement.target ());
+    placement.session_destroyed (home);
+}
+/*
+ * A pinned thread only runs on the CPUs of its node.
+ */
+static void
+placement_pin (void **state)
+{
+    UNUSED (state);
+    TctiSgxPlacement placement;
+    uint64_t generation = 0;
+    cpu_set_t set;
+
+    assert_int_equal (placement.set (TCTI_SGX_PLACEMENT_NODE, 0), 0);
+    placement.pin_self (&generation);
+    assert_int_not_equal (generation, 0);
+    assert_int_equal (sched_getaffinity (0, sizeof (set), &set), 0);
+    assert_true (placement.node_of_cpu (sched_getcpu ()) == 0);
+    assert_int_equal (placement.set (TCTI_SGX_PLACEMENT_NONE, 0), 0);
+    placement.pin_self (&generation);
+}
+
+static void
+placement_mgr_stats (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_node_stats_t before, after;
+    uint8_t cmd [TPM2_HEADER_SIZE];
+    uint64_t id;
+
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    assert_int_equal (tcti_sgx_mgr_get_node_stats (0, NULL),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+    assert_int_equal (tcti_sgx_mgr_get_node_stats (PLACEMENT_NODES_MAX, &before),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (tcti_sgx_mgr_set_placement (TCTI_SGX_PLACEMENT_NODE,
+                                                  PLACEMENT_NODES_MAX),
+                      -1);
+    assert_int_equal (tcti_sgx_mgr_set_placement (TCTI_SGX_PLACEMENT_ENCLAVE, 0),
+                      0);
+    assert_int_equal (tcti_sgx_mgr_get_node_stats (0, &before),
+                      TSS2_RC_SUCCESS);
+
+    id = tcti_sgx_init_ocall ();
+    assert_int_not_equal (id, 0);
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, sizeof (cmd), TPM2_CC_Load);
+    assert_int_equal (tcti_sgx_transmit_ocall (id, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_get_node_stats (0, &after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.sessions, before.sessions + 1);
+    assert_int_equal (after.ocalls, before.ocalls + 1);
+    tcti_sgx_finalize_ocall (id);
+    assert_int_equal (tcti_sgx_mgr_get_node_stats (0, &after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.sessions, before.sessions);
+    assert_int_equal (tcti_sgx_mgr_set_placement (TCTI_SGX_PLACEMENT_NONE, 0),
+                      0);
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (placement_parse_cpulist),
+        cmocka_unit_test (placement_topology),
+        cmocka_unit_test (placement_no_topology),
+        cmocka_unit_test (placement_enclave),
+        cmocka_unit_test (placement_pin),
+        cmocka_unit_test (placement_mgr_stats),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
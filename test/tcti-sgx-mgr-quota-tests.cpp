@@ -0,0 +1,283 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+using namespace std;
+
+#define SESSIONS 3
+
+static TSS2_RC
+mock_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    UNUSED (ctx);
+    UNUSED (size);
+    UNUSED (command);
+
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC
+mock_receive (TSS2_TCTI_CONTEXT *ctx,
+              size_t *size,
+              uint8_t *response,
+              int32_t timeout)
+{
+    UNUSED (ctx);
+    UNUSED (timeout);
+
+    tpm2_header_set (response, TPM2_ST_NO_SESSIONS, TPM2_HEADER_SIZE,
+                     TPM2_RC_SUCCESS);
+    *size = TPM2_HEADER_SIZE;
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_TCTI_CONTEXT*
+test_tcti_cb (void *user_data)
+{
+    UNUSED (user_data);
+    TSS2_TCTI_CONTEXT_COMMON_V2 *ctx;
+
+    ctx = (TSS2_TCTI_CONTEXT_COMMON_V2*)calloc (1, sizeof (TSS2_TCTI_CONTEXT_COMMON_V2));
+    ctx->v1.version = 2;
+    ctx->v1.transmit = mock_transmit;
+    ctx->v1.receive = mock_receive;
+    return  (TSS2_TCTI_CONTEXT*)ctx;
+}
+
+static int
+quota_setup (void **state)
+{
+    uint64_t *ids = (uint64_t*)calloc (SESSIONS, sizeof (uint64_t));
+    size_t i;
+
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    for (i = 0; i < SESSIONS; ++i) {
+        ids [i] = tcti_sgx_init_ocall ();
+        assert_int_not_equal (ids [i], 0);
+    }
+    *state = ids;
+    return 0;
+}
+
+static int
+quota_teardown (void **state)
+{
+    uint64_t *ids = (uint64_t*)*state;
+    size_t i;
+
+    for (i = 0; i < SESSIONS; ++i)
+        tcti_sgx_finalize_ocall (ids [i]);
+    free (ids);
+    tcti_sgx_mgr_set_quota (TCTI_SGX_SCOPE_MANAGER, 0, NULL);
+    tcti_sgx_mgr_set_quota (TCTI_SGX_SCOPE_ENCLAVE, 7, NULL);
+    return 0;
+}
+/*
+ * Send a command from session 'id' and collect its response if it was
+ * sent.
+ */
+static TSS2_RC
+send_cmd (uint64_t id)
+{
+    uint8_t cmd [TPM2_HEADER_SIZE];
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE];
+    TSS2_RC rc;
+
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, sizeof (cmd), TPM2_CC_Load);
+    rc = tcti_sgx_transmit_ocall (id, sizeof (cmd), cmd);
+    if (rc != TSS2_RC_SUCCESS)
+        return rc;
+    assert_int_equal (tcti_sgx_receive_ocall (id,
+                                              sizeof (rsp),
+                                              rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    return rc;
+}
+/*
+ * Command tokens come back at the rate, up to the burst.
+ */
+static void
+quota_bucket_commands (void **state)
+{
+    UNUSED (state);
+    chrono::steady_clock::time_point now = chrono::steady_clock::now ();
+    tcti_sgx_quota_t quota = { 2, 3, 0, 0 };
+    TctiSgxBucket bucket;
+
+    bucket.configure (&quota, now);
+    assert_true (bucket.enabled);
+    bucket.charge (0);
+    bucket.charge (0);
+    bucket.charge (0);
+    assert_false (bucket.ready ());
+    bucket.refill (now + chrono::milliseconds (400));
+    assert_false (bucket.ready ());
+    bucket.refill (now + chrono::milliseconds (500));
+    assert_true (bucket.ready ());
+    bucket.refill (now + chrono::seconds (60));
+    assert_int_equal ((int)bucket.commands, 3);
+    bucket.configure (NULL, now);
+    assert_false (bucket.enabled);
+}
+/*
+ * A command may cost more TPM time than is left, the debt has to be paid
+ * off before the next one. A burst of 0 is a second's worth.
+ */
+static void
+quota_bucket_tpm_ms (void **state)
+{
+    UNUSED (state);
+    chrono::steady_clock::time_point now = chrono::steady_clock::now ();
+    tcti_sgx_quota_t quota = { 0, 0, 100, 0 };
+    tcti_sgx_quota_stats_t stats;
+    TctiSgxBucket bucket;
+
+    bucket.configure (&quota, now);
+    assert_int_equal (bucket.quota.tpm_ms_burst, 100);
+    assert_true (bucket.ready ());
+    bucket.charge (150);
+    assert_false (bucket.ready ());
+    bucket.refill (now + chrono::milliseconds (400));
+    assert_false (bucket.ready ());
+    bucket.refill (now + chrono::milliseconds (600));
+    assert_true (bucket.ready ());
+    bucket.get_stats (&stats);
+    assert_int_equal (stats.admitted, 1);
+    assert_int_equal (stats.tpm_ms, 150);
+}
+
+static void
+quota_bad_params (void **state)
+{
+    uint64_t *ids = (uint64_t*)*state;
+    tcti_sgx_quota_t quota = { 1, 0, 0, 0 };
+    tcti_sgx_quota_stats_t stats;
+
+    assert_int_equal (tcti_sgx_mgr_set_quota ((tcti_sgx_scope_t)3, 0, &quota),
+                      -1);
+    assert_int_equal (tcti_sgx_mgr_set_quota (TCTI_SGX_SCOPE_ENCLAVE, 0,
+                                              &quota),
+                      -1);
+    assert_int_equal (tcti_sgx_mgr_set_quota (TCTI_SGX_SCOPE_SESSION, 0,
+                                              &quota),
+                      -1);
+    assert_int_equal (tcti_sgx_mgr_set_quota (TCTI_SGX_SCOPE_SESSION,
+                                              ids [0] + 1000, &quota),
+                      -1);
+    assert_int_equal (tcti_sgx_mgr_get_quota_stats (TCTI_SGX_SCOPE_MANAGER, 0,
+                                                    NULL),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+    assert_int_equal (tcti_sgx_mgr_get_quota_stats (TCTI_SGX_SCOPE_MANAGER, 0,
+                                                    &stats),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (tcti_sgx_mgr_get_quota_stats (TCTI_SGX_SCOPE_SESSION,
+                                                    ids [0], &stats),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (tcti_sgx_mgr_set_admission_limit (TCTI_SGX_SCOPE_SESSION,
+                                                        1, 0),
+                      -1);
+}
+/*
+ * A session over its quota is throttled, the others aren't.
+ */
+static void
+quota_session (void **state)
+{
+    uint64_t *ids = (uint64_t*)*state;
+    tcti_sgx_quota_t quota = { 1, 1, 0, 0 };
+    tcti_sgx_quota_stats_t stats;
+
+    assert_int_equal (tcti_sgx_mgr_set_quota (TCTI_SGX_SCOPE_SESSION, ids [0],
+                                              &quota),
+                      0);
+    assert_int_equal (send_cmd (ids [0]), TSS2_RC_SUCCESS);
+    assert_int_equal (send_cmd (ids [0]), TSS2_TCTI_RC_TRY_AGAIN);
+    assert_int_equal (send_cmd (ids [1]), TSS2_RC_SUCCESS);
+    assert_int_equal (send_cmd (ids [1]), TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_get_quota_stats (TCTI_SGX_SCOPE_SESSION,
+                                                    ids [0], &stats),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats.admitted, 1);
+    assert_int_equal (stats.throttled, 1);
+    assert_int_not_equal (stats.tpm_ms, 0);
+
+    assert_int_equal (tcti_sgx_mgr_set_quota (TCTI_SGX_SCOPE_SESSION, ids [0],
+                                              NULL),
+                      0);
+    assert_int_equal (send_cmd (ids [0]), TSS2_RC_SUCCESS);
+}
+/*
+ * The sessions of an enclave share its quota, the manager's applies to
+ * everyone.
+ */
+static void
+quota_enclave_manager (void **state)
+{
+    uint64_t *ids = (uint64_t*)*state;
+    tcti_sgx_quota_t quota = { 1, 1, 0, 0 };
+    tcti_sgx_quota_stats_t stats;
+
+    assert_int_equal (tcti_sgx_mgr_set_quota (TCTI_SGX_SCOPE_ENCLAVE, 7,
+                                              &quota),
+                      0);
+    assert_int_equal (tcti_sgx_set_tag_ocall (ids [0], 7), TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_set_tag_ocall (ids [1], 7), TSS2_RC_SUCCESS);
+    assert_int_equal (send_cmd (ids [0]), TSS2_RC_SUCCESS);
+    assert_int_equal (send_cmd (ids [1]), TSS2_TCTI_RC_TRY_AGAIN);
+    assert_int_equal (send_cmd (ids [2]), TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_get_quota_stats (TCTI_SGX_SCOPE_ENCLAVE, 7,
+                                                    &stats),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats.admitted, 1);
+    assert_int_equal (stats.throttled, 1);
+
+    assert_int_equal (tcti_sgx_mgr_set_quota (TCTI_SGX_SCOPE_MANAGER, 0,
+                                              &quota),
+                      0);
+    assert_int_equal (send_cmd (ids [2]), TSS2_RC_SUCCESS);
+    assert_int_equal (send_cmd (ids [2]), TSS2_TCTI_RC_TRY_AGAIN);
+    assert_int_equal (tcti_sgx_mgr_get_quota_stats (TCTI_SGX_SCOPE_MANAGER, 0,
+                                                    &stats),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats.admitted, 1);
+    assert_int_equal (stats.throttled, 1);
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (quota_bucket_commands),
+        cmocka_unit_test (quota_bucket_tpm_ms),
+        cmocka_unit_test_setup_teardown (quota_bad_params,
+                                         quota_setup,
+                                         quota_teardown),
+        cmocka_unit_test_setup_teardown (quota_session,
+                                         quota_setup,
+                                         quota_teardown),
+        cmocka_unit_test_setup_teardown (quota_enclave_manager,
+                                         quota_setup,
+                                         quota_teardown),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,276 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define TOKEN_SIZE 32
+
+static TSS2_RC
+mock_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    UNUSED (ctx);
+    UNUSED (size);
+    UNUSED (command);
+
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Pops a pointer to a response buffer and its size off of the mock stack
+ * and copies it to the caller.
+ */
+static TSS2_RC
+mock_receive (TSS2_TCTI_CONTEXT *ctx,
+              size_t *size,
+              uint8_t *response,
+              int32_t timeout)
+{
+    UNUSED (ctx);
+    UNUSED (timeout);
+    uint8_t *buf = mock_ptr_type (uint8_t*);
+    size_t buf_size = mock_type (size_t);
+
+    memcpy (response, buf, buf_size);
+    *size = buf_size;
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_TCTI_CONTEXT*
+test_tcti_cb (void *user_data)
+{
+    UNUSED (user_data);
+    TSS2_TCTI_CONTEXT_COMMON_V2 *ctx;
+
+    ctx = (TSS2_TCTI_CONTEXT_COMMON_V2*)calloc (1, sizeof (TSS2_TCTI_CONTEXT_COMMON_V2));
+    ctx->v1.version = 2;
+    ctx->v1.transmit = mock_transmit;
+    ctx->v1.receive = mock_receive;
+    return  (TSS2_TCTI_CONTEXT*)ctx;
+}
+
+static int
+resume_setup (void **state)
+{
+    uint64_t *id = (uint64_t*)calloc (1, sizeof (uint64_t));
+
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    tcti_sgx_mgr_set_park_timeout (60000);
+    *id = tcti_sgx_init_ocall ();
+    assert_int_not_equal (*id, 0);
+    *state = id;
+    return 0;
+}
+
+static int
+resume_teardown (void **state)
+{
+    uint64_t *id = (uint64_t*)*state;
+
+    tcti_sgx_finalize_ocall (*id);
+    free (id);
+    return 0;
+}
+
+static TctiSgxSession*
+find_session (uint64_t id)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    TctiSgxSession *session;
+
+    mgr.lock ();
+    session = mgr.session_lookup (id);
+    mgr.unlock ();
+    return session;
+}
+
+static void
+resume_token_bad_params (void **state)
+{
+    uint64_t id = *(uint64_t*)*state;
+    uint8_t token [TOKEN_SIZE];
+
+    assert_int_equal (tcti_sgx_get_resume_token_ocall (id, sizeof (token), NULL),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+    assert_int_equal (tcti_sgx_get_resume_token_ocall (id, 16, token),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (tcti_sgx_get_resume_token_ocall (id + 1,
+                                                       sizeof (token),
+                                                       token),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (tcti_sgx_park_ocall (id + 1), TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (tcti_sgx_resume_ocall (16, token), 0);
+    assert_int_equal (tcti_sgx_resume_ocall (sizeof (token), NULL), 0);
+}
+/*
+ * A session hands out the same token until it's resumed.
+ */
+static void
+resume_token_stable (void **state)
+{
+    uint64_t id = *(uint64_t*)*state;
+    uint8_t first [TOKEN_SIZE], second [TOKEN_SIZE];
+
+    assert_int_equal (tcti_sgx_get_resume_token_ocall (id,
+                                                       sizeof (first),
+                                                       first),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_get_resume_token_ocall (id,
+                                                       sizeof (second),
+                                                       second),
+                      TSS2_RC_SUCCESS);
+    assert_memory_equal (first, second, sizeof (first));
+}
+/*
+ * A parked session can't be used under its old ID. The token gets the
+ * same session, context cache and all, back under a new ID, once.
+ */
+static void
+resume_parked (void **state)
+{
+    uint64_t *id = (uint64_t*)*state;
+    uint8_t token [TOKEN_SIZE], cmd [TPM2_HEADER_SIZE];
+    TctiSgxSession *session = find_session (*id);
+    uint64_t old_id = *id;
+
+    assert_int_equal (tcti_sgx_get_resume_token_ocall (*id,
+                                                       sizeof (token),
+                                                       token),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_park_ocall (*id), TSS2_RC_SUCCESS);
+    assert_null (find_session (*id));
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, sizeof (cmd), TPM2_CC_Load);
+    assert_int_equal (tcti_sgx_transmit_ocall (*id, sizeof (cmd), cmd),
+                      TSS2_TCTI_RC_BAD_VALUE);
+
+    *id = tcti_sgx_resume_ocall (sizeof (token), token);
+    assert_int_not_equal (*id, 0);
+    assert_int_not_equal (*id, old_id);
+    assert_ptr_equal (find_session (*id), session);
+    assert_null (find_session (old_id));
+    assert_int_equal (tcti_sgx_resume_ocall (sizeof (token), token), 0);
+}
+/*
+ * A token nobody was given resumes nothing.
+ */
+static void
+resume_wrong_token (void **state)
+{
+    uint64_t id = *(uint64_t*)*state;
+    uint8_t token [TOKEN_SIZE];
+
+    assert_int_equal (tcti_sgx_get_resume_token_ocall (id,
+                                                       sizeof (token),
+                                                       token),
+                      TSS2_RC_SUCCESS);
+    token [TOKEN_SIZE - 1] ^= 0x01;
+    assert_int_equal (tcti_sgx_resume_ocall (sizeof (token), token), 0);
+    assert_non_null (find_session (id));
+}
+/*
+ * Taking over from an enclave that crashed with a command outstanding:
+ * the response is collected and dropped so the session is ready for the
+ * next command.
+ */
+static void
+resume_in_flight (void **state)
+{
+    uint64_t *id = (uint64_t*)*state;
+    uint8_t token [TOKEN_SIZE], cmd [TPM2_HEADER_SIZE];
+    uint8_t tpm_rsp [TPM2_HEADER_SIZE], rsp [TPM2_MAX_RESPONSE_SIZE];
+    TctiSgxSession *session;
+
+    assert_int_equal (tcti_sgx_get_resume_token_ocall (*id,
+                                                       sizeof (token),
+                                                       token),
+                      TSS2_RC_SUCCESS);
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, sizeof (cmd), TPM2_CC_Load);
+    assert_int_equal (tcti_sgx_transmit_ocall (*id, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+
+    tpm2_header_set (tpm_rsp, TPM2_ST_NO_SESSIONS, sizeof (tpm_rsp),
+                     TPM2_RC_SUCCESS);
+    will_return (mock_receive, tpm_rsp);
+    will_return (mock_receive, sizeof (tpm_rsp));
+    *id = tcti_sgx_resume_ocall (sizeof (token), token);
+    assert_int_not_equal (*id, 0);
+    session = find_session (*id);
+    assert_non_null (session);
+    session->lock ();
+    assert_false (session->busy ());
+    session->unlock ();
+
+    assert_int_equal (tcti_sgx_transmit_ocall (*id, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+    will_return (mock_receive, tpm_rsp);
+    will_return (mock_receive, sizeof (tpm_rsp));
+    assert_int_equal (tcti_sgx_receive_ocall (*id,
+                                              sizeof (rsp),
+                                              rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+}
+/*
+ * Parked sessions are finalized once the park timeout runs out.
+ */
+static void
+resume_expired (void **state)
+{
+    uint64_t id = *(uint64_t*)*state;
+    uint8_t token [TOKEN_SIZE];
+    uint64_t other;
+
+    assert_int_equal (tcti_sgx_get_resume_token_ocall (id,
+                                                       sizeof (token),
+                                                       token),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_set_park_timeout (0), 0);
+    assert_int_equal (tcti_sgx_park_ocall (id), TSS2_RC_SUCCESS);
+    /* the next init reaps it */
+    other = tcti_sgx_init_ocall ();
+    assert_int_not_equal (other, 0);
+    assert_int_equal (tcti_sgx_resume_ocall (sizeof (token), token), 0);
+    assert_null (TctiSgxMgr::get_instance ().session_lookup (id));
+    tcti_sgx_finalize_ocall (other);
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (resume_token_bad_params,
+                                         resume_setup,
+                                         resume_teardown),
+        cmocka_unit_test_setup_teardown (resume_token_stable,
+                                         resume_setup,
+                                         resume_teardown),
+        cmocka_unit_test_setup_teardown (resume_parked,
+                                         resume_setup,
+                                         resume_teardown),
+        cmocka_unit_test_setup_teardown (resume_wrong_token,
+                                         resume_setup,
+                                         resume_teardown),
+        cmocka_unit_test_setup_teardown (resume_in_flight,
+                                         resume_setup,
+                                         resume_teardown),
+        cmocka_unit_test_setup_teardown (resume_expired,
+                                         resume_setup,
+                                         resume_teardown),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
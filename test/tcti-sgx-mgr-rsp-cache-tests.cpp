@@ -0,0 +1,403 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define GOOD_ID  0xf913038a09efdab5
+#define OTHER_ID 0x2a67b1f0c93e5d18
+#define PERSISTENT_HANDLE 0x81000001
+#define NV_INDEX 0x01500000
+
+/* the last command sent to the downstream TCTI */
+static uint8_t last_command [TPM2_MAX_COMMAND_SIZE];
+static size_t last_command_size;
+
+static TSS2_RC
+mock_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    UNUSED (ctx);
+
+    memcpy (last_command, command, size);
+    last_command_size = size;
+    return mock_type (TSS2_RC);
+}
+/*
+ * Pops a pointer to a response buffer and its size off of the mock stack
+ * and copies it to the caller.
+ */
+static TSS2_RC
+mock_receive (TSS2_TCTI_CONTEXT *ctx,
+              size_t *size,
+              uint8_t *response,
+              int32_t timeout)
+{
+    UNUSED (ctx);
+    UNUSED (timeout);
+    uint8_t *buf = mock_ptr_type (uint8_t*);
+    size_t buf_size = mock_type (size_t);
+
+    memcpy (response, buf, buf_size);
+    *size = buf_size;
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_TCTI_CONTEXT*
+test_tcti_cb (void *user_data)
+{
+    UNUSED (user_data);
+    TSS2_TCTI_CONTEXT_COMMON_V2 *ctx;
+
+    ctx = (TSS2_TCTI_CONTEXT_COMMON_V2*)calloc (1, sizeof (TSS2_TCTI_CONTEXT_COMMON_V2));
+    ctx->v1.version = 2;
+    ctx->v1.transmit = mock_transmit;
+    ctx->v1.receive = mock_receive;
+    return  (TSS2_TCTI_CONTEXT*)ctx;
+}
+
+static size_t
+build_handle_cmd (uint8_t *buf,
+                  TPM2_CC code,
+                  TPM2_HANDLE handle)
+{
+    tpm2_header_set (buf, TPM2_ST_NO_SESSIONS, TPM2_HEADER_SIZE + 4, code);
+    tpm2_set_uint32 (&buf [TPM2_HEADER_SIZE], handle);
+    return TPM2_HEADER_SIZE + 4;
+}
+/*
+ * NV_Read or NV_Write of 'index' authorized by the index itself with a
+ * password session. 'params' are the parameters that follow the auth
+ * area.
+ */
+static size_t
+build_nv_cmd (uint8_t *buf,
+              TPM2_CC code,
+              TPM2_HANDLE index,
+              uint8_t const *params,
+              size_t params_size)
+{
+    static uint8_t const password [] = { 'p', 'a', 's', 's' };
+    uint8_t *p = &buf [TPM2_HEADER_SIZE];
+    size_t size;
+
+    tpm2_set_uint32 (p, index);
+    tpm2_set_uint32 (p + 4, index);
+    tpm2_set_uint32 (p + 8, 4 + 2 + 1 + 2 + sizeof (password));
+    tpm2_set_uint32 (p + 12, TPM2_RS_PW);
+    tpm2_set_uint16 (p + 16, 0);
+    p [18] = 0;
+    tpm2_set_uint16 (p + 19, sizeof (password));
+    memcpy (p + 21, password, sizeof (password));
+    memcpy (p + 21 + sizeof (password), params, params_size);
+    size = TPM2_HEADER_SIZE + 21 + sizeof (password) + params_size;
+    tpm2_header_set (buf, TPM2_ST_SESSIONS, size, code);
+    return size;
+}
+/* NV_Read of 4 bytes at offset 0 */
+static size_t
+build_nv_read_cmd (uint8_t *buf,
+                   TPM2_HANDLE index)
+{
+    static uint8_t const params [] = { 0x00, 0x04, 0x00, 0x00 };
+
+    return build_nv_cmd (buf, TPM2_CC_NV_Read, index, params, sizeof (params));
+}
+/* NV_Write of 4 bytes at offset 0 */
+static size_t
+build_nv_write_cmd (uint8_t *buf,
+                    TPM2_HANDLE index)
+{
+    static uint8_t const params [] = {
+        0x00, 0x04, 0xde, 0xad, 0xbe, 0xef, 0x00, 0x00
+    };
+
+    return build_nv_cmd (buf, TPM2_CC_NV_Write, index, params, sizeof (params));
+}
+/* PCR_Read of PCR 0 from the SHA256 bank */
+static size_t
+build_pcr_read_cmd (uint8_t *buf)
+{
+    static uint8_t const selection [] = {
+        0x00, 0x00, 0x00, 0x01, 0x00, 0x0b, 0x03, 0x01, 0x00, 0x00
+    };
+
+    memcpy (&buf [TPM2_HEADER_SIZE], selection, sizeof (selection));
+    tpm2_header_set (buf,
+                     TPM2_ST_NO_SESSIONS,
+                     TPM2_HEADER_SIZE + sizeof (selection),
+                     TPM2_CC_PCR_Read);
+    return TPM2_HEADER_SIZE + sizeof (selection);
+}
+/*
+ * A successful response with 'fill' in place of the parameters. For a
+ * PCR_Read the first 4 bytes are the pcrUpdateCounter.
+ */
+static size_t
+build_rsp (uint8_t *buf,
+           TPM2_ST tag,
+           uint8_t fill)
+{
+    size_t size = TPM2_HEADER_SIZE + 16;
+
+    tpm2_header_set (buf, tag, size, TPM2_RC_SUCCESS);
+    memset (&buf [TPM2_HEADER_SIZE], fill, 16);
+    return size;
+}
+/*
+ * Send 'cmd' from session 'id' and collect the response in 'rsp'. When
+ * 'tpm_rsp' isn't NULL the command is expected to go to the TPM and
+ * 'tpm_rsp' is what it responds with.
+ */
+static void
+send_cmd (uint64_t id,
+          uint8_t const *cmd,
+          size_t size,
+          uint8_t *tpm_rsp,
+          size_t tpm_rsp_size,
+          uint8_t *rsp)
+{
+    if (tpm_rsp != NULL) {
+        will_return (mock_transmit, TSS2_RC_SUCCESS);
+        will_return (mock_receive, tpm_rsp);
+        will_return (mock_receive, tpm_rsp_size);
+    }
+    assert_int_equal (tcti_sgx_transmit_ocall (id, size, cmd),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_receive_ocall (id,
+                                              TPM2_MAX_RESPONSE_SIZE,
+                                              rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+}
+
+static int
+rsp_cache_setup (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    /* no maintenance thread, the tests drive maintenance directly */
+    tcti_sgx_mgr_set_maintenance (0, 1);
+    assert_int_equal (tcti_sgx_mgr_set_rsp_cache_size (8), 0);
+    mgr.sessions.push_back (new TctiSgxSession (GOOD_ID,
+                                                test_tcti_cb (NULL),
+                                                mgr.session_config));
+    mgr.sessions.push_back (new TctiSgxSession (OTHER_ID,
+                                                test_tcti_cb (NULL),
+                                                mgr.session_config));
+    return 0;
+}
+
+static int
+rsp_cache_teardown (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.session_remove (GOOD_ID);
+    mgr.session_remove (OTHER_ID);
+    tcti_sgx_mgr_set_rsp_cache_size (0);
+    return 0;
+}
+
+static void
+rsp_cache_bad_params (void **state)
+{
+    UNUSED (state);
+
+    assert_int_equal (tcti_sgx_mgr_get_rsp_cache_stats (NULL),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+}
+/*
+ * A ReadPublic of a persistent object from one session is answered from
+ * the cache when another session sends the same command.
+ */
+static void
+rsp_cache_hit (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], tpm_rsp [TPM2_MAX_RESPONSE_SIZE];
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE];
+    tcti_sgx_rsp_cache_stats_t before, after;
+    size_t size, rsp_size;
+
+    assert_int_equal (tcti_sgx_mgr_get_rsp_cache_stats (&before),
+                      TSS2_RC_SUCCESS);
+    size = build_handle_cmd (cmd, TPM2_CC_ReadPublic, PERSISTENT_HANDLE);
+    rsp_size = build_rsp (tpm_rsp, TPM2_ST_NO_SESSIONS, 0x11);
+    send_cmd (GOOD_ID, cmd, size, tpm_rsp, rsp_size, rsp);
+    memset (rsp, 0, sizeof (rsp));
+    send_cmd (OTHER_ID, cmd, size, NULL, 0, rsp);
+    assert_memory_equal (rsp, tpm_rsp, rsp_size);
+
+    assert_int_equal (tcti_sgx_mgr_get_rsp_cache_stats (&after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.hits - before.hits, 1);
+    assert_int_equal (after.misses - before.misses, 1);
+    assert_int_equal (after.entries, 1);
+}
+/*
+ * Transient objects come and go, ReadPublic of one always goes to the TPM.
+ */
+static void
+rsp_cache_transient (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], tpm_rsp [TPM2_MAX_RESPONSE_SIZE];
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE];
+    size_t size, rsp_size;
+
+    size = build_handle_cmd (cmd, TPM2_CC_ReadPublic, 0x80000001);
+    rsp_size = build_rsp (tpm_rsp, TPM2_ST_NO_SESSIONS, 0x11);
+    send_cmd (GOOD_ID, cmd, size, tpm_rsp, rsp_size, rsp);
+    send_cmd (OTHER_ID, cmd, size, tpm_rsp, rsp_size, rsp);
+}
+/*
+ * An NV_Write to some other index leaves a cached NV_Read alone, one to
+ * the index that was read drops it.
+ */
+static void
+rsp_cache_nv_write (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], write [TPM2_MAX_COMMAND_SIZE];
+    uint8_t tpm_rsp [TPM2_MAX_RESPONSE_SIZE], rsp [TPM2_MAX_RESPONSE_SIZE];
+    tcti_sgx_rsp_cache_stats_t before, after;
+    size_t size, write_size, rsp_size;
+
+    assert_int_equal (tcti_sgx_mgr_get_rsp_cache_stats (&before),
+                      TSS2_RC_SUCCESS);
+    size = build_nv_read_cmd (cmd, NV_INDEX);
+    rsp_size = build_rsp (tpm_rsp, TPM2_ST_SESSIONS, 0x22);
+    send_cmd (GOOD_ID, cmd, size, tpm_rsp, rsp_size, rsp);
+
+    write_size = build_nv_write_cmd (write, NV_INDEX + 1);
+    send_cmd (OTHER_ID, write, write_size, tpm_rsp, rsp_size, rsp);
+    send_cmd (GOOD_ID, cmd, size, NULL, 0, rsp);
+
+    write_size = build_nv_write_cmd (write, NV_INDEX);
+    send_cmd (OTHER_ID, write, write_size, tpm_rsp, rsp_size, rsp);
+    send_cmd (GOOD_ID, cmd, size, tpm_rsp, rsp_size, rsp);
+    assert_memory_equal (last_command, cmd, size);
+
+    assert_int_equal (tcti_sgx_mgr_get_rsp_cache_stats (&after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.hits - before.hits, 1);
+    assert_int_equal (after.misses - before.misses, 2);
+    assert_int_equal (after.invalidations - before.invalidations, 1);
+}
+/*
+ * A PCR_Extend sent while a PCR_Read is in flight on another session
+ * keeps the PCR_Read response out of the cache: the TPM may have executed
+ * the read before or after the extend.
+ */
+static void
+rsp_cache_pcr_race (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], extend [TPM2_MAX_COMMAND_SIZE];
+    uint8_t tpm_rsp [TPM2_MAX_RESPONSE_SIZE], rsp [TPM2_MAX_RESPONSE_SIZE];
+    size_t size, extend_size, rsp_size;
+
+    size = build_pcr_read_cmd (cmd);
+    rsp_size = build_rsp (tpm_rsp, TPM2_ST_NO_SESSIONS, 0x01);
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit_ocall (GOOD_ID, size, cmd),
+                      TSS2_RC_SUCCESS);
+
+    extend_size = build_handle_cmd (extend, TPM2_CC_PCR_Extend, 0);
+    send_cmd (OTHER_ID, extend, extend_size, tpm_rsp, rsp_size, rsp);
+
+    will_return (mock_receive, tpm_rsp);
+    will_return (mock_receive, rsp_size);
+    assert_int_equal (tcti_sgx_receive_ocall (GOOD_ID,
+                                              sizeof (rsp),
+                                              rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    send_cmd (GOOD_ID, cmd, size, tpm_rsp, rsp_size, rsp);
+    assert_memory_equal (last_command, cmd, size);
+}
+/*
+ * The maintenance thread reads the pcrUpdateCounter. When it has moved
+ * the cached PCR_Read responses are dropped.
+ */
+static void
+rsp_cache_pcr_counter (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], tpm_rsp [TPM2_MAX_RESPONSE_SIZE];
+    uint8_t counter_rsp [TPM2_MAX_RESPONSE_SIZE], rsp [TPM2_MAX_RESPONSE_SIZE];
+    size_t size, rsp_size, counter_size;
+
+    size = build_pcr_read_cmd (cmd);
+    rsp_size = build_rsp (tpm_rsp, TPM2_ST_NO_SESSIONS, 0x01);
+    send_cmd (GOOD_ID, cmd, size, tpm_rsp, rsp_size, rsp);
+
+    /* counter unchanged */
+    counter_size = build_rsp (counter_rsp, TPM2_ST_NO_SESSIONS, 0x01);
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    will_return (mock_receive, counter_rsp);
+    will_return (mock_receive, counter_size);
+    mgr.maintain ();
+    assert_int_equal (tpm2_header_code (last_command), TPM2_CC_PCR_Read);
+    assert_int_equal (last_command_size, TPM2_HEADER_SIZE + 4);
+    send_cmd (OTHER_ID, cmd, size, NULL, 0, rsp);
+
+    /* somebody else extended a PCR */
+    counter_size = build_rsp (counter_rsp, TPM2_ST_NO_SESSIONS, 0x02);
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    will_return (mock_receive, counter_rsp);
+    will_return (mock_receive, counter_size);
+    mgr.maintain ();
+    send_cmd (OTHER_ID, cmd, size, counter_rsp, counter_size, rsp);
+    assert_memory_equal (last_command, cmd, size);
+
+    /* nothing to check for with no PCR_Read cached */
+    tcti_sgx_mgr_set_rsp_cache_size (0);
+    mgr.maintain ();
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (rsp_cache_bad_params,
+                                         rsp_cache_setup,
+                                         rsp_cache_teardown),
+        cmocka_unit_test_setup_teardown (rsp_cache_hit,
+                                         rsp_cache_setup,
+                                         rsp_cache_teardown),
+        cmocka_unit_test_setup_teardown (rsp_cache_transient,
+                                         rsp_cache_setup,
+                                         rsp_cache_teardown),
+        cmocka_unit_test_setup_teardown (rsp_cache_nv_write,
+                                         rsp_cache_setup,
+                                         rsp_cache_teardown),
+        cmocka_unit_test_setup_teardown (rsp_cache_pcr_race,
+                                         rsp_cache_setup,
+                                         rsp_cache_teardown),
+        cmocka_unit_test_setup_teardown (rsp_cache_pcr_counter,
+                                         rsp_cache_setup,
+                                         rsp_cache_teardown),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,584 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+using namespace std;
+
+static TSS2_RC
+mock_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    UNUSED (ctx);
+    UNUSED (size);
+    UNUSED (command);
+
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * When 'tpm_stuck' is set the TPM doesn't answer until the command is
+ * cancelled, then it answers with TPM2_RC_CANCELED.
+ */
+static bool tpm_stuck = false;
+static bool tpm_cancelled = false;
+
+static TSS2_RC
+mock_receive (TSS2_TCTI_CONTEXT *ctx,
+              size_t *size,
+              uint8_t *response,
+              int32_t timeout)
+{
+    UNUSED (ctx);
+
+    if (tpm_stuck && !tpm_cancelled) {
+        assert_int_not_equal (timeout, TSS2_TCTI_TIMEOUT_BLOCK);
+        this_thread::sleep_for (chrono::milliseconds (timeout));
+        return TSS2_TCTI_RC_TRY_AGAIN;
+    }
+    tpm2_header_set (response, TPM2_ST_NO_SESSIONS, TPM2_HEADER_SIZE,
+                     tpm_cancelled ? TPM2_RC_CANCELED : TPM2_RC_SUCCESS);
+    *size = TPM2_HEADER_SIZE;
+    tpm_cancelled = false;
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC
+mock_cancel (TSS2_TCTI_CONTEXT *ctx)
+{
+    UNUSED (ctx);
+
+    tpm_cancelled = true;
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_TCTI_CONTEXT*
+test_tcti_cb (void *user_data)
+{
+    UNUSED (user_data);
+    TSS2_TCTI_CONTEXT_COMMON_V2 *ctx;
+
+    ctx = (TSS2_TCTI_CONTEXT_COMMON_V2*)calloc (1, sizeof (TSS2_TCTI_CONTEXT_COMMON_V2));
+    ctx->v1.version = 2;
+    ctx->v1.transmit = mock_transmit;
+    ctx->v1.receive = mock_receive;
+    ctx->v1.cancel = mock_cancel;
+    return  (TSS2_TCTI_CONTEXT*)ctx;
+}
+/*
+ * Take the TPM for a command in class 'priority' expected to take
+ * 'cost_us', note 'label' in 'order' when we get it and give it back.
+ */
+static void
+take_turn (TctiSgxScheduler *scheduler,
+           unsigned priority,
+           uint64_t cost_us,
+           unsigned label,
+           mutex *order_mutex,
+           vector<unsigned> *order)
+{
+    uint64_t turn;
+
+    assert_true (scheduler->acquire (priority, cost_us, NULL, &turn));
+    assert_int_not_equal (turn, 0);
+    order_mutex->lock ();
+    order->push_back (label);
+    order_mutex->unlock ();
+    scheduler->release (turn);
+}
+
+static void
+scheduler_params (void **state)
+{
+    UNUSED (state);
+    TctiSgxScheduler scheduler;
+    tcti_sgx_priority_stats_t stats;
+    uint64_t turn = 1;
+
+    assert_int_equal (scheduler.set (1, 0, 0), -1);
+    assert_int_equal (scheduler.set_command (TPM2_CC_Create,
+                                             (tcti_sgx_priority_t)3),
+                      -1);
+    assert_int_equal (scheduler.get_stats ((tcti_sgx_priority_t)3, &stats),
+                      -1);
+    assert_int_equal (scheduler.set_policy ((tcti_sgx_sched_policy_t)3), -1);
+    assert_int_equal (scheduler.set_command (TPM2_CC_Create,
+                                             TCTI_SGX_PRIORITY_HIGH),
+                      0);
+    assert_int_equal (scheduler.priority_of (TPM2_CC_Create,
+                                             TCTI_SGX_PRIORITY_LOW),
+                      TCTI_SGX_PRIORITY_HIGH);
+    assert_int_equal (scheduler.priority_of (TPM2_CC_Load,
+                                             TCTI_SGX_PRIORITY_LOW),
+                      TCTI_SGX_PRIORITY_LOW);
+    /* off by default */
+    assert_true (scheduler.acquire (TCTI_SGX_PRIORITY_LOW, 0, NULL, &turn));
+    assert_int_equal (turn, 0);
+}
+/*
+ * The best class waiting gets the next turn, whoever came first.
+ */
+static void
+scheduler_order (void **state)
+{
+    UNUSED (state);
+    TctiSgxScheduler scheduler;
+    tcti_sgx_priority_stats_t stats;
+    vector<unsigned> order;
+    mutex order_mutex;
+    uint64_t turn;
+
+    assert_int_equal (scheduler.set (1, 0, 5000), 0);
+    assert_true (scheduler.acquire (TCTI_SGX_PRIORITY_NORMAL, 0, NULL, &turn));
+    assert_int_not_equal (turn, 0);
+    thread low (take_turn, &scheduler, TCTI_SGX_PRIORITY_LOW, 0,
+                TCTI_SGX_PRIORITY_LOW, &order_mutex, &order);
+    this_thread::sleep_for (chrono::milliseconds (50));
+    thread high (take_turn, &scheduler, TCTI_SGX_PRIORITY_HIGH, 0,
+                 TCTI_SGX_PRIORITY_HIGH, &order_mutex, &order);
+    this_thread::sleep_for (chrono::milliseconds (50));
+    scheduler.release (turn);
+    low.join ();
+    high.join ();
+    assert_int_equal (order.size (), 2);
+    assert_int_equal (order [0], TCTI_SGX_PRIORITY_HIGH);
+    assert_int_equal (order [1], TCTI_SGX_PRIORITY_LOW);
+    assert_int_equal (scheduler.get_stats (TCTI_SGX_PRIORITY_LOW, &stats), 0);
+    assert_int_equal (stats.commands, 1);
+    assert_true (stats.max_wait_us >= 50000);
+    assert_true (stats.wait_us >= stats.max_wait_us);
+    assert_int_equal (stats.aged, 0);
+}
+/*
+ * A low priority command that has waited long enough goes ahead of a
+ * high priority one that just arrived.
+ */
+static void
+scheduler_aging (void **state)
+{
+    UNUSED (state);
+    TctiSgxScheduler scheduler;
+    tcti_sgx_priority_stats_t stats;
+    vector<unsigned> order;
+    mutex order_mutex;
+    uint64_t turn;
+
+    assert_int_equal (scheduler.set (1, 10, 5000), 0);
+    assert_true (scheduler.acquire (TCTI_SGX_PRIORITY_NORMAL, 0, NULL, &turn));
+    thread low (take_turn, &scheduler, TCTI_SGX_PRIORITY_LOW, 0,
+                TCTI_SGX_PRIORITY_LOW, &order_mutex, &order);
+    this_thread::sleep_for (chrono::milliseconds (100));
+    thread high (take_turn, &scheduler, TCTI_SGX_PRIORITY_HIGH, 0,
+                 TCTI_SGX_PRIORITY_HIGH, &order_mutex, &order);
+    this_thread::sleep_for (chrono::milliseconds (5));
+    scheduler.release (turn);
+    low.join ();
+    high.join ();
+    assert_int_equal (order [0], TCTI_SGX_PRIORITY_LOW);
+    assert_int_equal (order [1], TCTI_SGX_PRIORITY_HIGH);
+    assert_int_equal (scheduler.get_stats (TCTI_SGX_PRIORITY_LOW, &stats), 0);
+    assert_int_equal (stats.aged, 1);
+}
+/*
+ * With shortest job first a short command goes ahead of a long one that
+ * came first, unless the long one has waited long enough for its
+ * response ratio to be the higher.
+ */
+static void
+scheduler_sjf (void **state)
+{
+    UNUSED (state);
+    TctiSgxScheduler scheduler;
+    vector<unsigned> order;
+    mutex order_mutex;
+    uint64_t turn;
+
+    assert_int_equal (scheduler.set (1, 0, 5000), 0);
+    assert_int_equal (scheduler.set_policy (TCTI_SGX_SCHED_SJF), 0);
+    assert_true (scheduler.acquire (TCTI_SGX_PRIORITY_NORMAL, 0, NULL, &turn));
+    {
+        thread slow (take_turn, &scheduler, TCTI_SGX_PRIORITY_NORMAL,
+                     10000000, 1, &order_mutex, &order);
+        this_thread::sleep_for (chrono::milliseconds (20));
+        thread fast (take_turn, &scheduler, TCTI_SGX_PRIORITY_NORMAL, 100, 2,
+                     &order_mutex, &order);
+        this_thread::sleep_for (chrono::milliseconds (20));
+        scheduler.release (turn);
+        slow.join ();
+        fast.join ();
+    }
+    assert_int_equal (order [0], 2);
+    assert_int_equal (order [1], 1);
+
+    order.clear ();
+    assert_true (scheduler.acquire (TCTI_SGX_PRIORITY_NORMAL, 0, NULL, &turn));
+    {
+        thread slow (take_turn, &scheduler, TCTI_SGX_PRIORITY_NORMAL, 1000, 1,
+                     &order_mutex, &order);
+        this_thread::sleep_for (chrono::milliseconds (100));
+        thread fast (take_turn, &scheduler, TCTI_SGX_PRIORITY_NORMAL, 100, 2,
+                     &order_mutex, &order);
+        this_thread::sleep_for (chrono::milliseconds (1));
+        scheduler.release (turn);
+        slow.join ();
+        fast.join ();
+    }
+    assert_int_equal (order [0], 1);
+    assert_int_equal (order [1], 2);
+}
+/*
+ * Take the TPM for a command that must have it within 'deadline_ms', note
+ * 'label' in 'order' when we get it and give it back.
+ */
+static void
+take_turn_by (TctiSgxScheduler *scheduler,
+              uint32_t deadline_ms,
+              unsigned label,
+              mutex *order_mutex,
+              vector<unsigned> *order)
+{
+    chrono::steady_clock::time_point deadline =
+        chrono::steady_clock::now () + chrono::milliseconds (deadline_ms);
+    uint64_t turn;
+
+    assert_true (scheduler->acquire (TCTI_SGX_PRIORITY_NORMAL, 0, &deadline,
+                                     &turn));
+    order_mutex->lock ();
+    order->push_back (label);
+    order_mutex->unlock ();
+    scheduler->release (turn);
+}
+/*
+ * Earliest deadline first. A command whose deadline passes while it
+ * waits is dropped and counted as expired rather than timed out.
+ */
+static void
+scheduler_deadline (void **state)
+{
+    UNUSED (state);
+    TctiSgxScheduler scheduler;
+    tcti_sgx_priority_stats_t stats;
+    chrono::steady_clock::time_point deadline;
+    vector<unsigned> order;
+    mutex order_mutex;
+    uint64_t turn, late;
+
+    assert_int_equal (scheduler.set (1, 0, 5000), 0);
+    assert_int_equal (scheduler.set_policy (TCTI_SGX_SCHED_DEADLINE), 0);
+    assert_true (scheduler.acquire (TCTI_SGX_PRIORITY_NORMAL, 0, NULL, &turn));
+    {
+        thread late (take_turn_by, &scheduler, 4000, 1, &order_mutex,
+                     &order);
+        this_thread::sleep_for (chrono::milliseconds (20));
+        thread soon (take_turn_by, &scheduler, 1000, 2, &order_mutex,
+                     &order);
+        this_thread::sleep_for (chrono::milliseconds (20));
+        scheduler.release (turn);
+        late.join ();
+        soon.join ();
+    }
+    assert_int_equal (order [0], 2);
+    assert_int_equal (order [1], 1);
+
+    assert_true (scheduler.acquire (TCTI_SGX_PRIORITY_NORMAL, 0, NULL, &turn));
+    deadline = chrono::steady_clock::now () + chrono::milliseconds (20);
+    assert_false (scheduler.acquire (TCTI_SGX_PRIORITY_LOW, 0, &deadline,
+                                     &late));
+    assert_false (scheduler.acquire (TCTI_SGX_PRIORITY_LOW, 0, &deadline,
+                                     &late));
+    scheduler.release (turn);
+    assert_int_equal (scheduler.get_stats (TCTI_SGX_PRIORITY_LOW, &stats), 0);
+    assert_int_equal (stats.expired, 2);
+    assert_int_equal (stats.timeouts, 0);
+}
+/*
+ * A turn held past the wait limit lapses when a waiter gives up on it,
+ * giving it back late doesn't take the TPM from whoever has it now.
+ */
+static void
+scheduler_lapse (void **state)
+{
+    UNUSED (state);
+    TctiSgxScheduler scheduler;
+    tcti_sgx_priority_stats_t stats;
+    uint64_t first, second, third;
+
+    assert_int_equal (scheduler.set (1, 0, 20), 0);
+    assert_true (scheduler.acquire (TCTI_SGX_PRIORITY_NORMAL, 0, NULL,
+                                    &first));
+    assert_false (scheduler.acquire (TCTI_SGX_PRIORITY_NORMAL, 0, NULL,
+                                     &second));
+    assert_true (scheduler.acquire (TCTI_SGX_PRIORITY_NORMAL, 0, NULL,
+                                    &second));
+    assert_int_not_equal (second, first);
+    scheduler.release (first);
+    assert_false (scheduler.acquire (TCTI_SGX_PRIORITY_NORMAL, 0, NULL,
+                                     &third));
+    assert_int_equal (scheduler.get_stats (TCTI_SGX_PRIORITY_NORMAL, &stats),
+                      0);
+    assert_int_equal (stats.commands, 2);
+    assert_int_equal (stats.timeouts, 2);
+    scheduler.release (second);
+    assert_true (scheduler.acquire (TCTI_SGX_PRIORITY_NORMAL, 0, NULL,
+                                    &third));
+    scheduler.release (third);
+}
+/*
+ * Sessions take turns with the TPM. A command that waits too long is
+ * turned away, a session that has the TPM keeps it until it collects its
+ * response.
+ */
+static void
+scheduler_sessions (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_priority_stats_t before, after;
+    uint8_t cmd [TPM2_HEADER_SIZE];
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE];
+    uint64_t a, b;
+
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    assert_int_equal (tcti_sgx_mgr_set_scheduler (1, 0, 0), -1);
+    assert_int_equal (tcti_sgx_mgr_get_priority_stats (TCTI_SGX_PRIORITY_LOW,
+                                                       NULL),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+    assert_int_equal (tcti_sgx_mgr_get_priority_stats ((tcti_sgx_priority_t)3,
+                                                       &before),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (tcti_sgx_mgr_set_scheduler_policy (
+                          (tcti_sgx_sched_policy_t)3),
+                      -1);
+    assert_int_equal (tcti_sgx_mgr_set_scheduler (1, 0, 50), 0);
+    a = tcti_sgx_init_ocall ();
+    b = tcti_sgx_init_ocall ();
+    assert_int_equal (tcti_sgx_mgr_set_session_priority (0,
+                          TCTI_SGX_PRIORITY_LOW),
+                      -1);
+    assert_int_equal (tcti_sgx_mgr_set_session_priority (a,
+                          (tcti_sgx_priority_t)3),
+                      -1);
+    assert_int_equal (tcti_sgx_mgr_set_session_priority (a,
+                          TCTI_SGX_PRIORITY_LOW),
+                      0);
+    assert_int_equal (tcti_sgx_set_priority_ocall (b, 3),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (tcti_sgx_set_priority_ocall (0, 0),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (tcti_sgx_set_priority_ocall (b, TCTI_SGX_PRIORITY_HIGH),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_get_priority_stats (TCTI_SGX_PRIORITY_LOW,
+                                                       &before),
+                      TSS2_RC_SUCCESS);
+
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, sizeof (cmd), TPM2_CC_Load);
+    assert_int_equal (tcti_sgx_transmit_ocall (a, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit_ocall (b, sizeof (cmd), cmd),
+                      TSS2_TCTI_RC_TRY_AGAIN);
+    assert_int_equal (tcti_sgx_receive_ocall (a, sizeof (rsp), rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit_ocall (b, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_receive_ocall (b, sizeof (rsp), rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_get_priority_stats (TCTI_SGX_PRIORITY_LOW,
+                                                       &after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.commands - before.commands, 1);
+    assert_int_equal (tcti_sgx_mgr_get_priority_stats (TCTI_SGX_PRIORITY_HIGH,
+                                                       &after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.commands, 1);
+    assert_int_equal (after.timeouts, 1);
+
+    /* a session going away gives the TPM back */
+    assert_int_equal (tcti_sgx_transmit_ocall (a, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+    tcti_sgx_finalize_ocall (a);
+    assert_int_equal (tcti_sgx_transmit_ocall (b, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+    tcti_sgx_finalize_ocall (b);
+    assert_int_equal (tcti_sgx_mgr_set_scheduler (0, 0, 50), 0);
+}
+/*
+ * A session that sends a command and never collects the response holds
+ * the others up once, not for good.
+ */
+static void
+scheduler_abandoned (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_HEADER_SIZE];
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE];
+    uint64_t a, b;
+    int i;
+
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    assert_int_equal (tcti_sgx_mgr_set_scheduler (1, 0, 50), 0);
+    a = tcti_sgx_init_ocall ();
+    b = tcti_sgx_init_ocall ();
+
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, sizeof (cmd), TPM2_CC_Load);
+    assert_int_equal (tcti_sgx_transmit_ocall (a, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit_ocall (b, sizeof (cmd), cmd),
+                      TSS2_TCTI_RC_TRY_AGAIN);
+    for (i = 0; i < 4; ++i) {
+        assert_int_equal (tcti_sgx_transmit_ocall (b, sizeof (cmd), cmd),
+                          TSS2_RC_SUCCESS);
+        assert_int_equal (tcti_sgx_receive_ocall (b, sizeof (rsp), rsp,
+                                                  TSS2_TCTI_TIMEOUT_BLOCK),
+                          TSS2_RC_SUCCESS);
+    }
+    tcti_sgx_finalize_ocall (a);
+    tcti_sgx_finalize_ocall (b);
+    assert_int_equal (tcti_sgx_mgr_set_scheduler (0, 0, 50), 0);
+}
+/*
+ * A command whose deadline passes while it waits for the TPM is answered
+ * with TPM2_RC_CANCELED without being sent. One the TPM doesn't answer in
+ * time is cancelled.
+ */
+static void
+scheduler_deadline_sessions (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_priority_stats_t stats;
+    uint8_t cmd [TPM2_HEADER_SIZE];
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE];
+    uint64_t a, b;
+
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    assert_int_equal (tcti_sgx_mgr_set_scheduler (1, 0, 5000), 0);
+    a = tcti_sgx_init_ocall ();
+    b = tcti_sgx_init_ocall ();
+    assert_int_equal (tcti_sgx_transmit_deadline_ocall (0, sizeof (cmd), cmd,
+                                                        10),
+                      TSS2_TCTI_RC_BAD_VALUE);
+
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, sizeof (cmd), TPM2_CC_Load);
+    assert_int_equal (tcti_sgx_transmit_ocall (a, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit_deadline_ocall (b, sizeof (cmd), cmd,
+                                                        20),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_receive_ocall (b, sizeof (rsp), rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_header_code (rsp), TPM2_RC_CANCELED);
+    assert_int_equal (tcti_sgx_receive_ocall (a, sizeof (rsp), rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_header_code (rsp), TPM2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_get_priority_stats (TCTI_SGX_PRIORITY_NORMAL,
+                                                       &stats),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats.expired, 1);
+
+    tpm_stuck = true;
+    assert_int_equal (tcti_sgx_transmit_deadline_ocall (b, sizeof (cmd), cmd,
+                                                        20),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_receive_ocall (b, sizeof (rsp), rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_header_code (rsp), TPM2_RC_CANCELED);
+    tpm_stuck = false;
+
+    /* the TPM is free again */
+    assert_int_equal (tcti_sgx_transmit_ocall (a, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_receive_ocall (a, sizeof (rsp), rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    tcti_sgx_finalize_ocall (a);
+    tcti_sgx_finalize_ocall (b);
+    assert_int_equal (tcti_sgx_mgr_set_scheduler (0, 0, 50), 0);
+}
+/*
+ * Each backend's TPM is scheduled on its own: a command on one backend
+ * doesn't wait for the one that has the TPM of another, but it is
+ * scheduled.
+ */
+static void
+scheduler_backends (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_priority_stats_t before, after;
+    tcti_sgx_backend_stats_t stats;
+    uint8_t cmd [TPM2_HEADER_SIZE];
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE];
+    uint64_t a, b;
+
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    assert_int_equal (tcti_sgx_mgr_set_scheduler (1, 0, 50), 0);
+    assert_int_equal (tcti_sgx_mgr_add_backend (test_tcti_cb, NULL), 1);
+    a = tcti_sgx_init_ocall ();
+    b = tcti_sgx_init_ocall ();
+    assert_int_equal (tcti_sgx_mgr_get_backend_stats (1, &stats),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats.sessions, 1);
+    assert_int_equal (tcti_sgx_mgr_get_priority_stats (TCTI_SGX_PRIORITY_NORMAL,
+                                                       &before),
+                      TSS2_RC_SUCCESS);
+
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, sizeof (cmd), TPM2_CC_Load);
+    assert_int_equal (tcti_sgx_transmit_ocall (a, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit_ocall (b, sizeof (cmd), cmd),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_receive_ocall (a, sizeof (rsp), rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_receive_ocall (b, sizeof (rsp), rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_get_priority_stats (TCTI_SGX_PRIORITY_NORMAL,
+                                                       &after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.commands - before.commands, 2);
+    assert_int_equal (after.timeouts, before.timeouts);
+    tcti_sgx_finalize_ocall (a);
+    tcti_sgx_finalize_ocall (b);
+    assert_int_equal (tcti_sgx_mgr_set_scheduler (0, 0, 50), 0);
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (scheduler_params),
+        cmocka_unit_test (scheduler_order),
+        cmocka_unit_test (scheduler_aging),
+        cmocka_unit_test (scheduler_sjf),
+        cmocka_unit_test (scheduler_deadline),
+        cmocka_unit_test (scheduler_lapse),
+        cmocka_unit_test (scheduler_sessions),
+        cmocka_unit_test (scheduler_abandoned),
+        cmocka_unit_test (scheduler_deadline_sessions),
+        cmocka_unit_test (scheduler_backends),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
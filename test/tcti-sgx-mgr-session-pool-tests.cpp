@@ -0,0 +1,289 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define GOOD_ID 0xf913038a09efdab5
+#define SESSION_HANDLE 0x02000000
+
+/* the last command sent to the downstream TCTI */
+static uint8_t last_command [TPM2_MAX_COMMAND_SIZE];
+static size_t last_command_size;
+
+static TSS2_RC
+mock_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    UNUSED (ctx);
+
+    memcpy (last_command, command, size);
+    last_command_size = size;
+    return mock_type (TSS2_RC);
+}
+/*
+ * Pops a pointer to a response buffer and its size off of the mock stack
+ * and copies it to the caller.
+ */
+static TSS2_RC
+mock_receive (TSS2_TCTI_CONTEXT *ctx,
+              size_t *size,
+              uint8_t *response,
+              int32_t timeout)
+{
+    UNUSED (ctx);
+    UNUSED (timeout);
+    uint8_t *buf = mock_ptr_type (uint8_t*);
+    size_t buf_size = mock_type (size_t);
+
+    memcpy (response, buf, buf_size);
+    *size = buf_size;
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_TCTI_CONTEXT*
+test_tcti_cb (void *user_data)
+{
+    UNUSED (user_data);
+    TSS2_TCTI_CONTEXT_COMMON_V2 *ctx;
+
+    ctx = (TSS2_TCTI_CONTEXT_COMMON_V2*)calloc (1, sizeof (TSS2_TCTI_CONTEXT_COMMON_V2));
+    ctx->v1.version = 2;
+    ctx->v1.transmit = mock_transmit;
+    ctx->v1.receive = mock_receive;
+    return  (TSS2_TCTI_CONTEXT*)ctx;
+}
+/*
+ * StartAuthSession for an unbound, unsalted HMAC session using SHA256
+ * with no parameter encryption. The nonceCaller is filled in by
+ * build_start_cmd.
+ */
+static size_t
+build_start_cmd (uint8_t *buf,
+                 TPM2_SE type,
+                 uint8_t nonce_byte)
+{
+    size_t size = TPM2_HEADER_SIZE + 8 + 2 + 32 + 2 + 1 + 2 + 2;
+    uint8_t *param = &buf [TPM2_HEADER_SIZE];
+
+    tpm2_header_set (buf, TPM2_ST_NO_SESSIONS, size, TPM2_CC_StartAuthSession);
+    tpm2_set_uint32 (param, TPM2_RH_NULL);
+    tpm2_set_uint32 (param + 4, TPM2_RH_NULL);
+    tpm2_set_uint16 (param + 8, 32);
+    memset (param + 10, nonce_byte, 32);
+    tpm2_set_uint16 (param + 42, 0);
+    param [44] = type;
+    tpm2_set_uint16 (param + 45, TPM2_ALG_NULL);
+    tpm2_set_uint16 (param + 47, TPM2_ALG_SHA256);
+    return size;
+}
+static uint8_t start_response [TPM2_HEADER_SIZE + 4 + 2 + 32];
+
+static int
+session_pool_setup (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    TctiSgxSession *session;
+
+    /* no maintenance thread, the tests drive maintenance directly */
+    tcti_sgx_mgr_set_maintenance (0, 1);
+    if (mgr.session_config.session_specs.empty ())
+        assert_int_equal (tcti_sgx_mgr_add_session_pool (TPM2_SE_HMAC,
+                                                         TPM2_ALG_SHA256,
+                                                         NULL,
+                                                         1),
+                          0);
+    session = new TctiSgxSession (GOOD_ID,
+                                  test_tcti_cb (NULL),
+                                  mgr.session_config);
+    mgr.sessions.push_back (session);
+
+    tpm2_header_set (start_response,
+                     TPM2_ST_NO_SESSIONS,
+                     sizeof (start_response),
+                     TPM2_RC_SUCCESS);
+    tpm2_set_uint32 (&start_response [TPM2_HEADER_SIZE], SESSION_HANDLE);
+    tpm2_set_uint16 (&start_response [TPM2_HEADER_SIZE + 4], 32);
+    memset (&start_response [TPM2_HEADER_SIZE + 6], 0x5a, 32);
+    return 0;
+}
+
+static int
+session_pool_teardown (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.session_remove (GOOD_ID);
+    return 0;
+}
+
+static void
+session_pool_bad_params (void **state)
+{
+    UNUSED (state);
+
+    assert_int_equal (tcti_sgx_mgr_add_session_pool (TPM2_SE_TRIAL,
+                                                     TPM2_ALG_SHA256,
+                                                     NULL,
+                                                     1),
+                      -1);
+    assert_int_equal (tcti_sgx_mgr_add_session_pool (TPM2_SE_HMAC,
+                                                     TPM2_ALG_NULL,
+                                                     NULL,
+                                                     1),
+                      -1);
+}
+/*
+ * A maintenance pass starts a session for the pool. The next matching
+ * StartAuthSession from the client is answered with that session without
+ * going to the TPM.
+ */
+static void
+session_pool_hit (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], buf [TPM2_MAX_RESPONSE_SIZE];
+    tcti_sgx_session_pool_stats_t stats;
+    size_t size;
+
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    will_return (mock_receive, start_response);
+    will_return (mock_receive, sizeof (start_response));
+    mgr.maintain ();
+    /* the pool is full, another pass doesn't start anything */
+    mgr.maintain ();
+
+    size = build_start_cmd (cmd, TPM2_SE_HMAC, 0);
+    assert_int_equal (last_command_size, size);
+    assert_memory_equal (last_command, cmd, size);
+
+    size = build_start_cmd (cmd, TPM2_SE_HMAC, 0xa5);
+    assert_int_equal (tcti_sgx_transmit_ocall (GOOD_ID, size, cmd),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_receive_ocall (GOOD_ID,
+                                              sizeof (buf),
+                                              buf,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_memory_equal (buf, start_response, sizeof (start_response));
+
+    assert_int_equal (tcti_sgx_mgr_get_session_pool_stats (GOOD_ID, &stats),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats.hits, 1);
+    assert_int_equal (stats.misses, 0);
+    assert_int_equal (stats.started, 1);
+    assert_int_equal (stats.available, 0);
+}
+/*
+ * With nothing in the pool the StartAuthSession goes to the TPM.
+ */
+static void
+session_pool_miss (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], buf [TPM2_MAX_RESPONSE_SIZE];
+    tcti_sgx_session_pool_stats_t stats;
+    size_t size;
+
+    size = build_start_cmd (cmd, TPM2_SE_HMAC, 0xa5);
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit_ocall (GOOD_ID, size, cmd),
+                      TSS2_RC_SUCCESS);
+    assert_memory_equal (last_command, cmd, size);
+    will_return (mock_receive, start_response);
+    will_return (mock_receive, sizeof (start_response));
+    assert_int_equal (tcti_sgx_receive_ocall (GOOD_ID,
+                                              sizeof (buf),
+                                              buf,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_get_session_pool_stats (0, &stats),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats.hits, 0);
+    assert_int_equal (stats.misses, 1);
+}
+/*
+ * A policy session doesn't match the HMAC pool and is sent to the TPM
+ * even though a pooled session is available.
+ */
+static void
+session_pool_no_match (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], buf [TPM2_MAX_RESPONSE_SIZE];
+    tcti_sgx_session_pool_stats_t stats;
+    size_t size;
+
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    will_return (mock_receive, start_response);
+    will_return (mock_receive, sizeof (start_response));
+    mgr.maintain ();
+
+    size = build_start_cmd (cmd, TPM2_SE_POLICY, 0xa5);
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit_ocall (GOOD_ID, size, cmd),
+                      TSS2_RC_SUCCESS);
+    assert_memory_equal (last_command, cmd, size);
+    will_return (mock_receive, start_response);
+    will_return (mock_receive, sizeof (start_response));
+    assert_int_equal (tcti_sgx_receive_ocall (GOOD_ID,
+                                              sizeof (buf),
+                                              buf,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_mgr_get_session_pool_stats (GOOD_ID, &stats),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats.hits, 0);
+    assert_int_equal (stats.misses, 0);
+    assert_int_equal (stats.available, 1);
+
+    /* the pooled session is flushed when the session goes away */
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    will_return (mock_receive, start_response);
+    will_return (mock_receive, TPM2_HEADER_SIZE);
+    tpm2_set_uint32 (&start_response [2], TPM2_HEADER_SIZE);
+    tcti_sgx_finalize_ocall (GOOD_ID);
+    assert_int_equal (tpm2_header_code (last_command), TPM2_CC_FlushContext);
+    assert_int_equal (tpm2_get_uint32 (&last_command [TPM2_HEADER_SIZE]),
+                      SESSION_HANDLE);
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (session_pool_bad_params,
+                                         session_pool_setup,
+                                         session_pool_teardown),
+        cmocka_unit_test_setup_teardown (session_pool_hit,
+                                         session_pool_setup,
+                                         session_pool_teardown),
+        cmocka_unit_test_setup_teardown (session_pool_miss,
+                                         session_pool_setup,
+                                         session_pool_teardown),
+        cmocka_unit_test_setup_teardown (session_pool_no_match,
+                                         session_pool_setup,
+                                         session_pool_teardown),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,334 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define GOOD_ID  0xf913038a09efdab5
+#define OTHER_ID 0x2a67b1f0c93e5d18
+
+/* the last command sent to the downstream TCTI */
+static uint8_t last_command [TPM2_MAX_COMMAND_SIZE];
+static size_t last_command_size;
+
+static TSS2_RC
+mock_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    UNUSED (ctx);
+
+    memcpy (last_command, command, size);
+    last_command_size = size;
+    return mock_type (TSS2_RC);
+}
+/*
+ * Pops a pointer to a response buffer and its size off of the mock stack
+ * and copies it to the caller.
+ */
+static TSS2_RC
+mock_receive (TSS2_TCTI_CONTEXT *ctx,
+              size_t *size,
+              uint8_t *response,
+              int32_t timeout)
+{
+    UNUSED (ctx);
+    UNUSED (timeout);
+    uint8_t *buf = mock_ptr_type (uint8_t*);
+    size_t buf_size = mock_type (size_t);
+
+    memcpy (response, buf, buf_size);
+    *size = buf_size;
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_TCTI_CONTEXT*
+test_tcti_cb (void *user_data)
+{
+    UNUSED (user_data);
+    TSS2_TCTI_CONTEXT_COMMON_V2 *ctx;
+
+    ctx = (TSS2_TCTI_CONTEXT_COMMON_V2*)calloc (1, sizeof (TSS2_TCTI_CONTEXT_COMMON_V2));
+    ctx->v1.version = 2;
+    ctx->v1.transmit = mock_transmit;
+    ctx->v1.receive = mock_receive;
+    return  (TSS2_TCTI_CONTEXT*)ctx;
+}
+/* PCR_Read of PCR 0 from the SHA256 bank */
+static size_t
+build_pcr_read_cmd (uint8_t *buf)
+{
+    static uint8_t const selection [] = {
+        0x00, 0x00, 0x00, 0x01, 0x00, 0x0b, 0x03, 0x01, 0x00, 0x00
+    };
+
+    memcpy (&buf [TPM2_HEADER_SIZE], selection, sizeof (selection));
+    tpm2_header_set (buf,
+                     TPM2_ST_NO_SESSIONS,
+                     TPM2_HEADER_SIZE + sizeof (selection),
+                     TPM2_CC_PCR_Read);
+    return TPM2_HEADER_SIZE + sizeof (selection);
+}
+/* a successful response with 'fill' in place of the parameters */
+static size_t
+build_rsp (uint8_t *buf,
+           uint8_t fill)
+{
+    size_t size = TPM2_HEADER_SIZE + 16;
+
+    tpm2_header_set (buf, TPM2_ST_NO_SESSIONS, size, TPM2_RC_SUCCESS);
+    memset (&buf [TPM2_HEADER_SIZE], fill, 16);
+    return size;
+}
+
+static void
+transmit_cmd (uint64_t id,
+              uint8_t const *cmd,
+              size_t size,
+              bool to_tpm)
+{
+    if (to_tpm)
+        will_return (mock_transmit, TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_sgx_transmit_ocall (id, size, cmd),
+                      TSS2_RC_SUCCESS);
+}
+/*
+ * Collect the response for session 'id'. When 'tpm_rsp' isn't NULL it's
+ * expected to come from the TPM.
+ */
+static void
+receive_rsp (uint64_t id,
+             uint8_t *tpm_rsp,
+             size_t tpm_rsp_size,
+             uint8_t *rsp)
+{
+    if (tpm_rsp != NULL) {
+        will_return (mock_receive, tpm_rsp);
+        will_return (mock_receive, tpm_rsp_size);
+    }
+    assert_int_equal (tcti_sgx_receive_ocall (id,
+                                              TPM2_MAX_RESPONSE_SIZE,
+                                              rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+}
+
+static int
+single_flight_setup (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    assert_int_equal (tcti_sgx_mgr_set_single_flight (1), 0);
+    mgr.sessions.push_back (new TctiSgxSession (GOOD_ID,
+                                                test_tcti_cb (NULL),
+                                                mgr.session_config));
+    mgr.sessions.push_back (new TctiSgxSession (OTHER_ID,
+                                                test_tcti_cb (NULL),
+                                                mgr.session_config));
+    return 0;
+}
+
+static int
+single_flight_teardown (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.session_remove (GOOD_ID);
+    mgr.session_remove (OTHER_ID);
+    tcti_sgx_mgr_set_single_flight (0);
+    return 0;
+}
+
+static void
+single_flight_bad_params (void **state)
+{
+    UNUSED (state);
+
+    assert_int_equal (tcti_sgx_mgr_get_single_flight_stats (NULL),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+}
+/*
+ * The second session sends the same PCR_Read while the first is waiting
+ * on the TPM. Only one goes to the TPM and both get its response.
+ */
+static void
+single_flight_shared (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], tpm_rsp [TPM2_MAX_RESPONSE_SIZE];
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE];
+    tcti_sgx_single_flight_stats_t before, after;
+    size_t size, rsp_size;
+
+    assert_int_equal (tcti_sgx_mgr_get_single_flight_stats (&before),
+                      TSS2_RC_SUCCESS);
+    size = build_pcr_read_cmd (cmd);
+    rsp_size = build_rsp (tpm_rsp, 0x11);
+    transmit_cmd (GOOD_ID, cmd, size, true);
+    transmit_cmd (OTHER_ID, cmd, size, false);
+    receive_rsp (GOOD_ID, tpm_rsp, rsp_size, rsp);
+    memset (rsp, 0, sizeof (rsp));
+    receive_rsp (OTHER_ID, NULL, 0, rsp);
+    assert_memory_equal (rsp, tpm_rsp, rsp_size);
+
+    /* the flight is over, the next one goes to the TPM */
+    transmit_cmd (OTHER_ID, cmd, size, true);
+    receive_rsp (OTHER_ID, tpm_rsp, rsp_size, rsp);
+
+    assert_int_equal (tcti_sgx_mgr_get_single_flight_stats (&after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.flights - before.flights, 2);
+    assert_int_equal (after.joined - before.joined, 1);
+    assert_int_equal (after.fallbacks - before.fallbacks, 0);
+}
+/*
+ * A follower polling before the leader has its response is told to try
+ * again and stays in the flight.
+ */
+static void
+single_flight_poll (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], tpm_rsp [TPM2_MAX_RESPONSE_SIZE];
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE];
+    tcti_sgx_single_flight_stats_t before, after;
+    size_t size, rsp_size;
+
+    assert_int_equal (tcti_sgx_mgr_get_single_flight_stats (&before),
+                      TSS2_RC_SUCCESS);
+    size = build_pcr_read_cmd (cmd);
+    rsp_size = build_rsp (tpm_rsp, 0x55);
+    transmit_cmd (GOOD_ID, cmd, size, true);
+    transmit_cmd (OTHER_ID, cmd, size, false);
+    assert_int_equal (tcti_sgx_receive_ocall (OTHER_ID, sizeof (rsp), rsp, 0),
+                      TSS2_TCTI_RC_TRY_AGAIN);
+    receive_rsp (GOOD_ID, tpm_rsp, rsp_size, rsp);
+    memset (rsp, 0, sizeof (rsp));
+    assert_int_equal (tcti_sgx_receive_ocall (OTHER_ID, sizeof (rsp), rsp, 0),
+                      TSS2_RC_SUCCESS);
+    assert_memory_equal (rsp, tpm_rsp, rsp_size);
+
+    assert_int_equal (tcti_sgx_mgr_get_single_flight_stats (&after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.joined - before.joined, 1);
+    assert_int_equal (after.fallbacks - before.fallbacks, 0);
+}
+/*
+ * Commands that aren't read-only are never shared.
+ */
+static void
+single_flight_not_read_only (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_HEADER_SIZE + 2], tpm_rsp [TPM2_MAX_RESPONSE_SIZE];
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE];
+    size_t rsp_size;
+
+    tpm2_header_set (cmd, TPM2_ST_NO_SESSIONS, sizeof (cmd), TPM2_CC_GetRandom);
+    tpm2_set_uint16 (&cmd [TPM2_HEADER_SIZE], 8);
+    rsp_size = build_rsp (tpm_rsp, 0x22);
+    transmit_cmd (GOOD_ID, cmd, sizeof (cmd), true);
+    transmit_cmd (OTHER_ID, cmd, sizeof (cmd), true);
+    receive_rsp (GOOD_ID, tpm_rsp, rsp_size, rsp);
+    receive_rsp (OTHER_ID, tpm_rsp, rsp_size, rsp);
+}
+/*
+ * A PCR_Extend closes the flight: a PCR_Read sent after it can't have the
+ * response to one sent before it.
+ */
+static void
+single_flight_state_change (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], extend [TPM2_HEADER_SIZE + 4];
+    uint8_t tpm_rsp [TPM2_MAX_RESPONSE_SIZE], rsp [TPM2_MAX_RESPONSE_SIZE];
+    size_t size, rsp_size;
+
+    size = build_pcr_read_cmd (cmd);
+    rsp_size = build_rsp (tpm_rsp, 0x33);
+    tpm2_header_set (extend,
+                     TPM2_ST_NO_SESSIONS,
+                     sizeof (extend),
+                     TPM2_CC_PCR_Extend);
+    tpm2_set_uint32 (&extend [TPM2_HEADER_SIZE], 0);
+
+    transmit_cmd (GOOD_ID, cmd, size, true);
+    transmit_cmd (OTHER_ID, extend, sizeof (extend), true);
+    receive_rsp (OTHER_ID, tpm_rsp, rsp_size, rsp);
+    transmit_cmd (OTHER_ID, cmd, size, true);
+    receive_rsp (GOOD_ID, tpm_rsp, rsp_size, rsp);
+    receive_rsp (OTHER_ID, tpm_rsp, rsp_size, rsp);
+}
+/*
+ * When the leader cancels its command the follower sends it itself.
+ */
+static void
+single_flight_fallback (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], tpm_rsp [TPM2_MAX_RESPONSE_SIZE];
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE];
+    tcti_sgx_single_flight_stats_t before, after;
+    size_t size, rsp_size;
+
+    assert_int_equal (tcti_sgx_mgr_get_single_flight_stats (&before),
+                      TSS2_RC_SUCCESS);
+    size = build_pcr_read_cmd (cmd);
+    rsp_size = build_rsp (tpm_rsp, 0x44);
+    transmit_cmd (GOOD_ID, cmd, size, true);
+    transmit_cmd (OTHER_ID, cmd, size, false);
+    /* the mock TCTI doesn't implement cancel */
+    assert_int_equal (tcti_sgx_cancel_ocall (GOOD_ID),
+                      TSS2_TCTI_RC_NOT_IMPLEMENTED);
+    will_return (mock_transmit, TSS2_RC_SUCCESS);
+    receive_rsp (OTHER_ID, tpm_rsp, rsp_size, rsp);
+    assert_memory_equal (last_command, cmd, size);
+
+    assert_int_equal (tcti_sgx_mgr_get_single_flight_stats (&after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.joined - before.joined, 1);
+    assert_int_equal (after.fallbacks - before.fallbacks, 1);
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (single_flight_bad_params,
+                                         single_flight_setup,
+                                         single_flight_teardown),
+        cmocka_unit_test_setup_teardown (single_flight_shared,
+                                         single_flight_setup,
+                                         single_flight_teardown),
+        cmocka_unit_test_setup_teardown (single_flight_poll,
+                                         single_flight_setup,
+                                         single_flight_teardown),
+        cmocka_unit_test_setup_teardown (single_flight_not_read_only,
+                                         single_flight_setup,
+                                         single_flight_teardown),
+        cmocka_unit_test_setup_teardown (single_flight_state_change,
+                                         single_flight_setup,
+                                         single_flight_teardown),
+        cmocka_unit_test_setup_teardown (single_flight_fallback,
+                                         single_flight_setup,
+                                         single_flight_teardown),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
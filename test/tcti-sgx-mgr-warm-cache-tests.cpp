@@ -0,0 +1,313 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+#include "tcti-sgx-mgr_priv.h"
+#include "tcti-sgx-mgr.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define GOOD_ID 0x3b7d0e52f18ac964
+#define EK_HANDLE 0x81010001
+#define CACHE_PATH "tcti-sgx-mgr-warm-cache-tests.cache"
+
+/* number of commands sent to the downstream TCTI and the last one */
+static size_t transmit_count;
+static uint8_t last_command [TPM2_MAX_COMMAND_SIZE];
+
+static TSS2_RC
+mock_transmit (TSS2_TCTI_CONTEXT *ctx,
+               size_t size,
+               uint8_t const *command)
+{
+    UNUSED (ctx);
+
+    memcpy (last_command, command, size);
+    ++transmit_count;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Pops a pointer to a response buffer and its size off of the mock stack
+ * and copies it to the caller.
+ */
+static TSS2_RC
+mock_receive (TSS2_TCTI_CONTEXT *ctx,
+              size_t *size,
+              uint8_t *response,
+              int32_t timeout)
+{
+    UNUSED (ctx);
+    UNUSED (timeout);
+    uint8_t *buf = mock_ptr_type (uint8_t*);
+    size_t buf_size = mock_type (size_t);
+
+    memcpy (response, buf, buf_size);
+    *size = buf_size;
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_TCTI_CONTEXT*
+test_tcti_cb (void *user_data)
+{
+    UNUSED (user_data);
+    TSS2_TCTI_CONTEXT_COMMON_V2 *ctx;
+
+    ctx = (TSS2_TCTI_CONTEXT_COMMON_V2*)calloc (1, sizeof (TSS2_TCTI_CONTEXT_COMMON_V2));
+    ctx->v1.version = 2;
+    ctx->v1.transmit = mock_transmit;
+    ctx->v1.receive = mock_receive;
+    return  (TSS2_TCTI_CONTEXT*)ctx;
+}
+/* a successful response with 'fill' in place of the parameters */
+static size_t
+build_rsp (uint8_t *buf,
+           uint8_t fill)
+{
+    size_t size = TPM2_HEADER_SIZE + 16;
+
+    tpm2_header_set (buf, TPM2_ST_NO_SESSIONS, size, TPM2_RC_SUCCESS);
+    memset (&buf [TPM2_HEADER_SIZE], fill, 16);
+    return size;
+}
+
+static size_t
+build_read_public_cmd (uint8_t *buf)
+{
+    tpm2_header_set (buf,
+                     TPM2_ST_NO_SESSIONS,
+                     TPM2_HEADER_SIZE + 4,
+                     TPM2_CC_ReadPublic);
+    tpm2_set_uint32 (&buf [TPM2_HEADER_SIZE], EK_HANDLE);
+    return TPM2_HEADER_SIZE + 4;
+}
+
+static void
+expect_rsp (uint8_t *rsp,
+            size_t size)
+{
+    will_return (mock_receive, rsp);
+    will_return (mock_receive, size);
+}
+/*
+ * Send 'cmd' and collect its response. When 'tpm_rsp' isn't NULL the
+ * command is expected to go to the TPM.
+ */
+static void
+send_cmd (uint8_t const *cmd,
+          size_t size,
+          uint8_t *tpm_rsp,
+          size_t tpm_rsp_size,
+          uint8_t *rsp)
+{
+    size_t count = transmit_count;
+
+    assert_int_equal (tcti_sgx_transmit_ocall (GOOD_ID, size, cmd),
+                      TSS2_RC_SUCCESS);
+    if (tpm_rsp != NULL)
+        expect_rsp (tpm_rsp, tpm_rsp_size);
+    assert_int_equal (tcti_sgx_receive_ocall (GOOD_ID,
+                                              TPM2_MAX_RESPONSE_SIZE,
+                                              rsp,
+                                              TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (transmit_count - count, tpm_rsp != NULL ? 1 : 0);
+}
+/*
+ * Run the maintenance thread once with the TPM identity 'fill'.
+ */
+static void
+check_identity (uint8_t fill)
+{
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE];
+
+    expect_rsp (rsp, build_rsp (rsp, fill));
+    mgr.maintain ();
+    assert_int_equal (tpm2_header_code (last_command), TPM2_CC_GetCapability);
+}
+/*
+ * Put the EK ReadPublic response in the cache file with identity 0x01.
+ */
+static void
+populate (uint8_t *tpm_rsp,
+          size_t tpm_rsp_size)
+{
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], rsp [TPM2_MAX_RESPONSE_SIZE];
+    size_t size = build_read_public_cmd (cmd);
+
+    send_cmd (cmd, size, tpm_rsp, tpm_rsp_size, rsp);
+    check_identity (0x01);
+    assert_int_equal (access (CACHE_PATH, R_OK), 0);
+    /* restart */
+    assert_int_equal (tcti_sgx_mgr_set_warm_cache (CACHE_PATH), 0);
+}
+
+static int
+warm_cache_setup (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_mgr_init (test_tcti_cb, NULL);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    tcti_sgx_mgr_set_maintenance (0, 1);
+    unlink (CACHE_PATH);
+    assert_int_equal (tcti_sgx_mgr_set_warm_cache (CACHE_PATH), 0);
+    mgr.sessions.push_back (new TctiSgxSession (GOOD_ID,
+                                                test_tcti_cb (NULL),
+                                                mgr.session_config));
+    return 0;
+}
+
+static int
+warm_cache_teardown (void **state)
+{
+    UNUSED (state);
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+
+    mgr.session_remove (GOOD_ID);
+    tcti_sgx_mgr_set_warm_cache (NULL);
+    unlink (CACHE_PATH);
+    return 0;
+}
+
+static void
+warm_cache_bad_params (void **state)
+{
+    UNUSED (state);
+
+    assert_int_equal (tcti_sgx_mgr_get_warm_cache_stats (NULL),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+}
+/*
+ * After a restart the EK public area comes from the file. When the
+ * maintenance thread finds the TPM has a different answer it's replaced.
+ */
+static void
+warm_cache_restart (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], tpm_rsp [TPM2_MAX_RESPONSE_SIZE];
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE], new_rsp [TPM2_MAX_RESPONSE_SIZE];
+    TctiSgxMgr& mgr = TctiSgxMgr::get_instance ();
+    tcti_sgx_warm_cache_stats_t before, after;
+    size_t size, rsp_size;
+
+    assert_int_equal (tcti_sgx_mgr_get_warm_cache_stats (&before),
+                      TSS2_RC_SUCCESS);
+    rsp_size = build_rsp (tpm_rsp, 0x22);
+    populate (tpm_rsp, rsp_size);
+    size = build_read_public_cmd (cmd);
+    send_cmd (cmd, size, NULL, 0, rsp);
+    assert_memory_equal (rsp, tpm_rsp, rsp_size);
+
+    check_identity (0x01);
+    expect_rsp (new_rsp, build_rsp (new_rsp, 0x33));
+    mgr.maintain ();
+    assert_memory_equal (last_command, cmd, size);
+    send_cmd (cmd, size, NULL, 0, rsp);
+    assert_memory_equal (rsp, new_rsp, rsp_size);
+
+    assert_int_equal (tcti_sgx_mgr_get_warm_cache_stats (&after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.hits - before.hits, 2);
+    assert_int_equal (after.misses - before.misses, 1);
+    assert_int_equal (after.stale - before.stale, 1);
+    assert_int_equal (after.entries, 1);
+}
+/*
+ * A file from another TPM is thrown away.
+ */
+static void
+warm_cache_other_tpm (void **state)
+{
+    UNUSED (state);
+    uint8_t tpm_rsp [TPM2_MAX_RESPONSE_SIZE];
+    tcti_sgx_warm_cache_stats_t before, after;
+
+    populate (tpm_rsp, build_rsp (tpm_rsp, 0x44));
+    assert_int_equal (tcti_sgx_mgr_get_warm_cache_stats (&before),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (before.entries, 1);
+    check_identity (0x02);
+    assert_int_equal (tcti_sgx_mgr_get_warm_cache_stats (&after),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (after.entries, 0);
+    assert_int_equal (after.stale - before.stale, 1);
+}
+/*
+ * EvictControl drops the ReadPublic responses.
+ */
+static void
+warm_cache_evict (void **state)
+{
+    UNUSED (state);
+    uint8_t cmd [TPM2_MAX_COMMAND_SIZE], tpm_rsp [TPM2_MAX_RESPONSE_SIZE];
+    uint8_t rsp [TPM2_MAX_RESPONSE_SIZE], evict [TPM2_HEADER_SIZE + 8];
+    size_t size, rsp_size;
+
+    rsp_size = build_rsp (tpm_rsp, 0x55);
+    populate (tpm_rsp, rsp_size);
+    tpm2_header_set (evict,
+                     TPM2_ST_NO_SESSIONS,
+                     sizeof (evict),
+                     TPM2_CC_EvictControl);
+    tpm2_set_uint32 (&evict [TPM2_HEADER_SIZE], TPM2_RH_OWNER);
+    tpm2_set_uint32 (&evict [TPM2_HEADER_SIZE + 4], EK_HANDLE);
+    send_cmd (evict, sizeof (evict), tpm_rsp, rsp_size, rsp);
+    size = build_read_public_cmd (cmd);
+    send_cmd (cmd, size, tpm_rsp, rsp_size, rsp);
+}
+/*
+ * A file we can't make sense of is ignored.
+ */
+static void
+warm_cache_malformed (void **state)
+{
+    UNUSED (state);
+    tcti_sgx_warm_cache_stats_t stats;
+    FILE *file;
+
+    file = fopen (CACHE_PATH, "w");
+    assert_non_null (file);
+    fputs ("tctisgxw but not really", file);
+    fclose (file);
+    assert_int_equal (tcti_sgx_mgr_set_warm_cache (CACHE_PATH), 0);
+    assert_int_equal (tcti_sgx_mgr_get_warm_cache_stats (&stats),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (stats.entries, 0);
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (warm_cache_bad_params,
+                                         warm_cache_setup,
+                                         warm_cache_teardown),
+        cmocka_unit_test_setup_teardown (warm_cache_restart,
+                                         warm_cache_setup,
+                                         warm_cache_teardown),
+        cmocka_unit_test_setup_teardown (warm_cache_other_tpm,
+                                         warm_cache_setup,
+                                         warm_cache_teardown),
+        cmocka_unit_test_setup_teardown (warm_cache_evict,
+                                         warm_cache_setup,
+                                         warm_cache_teardown),
+        cmocka_unit_test_setup_teardown (warm_cache_malformed,
+                                         warm_cache_setup,
+                                         warm_cache_teardown),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
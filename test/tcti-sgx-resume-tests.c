@@ -0,0 +1,136 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sgx_error.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "tss2-tcti-sgx.h"
+#include "tcti-sgx_priv.h"
+#include "tcti-sgx-common.h"
+#include "util.h"
+
+/*
+ * This module tests session resumption: Tss2_Tcti_Sgx_GetResumeToken,
+ * Tss2_Tcti_Sgx_Park and Tss2_Tcti_Sgx_InitResume.
+ */
+
+static void
+tcti_resume_token_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = *state;
+    uint8_t token [TSS2_TCTI_SGX_RESUME_TOKEN_SIZE];
+    uint8_t expected [TSS2_TCTI_SGX_RESUME_TOKEN_SIZE];
+
+    assert_int_equal (Tss2_Tcti_Sgx_GetResumeToken (context, NULL,
+                                                    sizeof (token)),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+    assert_int_equal (Tss2_Tcti_Sgx_GetResumeToken (context, token, 16),
+                      TSS2_TCTI_RC_BAD_VALUE);
+
+    memset (expected, 0xa5, sizeof (expected));
+    will_return (__wrap_tcti_sgx_get_resume_token_ocall, expected);
+    will_return (__wrap_tcti_sgx_get_resume_token_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_get_resume_token_ocall, SGX_SUCCESS);
+    assert_int_equal (Tss2_Tcti_Sgx_GetResumeToken (context, token,
+                                                    sizeof (token)),
+                      TSS2_RC_SUCCESS);
+    assert_memory_equal (token, expected, sizeof (token));
+}
+/*
+ * Parking detaches the context from its session.
+ */
+static void
+tcti_park_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = *state;
+
+    will_return (__wrap_tcti_sgx_park_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_park_ocall, SGX_SUCCESS);
+    assert_int_equal (Tss2_Tcti_Sgx_Park (context), TSS2_RC_SUCCESS);
+    assert_int_equal (TCTI_SGX_ID (context), 0);
+}
+/*
+ * A failed park leaves the context with its session.
+ */
+static void
+tcti_park_fail_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = *state;
+
+    will_return (__wrap_tcti_sgx_park_ocall, TSS2_RC_SUCCESS);
+    will_return (__wrap_tcti_sgx_park_ocall, SGX_ERROR_UNEXPECTED);
+    assert_int_equal (Tss2_Tcti_Sgx_Park (context),
+                      TSS2_TCTI_RC_GENERAL_FAILURE);
+    assert_int_equal (TCTI_SGX_ID (context), 1);
+
+    TCTI_SGX_STATE (context) = READY_TO_RECEIVE;
+    assert_int_equal (Tss2_Tcti_Sgx_Park (context), TSS2_TCTI_RC_BAD_SEQUENCE);
+    TCTI_SGX_STATE (context) = READY_TO_TRANSMIT;
+}
+
+static void
+tcti_init_resume_test (void **state)
+{
+    UNUSED (state);
+    uint8_t token [TSS2_TCTI_SGX_RESUME_TOKEN_SIZE] = { 0 };
+    TSS2_TCTI_CONTEXT *context;
+    size_t size = 0;
+
+    assert_int_equal (Tss2_Tcti_Sgx_InitResume (NULL, NULL, token,
+                                                sizeof (token)),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (Tss2_Tcti_Sgx_InitResume (NULL, &size, token,
+                                                sizeof (token)),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (size, sizeof (TCTI_CONTEXT_SGX));
+    context = calloc (1, size);
+    assert_non_null (context);
+    assert_int_equal (Tss2_Tcti_Sgx_InitResume (context, NULL, NULL,
+                                                sizeof (token)),
+                      TSS2_TCTI_RC_BAD_REFERENCE);
+    assert_int_equal (Tss2_Tcti_Sgx_InitResume (context, NULL, token, 16),
+                      TSS2_TCTI_RC_BAD_VALUE);
+
+    /* no session for the token */
+    will_return (__wrap_tcti_sgx_resume_ocall, 0);
+    will_return (__wrap_tcti_sgx_resume_ocall, SGX_SUCCESS);
+    assert_int_equal (Tss2_Tcti_Sgx_InitResume (context, NULL, token,
+                                                sizeof (token)),
+                      TSS2_TCTI_RC_BAD_VALUE);
+
+    will_return (__wrap_tcti_sgx_resume_ocall, 0x1d);
+    will_return (__wrap_tcti_sgx_resume_ocall, SGX_SUCCESS);
+    assert_int_equal (Tss2_Tcti_Sgx_InitResume (context, NULL, token,
+                                                sizeof (token)),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (TSS2_TCTI_MAGIC (context), TCTI_SGX_MAGIC);
+    assert_int_equal (TCTI_SGX_ID (context), 0x1d);
+    assert_int_equal (TCTI_SGX_STATE (context), READY_TO_TRANSMIT);
+    Tss2_Tcti_Finalize (context);
+    free (context);
+}
+
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (tcti_resume_token_test,
+                                         tcti_struct_setup,
+                                         tcti_struct_teardown),
+        cmocka_unit_test_setup_teardown (tcti_park_test,
+                                         tcti_struct_setup,
+                                         tcti_struct_teardown),
+        cmocka_unit_test_setup_teardown (tcti_park_fail_test,
+                                         tcti_struct_setup,
+                                         tcti_struct_teardown),
+        cmocka_unit_test (tcti_init_resume_test),
+    };
+
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -12,6 +12,7 @@
 #include <stddef.h>
 #include <stdarg.h>
 #include <sgx_error.h>
+#include <string.h>
 
 #include <setjmp.h>
 #include <cmocka.h>
@@ -88,3 +89,146 @@ __wrap_tcti_sgx_set_locality_ocall (TSS2_RC *retval,
     *retval = (TSS2_RC)mock ();
     return (sgx_status_t)mock ();
 }
+/*
+ * The random bytes are all set to a value popped off of the cmocka stack
+ * so tests can tell which refill they came from.
+ */
+sgx_status_t
+__wrap_tcti_sgx_get_random_ocall (TSS2_RC *retval,
+                                  uint64_t id,
+                                  size_t size,
+                                  uint8_t *random)
+{
+    UNUSED (id);
+
+    memset (random, (int)mock (), size);
+    *retval = (TSS2_RC)mock ();
+    return (sgx_status_t)mock ();
+}
+sgx_status_t
+__wrap_tcti_sgx_hash_update_ocall (TSS2_RC *retval,
+                                   uint64_t id,
+                                   TPMI_ALG_HASH hash_alg,
+                                   size_t size,
+                                   const uint8_t *data)
+{
+    UNUSED (id);
+    UNUSED (hash_alg);
+    UNUSED (size);
+    UNUSED (data);
+
+    *retval = (TSS2_RC)mock ();
+    return (sgx_status_t)mock ();
+}
+/*
+ * Pops a pointer to the result and its size off of the mock stack and
+ * copies it to the caller.
+ */
+sgx_status_t
+__wrap_tcti_sgx_hash_complete_ocall (TSS2_RC *retval,
+                                     uint64_t id,
+                                     TPMI_ALG_HASH hash_alg,
+                                     TPMI_RH_HIERARCHY hierarchy,
+                                     size_t size,
+                                     const uint8_t *data,
+                                     size_t result_size,
+                                     uint8_t *result)
+{
+    UNUSED (id);
+    UNUSED (hash_alg);
+    UNUSED (hierarchy);
+    UNUSED (size);
+    UNUSED (data);
+    uint8_t *src = mock_ptr_type (uint8_t*);
+    size_t src_size = mock_type (size_t);
+
+    memcpy (result, src, src_size < result_size ? src_size : result_size);
+    *retval = (TSS2_RC)mock ();
+    return (sgx_status_t)mock ();
+}
+/*
+ * Pops a pointer to the token off of the mock stack and copies it to the
+ * caller.
+ */
+sgx_status_t
+__wrap_tcti_sgx_get_resume_token_ocall (TSS2_RC *retval,
+                                        uint64_t id,
+                                        size_t size,
+                                        uint8_t *token)
+{
+    UNUSED (id);
+    uint8_t *src = mock_ptr_type (uint8_t*);
+
+    memcpy (token, src, size);
+    *retval = (TSS2_RC)mock ();
+    return (sgx_status_t)mock ();
+}
+sgx_status_t
+__wrap_tcti_sgx_park_ocall (TSS2_RC *retval,
+                            uint64_t id)
+{
+    UNUSED (id);
+
+    *retval = (TSS2_RC)mock ();
+    return (sgx_status_t)mock ();
+}
+sgx_status_t
+__wrap_tcti_sgx_resume_ocall (uint64_t *retval,
+                              size_t size,
+                              const uint8_t *token)
+{
+    UNUSED (size);
+    UNUSED (token);
+
+    *retval = (uint64_t)mock ();
+    return (sgx_status_t)mock ();
+}
+sgx_status_t
+__wrap_tcti_sgx_set_tag_ocall (TSS2_RC *retval,
+                               uint64_t id,
+                               uint64_t tag)
+{
+    UNUSED (id);
+    UNUSED (tag);
+
+    *retval = (TSS2_RC)mock ();
+    return (sgx_status_t)mock ();
+}
+sgx_status_t
+__wrap_tcti_sgx_get_queue_depth_ocall (TSS2_RC *retval,
+                                       uint64_t id,
+                                       uint32_t *depth)
+{
+    UNUSED (id);
+
+    *depth = (uint32_t)mock ();
+    *retval = (TSS2_RC)mock ();
+    return (sgx_status_t)mock ();
+}
+sgx_status_t
+__wrap_tcti_sgx_set_priority_ocall (TSS2_RC *retval,
+                                    uint64_t id,
+                                    uint32_t priority)
+{
+    UNUSED (id);
+    UNUSED (priority);
+
+    *retval = (TSS2_RC)mock ();
+    return (sgx_status_t)mock ();
+}
+
+sgx_status_t
+__wrap_tcti_sgx_transmit_deadline_ocall (TSS2_RC *retval,
+                                         uint64_t id,
+                                         size_t size,
+                                         const uint8_t *command,
+                                         uint32_t deadline_ms)
+{
+    UNUSED (id);
+    UNUSED (size);
+    UNUSED (command);
+    UNUSED (deadline_ms);
+
+    *retval = (TSS2_RC)mock ();
+    return (sgx_status_t)mock ();
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2018, Intel Corporation
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "tcti-sgx-mgr-audit-log.h"
+
+using namespace std;
+
+/*
+ * What a record describes: a client's command or response, or one the
+ * manager sent or got itself.
+ */
+static char const*
+record_type (uint32_t type)
+{
+    switch (type) {
+    case AUDIT_TYPE_COMMAND:
+        return "cmd";
+    case AUDIT_TYPE_RESPONSE:
+        return "rsp";
+    case AUDIT_TYPE_MGR_COMMAND:
+        return "mgr-cmd";
+    case AUDIT_TYPE_MGR_RESPONSE:
+        return "mgr-rsp";
+    default:
+        return "?";
+    }
+}
+/*
+ * Check the chain of digests through an audit log written by the TCTI
+ * manager and optionally list its records.
+ */
+int
+main (int argc,
+      char *argv[])
+{
+    vector<TctiSgxAuditRecord> records;
+    vector<TctiSgxAuditRecord>::const_iterator itr;
+    bool list = false;
+    char const *path;
+    size_t i;
+    int ret;
+
+    if (argc == 3 && strcmp (argv [1], "-l") == 0) {
+        list = true;
+        path = argv [2];
+    } else if (argc == 2) {
+        path = argv [1];
+    } else {
+        printf ("Usage: %s [-l] /path/to/audit.log\n", argv [0]);
+        return 2;
+    }
+
+    ret = TctiSgxAuditLog::verify (path, &records);
+    if (list) {
+        for (itr = records.begin (); itr != records.end (); ++itr) {
+            printf ("%" PRIu64 " %" PRIu64 ".%09" PRIu64 " %016" PRIx64
+                    " %s 0x%08" PRIx32 " %" PRIu32 " ",
+                    itr->seq,
+                    itr->time_ns / 1000000000,
+                    itr->time_ns % 1000000000,
+                    itr->session,
+                    record_type (itr->type),
+                    itr->code,
+                    itr->size);
+            for (i = 0; i < AUDIT_DIGEST_SIZE; ++i)
+                printf ("%02x", itr->digest [i]);
+            printf ("\n");
+        }
+    }
+    if (ret != 0) {
+        printf ("%s: verification failed after %zu good records\n",
+                path, records.size ());
+        return 1;
+    }
+    printf ("%s: %zu records verified\n", path, records.size ());
+    return 0;
+}